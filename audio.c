@@ -0,0 +1,255 @@
+#include "audio.h"
+
+#include <string.h>
+
+int audio_source_parse(const char *str, AudioSource *source) {
+    if (strcmp(str, "none") == 0) {
+        *source = AUDIO_NONE;
+    } else if (strcmp(str, "pulsesrc") == 0) {
+        *source = AUDIO_PULSE;
+    } else if (strcmp(str, "alsasrc") == 0) {
+        *source = AUDIO_ALSA;
+    } else if (strcmp(str, "audiotestsrc") == 0) {
+        *source = AUDIO_TEST;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+const char* audio_source_name(AudioSource source) {
+    return source == AUDIO_NONE ? "none" : audio_source_factory(source);
+}
+
+const char* audio_source_factory(AudioSource source) {
+    switch (source) {
+        case AUDIO_PULSE:
+            return "pulsesrc";
+        case AUDIO_ALSA:
+            return "alsasrc";
+        default:
+            return "audiotestsrc";
+    }
+}
+
+// Первый установленный кодировщик: контейнер ветки определяет, что искать сначала
+static const char* resolve_encoder(gboolean mkv) {
+    static const char *mp4_encoders[] = {"fdkaacenc", "avenc_aac", "voaacenc", "opusenc"};
+    static const char *mkv_encoders[] = {"opusenc", "fdkaacenc", "avenc_aac", "voaacenc"};
+    const char **encoders = mkv ? mkv_encoders : mp4_encoders;
+    size_t count = mkv ? G_N_ELEMENTS(mkv_encoders) : G_N_ELEMENTS(mp4_encoders);
+
+    for (size_t i = 0; i < count; i++) {
+        GstElementFactory *factory = gst_element_factory_find(encoders[i]);
+        if (factory != NULL) {
+            gst_object_unref(factory);
+            return encoders[i];
+        }
+    }
+    return NULL;
+}
+
+// Время работы конвейера сейчас. Источники живые, их сегмент начинается с нуля,
+// поэтому PTS сравнивается с ним напрямую
+static gboolean running_time_us(GstPad *pad, gint64 *now_us) {
+    GstElement *element = GST_PAD_PARENT(pad);
+    GstClock *clock = element != NULL ? gst_element_get_clock(element) : NULL;
+
+    if (clock == NULL) {
+        return FALSE;
+    }
+    *now_us = (gint64)(gst_clock_get_time(clock) - gst_element_get_base_time(element)) / 1000;
+    gst_object_unref(clock);
+    return TRUE;
+}
+
+// Сверяет метки звука с кадрами и сдвигает их на накопленную поправку
+static GstPadProbeReturn audio_sync_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    AudioBranch *audio = user_data;
+    gint64 now_us, correction_us;
+
+    if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+        GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+        if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
+            GstCaps *caps;
+            gst_event_parse_caps(event, &caps);
+            audio->have_info = gst_audio_info_from_caps(&audio->info, caps);
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    if (!audio->have_info || !GST_BUFFER_PTS_IS_VALID(buffer) || !running_time_us(pad, &now_us)) {
+        return GST_PAD_PROBE_OK;
+    }
+    guint64 samples = gst_buffer_get_size(buffer) / GST_AUDIO_INFO_BPF(&audio->info);
+
+    g_mutex_lock(&audio->lock);
+    correction_us = avsync_audio(&audio->sync, now_us, (gint64)(GST_BUFFER_PTS(buffer) / 1000), samples);
+    audio->buffers++;
+    g_mutex_unlock(&audio->lock);
+
+    if (correction_us != 0) {
+        // Сдвиг меток audiorate превращает в тишину или обрезку, кодировщик видит непрерывный звук
+        buffer = gst_buffer_make_writable(buffer);
+        gint64 pts = (gint64)GST_BUFFER_PTS(buffer) + correction_us * 1000;
+        GST_BUFFER_PTS(buffer) = (GstClockTime)MAX(pts, 0);
+        GST_PAD_PROBE_INFO_DATA(info) = buffer;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn video_sync_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    AudioBranch *audio = user_data;
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    gint64 now_us;
+
+    if (!GST_BUFFER_PTS_IS_VALID(buffer) || !running_time_us(pad, &now_us)) {
+        return GST_PAD_PROBE_OK;
+    }
+    g_mutex_lock(&audio->lock);
+    avsync_video(&audio->sync, now_us, (gint64)(GST_BUFFER_PTS(buffer) / 1000));
+    g_mutex_unlock(&audio->lock);
+    return GST_PAD_PROBE_OK;
+}
+
+int audio_branch_create(AudioBranch *audio, GstBin *bin, const AudioSettings *settings) {
+    GstCaps *caps;
+    GstPad *pad;
+
+    memset(audio, 0, sizeof(*audio));
+    g_mutex_init(&audio->lock);
+    avsync_init(&audio->sync, settings->rate, (int64_t)AUDIO_SYNC_WINDOW_MS * 1000, (int64_t)settings->sync_tolerance_ms * 1000);
+    audio->encoder_name = resolve_encoder(settings->mkv);
+    if (audio->encoder_name == NULL) {
+        g_printerr("No audio encoder found: install fdkaacenc, avenc_aac, voaacenc or opusenc.\n");
+        return -1;
+    }
+    audio->bitrate_kbps = settings->bitrate_kbps;
+
+    audio->source = gst_element_factory_make(audio_source_factory(settings->source), "audio_source");
+    audio->convert = gst_element_factory_make("audioconvert", "audio_convert");
+    audio->resample = gst_element_factory_make("audioresample", "audio_resample");
+    audio->caps = gst_element_factory_make("capsfilter", "audio_caps");
+    audio->rate = gst_element_factory_make("audiorate", "audio_rate");
+    audio->queue = gst_element_factory_make("queue", "audio_queue");
+    audio->encoder = gst_element_factory_make(audio->encoder_name, "audio_encoder");
+    if (strcmp(audio->encoder_name, "opusenc") != 0) {
+        audio->parser = gst_element_factory_make("aacparse", "audio_parser");
+    }
+    audio->tee = gst_element_factory_make("tee", "audio_tee");
+    if (!audio->source || !audio->convert || !audio->resample || !audio->caps || !audio->rate || !audio->queue ||
+        !audio->encoder || (strcmp(audio->encoder_name, "opusenc") != 0 && !audio->parser) || !audio->tee) {
+        g_printerr("Failed to create the audio elements.\n");
+        return -1;
+    }
+
+    if (settings->source == AUDIO_TEST) {
+        // Живой источник, читающий по latency_ms, как звуковая карта
+        g_object_set(audio->source, "is-live", TRUE, "samplesperbuffer", MAX(1, settings->rate * settings->latency_ms / 1000), NULL);
+    } else {
+        // Часы конвейера остаются системными, как у кадров; источник подстраивается под них сам (slave-method=skew)
+        g_object_set(audio->source, "buffer-time", (gint64)settings->buffer_ms * 1000,
+                     "latency-time", (gint64)settings->latency_ms * 1000, "provide-clock", FALSE, NULL);
+        if (settings->device != NULL && settings->device[0] != '\0') {
+            g_object_set(audio->source, "device", settings->device, NULL);
+        }
+    }
+    caps = gst_caps_new_simple("audio/x-raw", "rate", G_TYPE_INT, settings->rate,
+                               "channels", G_TYPE_INT, settings->channels, NULL);
+    g_object_set(audio->caps, "caps", caps, NULL);
+    gst_caps_unref(caps);
+    // Поправка больше половины допуска не должна тонуть в допуске audiorate (по умолчанию 40 мс)
+    g_object_set(audio->rate, "tolerance", (guint64)settings->sync_tolerance_ms * GST_MSECOND / 2, NULL);
+    g_object_set(audio->queue, "leaky", 2, "max-size-time", (guint64)AUDIO_ENCODE_QUEUE_MS * GST_MSECOND,
+                 "max-size-buffers", 0, "max-size-bytes", 0, NULL);
+    // bitrate у кодировщиков разного типа: int у opusenc и fdkaacenc, int64 у avenc_aac
+    gchar *bitrate = g_strdup_printf("%d", settings->bitrate_kbps * 1000);
+    gst_util_set_object_arg(G_OBJECT(audio->encoder), "bitrate", bitrate);
+    g_free(bitrate);
+
+    gst_bin_add_many(bin, audio->source, audio->convert, audio->resample, audio->caps, audio->rate, audio->queue,
+                     audio->encoder, audio->tee, NULL);
+    if (audio->parser) {
+        gst_bin_add(bin, audio->parser);
+    }
+    if (!gst_element_link_many(audio->source, audio->convert, audio->resample, audio->caps, audio->rate,
+                               audio->queue, audio->encoder, NULL) ||
+        !gst_element_link(audio->parser ? audio->parser : audio->encoder, audio->tee) ||
+        (audio->parser && !gst_element_link(audio->encoder, audio->parser))) {
+        g_printerr("Failed to link the audio elements.\n");
+        return -1;
+    }
+
+    // После audioresample частота и метки уже те, что пойдут в запись
+    pad = gst_element_get_static_pad(audio->caps, "src");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, audio_sync_probe, audio, NULL);
+    gst_object_unref(pad);
+    return 0;
+}
+
+int audio_branch_link(AudioBranch *audio, GstBin *bin, GstElement *splitmux, int index) {
+    gchar *name = g_strdup_printf("audio_mux_queue%d", index);
+    GstElement *queue = gst_element_factory_make("queue", name);
+    GstPad *src_pad, *audio_pad;
+    GstPadLinkReturn link;
+
+    g_free(name);
+    if (queue == NULL) {
+        return -1;
+    }
+    // Протекающая: стоящий muxer одной ветки не останавливает tee и звук остальных
+    g_object_set(queue, "leaky", 2, "max-size-time", (guint64)AUDIO_MUX_QUEUE_MS * GST_MSECOND,
+                 "max-size-buffers", 0, "max-size-bytes", 0, NULL);
+    gst_bin_add(bin, queue);
+    if (!gst_element_link(audio->tee, queue)) {
+        return -1;
+    }
+    src_pad = gst_element_get_static_pad(queue, "src");
+    audio_pad = gst_element_request_pad_simple(splitmux, "audio_%u");
+    link = audio_pad ? gst_pad_link(src_pad, audio_pad) : GST_PAD_LINK_REFUSED;
+    gst_object_unref(src_pad);
+    if (audio_pad) {
+        gst_object_unref(audio_pad);
+    }
+    if (link != GST_PAD_LINK_OK) {
+        return -1;
+    }
+    audio->renditions++;
+    return 0;
+}
+
+void audio_attach_video(AudioBranch *audio, GstElement *element, const char *pad_name) {
+    GstPad *pad = gst_element_get_static_pad(element, pad_name);
+
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, video_sync_probe, audio, NULL);
+    gst_object_unref(pad);
+}
+
+void audio_branch_report(AudioBranch *audio) {
+    AvSync *sync = &audio->sync;
+
+    if (audio->source == NULL) {
+        return;
+    }
+    g_print("Audio: %s, %s %d kbps encoded once into %d recordings, %" G_GUINT64_FORMAT " buffers\n",
+            GST_OBJECT_NAME(gst_element_get_factory(audio->source)), audio->encoder_name, audio->bitrate_kbps,
+            audio->renditions, audio->buffers);
+    if (sync->windows == 0) {
+        g_print("  A/V offset not measured: no window had both audio and video\n");
+    } else {
+        // Смещение до поправки: звук минус видео, > 0 - звук в записи раньше, чем был на самом деле
+        g_print("  A/V offset %.1f ms mean, %.1f .. %.1f ms, %.1f ms in the last window, over %" G_GUINT64_FORMAT " s\n",
+                sync->offset_sum_us / sync->windows / 1000.0, sync->offset_min_us / 1000.0, sync->offset_max_us / 1000.0,
+                sync->last_offset_us / 1000.0, sync->windows * AUDIO_SYNC_WINDOW_MS / 1000);
+    }
+    g_print("  %" G_GUINT64_FORMAT " corrections, %.1f ms in total, audio timestamps shifted by %.1f ms at the end; "
+            "audio clock drift %.1f ppm\n",
+            sync->corrections, sync->corrected_us / 1000.0, sync->correction_us / 1000.0, avsync_drift_ppm(sync));
+}
+
+void audio_branch_clear(AudioBranch *audio) {
+    if (audio->source != NULL) {
+        g_mutex_clear(&audio->lock);
+    }
+}
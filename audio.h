@@ -0,0 +1,71 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <gst/gst.h>
+#include <gst/audio/audio.h>
+
+#include "avsync.h"
+
+// Звук для записи: source -> audioconvert -> audioresample -> caps -> audiorate -> queue -> encoder
+// [-> aacparse] -> tee. Кодируется один раз, tee раздаёт его в splitmuxsink каждой ветки.
+// Метки звука сверяются с метками кадров источников и подправляются, если разошлись (avsync.h)
+
+typedef enum {
+    AUDIO_NONE,
+    AUDIO_PULSE,
+    AUDIO_ALSA,
+    AUDIO_TEST
+} AudioSource;
+
+#define AUDIO_SYNC_WINDOW_MS 1000
+#define AUDIO_ENCODE_QUEUE_MS 200 // перед кодировщиком: переполнение теряет звук, а не останавливает запись
+#define AUDIO_MUX_QUEUE_MS 2000   // перед muxer ветки: кадры ветки приходят позже на задержку кодировщика видео
+
+typedef struct {
+    AudioSource source;
+    const char *device;    // "" - устройство по умолчанию
+    int rate;
+    int channels;
+    int buffer_ms;         // кольцевой буфер источника
+    int latency_ms;        // размер одного чтения из устройства
+    int bitrate_kbps;
+    int sync_tolerance_ms; // расхождение A/V в этих пределах не исправляется
+    gboolean mkv;          // Opus для matroska, AAC для mp4
+} AudioSettings;
+
+typedef struct {
+    GstElement *source;
+    GstElement *convert;
+    GstElement *resample;
+    GstElement *caps;
+    GstElement *rate;      // audiorate: после поправки меток заполняет разрыв тишиной или обрезает перекрытие
+    GstElement *queue;
+    GstElement *encoder;
+    GstElement *parser;    // только для AAC
+    GstElement *tee;
+    const char *encoder_name;
+    int bitrate_kbps;
+    int renditions;        // веток, в которые пишется звук
+    GstAudioInfo info;
+    gboolean have_info;
+    guint64 buffers;
+    AvSync sync;
+    GMutex lock;           // звук и кадры источников приходят из разных потоков
+} AudioBranch;
+
+// 1 - успешно
+int audio_source_parse(const char *str, AudioSource *source);
+const char* audio_source_name(AudioSource source);
+// Фабрика элемента источника
+const char* audio_source_factory(AudioSource source);
+
+// Создаёт и связывает звуковую часть в bin. 0 - успешно
+int audio_branch_create(AudioBranch *audio, GstBin *bin, const AudioSettings *settings);
+// tee -> queue -> audio_%u у splitmux ветки index. 0 - успешно
+int audio_branch_link(AudioBranch *audio, GstBin *bin, GstElement *splitmux, int index);
+// Пробник на выходе источника кадров: опоздание кадров для сравнения со звуком
+void audio_attach_video(AudioBranch *audio, GstElement *element, const char *pad_name);
+void audio_branch_report(AudioBranch *audio);
+void audio_branch_clear(AudioBranch *audio);
+
+#endif
@@ -0,0 +1,99 @@
+#include "avsync.h"
+
+void avsync_init(AvSync *sync, int rate, int64_t window_us, int64_t tolerance_us) {
+    sync->rate = rate;
+    sync->window_us = window_us;
+    sync->tolerance_us = tolerance_us;
+    sync->window_start_us = -1;
+    sync->audio_min_us = AVSYNC_NONE;
+    sync->video_min_us = AVSYNC_NONE;
+    sync->raw_min_us = AVSYNC_NONE;
+    sync->correction_us = 0;
+    sync->corrections = 0;
+    sync->corrected_us = 0;
+    sync->windows = 0;
+    sync->offset_sum_us = 0.0;
+    sync->offset_min_us = 0;
+    sync->offset_max_us = 0;
+    sync->last_offset_us = 0;
+    sync->samples = 0;
+    sync->first_pts_us = 0;
+    sync->drift_first_us = AVSYNC_NONE;
+    sync->drift_first_at_us = 0;
+    sync->drift_last_us = AVSYNC_NONE;
+    sync->drift_last_at_us = 0;
+}
+
+void avsync_video(AvSync *sync, int64_t arrival_us, int64_t pts_us) {
+    int64_t lateness = arrival_us - pts_us;
+
+    if (lateness < sync->video_min_us) {
+        sync->video_min_us = lateness;
+    }
+}
+
+// Конец окна: смещение A/V и точка для наклона дрейфа
+static void close_window(AvSync *sync, int64_t arrival_us) {
+    if (sync->drift_first_us == AVSYNC_NONE) {
+        sync->drift_first_us = sync->raw_min_us;
+        sync->drift_first_at_us = arrival_us;
+    } else {
+        sync->drift_last_us = sync->raw_min_us;
+        sync->drift_last_at_us = arrival_us;
+    }
+    if (sync->video_min_us != AVSYNC_NONE) {
+        int64_t offset = sync->audio_min_us - sync->video_min_us;
+
+        if (sync->windows == 0 || offset < sync->offset_min_us) {
+            sync->offset_min_us = offset;
+        }
+        if (sync->windows == 0 || offset > sync->offset_max_us) {
+            sync->offset_max_us = offset;
+        }
+        sync->windows++;
+        sync->offset_sum_us += (double)offset;
+        sync->last_offset_us = offset;
+        // Звук опаздывает сильнее видео - его метки слишком ранние, сдвигаем их позже
+        if (offset > sync->tolerance_us || offset < -sync->tolerance_us) {
+            sync->correction_us += offset;
+            sync->corrections++;
+            sync->corrected_us += offset > 0 ? offset : -offset;
+        }
+    }
+    sync->window_start_us = arrival_us;
+    sync->audio_min_us = AVSYNC_NONE;
+    sync->video_min_us = AVSYNC_NONE;
+    sync->raw_min_us = AVSYNC_NONE;
+}
+
+int64_t avsync_audio(AvSync *sync, int64_t arrival_us, int64_t pts_us, uint64_t samples) {
+    int64_t duration_us = (int64_t)(samples * 1000000 / (uint64_t)sync->rate);
+    int64_t lateness = arrival_us - (pts_us + sync->correction_us + duration_us);
+
+    if (sync->window_start_us < 0) {
+        sync->window_start_us = arrival_us;
+        sync->first_pts_us = pts_us;
+    }
+    sync->samples += samples;
+    // По отсчётам: где был бы конец буфера, если бы карта шла точно с номинальной частотой
+    int64_t raw = arrival_us - (sync->first_pts_us + (int64_t)(sync->samples * 1000000 / (uint64_t)sync->rate));
+    if (lateness < sync->audio_min_us) {
+        sync->audio_min_us = lateness;
+    }
+    if (raw < sync->raw_min_us) {
+        sync->raw_min_us = raw;
+    }
+    if (arrival_us - sync->window_start_us >= sync->window_us) {
+        close_window(sync, arrival_us);
+    }
+    return sync->correction_us;
+}
+
+double avsync_drift_ppm(const AvSync *sync) {
+    if (sync->drift_last_us == AVSYNC_NONE || sync->drift_last_at_us <= sync->drift_first_at_us) {
+        return 0.0;
+    }
+    // Карта спешит - отсчёты копятся быстрее времени и опоздание по ним уменьшается
+    return -(double)(sync->drift_last_us - sync->drift_first_us) * 1e6 /
+           (double)(sync->drift_last_at_us - sync->drift_first_at_us);
+}
@@ -0,0 +1,49 @@
+#ifndef AVSYNC_H
+#define AVSYNC_H
+
+#include <stdint.h>
+
+// Сведение звука с видео. Опоздание буфера - насколько позже его времени (PTS) он пришёл:
+// у видео от PTS кадра, у звука от конца буфера, то есть от последнего записанного отсчёта.
+// Задержки потоков только добавляются к опозданию, поэтому минимум за окно показывает
+// смещение самих меток времени. Разница минимумов звука и видео - смещение A/V:
+// если она больше допуска, к меткам звука прибавляется поправка.
+// Дрейф часов звуковой карты - наклон опоздания, посчитанного по числу отсчётов, а не по PTS.
+// Модуль не зависит от GStreamer, время в микросекундах одних и тех же часов
+
+#define AVSYNC_NONE INT64_MAX
+
+typedef struct {
+    int rate;                   // частота отсчётов звука
+    int64_t window_us;
+    int64_t tolerance_us;       // смещение в этих пределах не исправляется
+    int64_t window_start_us;    // -1 - звука ещё не было
+    int64_t audio_min_us;       // минимумы опоздания в текущем окне
+    int64_t video_min_us;
+    int64_t raw_min_us;         // то же для звука по числу отсчётов
+    int64_t correction_us;      // прибавляется к PTS звука
+    uint64_t corrections;
+    int64_t corrected_us;       // сумма модулей поправок
+    uint64_t windows;           // окна, в которых были и звук, и видео
+    double offset_sum_us;       // смещения таких окон до поправки: звук минус видео
+    int64_t offset_min_us;
+    int64_t offset_max_us;
+    int64_t last_offset_us;
+    uint64_t samples;           // отсчёты с первого буфера
+    int64_t first_pts_us;
+    int64_t drift_first_us;     // минимум опоздания по отсчётам в первом и последнем окне и их время
+    int64_t drift_first_at_us;
+    int64_t drift_last_us;
+    int64_t drift_last_at_us;
+} AvSync;
+
+void avsync_init(AvSync *sync, int rate, int64_t window_us, int64_t tolerance_us);
+// Кадр видео с меткой pts пришёл в arrival_us
+void avsync_video(AvSync *sync, int64_t arrival_us, int64_t pts_us);
+// Буфер звука из samples отсчётов. Возвращает поправку, которую нужно прибавить к его PTS
+int64_t avsync_audio(AvSync *sync, int64_t arrival_us, int64_t pts_us, uint64_t samples);
+// Дрейф часов звуковой карты относительно часов конвейера, миллионные доли: > 0 - карта спешит.
+// 0, пока не прошло двух окон
+double avsync_drift_ppm(const AvSync *sync);
+
+#endif
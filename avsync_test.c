@@ -0,0 +1,162 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "avsync.h"
+
+#define RATE 48000
+#define BUFFER_SAMPLES 480      // 10 мс, как latency-time источника
+#define VIDEO_FPS 30
+#define WINDOW_US 1000000
+#define TOLERANCE_US 10000
+#define BENCH_ITERATIONS 10000000
+
+static uint32_t rng_state = 12345;
+
+static uint32_t next_random(void) {
+    rng_state = rng_state * 1664525u + 1013904223u;
+    return rng_state >> 8;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct {
+    double drift_ppm;      // карта спешит на столько миллионных
+    int64_t bias_us;       // метки звука раньше настоящего времени записи
+    int with_video;
+    int seconds;
+} Scenario;
+
+typedef struct {
+    AvSync sync;
+    int64_t worst_late_offset_us; // худшее смещение после первых двух окон
+} Outcome;
+
+// Звук: метки по числу отсчётов, как у источника без подстройки, карта идёт со своей частотой.
+// Видео: метка - время захвата. Оба приходят с задержкой доставки до 5 и до 8 мс
+static void simulate(const Scenario *scenario, Outcome *outcome) {
+    const double device_rate = RATE * (1.0 + scenario->drift_ppm / 1e6);
+    uint64_t buffer = 0, frame = 0;
+
+    avsync_init(&outcome->sync, RATE, WINDOW_US, TOLERANCE_US);
+    outcome->worst_late_offset_us = 0;
+    for (;;) {
+        int64_t audio_end = (int64_t)((buffer + 1) * BUFFER_SAMPLES * 1e6 / device_rate);
+        int64_t video_at = (int64_t)(frame * 1e6 / VIDEO_FPS);
+
+        if (audio_end > (int64_t)scenario->seconds * 1000000 &&
+            (!scenario->with_video || video_at > (int64_t)scenario->seconds * 1000000)) {
+            break;
+        }
+        if (!scenario->with_video || audio_end <= video_at) {
+            int64_t pts = (int64_t)(buffer * BUFFER_SAMPLES * 1000000 / RATE) - scenario->bias_us;
+            avsync_audio(&outcome->sync, audio_end + 3000 + (int64_t)(next_random() % 5000), pts, BUFFER_SAMPLES);
+            buffer++;
+            if (outcome->sync.windows > 2 && llabs(outcome->sync.last_offset_us) > outcome->worst_late_offset_us) {
+                outcome->worst_late_offset_us = llabs(outcome->sync.last_offset_us);
+            }
+        } else {
+            avsync_video(&outcome->sync, video_at + 3000 + (int64_t)(next_random() % 8000), video_at);
+            frame++;
+        }
+    }
+}
+
+// 1. Метки звука на 40 мс раньше, карта спешит на 500 ppm: первое окно исправляет смещение,
+// дальше дрейф набегает и исправляется шагами, не выходя за допуск
+static int check_correction(void) {
+    Scenario scenario = {500.0, 40000, 1, 60};
+    Outcome outcome;
+    int failed = 0;
+
+    simulate(&scenario, &outcome);
+    double drift = avsync_drift_ppm(&outcome.sync);
+    printf("bias 40 ms, drift 500 ppm: %llu corrections, %.1f ms total, worst offset %.1f ms, drift %.1f ppm\n",
+           (unsigned long long)outcome.sync.corrections, outcome.sync.corrected_us / 1000.0,
+           outcome.worst_late_offset_us / 1000.0, drift);
+    if (outcome.sync.corrections < 2) {
+        fprintf(stderr, "FAIL bias and drift were not corrected\n");
+        failed = 1;
+    }
+    // Окно может набрать не больше допуска, дрейфа за одно окно и шума минимумов
+    if (outcome.worst_late_offset_us > TOLERANCE_US + 2000) {
+        fprintf(stderr, "FAIL offset %.1f ms after correction\n", outcome.worst_late_offset_us / 1000.0);
+        failed = 1;
+    }
+    if (fabs(drift - 500.0) > 20.0) {
+        fprintf(stderr, "FAIL drift measured %.1f ppm, expected 500\n", drift);
+        failed = 1;
+    }
+    return failed;
+}
+
+// 2. Смещение в пределах допуска не трогаем, медленная карта даёт отрицательный дрейф
+static int check_tolerance(void) {
+    Scenario scenario = {-200.0, 4000, 1, 20};
+    Outcome outcome;
+    int failed = 0;
+
+    simulate(&scenario, &outcome);
+    double drift = avsync_drift_ppm(&outcome.sync);
+    double mean = outcome.sync.offset_sum_us / outcome.sync.windows;
+    if (outcome.sync.corrections != 0 || fabs(mean - 4000.0) > 3000.0 || fabs(drift + 200.0) > 20.0) {
+        fprintf(stderr, "FAIL within tolerance: %llu corrections, mean offset %.1f ms, drift %.1f ppm\n",
+                (unsigned long long)outcome.sync.corrections, mean / 1000.0, drift);
+        failed = 1;
+    }
+    return failed;
+}
+
+// 3. Без видео сравнивать не с чем: поправок нет, дрейф всё равно измеряется
+static int check_audio_only(void) {
+    Scenario scenario = {300.0, 40000, 0, 20};
+    Outcome outcome;
+    int failed = 0;
+
+    simulate(&scenario, &outcome);
+    if (outcome.sync.corrections != 0 || outcome.sync.windows != 0 ||
+        fabs(avsync_drift_ppm(&outcome.sync) - 300.0) > 20.0) {
+        fprintf(stderr, "FAIL audio only: %llu corrections, %llu windows, drift %.1f ppm\n",
+                (unsigned long long)outcome.sync.corrections, (unsigned long long)outcome.sync.windows,
+                avsync_drift_ppm(&outcome.sync));
+        failed = 1;
+    }
+    return failed;
+}
+
+static void benchmark(void) {
+    AvSync sync;
+    int64_t sum = 0;
+
+    avsync_init(&sync, RATE, WINDOW_US, TOLERANCE_US);
+    double start = now_seconds();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        int64_t pts = (int64_t)i * 10000;
+        avsync_video(&sync, pts + 4000, pts);
+        sum += avsync_audio(&sync, pts + 15000, pts, BUFFER_SAMPLES);
+    }
+    double seconds = now_seconds() - start;
+    printf("avsync video + audio update %.1f ns (%lld)\n", seconds * 1e9 / BENCH_ITERATIONS, (long long)sum);
+}
+
+int main(int argc, char *argv[]) {
+    int failed = 0;
+
+    failed |= check_correction();
+    failed |= check_tolerance();
+    failed |= check_audio_only();
+
+    // 4. Стоимость на буфер
+    if (argc < 2 || strcmp(argv[1], "--no-bench") != 0) {
+        benchmark();
+    }
+
+    printf(failed ? "FAILED\n" : "OK\n");
+    return failed;
+}
@@ -0,0 +1,174 @@
+#include "bench.h"
+
+#include <stdlib.h>
+#include <sys/resource.h>
+
+static double process_cpu(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+typedef struct {
+    Bench *bench;
+    LatencyRecorder *recorder;
+} BranchProbe;
+
+void bench_init(Bench *bench, guint64 frames, guint64 warmup_frames) {
+    bench->frames = frames;
+    bench->warmup_frames = frames > warmup_frames ? warmup_frames : 0;
+    bench->source_frames = 0;
+    bench->start_us = 0;
+    bench->end_us = 0;
+    bench->start_cpu_seconds = 0.0;
+    bench->end_cpu_seconds = 0.0;
+    bench->stamp_caps = gst_caps_new_empty_simple("timestamp/x-ladder-capture");
+    g_mutex_init(&bench->lock);
+}
+
+void bench_clear(Bench *bench) {
+    gst_caps_replace(&bench->stamp_caps, NULL);
+    g_mutex_clear(&bench->lock);
+}
+
+static GstPadProbeReturn source_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    Bench *bench = user_data;
+    gint64 now = g_get_monotonic_time();
+    gboolean stamp, done;
+
+    g_mutex_lock(&bench->lock);
+    // Кадры после конца прогона не пускаем дальше, чтобы все ветки видели одинаковое число кадров
+    if (bench->frames > 0 && bench->source_frames >= bench->frames) {
+        g_mutex_unlock(&bench->lock);
+        return GST_PAD_PROBE_DROP;
+    }
+    bench->source_frames++;
+    stamp = bench->source_frames > bench->warmup_frames;
+    if (stamp) {
+        if (bench->start_us == 0) {
+            bench->start_us = now;
+            bench->start_cpu_seconds = process_cpu();
+        }
+        // Конец окна сдвигается с каждым кадром: файл может закончиться раньше frames
+        bench->end_us = now;
+        bench->end_cpu_seconds = process_cpu();
+    }
+    done = bench->frames > 0 && bench->source_frames == bench->frames;
+    g_mutex_unlock(&bench->lock);
+
+    if (stamp) {
+        // Метка идёт вместе с буфером через videorate, videoscale и videoconvert
+        GstBuffer *buffer = gst_buffer_make_writable(GST_PAD_PROBE_INFO_BUFFER(info));
+        gst_buffer_add_reference_timestamp_meta(buffer, bench->stamp_caps, (GstClockTime)now * GST_USECOND,
+                                                GST_CLOCK_TIME_NONE);
+        GST_PAD_PROBE_INFO_DATA(info) = buffer;
+    }
+    if (done) {
+        GstElement *element = gst_pad_get_parent_element(pad);
+        gst_element_post_message(element, gst_message_new_application(GST_OBJECT(element),
+                                 gst_structure_new_empty("bench-done")));
+        gst_object_unref(element);
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn branch_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    BranchProbe *probe = user_data;
+    LatencyRecorder *recorder = probe->recorder;
+    GstReferenceTimestampMeta *meta;
+
+    meta = gst_buffer_get_reference_timestamp_meta(GST_PAD_PROBE_INFO_BUFFER(info), probe->bench->stamp_caps);
+    if (meta == NULL) {
+        return GST_PAD_PROBE_OK;
+    }
+    gint64 now = g_get_monotonic_time();
+    // videorate может повторить кадр: задержку повтора тоже считаем, она видна зрителю
+    latency_recorder_add(recorder, now, (guint64)(now - (gint64)(meta->timestamp / GST_USECOND)));
+    return GST_PAD_PROBE_OK;
+}
+
+void bench_attach_source(Bench *bench, GstElement *element, const char *pad_name) {
+    GstPad *pad = gst_element_get_static_pad(element, pad_name);
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, source_probe, bench, NULL);
+    gst_object_unref(pad);
+}
+
+void bench_attach_branch(Bench *bench, LatencyRecorder *recorder, GstElement *element, const char *pad_name) {
+    BranchProbe *probe = g_new(BranchProbe, 1);
+    GstPad *pad = gst_element_get_static_pad(element, pad_name);
+
+    probe->bench = bench;
+    probe->recorder = recorder;
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, branch_probe, probe, g_free);
+    gst_object_unref(pad);
+}
+
+void latency_recorder_init(LatencyRecorder *recorder, guint capacity) {
+    recorder->samples_us = g_new(guint64, capacity);
+    recorder->capacity = capacity;
+    recorder->count = 0;
+    recorder->first_us = 0;
+    recorder->last_us = 0;
+}
+
+void latency_recorder_add(LatencyRecorder *recorder, gint64 now_us, guint64 latency_us) {
+    if (recorder->count == 0) {
+        recorder->first_us = now_us;
+    }
+    recorder->last_us = now_us;
+    if (recorder->count < recorder->capacity) {
+        recorder->samples_us[recorder->count] = latency_us;
+    }
+    recorder->count++;
+}
+
+void latency_recorder_clear(LatencyRecorder *recorder) {
+    g_free(recorder->samples_us);
+    recorder->samples_us = NULL;
+    recorder->capacity = 0;
+    recorder->count = 0;
+}
+
+static int compare_samples(const void *a, const void *b) {
+    guint64 x = *(const guint64*)a, y = *(const guint64*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Процентиль по ближайшему рангу в отсортированной выборке
+static double percentile(const guint64 *sorted, guint count, double p) {
+    guint rank = (guint)(p / 100.0 * count + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    return (double)sorted[MIN(rank, count) - 1];
+}
+
+LatencyStats latency_recorder_stats(LatencyRecorder *recorder) {
+    LatencyStats stats = {0};
+    guint stored = MIN(recorder->count, recorder->capacity);
+    double sum = 0.0;
+
+    if (stored == 0) {
+        return stats;
+    }
+    qsort(recorder->samples_us, stored, sizeof(guint64), compare_samples);
+    for (guint i = 0; i < stored; i++) {
+        sum += recorder->samples_us[i];
+    }
+    stats.p50_us = percentile(recorder->samples_us, stored, 50.0);
+    stats.p90_us = percentile(recorder->samples_us, stored, 90.0);
+    stats.p99_us = percentile(recorder->samples_us, stored, 99.0);
+    stats.max_us = (double)recorder->samples_us[stored - 1];
+    stats.mean_us = sum / stored;
+    if (recorder->count > 1 && recorder->last_us > recorder->first_us) {
+        stats.fps = (recorder->count - 1) * 1e6 / (recorder->last_us - recorder->first_us);
+    }
+    return stats;
+}
+
+long bench_peak_rss_kb(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
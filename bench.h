@@ -0,0 +1,55 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <gst/gst.h>
+
+// Задержки кадров одной ветки: от выхода источника до конца обработки ветки
+typedef struct {
+    guint64 *samples_us;
+    guint capacity;
+    guint count;     // измеренные кадры; в выборку попадают первые capacity
+    gint64 first_us; // время прихода первого и последнего измеренного кадра
+    gint64 last_us;
+} LatencyRecorder;
+
+typedef struct {
+    double p50_us;
+    double p90_us;
+    double p99_us;
+    double max_us;
+    double mean_us;
+    double fps; // устойчивая частота по измеренным кадрам
+} LatencyStats;
+
+// Прогон на фиксированное число кадров: источник помечает кадры временем захвата,
+// после последнего кадра на шину уходит сообщение "bench-done"
+typedef struct {
+    guint64 frames;        // кадров всех источников в прогоне, 0 = без ограничения
+    guint64 warmup_frames; // первые кадры не измеряются
+    guint64 source_frames;
+    gint64 start_us;       // первый измеряемый кадр
+    gint64 end_us;         // последний кадр прогона
+    double start_cpu_seconds; // процессорное время процесса на start_us и end_us
+    double end_cpu_seconds;
+    GstCaps *stamp_caps;   // ключ GstReferenceTimestampMeta
+    GMutex lock;           // источников может быть несколько, у каждого свой поток
+} Bench;
+
+void bench_init(Bench *bench, guint64 frames, guint64 warmup_frames);
+void bench_clear(Bench *bench);
+// Пробник на выходе источника: считает и помечает кадры
+void bench_attach_source(Bench *bench, GstElement *element, const char *pad_name);
+// Пробник в конце ветки: записывает задержку помеченных кадров
+void bench_attach_branch(Bench *bench, LatencyRecorder *recorder, GstElement *element, const char *pad_name);
+
+void latency_recorder_init(LatencyRecorder *recorder, guint capacity);
+void latency_recorder_clear(LatencyRecorder *recorder);
+// Задержка кадра, пришедшего в now_us. Вызывать из одного потока
+void latency_recorder_add(LatencyRecorder *recorder, gint64 now_us, guint64 latency_us);
+// Сортирует выборку; вызывать после остановки конвейера
+LatencyStats latency_recorder_stats(LatencyRecorder *recorder);
+
+// Пиковый RSS процесса в килобайтах
+long bench_peak_rss_kb(void);
+
+#endif
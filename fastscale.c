@@ -0,0 +1,381 @@
+#include "fastscale.h"
+
+#include <string.h>
+
+GST_DEBUG_CATEGORY_STATIC(fast_scale_convert_debug);
+#define GST_CAT_DEFAULT fast_scale_convert_debug
+
+#define DEFAULT_METHOD FAST_SCALE_BILINEAR
+#define DEFAULT_N_THREADS 1
+#define DEFAULT_ADD_BORDERS FALSE
+
+struct _GstFastScaleConvert {
+    GstVideoFilter parent;
+
+    FastScaleMethod method;
+    guint n_threads; // 0 = по числу процессоров
+    gboolean add_borders; // вписывать кадр другой формы с чёрными полями, как videoscale
+
+    FastScaleIsa isa;
+    FastScaleJob job; // при полях - только внутренний прямоугольник кадра
+    int out_width;
+    int out_height;
+    int border_x;     // левый верхний угол картинки внутри полей, чётный
+    int border_y;
+    FastScaleScratch *scratch; // по одному набору строк на срез
+    guint slices;
+    GThreadPool *pool;
+    GMutex lock;
+    GCond done;
+    guint pending;
+};
+
+enum {
+    PROP_0,
+    PROP_METHOD,
+    PROP_N_THREADS,
+    PROP_ADD_BORDERS
+};
+
+static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE("sink", GST_PAD_SINK, GST_PAD_ALWAYS,
+    GST_STATIC_CAPS(GST_VIDEO_CAPS_MAKE("{ BGRx, BGRA }")));
+
+static GstStaticPadTemplate src_template = GST_STATIC_PAD_TEMPLATE("src", GST_PAD_SRC, GST_PAD_ALWAYS,
+    GST_STATIC_CAPS(GST_VIDEO_CAPS_MAKE("{ I420, NV12 }")));
+
+G_DEFINE_TYPE(GstFastScaleConvert, gst_fast_scale_convert, GST_TYPE_VIDEO_FILTER)
+
+#define GST_TYPE_FAST_SCALE_METHOD (gst_fast_scale_method_get_type())
+static GType gst_fast_scale_method_get_type(void) {
+    static GType type = 0;
+    static const GEnumValue values[] = {
+        {FAST_SCALE_BILINEAR, "Bilinear", "bilinear"},
+        {FAST_SCALE_BOX, "Box filter (downscale only)", "box"},
+        {0, NULL, NULL}
+    };
+
+    if (type == 0) {
+        type = g_enum_register_static("GstFastScaleMethod", values);
+    }
+    return type;
+}
+
+static void free_slices(GstFastScaleConvert *self) {
+    if (self->pool != NULL) {
+        g_thread_pool_free(self->pool, FALSE, TRUE);
+        self->pool = NULL;
+    }
+    for (guint i = 0; i < self->slices; i++) {
+        fast_scale_scratch_clear(&self->scratch[i]);
+    }
+    g_free(self->scratch);
+    self->scratch = NULL;
+    self->slices = 0;
+}
+
+// Срез i обрабатывает свою часть пар выходных строк
+static void run_slice(GstFastScaleConvert *self, guint slice) {
+    int pairs = (self->job.dst_height + 1) / 2;
+    int begin = (int)((gint64)pairs * slice / self->slices);
+    int end = (int)((gint64)pairs * (slice + 1) / self->slices);
+
+    fast_scale_convert_rows(&self->job, &self->scratch[slice], begin, end);
+}
+
+static void slice_worker(gpointer data, gpointer user_data) {
+    GstFastScaleConvert *self = user_data;
+
+    run_slice(self, GPOINTER_TO_UINT(data) - 1);
+
+    g_mutex_lock(&self->lock);
+    if (--self->pending == 0) {
+        g_cond_signal(&self->done);
+    }
+    g_mutex_unlock(&self->lock);
+}
+
+static GstCaps* gst_fast_scale_convert_transform_caps(GstBaseTransform *trans, GstPadDirection direction,
+                                                      GstCaps *caps, GstCaps *filter) {
+    GstCaps *result = gst_caps_new_empty();
+    GstPadTemplate *other = gst_element_class_get_pad_template(GST_ELEMENT_GET_CLASS(trans),
+                                                               direction == GST_PAD_SINK ? "src" : "sink");
+
+    // Размер и формат на другой стороне любые, остальное (частота кадров) сохраняется
+    for (guint i = 0; i < gst_caps_get_size(caps); i++) {
+        GstStructure *structure = gst_structure_copy(gst_caps_get_structure(caps, i));
+        gst_structure_set(structure,
+                          "width", GST_TYPE_INT_RANGE, 1, G_MAXINT,
+                          "height", GST_TYPE_INT_RANGE, 1, G_MAXINT, NULL);
+        gst_structure_remove_fields(structure, "format", "colorimetry", "chroma-site", "pixel-aspect-ratio", NULL);
+        result = gst_caps_merge_structure(result, structure);
+    }
+
+    GstCaps *template_caps = gst_pad_template_get_caps(other);
+    GstCaps *intersection = gst_caps_intersect(result, template_caps);
+    gst_caps_unref(template_caps);
+    gst_caps_unref(result);
+
+    if (filter != NULL) {
+        result = gst_caps_intersect_full(filter, intersection, GST_CAPS_INTERSECT_FIRST);
+        gst_caps_unref(intersection);
+        return result;
+    }
+    return intersection;
+}
+
+// Если размер на выходе не задан, сохраняем входной
+static GstCaps* gst_fast_scale_convert_fixate_caps(GstBaseTransform *trans, GstPadDirection direction,
+                                                   GstCaps *caps, GstCaps *othercaps) {
+    GstStructure *in = gst_caps_get_structure(caps, 0);
+    GstStructure *out;
+    int width, height;
+
+    othercaps = gst_caps_make_writable(gst_caps_truncate(othercaps));
+    out = gst_caps_get_structure(othercaps, 0);
+    if (gst_structure_get_int(in, "width", &width)) {
+        gst_structure_fixate_field_nearest_int(out, "width", width);
+    }
+    if (gst_structure_get_int(in, "height", &height)) {
+        gst_structure_fixate_field_nearest_int(out, "height", height);
+    }
+    return gst_caps_fixate(othercaps);
+}
+
+// Прямоугольник картинки внутри кадра с полями: та же пропорция, что у источника, как считает
+// videoscale с add-borders. Пиксели квадратные с обеих сторон. Углы и размеры чётные, чтобы
+// не делить пары строк и пикселей цветности
+static void letterbox(GstFastScaleConvert *self) {
+    int width = self->out_width, height = self->out_height;
+    gint64 fit_height = (gint64)width * self->job.src_height / self->job.src_width;
+    gint64 fit_width = (gint64)height * self->job.src_width / self->job.src_height;
+
+    if (fit_height < height) {
+        height = MAX(2, (int)fit_height & ~1);
+    } else if (fit_width < width) {
+        width = MAX(2, (int)fit_width & ~1);
+    }
+    if (width >= self->out_width && height >= self->out_height) {
+        return;
+    }
+    self->border_x = ((self->out_width - width) / 2) & ~1;
+    self->border_y = ((self->out_height - height) / 2) & ~1;
+    self->job.dst_width = width;
+    self->job.dst_height = height;
+}
+
+// Заливает плоскость значением value везде, кроме прямоугольника картинки; размеры в байтах
+static void fill_borders(guint8 *plane, int stride, int width, int height, int x, int y, int w, int h, guint8 value) {
+    for (int row = 0; row < height; row++) {
+        guint8 *line = plane + (gsize)row * stride;
+        if (row < y || row >= y + h) {
+            memset(line, value, width);
+        } else {
+            memset(line, value, x);
+            memset(line + x + w, value, width - x - w);
+        }
+    }
+}
+
+static gboolean gst_fast_scale_convert_set_info(GstVideoFilter *filter, GstCaps *incaps, GstVideoInfo *in_info,
+                                                GstCaps *outcaps, GstVideoInfo *out_info) {
+    GstFastScaleConvert *self = GST_FAST_SCALE_CONVERT(filter);
+    guint threads = self->n_threads > 0 ? self->n_threads : g_get_num_processors();
+    int pairs;
+
+    free_slices(self);
+
+    memset(&self->job, 0, sizeof(self->job));
+    self->job.src_width = GST_VIDEO_INFO_WIDTH(in_info);
+    self->job.src_height = GST_VIDEO_INFO_HEIGHT(in_info);
+    self->job.dst_width = self->out_width = GST_VIDEO_INFO_WIDTH(out_info);
+    self->job.dst_height = self->out_height = GST_VIDEO_INFO_HEIGHT(out_info);
+    self->border_x = self->border_y = 0;
+    if (self->add_borders) {
+        letterbox(self);
+    }
+    self->job.method = self->method;
+    self->job.isa = self->isa;
+    // Матрица та же, что выбрал бы videoconvert для этих caps; диапазон всегда ограниченный
+    self->job.matrix = GST_VIDEO_INFO_COLORIMETRY(out_info).matrix == GST_VIDEO_COLOR_MATRIX_BT709 ?
+                       &fast_scale_bt709 : &fast_scale_bt601;
+
+    pairs = (self->job.dst_height + 1) / 2;
+    self->slices = MAX(1, MIN(threads, (guint)pairs));
+    self->scratch = g_new0(FastScaleScratch, self->slices);
+    for (guint i = 0; i < self->slices; i++) {
+        if (fast_scale_scratch_init(&self->scratch[i], &self->job) != 0) {
+            free_slices(self);
+            return FALSE;
+        }
+    }
+    if (self->slices > 1) {
+        self->pool = g_thread_pool_new(slice_worker, self, self->slices - 1, TRUE, NULL);
+    }
+
+    GST_INFO_OBJECT(self, "%dx%d -> %dx%d at %d,%d in %dx%d, %s kernels, %u slices", self->job.src_width,
+                    self->job.src_height, self->job.dst_width, self->job.dst_height, self->border_x, self->border_y,
+                    self->out_width, self->out_height, fast_scale_isa_name(self->isa), self->slices);
+    return TRUE;
+}
+
+static GstFlowReturn gst_fast_scale_convert_transform_frame(GstVideoFilter *filter, GstVideoFrame *in_frame,
+                                                            GstVideoFrame *out_frame) {
+    GstFastScaleConvert *self = GST_FAST_SCALE_CONVERT(filter);
+    FastScaleJob *job = &self->job;
+
+    job->src = GST_VIDEO_FRAME_PLANE_DATA(in_frame, 0);
+    job->src_stride = GST_VIDEO_FRAME_PLANE_STRIDE(in_frame, 0);
+    job->y = GST_VIDEO_FRAME_PLANE_DATA(out_frame, 0);
+    job->y_stride = GST_VIDEO_FRAME_PLANE_STRIDE(out_frame, 0);
+    job->u = GST_VIDEO_FRAME_PLANE_DATA(out_frame, 1);
+    job->u_stride = GST_VIDEO_FRAME_PLANE_STRIDE(out_frame, 1);
+    if (GST_VIDEO_FRAME_FORMAT(out_frame) == GST_VIDEO_FORMAT_I420) {
+        job->v = GST_VIDEO_FRAME_PLANE_DATA(out_frame, 2);
+        job->v_stride = GST_VIDEO_FRAME_PLANE_STRIDE(out_frame, 2);
+    } else {
+        job->v = NULL;
+        job->v_stride = 0;
+    }
+
+    // Поля чёрные в ограниченном диапазоне; ядра пишут только в картинку, сдвинутую за поля
+    if (job->dst_width != self->out_width || job->dst_height != self->out_height) {
+        int chroma_width = (self->out_width + 1) / 2, chroma_height = (self->out_height + 1) / 2;
+        int x = self->border_x, y = self->border_y;
+
+        fill_borders(job->y, job->y_stride, self->out_width, self->out_height, x, y,
+                     job->dst_width, job->dst_height, 16);
+        if (job->v != NULL) {
+            fill_borders(job->u, job->u_stride, chroma_width, chroma_height, x / 2, y / 2,
+                         (job->dst_width + 1) / 2, (job->dst_height + 1) / 2, 128);
+            fill_borders(job->v, job->v_stride, chroma_width, chroma_height, x / 2, y / 2,
+                         (job->dst_width + 1) / 2, (job->dst_height + 1) / 2, 128);
+            job->v += (gsize)(y / 2) * job->v_stride + x / 2;
+            job->u += (gsize)(y / 2) * job->u_stride + x / 2;
+        } else {
+            fill_borders(job->u, job->u_stride, chroma_width * 2, chroma_height, x, y / 2,
+                         (job->dst_width + 1) / 2 * 2, (job->dst_height + 1) / 2, 128);
+            job->u += (gsize)(y / 2) * job->u_stride + x;
+        }
+        job->y += (gsize)y * job->y_stride + x;
+    }
+
+    if (self->pool == NULL) {
+        run_slice(self, 0);
+        return GST_FLOW_OK;
+    }
+
+    // Срезы 1..n-1 уходят в пул, срез 0 считаем в потоке конвейера
+    self->pending = self->slices - 1;
+    for (guint i = 1; i < self->slices; i++) {
+        g_thread_pool_push(self->pool, GUINT_TO_POINTER(i + 1), NULL);
+    }
+    run_slice(self, 0);
+
+    g_mutex_lock(&self->lock);
+    while (self->pending > 0) {
+        g_cond_wait(&self->done, &self->lock);
+    }
+    g_mutex_unlock(&self->lock);
+    return GST_FLOW_OK;
+}
+
+static gboolean gst_fast_scale_convert_stop(GstBaseTransform *trans) {
+    free_slices(GST_FAST_SCALE_CONVERT(trans));
+    return TRUE;
+}
+
+static void gst_fast_scale_convert_set_property(GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec) {
+    GstFastScaleConvert *self = GST_FAST_SCALE_CONVERT(object);
+
+    switch (prop_id) {
+        case PROP_METHOD:
+            self->method = g_value_get_enum(value);
+            break;
+        case PROP_N_THREADS:
+            self->n_threads = g_value_get_uint(value);
+            break;
+        case PROP_ADD_BORDERS:
+            self->add_borders = g_value_get_boolean(value);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+            break;
+    }
+}
+
+static void gst_fast_scale_convert_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *pspec) {
+    GstFastScaleConvert *self = GST_FAST_SCALE_CONVERT(object);
+
+    switch (prop_id) {
+        case PROP_METHOD:
+            g_value_set_enum(value, self->method);
+            break;
+        case PROP_N_THREADS:
+            g_value_set_uint(value, self->n_threads);
+            break;
+        case PROP_ADD_BORDERS:
+            g_value_set_boolean(value, self->add_borders);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+            break;
+    }
+}
+
+static void gst_fast_scale_convert_finalize(GObject *object) {
+    GstFastScaleConvert *self = GST_FAST_SCALE_CONVERT(object);
+
+    free_slices(self);
+    g_mutex_clear(&self->lock);
+    g_cond_clear(&self->done);
+    G_OBJECT_CLASS(gst_fast_scale_convert_parent_class)->finalize(object);
+}
+
+static void gst_fast_scale_convert_class_init(GstFastScaleConvertClass *klass) {
+    GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+    GstElementClass *element_class = GST_ELEMENT_CLASS(klass);
+    GstBaseTransformClass *trans_class = GST_BASE_TRANSFORM_CLASS(klass);
+    GstVideoFilterClass *filter_class = GST_VIDEO_FILTER_CLASS(klass);
+
+    GST_DEBUG_CATEGORY_INIT(fast_scale_convert_debug, "fastscaleconvert", 0, "Fused scale and convert");
+
+    gobject_class->set_property = gst_fast_scale_convert_set_property;
+    gobject_class->get_property = gst_fast_scale_convert_get_property;
+    gobject_class->finalize = gst_fast_scale_convert_finalize;
+
+    g_object_class_install_property(gobject_class, PROP_METHOD,
+        g_param_spec_enum("method", "Method", "Scaling method", GST_TYPE_FAST_SCALE_METHOD, DEFAULT_METHOD,
+                          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property(gobject_class, PROP_N_THREADS,
+        g_param_spec_uint("n-threads", "Threads", "Number of row slices processed in parallel (0 = all cores)",
+                          0, G_MAXUINT, DEFAULT_N_THREADS, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property(gobject_class, PROP_ADD_BORDERS,
+        g_param_spec_boolean("add-borders", "Add borders",
+                             "Keep the source aspect ratio and fill the rest of the frame with black",
+                             DEFAULT_ADD_BORDERS, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    gst_element_class_add_static_pad_template(element_class, &sink_template);
+    gst_element_class_add_static_pad_template(element_class, &src_template);
+    gst_element_class_set_static_metadata(element_class, "Fast scale and convert", "Filter/Converter/Video/Scaler",
+                                          "Scales BGRx video and converts it to I420/NV12 in one pass",
+                                          "cppGstreamTest");
+
+    trans_class->transform_caps = gst_fast_scale_convert_transform_caps;
+    trans_class->fixate_caps = gst_fast_scale_convert_fixate_caps;
+    trans_class->stop = gst_fast_scale_convert_stop;
+    filter_class->set_info = gst_fast_scale_convert_set_info;
+    filter_class->transform_frame = gst_fast_scale_convert_transform_frame;
+}
+
+static void gst_fast_scale_convert_init(GstFastScaleConvert *self) {
+    self->method = DEFAULT_METHOD;
+    self->n_threads = DEFAULT_N_THREADS;
+    self->add_borders = DEFAULT_ADD_BORDERS;
+    self->isa = fast_scale_detect_isa();
+    g_mutex_init(&self->lock);
+    g_cond_init(&self->done);
+}
+
+gboolean fast_scale_convert_register(void) {
+    return gst_element_register(NULL, "fastscaleconvert", GST_RANK_NONE, GST_TYPE_FAST_SCALE_CONVERT);
+}
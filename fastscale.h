@@ -0,0 +1,22 @@
+#ifndef FASTSCALE_H
+#define FASTSCALE_H
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <gst/video/gstvideofilter.h>
+
+#include "fastscale_kernels.h"
+
+G_BEGIN_DECLS
+
+// Элемент fastscaleconvert: BGRx -> I420/NV12 с уменьшением (bilinear или box) за один проход.
+// add-borders вписывает кадр другой формы с чёрными полями, как videoscale
+#define GST_TYPE_FAST_SCALE_CONVERT (gst_fast_scale_convert_get_type())
+G_DECLARE_FINAL_TYPE(GstFastScaleConvert, gst_fast_scale_convert, GST, FAST_SCALE_CONVERT, GstVideoFilter)
+
+// Регистрирует элемент в процессе, без отдельного плагина
+gboolean fast_scale_convert_register(void);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,418 @@
+#include "fastscale_kernels.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FAST_SCALE_X86 1
+#endif
+
+// Y = 16 + 219/255 * (Kr R + Kg G + Kb B), U/V = 128 + 224/255 * ..., всё умножено на 2^14.
+// Суммы коэффициентов U и V равны нулю, суммы Y - 14071.
+const FastScaleMatrix fast_scale_bt601 = {
+    {4207, 8260, 1604},
+    {-2428, -4768, 7196},
+    {7196, -6026, -1170}
+};
+
+const FastScaleMatrix fast_scale_bt709 = {
+    {2991, 10064, 1016},
+    {-1649, -5547, 7196},
+    {7196, -6536, -660}
+};
+
+#define Y_ROUND ((16 << 14) + (1 << 13))
+#define C_ROUND ((128 << 16) + (1 << 15)) // цветность считается по сумме четырёх пикселей
+
+static inline uint8_t clamp_u8(int value) {
+    return value < 0 ? 0 : (value > 255 ? 255 : (uint8_t)value);
+}
+
+FastScaleIsa fast_scale_detect_isa(void) {
+#ifdef FAST_SCALE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return FAST_SCALE_AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return FAST_SCALE_SSE41;
+    }
+#endif
+    return FAST_SCALE_SCALAR;
+}
+
+const char* fast_scale_isa_name(FastScaleIsa isa) {
+    switch (isa) {
+        case FAST_SCALE_AVX2:
+            return "avx2";
+        case FAST_SCALE_SSE41:
+            return "sse4.1";
+        default:
+            return "scalar";
+    }
+}
+
+static int use_box(const FastScaleJob *job) {
+    return job->method == FAST_SCALE_BOX && job->dst_width <= job->src_width && job->dst_height <= job->src_height;
+}
+
+// Координата центра выходного пикселя в исходном кадре, 16.16
+static int64_t source_coord(int dst, int dst_size, int src_size) {
+    int64_t coord = ((int64_t)(2 * dst + 1) * src_size << 16) / (2 * dst_size) - 32768;
+    return coord < 0 ? 0 : coord;
+}
+
+int fast_scale_scratch_init(FastScaleScratch *scratch, const FastScaleJob *job) {
+    memset(scratch, 0, sizeof(*scratch));
+    // Лишний пиксель в конце строк: правый сосед для bilinear и пара для нечётной ширины
+    scratch->vline = malloc(((size_t)job->src_width + 1) * 4);
+    scratch->box_sum = malloc((size_t)job->src_width * 4 * sizeof(uint32_t));
+    scratch->rows[0] = malloc(((size_t)job->dst_width + 1) * 4);
+    scratch->rows[1] = malloc(((size_t)job->dst_width + 1) * 4);
+    scratch->x_index = malloc(((size_t)job->dst_width + 1) * sizeof(int32_t));
+    scratch->x_frac = malloc((size_t)job->dst_width);
+    if (!scratch->vline || !scratch->box_sum || !scratch->rows[0] || !scratch->rows[1] ||
+        !scratch->x_index || !scratch->x_frac) {
+        fast_scale_scratch_clear(scratch);
+        return -1;
+    }
+
+    for (int x = 0; x < job->dst_width; x++) {
+        if (use_box(job)) {
+            scratch->x_index[x] = (int32_t)((int64_t)x * job->src_width / job->dst_width);
+            scratch->x_frac[x] = 0;
+        } else {
+            int64_t coord = source_coord(x, job->dst_width, job->src_width);
+            int x0 = (int)(coord >> 16);
+            scratch->x_frac[x] = (uint8_t)((coord >> 8) & 0xff);
+            if (x0 >= job->src_width - 1) {
+                x0 = job->src_width - 1;
+                scratch->x_frac[x] = 0;
+            }
+            scratch->x_index[x] = x0;
+        }
+    }
+    scratch->x_index[job->dst_width] = job->src_width;
+    return 0;
+}
+
+void fast_scale_scratch_clear(FastScaleScratch *scratch) {
+    free(scratch->vline);
+    free(scratch->box_sum);
+    free(scratch->rows[0]);
+    free(scratch->rows[1]);
+    free(scratch->x_index);
+    free(scratch->x_frac);
+    memset(scratch, 0, sizeof(*scratch));
+}
+
+// ---- Вертикальная интерполяция двух исходных строк: (a * (256 - f) + b * f + 128) >> 8 ----
+
+static void lerp_rows_scalar(uint8_t *dst, const uint8_t *a, const uint8_t *b, int f, int n, int start) {
+    for (int i = start; i < n; i++) {
+        dst[i] = (uint8_t)((a[i] * (256 - f) + b[i] * f + 128) >> 8);
+    }
+}
+
+#ifdef FAST_SCALE_X86
+__attribute__((target("sse4.1")))
+static void lerp_rows_sse41(uint8_t *dst, const uint8_t *a, const uint8_t *b, int f, int n) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i wa = _mm_set1_epi16((short)(256 - f));
+    const __m128i wb = _mm_set1_epi16((short)f);
+    const __m128i round = _mm_set1_epi16(128);
+    int i = 0;
+
+    // Промежуточная сумма не превышает 255 * 256 + 128 и помещается в беззнаковые 16 бит
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa),
+                                                 _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb)), round);
+        __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa),
+                                                 _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb)), round);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+    }
+    lerp_rows_scalar(dst, a, b, f, n, i);
+}
+
+__attribute__((target("avx2")))
+static void lerp_rows_avx2(uint8_t *dst, const uint8_t *a, const uint8_t *b, int f, int n) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i wa = _mm256_set1_epi16((short)(256 - f));
+    const __m256i wb = _mm256_set1_epi16((short)f);
+    const __m256i round = _mm256_set1_epi16(128);
+    int i = 0;
+
+    // unpack и packus работают по 128-битным половинам одинаково, порядок байтов сохраняется
+    for (; i + 32 <= n; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        __m256i lo = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(va, zero), wa),
+                                                       _mm256_mullo_epi16(_mm256_unpacklo_epi8(vb, zero), wb)), round);
+        __m256i hi = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(va, zero), wa),
+                                                       _mm256_mullo_epi16(_mm256_unpackhi_epi8(vb, zero), wb)), round);
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_packus_epi16(_mm256_srli_epi16(lo, 8), _mm256_srli_epi16(hi, 8)));
+    }
+    lerp_rows_scalar(dst, a, b, f, n, i);
+}
+#endif
+
+static void lerp_rows(FastScaleIsa isa, uint8_t *dst, const uint8_t *a, const uint8_t *b, int f, int n) {
+#ifdef FAST_SCALE_X86
+    if (isa == FAST_SCALE_AVX2) {
+        lerp_rows_avx2(dst, a, b, f, n);
+        return;
+    }
+    if (isa == FAST_SCALE_SSE41) {
+        lerp_rows_sse41(dst, a, b, f, n);
+        return;
+    }
+#endif
+    lerp_rows_scalar(dst, a, b, f, n, 0);
+}
+
+// ---- Яркость: строка BGRx -> строка Y ----
+
+static void luma_row_scalar(uint8_t *y, const uint8_t *bgrx, const FastScaleMatrix *m, int width, int start) {
+    for (int x = start; x < width; x++) {
+        const uint8_t *p = bgrx + x * 4;
+        y[x] = clamp_u8((m->y[0] * p[2] + m->y[1] * p[1] + m->y[2] * p[0] + Y_ROUND) >> 14);
+    }
+}
+
+#ifdef FAST_SCALE_X86
+__attribute__((target("sse4.1")))
+static void luma_row_sse41(uint8_t *y, const uint8_t *bgrx, const FastScaleMatrix *m, int width) {
+    // pmaddwd по парам (B, G) и (R, X) даёт две частичные суммы на пиксель, phaddd их складывает
+    const __m128i coef = _mm_setr_epi16(m->y[2], m->y[1], m->y[0], 0, m->y[2], m->y[1], m->y[0], 0);
+    const __m128i round = _mm_set1_epi32(Y_ROUND);
+    int x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        __m128i p0 = _mm_loadu_si128((const __m128i *)(bgrx + x * 4));
+        __m128i p1 = _mm_loadu_si128((const __m128i *)(bgrx + x * 4 + 16));
+        __m128i s0 = _mm_hadd_epi32(_mm_madd_epi16(_mm_cvtepu8_epi16(p0), coef),
+                                    _mm_madd_epi16(_mm_cvtepu8_epi16(_mm_srli_si128(p0, 8)), coef));
+        __m128i s1 = _mm_hadd_epi32(_mm_madd_epi16(_mm_cvtepu8_epi16(p1), coef),
+                                    _mm_madd_epi16(_mm_cvtepu8_epi16(_mm_srli_si128(p1, 8)), coef));
+        s0 = _mm_srai_epi32(_mm_add_epi32(s0, round), 14);
+        s1 = _mm_srai_epi32(_mm_add_epi32(s1, round), 14);
+        __m128i packed = _mm_packs_epi32(s0, s1);
+        _mm_storel_epi64((__m128i *)(y + x), _mm_packus_epi16(packed, packed));
+    }
+    luma_row_scalar(y, bgrx, m, width, x);
+}
+
+__attribute__((target("avx2")))
+static void luma_row_avx2(uint8_t *y, const uint8_t *bgrx, const FastScaleMatrix *m, int width) {
+    const __m256i coef = _mm256_setr_epi16(m->y[2], m->y[1], m->y[0], 0, m->y[2], m->y[1], m->y[0], 0,
+                                           m->y[2], m->y[1], m->y[0], 0, m->y[2], m->y[1], m->y[0], 0);
+    const __m256i round = _mm256_set1_epi32(Y_ROUND);
+    int x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(bgrx + x * 4)));
+        __m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(bgrx + x * 4 + 16)));
+        // hadd складывает внутри 128-битных половин: [a0 a1 b0 b1 | a2 a3 b2 b3] -> переставляем 64-битные слова
+        __m256i s = _mm256_permute4x64_epi64(_mm256_hadd_epi32(_mm256_madd_epi16(a, coef), _mm256_madd_epi16(b, coef)), 0xD8);
+        s = _mm256_srai_epi32(_mm256_add_epi32(s, round), 14);
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(s, s), 0x08);
+        __m128i words = _mm256_castsi256_si128(packed);
+        _mm_storel_epi64((__m128i *)(y + x), _mm_packus_epi16(words, words));
+    }
+    luma_row_scalar(y, bgrx, m, width, x);
+}
+#endif
+
+static void luma_row(FastScaleIsa isa, uint8_t *y, const uint8_t *bgrx, const FastScaleMatrix *m, int width) {
+#ifdef FAST_SCALE_X86
+    if (isa == FAST_SCALE_AVX2) {
+        luma_row_avx2(y, bgrx, m, width);
+        return;
+    }
+    if (isa == FAST_SCALE_SSE41) {
+        luma_row_sse41(y, bgrx, m, width);
+        return;
+    }
+#endif
+    luma_row_scalar(y, bgrx, m, width, 0);
+}
+
+// ---- Цветность: две строки BGRx -> строка U/V (I420) или UV (NV12) по блокам 2x2 ----
+
+static void chroma_row_scalar(uint8_t *u, uint8_t *v, const uint8_t *row0, const uint8_t *row1,
+                              const FastScaleMatrix *m, int chroma_width, int start) {
+    for (int x = start; x < chroma_width; x++) {
+        const uint8_t *a = row0 + x * 8;
+        const uint8_t *b = row1 + x * 8;
+        int sb = a[0] + a[4] + b[0] + b[4];
+        int sg = a[1] + a[5] + b[1] + b[5];
+        int sr = a[2] + a[6] + b[2] + b[6];
+        uint8_t cu = clamp_u8((m->u[0] * sr + m->u[1] * sg + m->u[2] * sb + C_ROUND) >> 16);
+        uint8_t cv = clamp_u8((m->v[0] * sr + m->v[1] * sg + m->v[2] * sb + C_ROUND) >> 16);
+
+        if (v != NULL) {
+            u[x] = cu;
+            v[x] = cv;
+        } else {
+            u[x * 2] = cu;
+            u[x * 2 + 1] = cv;
+        }
+    }
+}
+
+#ifdef FAST_SCALE_X86
+// Сумма блоков 2x2 по каналам для четырёх выборок цветности (восемь пикселей двух строк)
+__attribute__((target("sse4.1")))
+static inline void chroma_sums_sse41(const uint8_t *row0, const uint8_t *row1, __m128i *lo, __m128i *hi) {
+    // Соседние пиксели ставим рядом по каналам, pmaddubsw с единицами их складывает
+    const __m128i pairs = _mm_setr_epi8(0, 4, 1, 5, 2, 6, 3, 7, 8, 12, 9, 13, 10, 14, 11, 15);
+    const __m128i ones = _mm_set1_epi8(1);
+
+    *lo = _mm_add_epi16(_mm_maddubs_epi16(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)row0), pairs), ones),
+                        _mm_maddubs_epi16(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)row1), pairs), ones));
+    *hi = _mm_add_epi16(_mm_maddubs_epi16(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(row0 + 16)), pairs), ones),
+                        _mm_maddubs_epi16(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(row1 + 16)), pairs), ones));
+}
+
+// Используется и в пути AVX2: цветности вчетверо меньше, чем яркости
+__attribute__((target("sse4.1")))
+static void chroma_row_sse41(uint8_t *u, uint8_t *v, const uint8_t *row0, const uint8_t *row1,
+                             const FastScaleMatrix *m, int chroma_width) {
+    const __m128i ucoef = _mm_setr_epi16(m->u[2], m->u[1], m->u[0], 0, m->u[2], m->u[1], m->u[0], 0);
+    const __m128i vcoef = _mm_setr_epi16(m->v[2], m->v[1], m->v[0], 0, m->v[2], m->v[1], m->v[0], 0);
+    const __m128i round = _mm_set1_epi32(C_ROUND);
+    int x = 0;
+
+    for (; x + 4 <= chroma_width; x += 4) {
+        __m128i lo, hi;
+        chroma_sums_sse41(row0 + x * 8, row1 + x * 8, &lo, &hi);
+        __m128i su = _mm_srai_epi32(_mm_add_epi32(_mm_hadd_epi32(_mm_madd_epi16(lo, ucoef), _mm_madd_epi16(hi, ucoef)), round), 16);
+        __m128i sv = _mm_srai_epi32(_mm_add_epi32(_mm_hadd_epi32(_mm_madd_epi16(lo, vcoef), _mm_madd_epi16(hi, vcoef)), round), 16);
+
+        if (v != NULL) {
+            __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(su, sv), _mm_setzero_si128());
+            int32_t packed_u = _mm_cvtsi128_si32(bytes);
+            int32_t packed_v = _mm_cvtsi128_si32(_mm_srli_si128(bytes, 4));
+            memcpy(u + x, &packed_u, 4);
+            memcpy(v + x, &packed_v, 4);
+        } else {
+            __m128i u16 = _mm_packs_epi32(su, su);
+            __m128i v16 = _mm_packs_epi32(sv, sv);
+            __m128i uv = _mm_unpacklo_epi16(u16, v16);
+            _mm_storel_epi64((__m128i *)(u + x * 2), _mm_packus_epi16(uv, uv));
+        }
+    }
+    chroma_row_scalar(u, v, row0, row1, m, chroma_width, x);
+}
+#endif
+
+static void chroma_row(FastScaleIsa isa, uint8_t *u, uint8_t *v, const uint8_t *row0, const uint8_t *row1,
+                       const FastScaleMatrix *m, int chroma_width) {
+#ifdef FAST_SCALE_X86
+    if (isa != FAST_SCALE_SCALAR) {
+        chroma_row_sse41(u, v, row0, row1, m, chroma_width);
+        return;
+    }
+#endif
+    chroma_row_scalar(u, v, row0, row1, m, chroma_width, 0);
+}
+
+// ---- Масштабирование одной выходной строки в BGRx ----
+
+static void scale_row_bilinear(const FastScaleJob *job, FastScaleScratch *scratch, int y, uint8_t *out) {
+    int64_t coord = source_coord(y, job->dst_height, job->src_height);
+    int y0 = (int)(coord >> 16);
+    int f = (int)((coord >> 8) & 0xff);
+    int row_bytes = job->src_width * 4;
+    const uint8_t *line;
+
+    if (y0 >= job->src_height - 1) {
+        y0 = job->src_height - 1;
+        f = 0;
+    }
+    line = job->src + (size_t)y0 * job->src_stride;
+    if (f != 0) {
+        lerp_rows(job->isa, scratch->vline, line, line + job->src_stride, f, row_bytes);
+    } else {
+        memcpy(scratch->vline, line, row_bytes);
+    }
+    memcpy(scratch->vline + row_bytes, scratch->vline + row_bytes - 4, 4);
+
+    for (int x = 0; x < job->dst_width; x++) {
+        const uint8_t *p = scratch->vline + scratch->x_index[x] * 4;
+        int fx = scratch->x_frac[x];
+        for (int c = 0; c < 4; c++) {
+            out[x * 4 + c] = (uint8_t)((p[c] * (256 - fx) + p[c + 4] * fx + 128) >> 8);
+        }
+    }
+}
+
+static void scale_row_box(const FastScaleJob *job, FastScaleScratch *scratch, int y, uint8_t *out) {
+    int y0 = (int)((int64_t)y * job->src_height / job->dst_height);
+    int y1 = (int)((int64_t)(y + 1) * job->src_height / job->dst_height);
+    int n = job->src_width * 4;
+    uint32_t *sum = scratch->box_sum;
+
+    if (y1 <= y0) {
+        y1 = y0 + 1;
+    }
+    // Простые циклы, компилятор векторизует их сам
+    const uint8_t *line = job->src + (size_t)y0 * job->src_stride;
+    for (int i = 0; i < n; i++) {
+        sum[i] = line[i];
+    }
+    for (int row = y0 + 1; row < y1; row++) {
+        line = job->src + (size_t)row * job->src_stride;
+        for (int i = 0; i < n; i++) {
+            sum[i] += line[i];
+        }
+    }
+
+    for (int x = 0; x < job->dst_width; x++) {
+        int x0 = scratch->x_index[x];
+        int x1 = scratch->x_index[x + 1] > x0 ? scratch->x_index[x + 1] : x0 + 1;
+        uint32_t count = (uint32_t)(x1 - x0) * (uint32_t)(y1 - y0);
+        for (int c = 0; c < 4; c++) {
+            uint32_t total = 0;
+            for (int sx = x0; sx < x1; sx++) {
+                total += sum[sx * 4 + c];
+            }
+            out[x * 4 + c] = (uint8_t)((total + count / 2) / count);
+        }
+    }
+}
+
+static void scale_row(const FastScaleJob *job, FastScaleScratch *scratch, int y, uint8_t *out) {
+    if (use_box(job)) {
+        scale_row_box(job, scratch, y, out);
+    } else {
+        scale_row_bilinear(job, scratch, y, out);
+    }
+    // Пара для последней выборки цветности при нечётной ширине
+    memcpy(out + job->dst_width * 4, out + (job->dst_width - 1) * 4, 4);
+}
+
+void fast_scale_convert_rows(const FastScaleJob *job, FastScaleScratch *scratch, int pair_begin, int pair_end) {
+    int chroma_width = (job->dst_width + 1) / 2;
+
+    for (int pair = pair_begin; pair < pair_end; pair++) {
+        int y = pair * 2;
+        const uint8_t *second = scratch->rows[0];
+
+        // Масштабированные строки живут только в кэше: в память кадра пишутся сразу Y, U и V
+        scale_row(job, scratch, y, scratch->rows[0]);
+        luma_row(job->isa, job->y + (size_t)y * job->y_stride, scratch->rows[0], job->matrix, job->dst_width);
+        if (y + 1 < job->dst_height) {
+            scale_row(job, scratch, y + 1, scratch->rows[1]);
+            luma_row(job->isa, job->y + (size_t)(y + 1) * job->y_stride, scratch->rows[1], job->matrix, job->dst_width);
+            second = scratch->rows[1];
+        }
+
+        chroma_row(job->isa, job->u + (size_t)pair * job->u_stride,
+                   job->v != NULL ? job->v + (size_t)pair * job->v_stride : NULL,
+                   scratch->rows[0], second, job->matrix, chroma_width);
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef FASTSCALE_KERNELS_H
+#define FASTSCALE_KERNELS_H
+
+#include <stdint.h>
+
+// Методы масштабирования
+typedef enum {
+    FAST_SCALE_BILINEAR = 0,
+    FAST_SCALE_BOX = 1 // среднее по исходному прямоугольнику, только для уменьшения
+} FastScaleMethod;
+
+// Набор SIMD-ядер, выбирается один раз по возможностям процессора
+typedef enum {
+    FAST_SCALE_SCALAR = 0,
+    FAST_SCALE_SSE41 = 1,
+    FAST_SCALE_AVX2 = 2
+} FastScaleIsa;
+
+// Коэффициенты RGB -> YUV (ограниченный диапазон) в фиксированной точке 2^14
+typedef struct {
+    int16_t y[3];   // r, g, b
+    int16_t u[3];
+    int16_t v[3];
+} FastScaleMatrix;
+
+extern const FastScaleMatrix fast_scale_bt601;
+extern const FastScaleMatrix fast_scale_bt709;
+
+// Одно преобразование кадра BGRx -> I420/NV12 с масштабированием.
+// Для NV12 u указывает на чередующуюся плоскость UV, v == NULL.
+typedef struct {
+    const uint8_t *src;
+    int src_stride;
+    int src_width;
+    int src_height;
+
+    uint8_t *y;
+    int y_stride;
+    uint8_t *u;
+    int u_stride;
+    uint8_t *v;
+    int v_stride;
+    int dst_width;
+    int dst_height;
+
+    FastScaleMethod method;
+    const FastScaleMatrix *matrix;
+    FastScaleIsa isa;
+} FastScaleJob;
+
+// Временные строки одного потока, размеры зависят только от ширины кадров
+typedef struct {
+    uint8_t *vline;     // src_width * 4: исходная строка после вертикальной интерполяции
+    uint32_t *box_sum;  // src_width * 4: суммы строк для box
+    uint8_t *rows[2];   // dst_width * 4: две строки результата в BGRx
+    int32_t *x_index;   // dst_width + 1: для bilinear - левый пиксель, для box - начало диапазона
+    uint8_t *x_frac;    // dst_width: вес правого пикселя для bilinear
+} FastScaleScratch;
+
+FastScaleIsa fast_scale_detect_isa(void);
+const char* fast_scale_isa_name(FastScaleIsa isa);
+
+int fast_scale_scratch_init(FastScaleScratch *scratch, const FastScaleJob *job);
+void fast_scale_scratch_clear(FastScaleScratch *scratch);
+
+// Обрабатывает пары выходных строк [pair_begin, pair_end), пара k = строки 2k и 2k+1
+void fast_scale_convert_rows(const FastScaleJob *job, FastScaleScratch *scratch, int pair_begin, int pair_end);
+
+#endif
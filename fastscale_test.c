@@ -0,0 +1,340 @@
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/video/video.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fastscale.h"
+
+// Минимальное качество относительно videoscale ! videoconvert, дБ
+#define MIN_PSNR 30.0
+#define BENCH_FRAMES 300
+
+typedef struct {
+    int src_width;
+    int src_height;
+    int dst_width;
+    int dst_height;
+} ScaleCase;
+
+static const ScaleCase cases[] = {
+    {1920, 1080, 640, 360},
+    {1920, 1080, 1280, 720},
+    {1280, 720, 1280, 720},
+    {101, 77, 33, 19}
+};
+
+// Пропорции источника после xrandr не совпадают с веткой: 1920x1200 -> 640x360 даёт поля
+// по 32 пикселя слева и справа, 2560x1080 -> 1280x720 - по 90 строк сверху и снизу
+static const ScaleCase letterbox_cases[] = {
+    {1920, 1200, 640, 360},
+    {2560, 1080, 1280, 720}
+};
+
+// Заполняет BGRx кадр псевдослучайным, но гладким содержимым
+static void fill_frame(guint8 *data, int stride, int width, int height) {
+    for (int y = 0; y < height; y++) {
+        guint8 *row = data + (gsize)y * stride;
+        for (int x = 0; x < width; x++) {
+            row[x * 4 + 0] = (guint8)(x * 255 / width);
+            row[x * 4 + 1] = (guint8)(y * 255 / height);
+            row[x * 4 + 2] = (guint8)((x + y) * 3 + (x ^ y) % 7);
+            row[x * 4 + 3] = 0;
+        }
+    }
+}
+
+// Прогоняет один кадр через все наборы ядер и сравнивает результат со скалярным
+static int check_kernels(const ScaleCase *sc, FastScaleMethod method, int nv12) {
+    FastScaleIsa best = fast_scale_detect_isa();
+    int src_stride = sc->src_width * 4 + 12;
+    int chroma_width = (sc->dst_width + 1) / 2;
+    int chroma_height = (sc->dst_height + 1) / 2;
+    gsize y_size = (gsize)sc->dst_width * sc->dst_height;
+    gsize out_size = y_size + (gsize)chroma_width * chroma_height * 2;
+    guint8 *src = g_malloc((gsize)src_stride * sc->src_height);
+    guint8 *reference = NULL;
+    int failed = 0;
+
+    fill_frame(src, src_stride, sc->src_width, sc->src_height);
+    for (int isa = FAST_SCALE_SCALAR; isa <= (int)best; isa++) {
+        guint8 *out = g_malloc0(out_size);
+        FastScaleJob job;
+        FastScaleScratch scratch;
+
+        memset(&job, 0, sizeof(job));
+        job.src = src;
+        job.src_stride = src_stride;
+        job.src_width = sc->src_width;
+        job.src_height = sc->src_height;
+        job.y = out;
+        job.y_stride = sc->dst_width;
+        job.u = out + y_size;
+        if (nv12) {
+            job.u_stride = chroma_width * 2;
+        } else {
+            job.u_stride = chroma_width;
+            job.v = job.u + (gsize)chroma_width * chroma_height;
+            job.v_stride = chroma_width;
+        }
+        job.dst_width = sc->dst_width;
+        job.dst_height = sc->dst_height;
+        job.method = method;
+        job.matrix = &fast_scale_bt601;
+        job.isa = (FastScaleIsa)isa;
+
+        if (fast_scale_scratch_init(&scratch, &job) != 0) {
+            g_printerr("scratch allocation failed\n");
+            g_free(out);
+            failed = 1;
+            break;
+        }
+        fast_scale_convert_rows(&job, &scratch, 0, chroma_height);
+        fast_scale_scratch_clear(&scratch);
+
+        if (reference == NULL) {
+            reference = out;
+        } else {
+            if (memcmp(reference, out, out_size) != 0) {
+                g_printerr("FAIL kernels %s differ from scalar: %dx%d -> %dx%d %s %s\n",
+                           fast_scale_isa_name((FastScaleIsa)isa), sc->src_width, sc->src_height,
+                           sc->dst_width, sc->dst_height, method == FAST_SCALE_BOX ? "box" : "bilinear",
+                           nv12 ? "NV12" : "I420");
+                failed = 1;
+            }
+            g_free(out);
+        }
+    }
+    g_free(reference);
+    g_free(src);
+    return failed;
+}
+
+// Запускает конвейер appsrc ! <scaler> ! appsink на одном кадре и возвращает результат.
+// square - квадратные пиксели с обеих сторон, как при resize_policy=keep
+static GstSample* convert_frame(GstBuffer *input, const ScaleCase *sc, const char *scaler, const char *format,
+                                gboolean square) {
+    const char *par = square ? ",pixel-aspect-ratio=1/1" : "";
+    gchar *description = g_strdup_printf(
+        "appsrc name=src format=time caps=video/x-raw,format=BGRx,width=%d,height=%d,framerate=30/1%s ! "
+        "%s ! video/x-raw,format=%s,width=%d,height=%d%s ! appsink name=out sync=false",
+        sc->src_width, sc->src_height, par, scaler, format, sc->dst_width, sc->dst_height, par);
+    GError *error = NULL;
+    GstElement *pipeline = gst_parse_launch(description, &error);
+    GstSample *sample = NULL;
+
+    g_free(description);
+    if (error != NULL) {
+        g_printerr("Failed to create pipeline: %s\n", error->message);
+        g_error_free(error);
+        return NULL;
+    }
+
+    GstElement *src = gst_bin_get_by_name(GST_BIN(pipeline), "src");
+    GstElement *out = gst_bin_get_by_name(GST_BIN(pipeline), "out");
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    gst_app_src_push_buffer(GST_APP_SRC(src), gst_buffer_ref(input));
+    gst_app_src_end_of_stream(GST_APP_SRC(src));
+    sample = gst_app_sink_try_pull_sample(GST_APP_SINK(out), 5 * GST_SECOND);
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+
+    gst_object_unref(src);
+    gst_object_unref(out);
+    gst_object_unref(pipeline);
+    return sample;
+}
+
+// PSNR одной плоскости
+static double plane_psnr(const GstVideoFrame *a, const GstVideoFrame *b, int plane) {
+    int width = GST_VIDEO_FRAME_COMP_WIDTH(a, plane) * GST_VIDEO_FRAME_COMP_PSTRIDE(a, plane);
+    int height = GST_VIDEO_FRAME_COMP_HEIGHT(a, plane);
+    double sum = 0.0;
+
+    for (int y = 0; y < height; y++) {
+        const guint8 *row_a = (const guint8*)GST_VIDEO_FRAME_PLANE_DATA(a, plane) + (gsize)y * GST_VIDEO_FRAME_PLANE_STRIDE(a, plane);
+        const guint8 *row_b = (const guint8*)GST_VIDEO_FRAME_PLANE_DATA(b, plane) + (gsize)y * GST_VIDEO_FRAME_PLANE_STRIDE(b, plane);
+        for (int x = 0; x < width; x++) {
+            double d = (double)row_a[x] - row_b[x];
+            sum += d * d;
+        }
+    }
+    if (sum == 0.0) {
+        return 99.0;
+    }
+    return 10.0 * log10(255.0 * 255.0 * width * height / sum);
+}
+
+// Сравнивает fastscaleconvert с videoscale ! videoconvert и n-threads=4 с n-threads=1.
+// borders - кадр другой формы вписывается с полями у обоих
+static int check_element(const ScaleCase *sc, const char *method, const char *format, gboolean borders) {
+    GstVideoInfo info;
+    GstVideoFrame frame;
+    GstVideoFrame fused_frame, threaded_frame, reference_frame;
+    gchar *fused_desc = g_strdup_printf("fastscaleconvert method=%s n-threads=1 add-borders=%s", method,
+                                        borders ? "true" : "false");
+    gchar *threaded_desc = g_strdup_printf("fastscaleconvert method=%s n-threads=4 add-borders=%s", method,
+                                           borders ? "true" : "false");
+    gchar *reference_desc = g_strdup_printf("videoscale method=%s add-borders=%s ! videoconvert",
+                                            strcmp(method, "box") == 0 ? "pixel-average" : "bilinear",
+                                            borders ? "true" : "false");
+    int failed = 0;
+
+    gst_video_info_set_format(&info, GST_VIDEO_FORMAT_BGRx, sc->src_width, sc->src_height);
+    GstBuffer *input = gst_buffer_new_allocate(NULL, GST_VIDEO_INFO_SIZE(&info), NULL);
+    gst_video_frame_map(&frame, &info, input, GST_MAP_WRITE);
+    fill_frame(GST_VIDEO_FRAME_PLANE_DATA(&frame, 0), GST_VIDEO_FRAME_PLANE_STRIDE(&frame, 0),
+               sc->src_width, sc->src_height);
+    gst_video_frame_unmap(&frame);
+    GST_BUFFER_PTS(input) = 0;
+    GST_BUFFER_DURATION(input) = GST_SECOND / 30;
+
+    GstSample *fused = convert_frame(input, sc, fused_desc, format, borders);
+    GstSample *threaded = convert_frame(input, sc, threaded_desc, format, borders);
+    GstSample *reference = convert_frame(input, sc, reference_desc, format, borders);
+    g_free(fused_desc);
+    g_free(threaded_desc);
+    g_free(reference_desc);
+    gst_buffer_unref(input);
+
+    if (!fused || !threaded || !reference) {
+        g_printerr("FAIL %dx%d -> %dx%d %s %s: no output\n", sc->src_width, sc->src_height,
+                   sc->dst_width, sc->dst_height, method, format);
+        failed = 1;
+    } else {
+        gst_video_info_from_caps(&info, gst_sample_get_caps(fused));
+        gst_video_frame_map(&fused_frame, &info, gst_sample_get_buffer(fused), GST_MAP_READ);
+        gst_video_frame_map(&threaded_frame, &info, gst_sample_get_buffer(threaded), GST_MAP_READ);
+        gst_video_frame_map(&reference_frame, &info, gst_sample_get_buffer(reference), GST_MAP_READ);
+
+        g_print("%4dx%-4d -> %4dx%-4d %-8s %s%s:", sc->src_width, sc->src_height, sc->dst_width, sc->dst_height,
+                method, format, borders ? " borders" : "");
+        for (guint plane = 0; plane < GST_VIDEO_FRAME_N_PLANES(&fused_frame); plane++) {
+            double psnr = plane_psnr(&fused_frame, &reference_frame, plane);
+            g_print(" plane %u %.1f dB", plane, psnr);
+            if (psnr < MIN_PSNR) {
+                failed = 1;
+            }
+            if (plane_psnr(&fused_frame, &threaded_frame, plane) < 99.0) {
+                g_print(" (threaded output differs)");
+                failed = 1;
+            }
+        }
+        g_print("%s\n", failed ? " FAIL" : "");
+
+        gst_video_frame_unmap(&fused_frame);
+        gst_video_frame_unmap(&threaded_frame);
+        gst_video_frame_unmap(&reference_frame);
+    }
+
+    if (fused) {
+        gst_sample_unref(fused);
+    }
+    if (threaded) {
+        gst_sample_unref(threaded);
+    }
+    if (reference) {
+        gst_sample_unref(reference);
+    }
+    return failed;
+}
+
+// Прогоняет BENCH_FRAMES одинаковых кадров через масштабировщик и возвращает кадры в секунду
+static double benchmark(const ScaleCase *sc, const char *scaler) {
+    gchar *description = g_strdup_printf(
+        "appsrc name=src format=time block=true caps=video/x-raw,format=BGRx,width=%d,height=%d,framerate=60/1 ! "
+        "%s ! video/x-raw,format=I420,width=%d,height=%d ! fakesink sync=false",
+        sc->src_width, sc->src_height, scaler, sc->dst_width, sc->dst_height);
+    GError *error = NULL;
+    GstElement *pipeline = gst_parse_launch(description, &error);
+    GstVideoInfo info;
+
+    g_free(description);
+    if (error != NULL) {
+        g_printerr("Failed to create pipeline: %s\n", error->message);
+        g_error_free(error);
+        return 0.0;
+    }
+
+    gst_video_info_set_format(&info, GST_VIDEO_FORMAT_BGRx, sc->src_width, sc->src_height);
+    GstBuffer *input = gst_buffer_new_allocate(NULL, GST_VIDEO_INFO_SIZE(&info), NULL);
+    gst_buffer_memset(input, 0, 0x5a, GST_VIDEO_INFO_SIZE(&info));
+
+    GstElement *src = gst_bin_get_by_name(GST_BIN(pipeline), "src");
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+
+    gint64 start = g_get_monotonic_time();
+    for (int i = 0; i < BENCH_FRAMES; i++) {
+        // Неглубокая копия: те же пиксели, свои метки времени
+        GstBuffer *buffer = gst_buffer_copy(input);
+        GST_BUFFER_PTS(buffer) = gst_util_uint64_scale(i, GST_SECOND, 60);
+        GST_BUFFER_DURATION(buffer) = GST_SECOND / 60;
+        gst_app_src_push_buffer(GST_APP_SRC(src), buffer);
+    }
+    gst_app_src_end_of_stream(GST_APP_SRC(src));
+
+    GstBus *bus = gst_element_get_bus(pipeline);
+    GstMessage *msg = gst_bus_timed_pop_filtered(bus, GST_CLOCK_TIME_NONE, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+    double seconds = (g_get_monotonic_time() - start) / 1e6;
+    double fps = GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS ? BENCH_FRAMES / seconds : 0.0;
+
+    gst_message_unref(msg);
+    gst_object_unref(bus);
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(src);
+    gst_object_unref(pipeline);
+    gst_buffer_unref(input);
+    return fps;
+}
+
+int main(int argc, char *argv[]) {
+    const size_t case_count = sizeof(cases) / sizeof(cases[0]);
+    int failed = 0;
+
+    gst_init(&argc, &argv);
+    if (!fast_scale_convert_register()) {
+        g_printerr("Failed to register fastscaleconvert.\n");
+        return 1;
+    }
+    g_print("Kernels: %s\n", fast_scale_isa_name(fast_scale_detect_isa()));
+
+    // 1. Все наборы SIMD-ядер дают тот же результат, что и скалярные
+    for (size_t i = 0; i < case_count; i++) {
+        for (int method = FAST_SCALE_BILINEAR; method <= FAST_SCALE_BOX; method++) {
+            failed |= check_kernels(&cases[i], (FastScaleMethod)method, 0);
+            failed |= check_kernels(&cases[i], (FastScaleMethod)method, 1);
+        }
+    }
+
+    // 2. Элемент близок к videoscale ! videoconvert
+    for (size_t i = 0; i < case_count; i++) {
+        failed |= check_element(&cases[i], "bilinear", "I420", FALSE);
+        failed |= check_element(&cases[i], "bilinear", "NV12", FALSE);
+        failed |= check_element(&cases[i], "box", "I420", FALSE);
+    }
+    // Источник другой формы: поля по бокам и сверху-снизу, как у videoscale
+    for (size_t i = 0; i < sizeof(letterbox_cases) / sizeof(letterbox_cases[0]); i++) {
+        failed |= check_element(&letterbox_cases[i], "bilinear", "I420", TRUE);
+        failed |= check_element(&letterbox_cases[i], "bilinear", "NV12", TRUE);
+    }
+
+    // 3. Пропускная способность на кадрах ладдера
+    if (argc < 2 || strcmp(argv[1], "--no-bench") != 0) {
+        static const char *scalers[] = {
+            "videoscale ! videoconvert",
+            "fastscaleconvert n-threads=1",
+            "fastscaleconvert n-threads=0"
+        };
+        for (size_t i = 0; i < 2; i++) {
+            for (size_t s = 0; s < sizeof(scalers) / sizeof(scalers[0]); s++) {
+                g_print("%dx%d -> %dx%d %-28s %.1f fps\n", cases[i].src_width, cases[i].src_height,
+                        cases[i].dst_width, cases[i].dst_height, scalers[s], benchmark(&cases[i], scalers[s]));
+            }
+        }
+    }
+
+    g_print(failed ? "FAILED\n" : "OK\n");
+    return failed;
+}
@@ -0,0 +1,87 @@
+#include "framestamp.h"
+
+#include <string.h>
+
+#define STAMP_BLACK 16  // уровни яркости studio range: кодировщик их не обрезает
+#define STAMP_WHITE 235
+#define STAMP_THRESHOLD 128
+#define STAMP_VALUE_MASK ((UINT64_C(1) << FRAME_STAMP_VALUE_BITS) - 1)
+
+// CRC-16/CCITT-FALSE по байтам значения
+static uint16_t stamp_crc(uint64_t value) {
+    uint16_t crc = 0xffff;
+
+    for (int i = FRAME_STAMP_VALUE_BITS / 8 - 1; i >= 0; i--) {
+        crc ^= (uint16_t)(((value >> (8 * i)) & 0xff) << 8);
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 0x8000 ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+int frame_stamp_block(int width, int height) {
+    // Чётная сторона: квадраты совпадают с блоками цветности 4:2:0 и макроблоками
+    int block = width / FRAME_STAMP_COLUMNS & ~1;
+
+    if (block > FRAME_STAMP_MAX_BLOCK) {
+        block = FRAME_STAMP_MAX_BLOCK;
+    }
+    if (block < FRAME_STAMP_MIN_BLOCK || height < FRAME_STAMP_ROWS * block) {
+        return 0;
+    }
+    return block;
+}
+
+int frame_stamp_write(uint8_t *luma, int stride, int width, int height, uint64_t value) {
+    int block = frame_stamp_block(width, height);
+    uint64_t word;
+
+    if (block == 0) {
+        return -1;
+    }
+    value &= STAMP_VALUE_MASK;
+    word = value | (uint64_t)stamp_crc(value) << FRAME_STAMP_VALUE_BITS;
+    for (int bit = 0; bit < FRAME_STAMP_ROWS * FRAME_STAMP_COLUMNS; bit++) {
+        int x = bit % FRAME_STAMP_COLUMNS * block;
+        int y = bit / FRAME_STAMP_COLUMNS * block;
+        uint8_t level = word >> bit & 1 ? STAMP_WHITE : STAMP_BLACK;
+
+        for (int row = 0; row < block; row++) {
+            memset(luma + (size_t)(y + row) * stride + x, level, (size_t)block);
+        }
+    }
+    return 0;
+}
+
+int frame_stamp_read(const uint8_t *luma, int stride, int width, int height, uint64_t *value) {
+    int block = frame_stamp_block(width, height);
+    // Края квадрата размывает кодировщик и деблокинг, читается только середина
+    int inset = block / 4;
+    int side = block - 2 * inset;
+    uint64_t word = 0;
+
+    if (block == 0) {
+        return -1;
+    }
+    for (int bit = 0; bit < FRAME_STAMP_ROWS * FRAME_STAMP_COLUMNS; bit++) {
+        int x = bit % FRAME_STAMP_COLUMNS * block + inset;
+        int y = bit / FRAME_STAMP_COLUMNS * block + inset;
+        unsigned sum = 0;
+
+        for (int row = 0; row < side; row++) {
+            const uint8_t *line = luma + (size_t)(y + row) * stride + x;
+            for (int col = 0; col < side; col++) {
+                sum += line[col];
+            }
+        }
+        if (sum > (unsigned)(STAMP_THRESHOLD * side * side)) {
+            word |= UINT64_C(1) << bit;
+        }
+    }
+    if ((uint16_t)(word >> FRAME_STAMP_VALUE_BITS) != stamp_crc(word & STAMP_VALUE_MASK)) {
+        return -1;
+    }
+    *value = word & STAMP_VALUE_MASK;
+    return 0;
+}
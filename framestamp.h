@@ -0,0 +1,28 @@
+#ifndef FRAMESTAMP_H
+#define FRAMESTAMP_H
+
+#include <stdint.h>
+
+// Метка времени, вписанная прямо в яркость кадра: 2 ряда по 32 квадрата в левом верхнем углу,
+// чёрный - 0, белый - 1. 48 бит значения и 16 бит CRC, чтобы кадр без метки или
+// с испорченной кодировщиком меткой не давал ложного времени.
+// Переживает кодирование с потерями и передачу по сети, где метаданные буфера теряются.
+// Модуль не зависит от GStreamer: работает с плоскостью яркости 8 бит
+
+#define FRAME_STAMP_COLUMNS 32
+#define FRAME_STAMP_ROWS 2
+#define FRAME_STAMP_VALUE_BITS 48
+#define FRAME_STAMP_MIN_BLOCK 4
+#define FRAME_STAMP_MAX_BLOCK 16
+
+// Сторона квадрата для кадра такой ширины и высоты, 0 - кадр слишком мал для метки.
+// Писатель и читатель получают одно и то же, пока размер кадра не менялся по дороге
+int frame_stamp_block(int width, int height);
+
+// Вписывает младшие 48 бит value. -1, если кадр слишком мал
+int frame_stamp_write(uint8_t *luma, int stride, int width, int height, uint64_t value);
+
+// Читает метку. 0 - value заполнено, -1 - метки нет или она не прошла проверку
+int frame_stamp_read(const uint8_t *luma, int stride, int width, int height, uint64_t *value);
+
+#endif
@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "framestamp.h"
+
+#define RANDOM_FRAMES 2000
+#define BENCH_ITERATIONS 20000
+
+static uint32_t rng_state = 12345;
+
+static uint32_t next_random(void) {
+    rng_state = rng_state * 1664525u + 1013904223u;
+    return rng_state >> 8;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint8_t clamp_byte(int value) {
+    return (uint8_t)(value < 0 ? 0 : value > 255 ? 255 : value);
+}
+
+// Картинка под меткой: градиент с шумом, как у настоящего экрана
+static void fill_picture(uint8_t *luma, int stride, int width, int height) {
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            luma[(size_t)y * stride + x] = clamp_byte((x + y) % 256 + (int)(next_random() % 32) - 16);
+        }
+    }
+}
+
+// Порча, похожая на кодирование с потерями: размытие 3x3, шум и грубое квантование
+static void degrade(uint8_t *luma, int stride, int width, int height, int noise, int step) {
+    uint8_t *copy = malloc((size_t)stride * height);
+
+    memcpy(copy, luma, (size_t)stride * height);
+    for (int y = 1; y < height - 1; y++) {
+        for (int x = 1; x < width - 1; x++) {
+            int sum = 0;
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    sum += copy[(size_t)(y + dy) * stride + x + dx];
+                }
+            }
+            int value = sum / 9 + (noise > 0 ? (int)(next_random() % (2 * noise + 1)) - noise : 0);
+            luma[(size_t)y * stride + x] = clamp_byte(value / step * step);
+        }
+    }
+    free(copy);
+}
+
+static int check_round_trip(int width, int height, int stride, int noise, int step) {
+    uint8_t *luma = malloc((size_t)stride * height);
+    uint64_t value = ((uint64_t)next_random() << 24 ^ next_random()) & ((UINT64_C(1) << FRAME_STAMP_VALUE_BITS) - 1);
+    uint64_t read = 0;
+    int failed = 0;
+
+    fill_picture(luma, stride, width, height);
+    if (frame_stamp_write(luma, stride, width, height, value) != 0) {
+        fprintf(stderr, "FAIL %dx%d: stamp not written\n", width, height);
+        free(luma);
+        return 1;
+    }
+    degrade(luma, stride, width, height, noise, step);
+    if (frame_stamp_read(luma, stride, width, height, &read) != 0) {
+        fprintf(stderr, "FAIL %dx%d noise %d step %d: stamp not found\n", width, height, noise, step);
+        failed = 1;
+    } else if (read != value) {
+        fprintf(stderr, "FAIL %dx%d noise %d step %d: wrote %llu, read %llu\n", width, height, noise, step,
+                (unsigned long long)value, (unsigned long long)read);
+        failed = 1;
+    }
+    free(luma);
+    return failed;
+}
+
+// Кадры без метки не должны давать время
+static int check_unstamped(void) {
+    const int width = 640, height = 360;
+    uint8_t *luma = malloc((size_t)width * height);
+    int accepted = 0;
+    uint64_t value;
+
+    for (int i = 0; i < RANDOM_FRAMES; i++) {
+        for (int p = 0; p < width * height; p++) {
+            luma[p] = (uint8_t)next_random();
+        }
+        // Половина кадров - крупные случайные квадраты, похожие на метку
+        if (i % 2 == 1) {
+            int block = frame_stamp_block(width, height);
+            for (int y = 0; y < height; y += block) {
+                for (int x = 0; x < width; x += block) {
+                    uint8_t level = next_random() & 1 ? 235 : 16;
+                    for (int row = 0; row < block && y + row < height; row++) {
+                        memset(luma + (size_t)(y + row) * width + x, level, (size_t)(x + block <= width ? block : width - x));
+                    }
+                }
+            }
+        }
+        accepted += frame_stamp_read(luma, width, width, height, &value) == 0;
+    }
+    free(luma);
+    printf("%d of %d unstamped frames accepted\n", accepted, RANDOM_FRAMES);
+    // CRC-16 пропускает случайное слово с вероятностью 1/65536
+    if (accepted > 1) {
+        fprintf(stderr, "FAIL unstamped frames accepted\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int check_sizes(void) {
+    uint8_t luma[64 * 8];
+    int failed = 0;
+
+    if (frame_stamp_block(1920, 1080) != FRAME_STAMP_MAX_BLOCK || frame_stamp_block(160, 120) != 4 ||
+        frame_stamp_block(200, 120) != 6) {
+        fprintf(stderr, "FAIL block sizes %d %d %d\n", frame_stamp_block(1920, 1080),
+                frame_stamp_block(160, 120), frame_stamp_block(200, 120));
+        failed = 1;
+    }
+    // Слишком узкий или низкий кадр остаётся нетронутым
+    memset(luma, 77, sizeof(luma));
+    if (frame_stamp_write(luma, 64, 64, 8, 1) == 0 || luma[0] != 77 ||
+        frame_stamp_block(1920, 31) != 0 || frame_stamp_block(128, 7) != 0) {
+        fprintf(stderr, "FAIL small frames\n");
+        failed = 1;
+    }
+    return failed;
+}
+
+static void benchmark(void) {
+    const int width = 1920, height = 1080;
+    uint8_t *luma = malloc((size_t)width * height);
+    uint64_t value = 0, sum = 0;
+
+    fill_picture(luma, width, width, height);
+    double start = now_seconds();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        frame_stamp_write(luma, width, width, height, (uint64_t)i);
+    }
+    double write_seconds = now_seconds() - start;
+    start = now_seconds();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        if (frame_stamp_read(luma, width, width, height, &value) == 0) {
+            sum += value;
+        }
+    }
+    double read_seconds = now_seconds() - start;
+    printf("1080p stamp write %.2f us, read %.2f us (%llu)\n", write_seconds * 1e6 / BENCH_ITERATIONS,
+           read_seconds * 1e6 / BENCH_ITERATIONS, (unsigned long long)sum);
+    free(luma);
+}
+
+int main(int argc, char *argv[]) {
+    int failed = 0;
+
+    // 1. Метка читается после порчи на разных размерах и с запасом в stride
+    failed |= check_round_trip(1920, 1080, 1920, 0, 1);
+    failed |= check_round_trip(1280, 720, 1280, 24, 8);
+    failed |= check_round_trip(640, 360, 704, 40, 16);
+    failed |= check_round_trip(256, 144, 256, 24, 8);
+    failed |= check_round_trip(160, 90, 160, 16, 4);
+
+    // 2. Размер квадратов и слишком маленькие кадры
+    failed |= check_sizes();
+
+    // 3. Ложные срабатывания
+    failed |= check_unstamped();
+
+    // 4. Стоимость на кадр
+    if (argc < 2 || strcmp(argv[1], "--no-bench") != 0) {
+        benchmark();
+    }
+
+    printf(failed ? "FAILED\n" : "OK\n");
+    return failed;
+}
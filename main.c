@@ -1,20 +1,78 @@
+#define _GNU_SOURCE
 #include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <gst/video/video.h>
 #include <glib.h>
+#include <glib-unix.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/Xdamage.h>
 
-#define MAX_LINE_LENGTH 100
-#define MAX_VIDEO_FORMATS 10
+#include "audio.h"
+#include "bench.h"
+#include "fastscale.h"
+#include "metrics.h"
+#include "replay.h"
+#include "scheduler.h"
+#include "shmexport.h"
+#include "startup.h"
+#include "stream.h"
+#include "tilecompositor.h"
+#include "tracer.h"
+
+#define MAX_LINE_LENGTH 256
+#define MAX_FORMAT_NAME 16
+#define DEFAULT_DEDUPE_TILE 64
+#define MAX_CAPTURE_REGIONS 32
+#define DEFAULT_QUEUE_LATENCY_MS 200
+#define DEFAULT_SEGMENT_SECONDS 6
+#define DEFAULT_REPLAY_SECONDS 30
+#define DEFAULT_BENCH_WARMUP_FRAMES 30
+#define DEFAULT_TRACE_MAX_EVENTS 200000
+#define DEFAULT_METRICS_INTERVAL_MS 1000
+#define DEFAULT_ADAPTIVE_INTERVAL_MS 500
+#define DEFAULT_EXPORT_SLOTS 4
+#define EXPORT_QUEUE_BUFFERS 2
+#define DEFAULT_STREAM_KEYFRAME_SECONDS 1
+#define DEFAULT_STREAM_SRT_LATENCY_MS 20
+#define STREAM_LATENCY_SAMPLES 100000
+#define DEFAULT_DRAIN_TIMEOUT_MS 5000
+#define DEFAULT_AUDIO_RATE 48000
+#define DEFAULT_AUDIO_BUFFER_MS 40
+#define DEFAULT_AUDIO_LATENCY_MS 10
+#define DEFAULT_AUDIO_BITRATE 128
+#define DEFAULT_AUDIO_SYNC_TOLERANCE_MS 20
+#define MAX_AUDIO_BUFFER_MS 500
+#define DEFAULT_RESIZE_CHECK_MS 250
 
 static GstElement *pipeline;
-static gboolean eos_received = FALSE;
+// Ошибки X, пропущенные вместо завершения процесса, пока ximagesrc не перезапущен под новый размер экрана
+static volatile gint x_errors;
+// Соединения с X, которые процесс открывает сам, и дисплеи, потерянные на ходу. После обработчика
+// ошибки ввода-вывода Xlib завершает процесс; на своих соединениях это заменяет own_display_lost
+static struct {
+    GMutex lock;
+    GPtrArray *own;     // Display*
+    GArray *lost;       // int: номера дисплеев, которые главный цикл ещё не разобрал; NULL - не следим
+    GSourceFunc notify; // разбирает lost в главном цикле
+    gpointer data;
+} x_connections;
+static int control_pipe[2] = {-1, -1}; // обработчики сигналов будят поток управления через этот канал
 
-// Signal handler for SIGINT to stop recording
-void sigint_handler(int sig) {
-    g_print("Received SIGINT, stopping...\n");
-    gst_element_send_event(GST_ELEMENT(pipeline), gst_event_new_eos());
+// SIGUSR1: сбросить буфер повтора в файлы. Сам сброс делает поток управления,
+// здесь только будим его
+void sigusr1_handler(int sig) {
+    char command = 'd';
+    ssize_t written = write(control_pipe[1], &command, 1);
+    (void)written;
 }
 
 // Функция для конкатенации строки и числа
@@ -39,13 +97,457 @@ char* concat_string_and_number(const char* str, int video_format_count) {
     return result;
 }
 
+// Что делает ветка, когда не успевает: блокирует tee (как раньше), отбрасывает новые
+// или старые кадры в своей очереди, или работает отвязанно от компоновщика через intervideosink
+typedef enum {
+    ISOLATION_DEFAULT, // берётся из branch_isolation
+    ISOLATION_BLOCK,
+    ISOLATION_LEAKY,
+    ISOLATION_DROP_OLDEST,
+    ISOLATION_DECOUPLED
+} IsolationPolicy;
+
+// Кодировщик для записи: auto выбирает первый доступный из x264, openh264, vp8
+typedef enum {
+    ENCODER_AUTO,
+    ENCODER_X264,
+    ENCODER_OPENH264,
+    ENCODER_VP8
+} EncoderKind;
+
 // Структура для хранения параметров видеоформата
 typedef struct {
     int width;
     int height;
     int framerate;
+    char format[MAX_FORMAT_NAME]; // необязательный формат пикселей на выходе ветки, "" = любой
+    IsolationPolicy isolation;
+    ThreadPlacement placement; // cpus= и priority= ветки, иначе берутся branch_cpus/branch_priority
+    int bitrate;               // кбит/с для записи, 0 = по размеру и частоте кадров
+    int qos_priority;          // при перегрузке сначала ухудшаются ветки с меньшим значением
+    int region;                // индекс области или дисплея, из которых ветка берёт кадры
+    char export_name[SHM_RING_NAME_LENGTH]; // кольцо shm для локальных читателей, "" = без экспорта
+    int stream_port;           // порт потока RTP/SRT, 0 = ветка не уходит в сеть
 } VideoFormat;
 
+// Уровни деградации ветки при перегрузке, по возрастанию
+typedef enum {
+    DEGRADE_NONE,
+    DEGRADE_CHEAP_SCALE, // самый дешёвый метод масштабирования
+    DEGRADE_HALF_RATE,   // пропускать каждый второй кадр до масштабирования
+    DEGRADE_ONE_FPS      // один кадр в секунду
+} DegradeLevel;
+
+// Топология лестницы: каждая ветка масштабирует исходный кадр (fanout)
+// или выход ближайшей большей ветки (cascade)
+typedef enum {
+    LADDER_FANOUT,
+    LADDER_CASCADE
+} LadderMode;
+
+// Режим захвата: полный кадр XShm каждый раз или только изменённые области (XDamage)
+typedef enum {
+    CAPTURE_FULL,
+    CAPTURE_DAMAGE
+} CaptureMode;
+
+// Источник кадров: экран X, тестовый сигнал или файл
+typedef enum {
+    SOURCE_XIMAGE,
+    SOURCE_VIDEOTEST,
+    SOURCE_FILE
+} SourceType;
+
+// Что делать с ветками, когда источник меняет размер на ходу (xrandr, окно):
+// вписать ветку в её размер с пропорциями источника или оставить размер и добавить поля
+typedef enum {
+    RESIZE_FIT,
+    RESIZE_KEEP
+} ResizePolicy;
+
+// Область захвата: прямоугольник экрана, окно X или весь экран дисплея
+typedef struct {
+    int x;
+    int y;
+    int width;
+    int height;
+    unsigned long window; // XID окна, 0 = прямоугольник x, y, width, height
+    int display;          // номер X-дисплея; width = 0 и window = 0 - весь его экран
+} CaptureRegion;
+
+// Структура для хранения параметров конфигурации
+typedef struct {
+    int display_number;
+    GArray *video_formats; // VideoFormat, по одному на строку video_format
+    LadderMode ladder_mode;
+    char preconvert_format[MAX_FORMAT_NAME]; // I420/NV12 - конвертировать один раз до tee, "" = выключено
+    CaptureMode capture_mode;
+    SourceType source_type;
+    char source_location[MAX_LINE_LENGTH]; // путь к файлу для SOURCE_FILE
+    VideoFormat source_format;             // размер и частота для videotestsrc, 0 = по умолчанию
+    CaptureRegion regions[MAX_CAPTURE_REGIONS]; // области и дисплеи, у каждого свой источник и свои ветки
+    int region_count;                      // 0 = весь экран display_number одним источником
+    int dedupe;                            // сравнивать хеши плиток и отбрасывать повторяющиеся кадры
+    int dedupe_tile;                       // размер плитки в пикселях
+    int fused_scale;                       // использовать fastscaleconvert для веток, если он доступен
+    FastScaleMethod fused_method;
+    int fused_threads;                     // 0 = все ядра
+    IsolationPolicy branch_isolation;      // политика для веток без isolation=
+    int memory_budget_mb;                  // общий предел памяти под кадры, 0 = без предела
+    int queue_latency_ms;                  // сколько времени кадров может ждать в очереди ветки
+    ThreadPlacement capture_placement;     // поток источника
+    ThreadPlacement branch_placement;      // потоки очередей веток без своих cpus=/priority=
+    ThreadPlacement output_placement;      // поток компоновщика и sink
+    int scaler_threads;                    // n-threads масштабирования: -1 = поровну по ядрам, 0 = не менять
+    int thread_report;
+    int preview;                           // показывать лестницу через compositor -> xvimagesink
+    int preview_tiles;                     // tilecompositor вместо compositor, если все ветки отдают I420
+    int preview_fps;                       // предел частоты предпросмотра, 0 = как у самой быстрой ветки
+    int record;                            // кодировать каждую ветку в сегменты splitmuxsink
+    EncoderKind encoder;
+    char x264_preset[MAX_FORMAT_NAME];
+    char x264_tune[MAX_FORMAT_NAME];       // "none" = без tune
+    int encoder_threads;                   // потоки кодирования на все ветки, 0 = все ядра
+    int segment_seconds;
+    char record_location[MAX_LINE_LENGTH]; // префикс файлов сегментов
+    char record_muxer[MAX_FORMAT_NAME];    // mp4 или mkv
+    int replay;                            // держать последние replay_seconds каждой ветки в памяти
+    int replay_seconds;
+    int replay_memory_mb;                  // на все ветки, делится пропорционально битрейту
+    char replay_location[MAX_LINE_LENGTH]; // префикс файлов при сбросе
+    char replay_muxer[MAX_FORMAT_NAME];    // mp4 или mkv
+    char control_fifo[MAX_LINE_LENGTH];    // именованный канал для команд ("dump"), "" = выключен
+    char preview_sink[MAX_FORMAT_NAME];    // xvimagesink, fakesink или appsink
+    int source_live;                       // videotestsrc с is-live: частота ограничена framerate
+    int bench_frames;                      // остановиться после стольких кадров источника, 0 = работать до SIGINT
+    int bench_warmup_frames;
+    char bench_output[MAX_LINE_LENGTH];    // куда писать JSON прогона, "-" = stdout
+    int trace;                             // время обработки буферов по элементам
+    int trace_sample;                      // измерять каждый N-й буфер
+    char trace_output[MAX_LINE_LENGTH];    // Chrome trace JSON, "" = только гистограммы
+    int trace_max_events;
+    int metrics_port;                      // Prometheus по HTTP на 127.0.0.1, 0 = выключено
+    char metrics_file[MAX_LINE_LENGTH];    // периодически переписываемый файл метрик, "" = выключено
+    int metrics_interval_ms;
+    int adaptive;                          // ухудшать неважные ветки при перегрузке
+    int adaptive_interval_ms;
+    int adaptive_cpu_high;                 // % от всех ядер: выше - перегрузка
+    int adaptive_cpu_low;                  // ниже - есть запас
+    int adaptive_queue_high;               // % заполнения самой полной очереди
+    int adaptive_queue_low;
+    int adaptive_degrade_ticks;            // сколько интервалов подряд нужно для шага вниз
+    int adaptive_restore_ticks;            // и для шага вверх
+    int reload;                            // применять изменения video_format без перезапуска
+    int export_slots;                      // слотов в кольце shm каждой ветки с export=
+    StreamProtocol stream_protocol;        // транспорт веток со stream=
+    char stream_host[MAX_LINE_LENGTH];     // udp - адрес зрителя, srt - адрес, на котором слушать
+    int stream_keyframe_seconds;           // ключевой кадр не реже, чтобы зритель быстро подключался
+    int stream_srt_latency_ms;             // окно повторной передачи SRT
+    int stream_jitter_ms;                  // rtpjitterbuffer приёмника loopback
+    int stream_loopback;                   // принимать свои потоки и мерить задержку от захвата до зрителя
+    int startup_profile;                   // печатать время фаз запуска до первого кадра
+    int registry_update;                   // 0 = читать готовый кэш реестра GStreamer без обхода плагинов
+    int drain_timeout_ms;                  // сколько ждать, пока ветки опустеют после SIGINT/SIGTERM
+    AudioSource audio;                     // звук в записи каждой ветки, AUDIO_NONE = без звука
+    char audio_device[MAX_LINE_LENGTH];    // устройство pulsesrc/alsasrc, "" = по умолчанию
+    int audio_rate;
+    int audio_channels;
+    int audio_buffer_ms;                   // кольцевой буфер источника звука
+    int audio_latency_ms;                  // одно чтение из устройства, не больше audio_buffer_ms
+    int audio_bitrate;                     // кбит/с
+    int audio_sync_tolerance_ms;           // расхождение A/V, которое ещё не исправляется
+    ResizePolicy resize_policy;            // ветки после смены размера источника
+    int resize_check_ms;                   // сколько ждать после смены размера экрана или окна до перезапуска ximagesrc, 0 = не следить
+} Config;
+
+// Счётчик кадров и байтов, прошедших через пад
+typedef struct {
+    guint64 frames;
+    guint64 bytes;
+} FrameCounter;
+
+// Счётчики на входе и выходе масштабирования
+typedef struct {
+    FrameCounter in;
+    FrameCounter out;
+} ScalerStats;
+
+// Отдельное соединение с X-сервером, через которое узнаём, менялся ли экран с прошлого кадра
+typedef struct {
+    Display *display;
+    Damage damage;
+    int event_base;
+    int frames_to_pass; // сколько ещё кадров пропустить после последнего повреждения
+    guint64 frames_skipped;
+} DamageMonitor;
+
+// Стадия дедупликации перед tee: хеши плиток предыдущего кадра и счётчики.
+// Решение принимается на весь кадр: кадр хотя бы с одной изменившейся плиткой
+// ветки и компоновщик обрабатывают целиком, плитки используются только для сравнения
+typedef struct {
+    GstVideoInfo info;
+    gboolean have_info;
+    int tile;
+    int tiles_x;
+    int tiles_y;
+    guint32 *hashes; // tiles_x * tiles_y, NULL до первого кадра
+    guint64 frames_hashed;
+    guint64 frames_deduped;
+    guint64 tiles_compared;
+    guint64 tiles_differing;  // плитки, отличавшиеся от прошлого кадра; сами по себе ничего не экономят
+    gint64 hash_time_us;
+} DedupeStage;
+
+// Одна ветка лестницы: queue -> videorate [-> videoscale] -> capsfilter [-> tee] [-> videoconvert [-> outcaps]]
+typedef struct {
+    VideoFormat format;
+    int parent; // индекс ветки, с выхода которой берётся кадр, -1 = исходный кадр
+    gboolean scales; // FALSE - ветка узла, которая только прореживает его кадры: videoscale у неё нет
+    GstElement *queue;
+    GstElement *videorate;
+    GstElement *videoscale;
+    GstElement *capsfilter;
+    GstElement *tee; // только если от ветки питаются другие ветки
+    gboolean fused;      // videoscale - это fastscaleconvert, масштабирование и конвертация в одном проходе
+    GstElement *convert; // только если формат ветки отличается от рабочего формата лестницы
+    GstElement *outcaps;
+    ScalerStats stats;
+    IsolationPolicy isolation;
+    GstElement *inter_sink; // только для decoupled: выход ветки уходит в intervideosink,
+    GstElement *inter_src;  // а компоновщик читает intervideosrc со своей частотой кадров
+    GstElement *inter_caps;
+    FrameCounter queue_in;
+    FrameCounter queue_out;
+    guint queued_at_stop; // буферы, оставшиеся в очереди при остановке, не считаются отброшенными
+    FrameCounter inter_out;
+    guint64 in_frame_bytes;  // размер кадра на входе очереди
+    int in_framerate;        // частота кадров на входе очереди (до videorate)
+    guint queue_buffers;     // max-size-buffers
+    guint64 queue_budget;    // байты, выделенные очереди из общего бюджета
+    guint64 inflight_bytes;  // кадры в обработке после очереди: масштабирование, конвертация, intervideo
+    ThreadPlacement placement;
+    GstElement *result_tee; // только если у выхода ветки несколько потребителей: предпросмотр, кодировщик, экспорт
+    // Кодирование для записи, повтора и потока: [result_tee ->] record_queue -> encconvert -> encoder [-> parser]
+    GstElement *record_queue;
+    GstElement *encconvert;
+    GstElement *encoder;
+    GstElement *parser;
+    GstElement *splitmux;
+    int encoder_threads;
+    int bitrate; // кбит/с
+    guint record_buffers;
+    FrameCounter encoded;
+    GstElement *encoded_tee;  // только если у кодировщика несколько потребителей: запись, повтор, поток
+    GstElement *replay_sink;  // appsink, складывающий закодированные кадры в replay
+    ReplayRing replay;
+    // Поток в сеть: [encoded_tee ->] stream_queue -> payloader -> udpsink/srtsink
+    GstElement *stream_queue; // протекающая: медленная сеть не задерживает кодировщик
+    GstElement *payloader;
+    GstElement *stream_sink;
+    FrameCounter streamed;    // пакеты RTP, ушедшие в сеть
+    StreamStamper stamper;    // только при stream_loopback
+    StreamReceiver receiver;
+    // Экспорт в разделяемую память: [result_tee ->] export_queue -> export_sink
+    GstElement *export_queue; // протекающая: копирование в кольцо не задерживает ветку
+    GstElement *export_sink;  // appsink, копирующий кадры в слоты кольца
+    ShmExport exporter;       // кольцо создаётся по первому кадру, когда известен его размер
+    GstCaps *export_caps;     // caps, по которым заполнен export_info
+    ShmFrameInfo export_info;
+    FrameCounter export_in;   // кадры на входе export_queue
+    guint64 export_failed;
+    LatencyRecorder latency;  // только при bench_frames > 0
+    double thread_cpu_seconds;
+    // Здоровье ветки для метрик: пробники только прибавляют, считает поток метрик
+    guint64 qos_events;       // QoS, пришедшие в ветку от компоновщика и sink
+    gint64 qos_jitter_ns;     // jitter из последнего QoS
+    gint64 last_out_us;       // выход последнего кадра
+    guint64 jitter_sum_us;    // сумма |интервал - 1/fps| между кадрами на выходе
+    guint64 jitter_samples;
+    guint64 jitter_max_us;
+    // Состояние потока метрик на прошлом снимке
+    guint64 metrics_in_frames;
+    guint64 metrics_out_frames;
+    guint64 metrics_jitter_sum_us;
+    guint64 metrics_jitter_samples;
+    double capture_fps;
+    double delivered_fps;
+    double mean_jitter_us;
+    volatile gint queue_high_water; // пишет поток перед очередью, читает поток метрик
+    // Адаптивная деградация
+    int qos_priority;
+    volatile gint degrade_level;  // DegradeLevel, меняет только поток контроллера
+    volatile gint rate_divisor;   // пропускать 1 кадр из rate_divisor до масштабирования
+    guint64 gate_frames;
+    guint64 degraded_drops;
+    int scale_method;             // исходный method масштабирования
+    guint64 qos_messages;         // GST_MESSAGE_QOS от элементов ветки
+    // Горячая перезагрузка
+    gboolean active;              // FALSE - слот свободен: ветка удалена или ещё не создана
+    GstPad *compositor_pad;       // запрошенный вход компоновщика
+    gboolean drained;             // EOS удаляемой ветки дошёл до её выхода
+    gboolean retiring;            // отключена от tee и опустошается: слот занят, но ветка уже не действует
+    // Остановка
+    volatile gint shutdown_pending; // выходы ветки, до которых ещё не дошёл EOS
+    gint64 shutdown_drained_us;     // EOS прошёл все выходы, 0 - ещё нет
+    gboolean shutdown_forced;       // после срока кадры ветки выброшены, EOS вставлен принудительно
+    // Смена размера источника
+    VideoFormat configured;         // формат из конфигурации: format.width и height могут быть вписаны в него
+    gint64 resize_from_us;          // источник сменил размер, 0 - пауза не измеряется
+    volatile gint resize_caps_seen; // главный цикл перестроил ветку под новый размер, следующий кадр закрывает паузу
+    guint renegotiations;
+    double stall_last_ms;           // от новых caps на входе tee до первого кадра ветки после перестройки
+    double stall_max_ms;
+} Branch;
+
+// Контроллер деградации: пороги из конфигурации и последние замеры
+typedef struct {
+    gboolean enabled;
+    guint interval_ms;
+    double cpu_high;
+    double cpu_low;
+    double queue_high;
+    double queue_low;
+    int degrade_ticks;
+    int restore_ticks;
+    GThread *thread;
+    volatile gint running;
+    guint64 changes;
+    double cpu_percent;
+    double queue_fill;
+} AdaptiveController;
+
+// Перезагрузка лестницы при изменении файла конфигурации
+typedef struct {
+    gboolean enabled;
+    const char *path;
+    Config current;      // последняя применённая конфигурация
+    int inotify_fd;
+    int wake[2];         // канал для остановки потока
+    GThread *thread;
+    GMutex drain_lock;   // ожидание EOS удаляемых веток
+    GCond drained;
+    guint64 applied;
+    guint64 rejected;
+    double last_ms;      // время применения последней перезагрузки
+    double max_ms;
+} ConfigReload;
+
+// Источник одной области захвата: bin(source [-> preconvert -> caps] [-> dedupe]) -> tee
+typedef struct {
+    GstElement *bin;        // своя часть конвейера источника: останавливается целиком, tee в ней нет
+    GstElement *source;
+    GstElement *preconvert; // videoconvert перед tee, если задан preconvert_format
+    GstElement *preconvert_caps;
+    GstElement *tee;
+    FrameCounter source_stats;
+    FrameCounter tee_stats;
+    VideoFormat geometry;   // размер и частота источника, известные до запуска (оценка)
+    gboolean geometry_known;
+    gboolean has_region;    // захватывается region, а не весь экран
+    CaptureRegion region;
+    int display;            // номер X-дисплея источника
+    int display_width;      // размер всего экрана дисплея для сравнения с захватом областей, 0 = неизвестен
+    int display_height;
+    gboolean failed;        // источник остановлен после ошибки, остальные работают дальше
+    int negotiated_width;   // размер из последних caps на входе tee, 0 - caps ещё не было
+    int negotiated_height;
+    guint resizes;          // смены размера после первых caps
+    gint64 restart_us;      // источник перезапущен под новый размер экрана, 0 - не перезапускался
+    int pending_width;      // размер из caps, которые ещё не разобрал главный цикл, 0 - нет таких
+    int pending_height;
+    Display *watch_display; // своё соединение с X для событий о размере экрана или окна, NULL - не следим
+    unsigned long watch_window;
+    guint watch_source;
+    int watched_width;      // размер из последнего ConfigureNotify, 0 - неизвестен
+    int watched_height;
+    int restarted_width;    // размер, под который источник уже перезапускали: ximagesrc мог дать другой
+    int restarted_height;
+} Capture;
+
+typedef struct {
+    LadderMode mode;
+    Capture captures[MAX_CAPTURE_REGIONS];
+    int capture_count;
+    GstElement *compositor;
+    GstElement *preview_caps; // предел частоты после компоновщика, если задан preview_fps
+    GstElement *sink;
+    GPtrArray *branches;         // Branch по слотам, каждая выделена отдельно: пробники держат указатели на них
+    int branch_count;            // занятые слоты, не больше branches->len
+    const char *working_format; // формат, в котором масштабируют ветки, "" = формат источника
+    DamageMonitor damage;
+    GstElement *dedupe_element;
+    DedupeStage dedupe;
+    gboolean fused_available;
+    FastScaleMethod fused_method;
+    int fused_threads;
+    guint64 memory_budget;       // байты, 0 = без предела
+    guint64 fixed_bytes;         // кадры вне очередей веток: источники, preconvert, компоновщик
+    int queue_latency_ms;
+    ThreadPlacement capture_placement;
+    ThreadPlacement output_placement;
+    int scaler_threads;
+    ThreadMonitor threads;
+    gboolean preview;
+    gboolean tiles;              // компоновщик - tilecompositor
+    gboolean record;
+    EncoderKind encoder;
+    const char *x264_preset;
+    const char *x264_tune;
+    int segment_seconds;
+    const char *record_location;
+    const char *record_muxer;
+    gboolean replay;
+    GstClockTime replay_duration;
+    guint64 replay_memory;
+    const char *replay_location;
+    const char *replay_muxer;
+    int export_slots;
+    gboolean exporting;          // хотя бы у одной ветки есть export=
+    StreamProtocol stream_protocol;
+    const char *stream_host;
+    int stream_keyframe_seconds;
+    int stream_srt_latency_ms;
+    int stream_jitter_ms;
+    gboolean stream_loopback;
+    gboolean streaming;          // хотя бы у одной ветки есть stream=
+    StartupProfile startup;
+    gboolean startup_profile;
+    GMainLoop *loop;
+    int drain_timeout_ms;
+    int shutdown_stage;          // 0 - работаем, 1 - ждём, пока ветки опустеют, 2 - ветки остановлены принудительно
+    guint shutdown_timer;        // срок текущей стадии
+    gint64 shutdown_us;          // запрос остановки
+    gint64 finalized_us;         // EOS конвейера: все sink, включая muxer, закончили
+    AudioBranch audio;           // source == NULL - без звука
+    SourceType source_type;
+    ResizePolicy resize_policy;
+    int resize_check_ms;
+    guint resize_timer;
+    GMutex resize_lock;          // pending_width/pending_height источников и renegotiate_idle
+    guint renegotiate_idle;      // главный цикл ещё не перестроил ветки под новые caps, 0 - нечего
+    GThread *control;
+    int control_fifo; // -1, если канал команд не задан
+    Bench bench;
+    ElementTracer tracer;
+    FrameCounter output_stats; // кадры на выходе компоновщика
+    MetricsServer metrics;
+    gint64 metrics_last_us;
+    guint64 metrics_source_frames;
+    guint64 metrics_output_frames;
+    double source_fps;
+    double output_fps;
+    AdaptiveController adaptive;
+    GMutex topology_lock; // набор веток меняет поток перезагрузки, читают метрики и контроллер
+    GMutex budget_lock;   // перенос байтов бюджета между очередями из потоков разных источников
+    GMutex table_lock;    // рост branches: потоки конвейера ищут в ней свою ветку без topology_lock
+    ConfigReload reload;
+} Ladder;
+
+// Ветка в слоте i
+static inline Branch *ladder_branch(Ladder *ladder, int i) {
+    return g_ptr_array_index(ladder->branches, i);
+}
+
 void swap(VideoFormat* xp, VideoFormat* yp) 
 { 
     VideoFormat temp = *xp; 
@@ -53,6 +555,18 @@ void swap(VideoFormat* xp, VideoFormat* yp)
     *yp = temp; 
 } 
   
+// Порядок веток: по убыванию ширины, высоты и частоты кадров. Одинаковые размеры
+// стоят подряд от быстрой к медленной, и медленная может прореживать кадры быстрой
+static gboolean format_before(const VideoFormat *a, const VideoFormat *b) {
+    if (a->width != b->width) {
+        return a->width > b->width;
+    }
+    if (a->height != b->height) {
+        return a->height > b->height;
+    }
+    return a->framerate > b->framerate;
+}
+
 // Function to perform Selection Sort 
 void selectionSort(VideoFormat arr[], int n) 
 { 
@@ -65,7 +579,7 @@ void selectionSort(VideoFormat arr[], int n)
         // unsorted array 
         min_idx = i; 
         for (j = i + 1; j < n; j++) 
-            if (arr[j].width > arr[min_idx].width) 
+            if (format_before(&arr[j], &arr[min_idx])) 
                 min_idx = j; 
   
         // Swap the found minimum element 
@@ -74,221 +588,5707 @@ void selectionSort(VideoFormat arr[], int n)
     } 
 }
 
-// Функция для парсинга строки с видеоформатом
-int parse_video_format(const char* str, VideoFormat* vf) {
-    return sscanf(str, "%dx%d, %d", &vf->width, &vf->height, &vf->framerate) == 3;
-}
-
-// Функция для парсинга конфигурационного файла
-int parse_config_file(const char* filename, int* display_number, VideoFormat* video_formats, int* video_format_count) {
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        perror("Ошибка открытия файла");
-        return -1;
-    }
-
-    char line[MAX_LINE_LENGTH];
-    *display_number = -1;
-    *video_format_count = 0;
-
-    while (fgets(line, sizeof(line), file)) {
-        // Удаляем символ новой строки в конце строки
-        line[strcspn(line, "\n")] = '\0';
-
-        // Парсим display_number
-        if (strncmp(line, "display_number=", 15) == 0) {
-            *display_number = atoi(line + 15);
-        } 
-        // Парсим video_format
-        else if (strncmp(line, "video_format=", 13) == 0) {
-            if (*video_format_count < MAX_VIDEO_FORMATS && parse_video_format(line + 13, &video_formats[*video_format_count])) {
-                (*video_format_count)++;
-            } else {
-                fprintf(stderr, "Ошибка парсинга video_format: %s\n", line + 13);
-            }
-        }
+// Функция для парсинга политики изоляции ветки
+int parse_isolation(const char* str, IsolationPolicy* policy) {
+    if (strcmp(str, "block") == 0) {
+        *policy = ISOLATION_BLOCK;
+    } else if (strcmp(str, "leaky") == 0) {
+        *policy = ISOLATION_LEAKY;
+    } else if (strcmp(str, "drop-oldest") == 0) {
+        *policy = ISOLATION_DROP_OLDEST;
+    } else if (strcmp(str, "decoupled") == 0) {
+        *policy = ISOLATION_DECOUPLED;
+    } else {
+        return 0;
     }
-
-    fclose(file);
-    return 0;
+    return 1;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc == 1) {
-        printf("Not enough arguments! Please enter configuration file name!");
-        return -1;
+const char* isolation_name(IsolationPolicy policy) {
+    switch (policy) {
+        case ISOLATION_LEAKY:
+            return "leaky";
+        case ISOLATION_DROP_OLDEST:
+            return "drop-oldest";
+        case ISOLATION_DECOUPLED:
+            return "decoupled";
+        default:
+            return "block";
     }
-    const char* filename = argv[1];
-    //const char* filename = "config.txt";
-    int display_number;
-    VideoFormat video_formats[MAX_VIDEO_FORMATS];
-    int video_format_count;
+}
 
-    if (parse_config_file(filename, &display_number, video_formats, &video_format_count) != 0) {
-        fprintf(stderr, "Error of parsing configuration file.\n");
-        return EXIT_FAILURE;
+// Функция для парсинга кодировщика записи
+int parse_encoder(const char* str, EncoderKind* encoder) {
+    if (strcmp(str, "auto") == 0) {
+        *encoder = ENCODER_AUTO;
+    } else if (strcmp(str, "x264") == 0) {
+        *encoder = ENCODER_X264;
+    } else if (strcmp(str, "openh264") == 0) {
+        *encoder = ENCODER_OPENH264;
+    } else if (strcmp(str, "vp8") == 0) {
+        *encoder = ENCODER_VP8;
+    } else {
+        return 0;
     }
+    return 1;
+}
 
-    selectionSort(video_formats, video_format_count);
-
-    GstElement *source, *tee;
-    GstBus *bus;
-    GstMessage *msg;
-    GstStateChangeReturn ret;
-
-    // Initialize GStreamer
-    gst_init(&argc, &argv);
-
-    // Create elements
-    source = gst_element_factory_make("ximagesrc", "source");
-
-    GstElement *videoscales[video_format_count];
-    GstElement *converts[video_format_count];
-    GstElement *videorates[video_format_count];
-    GstElement *sink, *compositor;
-    GstElement *queues[video_format_count];
-    GstCaps *caps[video_format_count];
-
-    tee = gst_element_factory_make("tee", "tee");
+// Функция для парсинга строки с видеоформатом: "WxH, FPS[, ключ=значение]..."
+int parse_video_format(const char* str, VideoFormat* vf) {
+    int consumed = 0;
 
-    for(int i = 0; i < video_format_count; i++) {
-        videoscales[i] = gst_element_factory_make("videoscale", concat_string_and_number("videoscale", i));
-        converts[i] = gst_element_factory_make("videoconvert", concat_string_and_number("convert", i));
-        videorates[i] = gst_element_factory_make("videorate", concat_string_and_number("videorate", i));
-        queues[i] = gst_element_factory_make("queue", concat_string_and_number("queue", i));
+    memset(vf, 0, sizeof(*vf));
+    if (sscanf(str, "%dx%d, %d%n", &vf->width, &vf->height, &vf->framerate, &consumed) != 3) {
+        return 0;
     }
 
-    compositor = gst_element_factory_make("compositor", "compositor");
-    sink = gst_element_factory_make("xvimagesink", "sink");
-
-    // Check that all elements are created successfully
-    if (!source || !tee || !sink || !compositor) {
-        g_printerr("Failed to create one of the elements.\n");
-        return -1;
-    }
-    for (int i = 0; i < video_format_count; i++) {
-        if (!videoscales[i] || !converts[i] || !videorates[i] || !queues[i]) {
-            g_printerr("Failed to create one of the elements.\n");
-            return -1;
+    // Необязательные параметры ветки
+    int ok = 1;
+    gchar **options = g_strsplit(str + consumed, ",", -1);
+    for (int i = 0; options[i] != NULL && ok; i++) {
+        gchar *option = g_strstrip(options[i]);
+        if (*option == '\0') {
+            continue;
+        }
+        if (strncmp(option, "format=", 7) == 0 && strlen(option + 7) < MAX_FORMAT_NAME) {
+            strcpy(vf->format, option + 7);
+        } else if (strncmp(option, "isolation=", 10) == 0) {
+            ok = parse_isolation(option + 10, &vf->isolation);
+        } else if (strncmp(option, "cpus=", 5) == 0) {
+            // Внутри video_format запятая разделяет параметры, поэтому ядра перечисляются через '+'
+            ok = thread_placement_parse_cpus(option + 5, &vf->placement);
+        } else if (strncmp(option, "priority=", 9) == 0) {
+            ok = thread_placement_parse_priority(option + 9, &vf->placement);
+        } else if (strncmp(option, "bitrate=", 8) == 0) {
+            vf->bitrate = atoi(option + 8);
+            ok = vf->bitrate > 0;
+        } else if (strncmp(option, "qos_priority=", 13) == 0) {
+            char *end;
+            vf->qos_priority = (int)strtol(option + 13, &end, 10);
+            ok = end != option + 13 && *end == '\0';
+        } else if (strncmp(option, "export=", 7) == 0) {
+            // Имя проверяется сразу, хотя кольцо создаётся только с первым кадром
+            ok = shm_ring_name(option + 7, vf->export_name) == 0;
+        } else if (strncmp(option, "stream=", 7) == 0) {
+            vf->stream_port = atoi(option + 7);
+            ok = vf->stream_port > 0 && vf->stream_port < 65536;
+        } else {
+            ok = 0;
         }
     }
+    g_strfreev(options);
+    return ok;
+}
 
-    // Set properties for elements
-    g_object_set(source, "startx", 0, "use-damage", 0, "display-name", concat_string_and_number(":", display_number), NULL);
+// Функция для парсинга формата предварительной конвертации
+int parse_preconvert_format(const char* str, char* format) {
+    if (strcmp(str, "none") == 0) {
+        format[0] = '\0';
+    } else if (strcmp(str, "I420") == 0 || strcmp(str, "NV12") == 0) {
+        strcpy(format, str);
+    } else {
+        return 0;
+    }
+    return 1;
+}
 
-    g_object_set(compositor, "background", 1, NULL);
+// Функция для парсинга режима лестницы
+int parse_ladder_mode(const char* str, LadderMode* mode) {
+    if (strcmp(str, "fanout") == 0) {
+        *mode = LADDER_FANOUT;
+    } else if (strcmp(str, "cascade") == 0) {
+        *mode = LADDER_CASCADE;
+    } else {
+        return 0;
+    }
+    return 1;
+}
 
-    // Create pipeline and add elements to it
-    pipeline = gst_pipeline_new("multi-screen-recorder");
-    gst_bin_add_many(GST_BIN(pipeline), source, tee, NULL);
-    for (int i = 0; i < video_format_count; i++) {
-        gst_bin_add_many(GST_BIN(pipeline), queues[i], videoscales[i], converts[i], videorates[i], NULL);
+int parse_resize_policy(const char* str, ResizePolicy* policy) {
+    if (strcmp(str, "fit") == 0) {
+        *policy = RESIZE_FIT;
+    } else if (strcmp(str, "keep") == 0) {
+        *policy = RESIZE_KEEP;
+    } else {
+        return 0;
     }
-    gst_bin_add_many(GST_BIN(pipeline), compositor, sink, NULL);
+    return 1;
+}
 
-    // Set caps for videoscale
+const char* resize_policy_name(ResizePolicy policy) {
+    return policy == RESIZE_KEEP ? "keep" : "fit";
+}
 
-    for (int i = 0; i < video_format_count; i++) {
-        caps[i] = gst_caps_new_simple("video/x-raw",
-                               "framerate", GST_TYPE_FRACTION, video_formats[i].framerate, 1,
-                               "width", G_TYPE_INT, video_formats[i].width,
-                               "height", G_TYPE_INT, video_formats[i].height,
-                               NULL);
-    }
+const char* ladder_mode_name(LadderMode mode) {
+    return mode == LADDER_CASCADE ? "cascade" : "fanout";
+}
 
-    // Link elements
-    if (!gst_element_link_many(source, tee, NULL)) {
-        g_printerr("Failed to link source to tee.\n");
-        gst_object_unref(pipeline);
-        return -1;
+// Функция для парсинга режима захвата
+int parse_capture_mode(const char* str, CaptureMode* mode) {
+    if (strcmp(str, "full") == 0) {
+        *mode = CAPTURE_FULL;
+    } else if (strcmp(str, "damage") == 0) {
+        *mode = CAPTURE_DAMAGE;
+    } else {
+        return 0;
     }
+    return 1;
+}
 
-    for (int i = 0; i < video_format_count; i++) {
-        if (!gst_element_link_many(tee, queues[i], videorates[i], videoscales[i], NULL) ||
-            !gst_element_link_filtered(videoscales[i], converts[i], caps[i])) {
-            g_printerr("Failed to link elements for first sink.\n");
-            gst_object_unref(pipeline);
-            return -1;
-        }
+// Функция для парсинга источника: ximagesrc, videotestsrc или file:<путь>
+int parse_source(const char* str, Config* config) {
+    if (strcmp(str, "ximagesrc") == 0) {
+        config->source_type = SOURCE_XIMAGE;
+    } else if (strcmp(str, "videotestsrc") == 0) {
+        config->source_type = SOURCE_VIDEOTEST;
+    } else if (strncmp(str, "file:", 5) == 0 && str[5] != '\0') {
+        config->source_type = SOURCE_FILE;
+        strcpy(config->source_location, str + 5);
+    } else {
+        return 0;
     }
+    return 1;
+}
 
-    for (int i = 0; i < video_format_count; i++) {
-        gst_caps_unref(caps[i]);
+// Функция для парсинга метода fastscaleconvert
+int parse_fused_method(const char* str, FastScaleMethod* method) {
+    if (strcmp(str, "bilinear") == 0) {
+        *method = FAST_SCALE_BILINEAR;
+    } else if (strcmp(str, "box") == 0) {
+        *method = FAST_SCALE_BOX;
+    } else {
+        return 0;
     }
+    return 1;
+}
 
-    GstPad *sinkpads[video_format_count];
-    for (int i = 0; i < video_format_count; i++) {
-        sinkpads[i] = gst_element_request_pad_simple(compositor, concat_string_and_number("sink_", i));
-    }
-    int xpos_sum = 0;
-    for (int i = 1; i < video_format_count; i++) {
-        g_object_set(sinkpads[i], "xpos", xpos_sum, "ypos", video_formats[0].height, "width", video_formats[i].width, "height", video_formats[i].height, "operator", 0, "sizing-policy", 1, NULL);
-        xpos_sum += video_formats[i].width;
+// Функция для парсинга области захвата: "X,Y,WxH" или "window:XID"
+int parse_capture_region(const char* str, CaptureRegion* region) {
+    int consumed = 0;
+    char *end;
+
+    memset(region, 0, sizeof(*region));
+    if (strncmp(str, "window:", 7) == 0) {
+        region->window = strtoul(str + 7, &end, 0);
+        return region->window != 0 && *end == '\0';
     }
-    g_object_set(sinkpads[0], "xpos", xpos_sum <= video_formats[0].width ? 0 : (xpos_sum - video_formats[0].width) / 2, "ypos", 0, NULL);
-    for (int i = 0; i < video_format_count; i++) {
-        gst_object_unref(sinkpads[i]);
+    if (sscanf(str, "%d,%d,%dx%d%n", &region->x, &region->y, &region->width, &region->height, &consumed) != 4 ||
+        str[consumed] != '\0') {
+        return 0;
     }
+    return region->x >= 0 && region->y >= 0 && region->width > 0 && region->height > 0;
+}
 
-    if (!gst_element_link(compositor, sink)) {
-        g_printerr("Failed to link compositor to sink.\n");
-        gst_object_unref(pipeline);
-        return -1;
-    }
+// Захватывается ли весь экран дисплея, а не его часть
+gboolean region_is_display(const CaptureRegion *region) {
+    return region->width == 0 && region->window == 0;
+}
 
-    for(int i = 0; i < video_format_count; i++) {
-        if (!gst_element_link(converts[i], compositor)) {
-            g_printerr("Failed to link queues to compositor.\n");
-            gst_object_unref(pipeline);
-            return -1;
-        }
+// Добавляет источник всего экрана дисплея. 0 - источников уже MAX_CAPTURE_REGIONS
+int add_display_capture(Config* config, int display) {
+    if (config->region_count >= MAX_CAPTURE_REGIONS) {
+        return 0;
     }
+    memset(&config->regions[config->region_count], 0, sizeof(CaptureRegion));
+    config->regions[config->region_count].display = display;
+    config->region_count++;
+    return 1;
+}
 
-    g_object_set(sink, "sync", 0, NULL);
-
-    // Set the pipeline to the PLAYING state
-    ret = gst_element_set_state(pipeline, GST_STATE_PLAYING);
-    if (ret == GST_STATE_CHANGE_FAILURE) {
-        g_printerr("Failed to set pipeline to PLAYING state.\n");
-        gst_object_unref(pipeline);
+// Функция для парсинга конфигурационного файла
+int parse_config_file(const char* filename, Config* config) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        perror("Ошибка открытия файла");
         return -1;
     }
 
-    // Register SIGINT handler
-    signal(SIGINT, sigint_handler);
+    char line[MAX_LINE_LENGTH];
+    int section_display = -1;   // дисплей из последней строки display=, -1 = display_number
+    int display_pending = 0;    // после display= ещё не было ни capture_region, ни video_format
+    config->display_number = -1;
+    config->video_formats = g_array_new(FALSE, TRUE, sizeof(VideoFormat));
+    config->ladder_mode = LADDER_FANOUT;
+    config->preconvert_format[0] = '\0';
+    config->capture_mode = CAPTURE_FULL;
+    config->source_type = SOURCE_XIMAGE;
+    config->source_location[0] = '\0';
+    memset(&config->source_format, 0, sizeof(config->source_format));
+    config->region_count = 0;
+    config->dedupe = 0;
+    config->dedupe_tile = DEFAULT_DEDUPE_TILE;
+    config->fused_scale = 1;
+    config->fused_method = FAST_SCALE_BILINEAR;
+    config->fused_threads = 1;
+    config->branch_isolation = ISOLATION_BLOCK;
+    config->memory_budget_mb = 0;
+    config->queue_latency_ms = DEFAULT_QUEUE_LATENCY_MS;
+    memset(&config->capture_placement, 0, sizeof(config->capture_placement));
+    memset(&config->branch_placement, 0, sizeof(config->branch_placement));
+    memset(&config->output_placement, 0, sizeof(config->output_placement));
+    config->scaler_threads = 0;
+    config->thread_report = 0;
+    config->preview = 1;
+    config->preview_tiles = 1;
+    config->preview_fps = 0;
+    config->record = 0;
+    config->encoder = ENCODER_AUTO;
+    strcpy(config->x264_preset, "superfast");
+    strcpy(config->x264_tune, "zerolatency");
+    config->encoder_threads = 0;
+    config->segment_seconds = DEFAULT_SEGMENT_SECONDS;
+    strcpy(config->record_location, "record");
+    strcpy(config->record_muxer, "mp4");
+    config->replay = 0;
+    config->replay_seconds = DEFAULT_REPLAY_SECONDS;
+    config->replay_memory_mb = 256;
+    strcpy(config->replay_location, "replay");
+    strcpy(config->replay_muxer, "mp4");
+    config->control_fifo[0] = '\0';
+    strcpy(config->preview_sink, "xvimagesink");
+    config->source_live = 1;
+    config->bench_frames = 0;
+    config->bench_warmup_frames = DEFAULT_BENCH_WARMUP_FRAMES;
+    strcpy(config->bench_output, "bench.json");
+    config->trace = 0;
+    config->trace_sample = 1;
+    strcpy(config->trace_output, "trace.json");
+    config->trace_max_events = DEFAULT_TRACE_MAX_EVENTS;
+    config->metrics_port = 0;
+    config->metrics_file[0] = '\0';
+    config->metrics_interval_ms = DEFAULT_METRICS_INTERVAL_MS;
+    config->adaptive = 0;
+    config->adaptive_interval_ms = DEFAULT_ADAPTIVE_INTERVAL_MS;
+    config->adaptive_cpu_high = 90;
+    config->adaptive_cpu_low = 70;
+    config->adaptive_queue_high = 75;
+    config->adaptive_queue_low = 25;
+    config->adaptive_degrade_ticks = 2;
+    config->adaptive_restore_ticks = 6;
+    config->reload = 0;
+    config->export_slots = DEFAULT_EXPORT_SLOTS;
+    config->stream_protocol = STREAM_UDP;
+    strcpy(config->stream_host, "127.0.0.1");
+    config->stream_keyframe_seconds = DEFAULT_STREAM_KEYFRAME_SECONDS;
+    config->stream_srt_latency_ms = DEFAULT_STREAM_SRT_LATENCY_MS;
+    config->stream_jitter_ms = 0;
+    config->stream_loopback = 0;
+    config->startup_profile = 0;
+    config->registry_update = 1;
+    config->drain_timeout_ms = DEFAULT_DRAIN_TIMEOUT_MS;
+    config->audio = AUDIO_NONE;
+    config->audio_device[0] = '\0';
+    config->audio_rate = DEFAULT_AUDIO_RATE;
+    config->audio_channels = 2;
+    config->audio_buffer_ms = DEFAULT_AUDIO_BUFFER_MS;
+    config->audio_latency_ms = DEFAULT_AUDIO_LATENCY_MS;
+    config->audio_bitrate = DEFAULT_AUDIO_BITRATE;
+    config->audio_sync_tolerance_ms = DEFAULT_AUDIO_SYNC_TOLERANCE_MS;
+    config->resize_policy = RESIZE_FIT;
+    config->resize_check_ms = DEFAULT_RESIZE_CHECK_MS;
 
-    // Wait for error or EOS messages
-    bus = gst_element_get_bus(pipeline);
-    while (!eos_received) {
-        msg = gst_bus_timed_pop_filtered(bus, GST_CLOCK_TIME_NONE,
-                                         GST_MESSAGE_ERROR | GST_MESSAGE_EOS);
-    if (msg != NULL) {
-            GError *err;
-            gchar *debug_info;
-
-            switch (GST_MESSAGE_TYPE(msg)) {
-                case GST_MESSAGE_ERROR:
-                    gst_message_parse_error(msg, &err, &debug_info);
-                    g_printerr("Error: %s\n", err->message);
-                    g_error_free(err);
-                    g_free(debug_info);
-                    break;
-                case GST_MESSAGE_EOS:
-                    g_print("End of stream reached.\n");
-                    eos_received = TRUE;
-                    break;
-                default:
-                    g_printerr("Unexpected message received.\n");
-                    break;
+    while (fgets(line, sizeof(line), file)) {
+        // Удаляем символ новой строки в конце строки
+        line[strcspn(line, "\n")] = '\0';
+
+        // Парсим display_number
+        if (strncmp(line, "display_number=", 15) == 0) {
+            config->display_number = atoi(line + 15);
+        }
+        // Парсим video_format
+        else if (strncmp(line, "video_format=", 13) == 0) {
+            VideoFormat format = {0};
+            if (parse_video_format(line + 13, &format)) {
+                // Дисплей без capture_region захватывается целиком
+                if (display_pending) {
+                    if (!add_display_capture(config, section_display)) {
+                        fprintf(stderr, "Ошибка парсинга display: больше %d источников\n", MAX_CAPTURE_REGIONS);
+                    }
+                    display_pending = 0;
+                }
+                // Ветка относится к последней объявленной выше области захвата или дисплею
+                format.region = MAX(config->region_count - 1, 0);
+                g_array_append_val(config->video_formats, format);
+            } else {
+                fprintf(stderr, "Ошибка парсинга video_format: %s\n", line + 13);
             }
-            gst_message_unref(msg);
         }
-    }
-
-    // Stop pipeline and release resources
-    gst_element_set_state(pipeline, GST_STATE_NULL);
-    gst_object_unref(bus);
-    gst_object_unref(pipeline);
-
-    return 0;
-}
\ No newline at end of file
+        // Парсим capture_region
+        else if (strncmp(line, "capture_region=", 15) == 0) {
+            if (config->region_count < MAX_CAPTURE_REGIONS && parse_capture_region(line + 15, &config->regions[config->region_count])) {
+                config->regions[config->region_count].display = section_display;
+                config->region_count++;
+                display_pending = 0;
+            } else {
+                fprintf(stderr, "Ошибка парсинга capture_region: %s\n", line + 15);
+            }
+        }
+        // Парсим display: следующие capture_region и video_format относятся к этому дисплею
+        else if (strncmp(line, "display=", 8) == 0) {
+            const char *number = line[8] == ':' ? line + 9 : line + 8;
+            char *end;
+            long display = strtol(number, &end, 10);
+            if (end != number && *end == '\0' && display >= 0) {
+                // Дисплей без единой ветки остаётся в списке, чтобы его нашла проверка
+                if (display_pending) {
+                    add_display_capture(config, section_display);
+                }
+                section_display = (int)display;
+                display_pending = 1;
+            } else {
+                fprintf(stderr, "Ошибка парсинга display: %s\n", line + 8);
+            }
+        }
+        // Парсим ladder_mode
+        else if (strncmp(line, "ladder_mode=", 12) == 0) {
+            if (!parse_ladder_mode(line + 12, &config->ladder_mode)) {
+                fprintf(stderr, "Ошибка парсинга ladder_mode: %s\n", line + 12);
+            }
+        }
+        // Парсим preconvert_format
+        else if (strncmp(line, "preconvert_format=", 18) == 0) {
+            if (!parse_preconvert_format(line + 18, config->preconvert_format)) {
+                fprintf(stderr, "Ошибка парсинга preconvert_format: %s\n", line + 18);
+            }
+        }
+        // Парсим capture_mode
+        else if (strncmp(line, "capture_mode=", 13) == 0) {
+            if (!parse_capture_mode(line + 13, &config->capture_mode)) {
+                fprintf(stderr, "Ошибка парсинга capture_mode: %s\n", line + 13);
+            }
+        }
+        // Парсим source
+        else if (strncmp(line, "source=", 7) == 0) {
+            if (!parse_source(line + 7, config)) {
+                fprintf(stderr, "Ошибка парсинга source: %s\n", line + 7);
+            }
+        }
+        // Парсим source_size
+        else if (strncmp(line, "source_size=", 12) == 0) {
+            if (!parse_video_format(line + 12, &config->source_format)) {
+                fprintf(stderr, "Ошибка парсинга source_size: %s\n", line + 12);
+            }
+        }
+        // Парсим dedupe
+        else if (strncmp(line, "dedupe=", 7) == 0) {
+            config->dedupe = atoi(line + 7);
+        }
+        // Парсим dedupe_tile
+        else if (strncmp(line, "dedupe_tile=", 12) == 0) {
+            config->dedupe_tile = atoi(line + 12);
+            if (config->dedupe_tile < 8) {
+                fprintf(stderr, "Ошибка парсинга dedupe_tile: %s\n", line + 12);
+                config->dedupe_tile = DEFAULT_DEDUPE_TILE;
+            }
+        }
+        // Парсим fused_scale
+        else if (strncmp(line, "fused_scale=", 12) == 0) {
+            if (strcmp(line + 12, "auto") == 0) {
+                config->fused_scale = 1;
+            } else if (strcmp(line + 12, "off") == 0) {
+                config->fused_scale = 0;
+            } else {
+                fprintf(stderr, "Ошибка парсинга fused_scale: %s\n", line + 12);
+            }
+        }
+        // Парсим fused_method
+        else if (strncmp(line, "fused_method=", 13) == 0) {
+            if (!parse_fused_method(line + 13, &config->fused_method)) {
+                fprintf(stderr, "Ошибка парсинга fused_method: %s\n", line + 13);
+            }
+        }
+        // Парсим branch_isolation
+        else if (strncmp(line, "branch_isolation=", 17) == 0) {
+            if (!parse_isolation(line + 17, &config->branch_isolation)) {
+                fprintf(stderr, "Ошибка парсинга branch_isolation: %s\n", line + 17);
+            }
+        }
+        // Парсим memory_budget_mb
+        else if (strncmp(line, "memory_budget_mb=", 17) == 0) {
+            config->memory_budget_mb = atoi(line + 17);
+            if (config->memory_budget_mb < 0) {
+                fprintf(stderr, "Ошибка парсинга memory_budget_mb: %s\n", line + 17);
+                config->memory_budget_mb = 0;
+            }
+        }
+        // Парсим queue_latency_ms
+        else if (strncmp(line, "queue_latency_ms=", 17) == 0) {
+            config->queue_latency_ms = atoi(line + 17);
+            if (config->queue_latency_ms <= 0) {
+                fprintf(stderr, "Ошибка парсинга queue_latency_ms: %s\n", line + 17);
+                config->queue_latency_ms = DEFAULT_QUEUE_LATENCY_MS;
+            }
+        }
+        // Парсим capture_cpus, branch_cpus, output_cpus
+        else if (strncmp(line, "capture_cpus=", 13) == 0) {
+            if (!thread_placement_parse_cpus(line + 13, &config->capture_placement)) {
+                fprintf(stderr, "Ошибка парсинга capture_cpus: %s\n", line + 13);
+            }
+        }
+        else if (strncmp(line, "branch_cpus=", 12) == 0) {
+            if (!thread_placement_parse_cpus(line + 12, &config->branch_placement)) {
+                fprintf(stderr, "Ошибка парсинга branch_cpus: %s\n", line + 12);
+            }
+        }
+        else if (strncmp(line, "output_cpus=", 12) == 0) {
+            if (!thread_placement_parse_cpus(line + 12, &config->output_placement)) {
+                fprintf(stderr, "Ошибка парсинга output_cpus: %s\n", line + 12);
+            }
+        }
+        // Парсим capture_priority, branch_priority, output_priority
+        else if (strncmp(line, "capture_priority=", 17) == 0) {
+            if (!thread_placement_parse_priority(line + 17, &config->capture_placement)) {
+                fprintf(stderr, "Ошибка парсинга capture_priority: %s\n", line + 17);
+            }
+        }
+        else if (strncmp(line, "branch_priority=", 16) == 0) {
+            if (!thread_placement_parse_priority(line + 16, &config->branch_placement)) {
+                fprintf(stderr, "Ошибка парсинга branch_priority: %s\n", line + 16);
+            }
+        }
+        else if (strncmp(line, "output_priority=", 16) == 0) {
+            if (!thread_placement_parse_priority(line + 16, &config->output_placement)) {
+                fprintf(stderr, "Ошибка парсинга output_priority: %s\n", line + 16);
+            }
+        }
+        // Парсим scaler_threads
+        else if (strncmp(line, "scaler_threads=", 15) == 0) {
+            if (strcmp(line + 15, "auto") == 0) {
+                config->scaler_threads = -1;
+            } else {
+                config->scaler_threads = atoi(line + 15);
+                if (config->scaler_threads < 0) {
+                    fprintf(stderr, "Ошибка парсинга scaler_threads: %s\n", line + 15);
+                    config->scaler_threads = 0;
+                }
+            }
+        }
+        // Парсим thread_report
+        else if (strncmp(line, "thread_report=", 14) == 0) {
+            config->thread_report = atoi(line + 14);
+        }
+        // Парсим preview
+        else if (strncmp(line, "preview=", 8) == 0) {
+            config->preview = atoi(line + 8);
+        }
+        // Парсим preview_compositor
+        else if (strncmp(line, "preview_compositor=", 19) == 0) {
+            if (strcmp(line + 19, "tiles") == 0) {
+                config->preview_tiles = 1;
+            } else if (strcmp(line + 19, "compositor") == 0) {
+                config->preview_tiles = 0;
+            } else {
+                fprintf(stderr, "Ошибка парсинга preview_compositor: %s\n", line + 19);
+            }
+        }
+        // Парсим preview_fps
+        else if (strncmp(line, "preview_fps=", 12) == 0) {
+            config->preview_fps = atoi(line + 12);
+            if (config->preview_fps < 0) {
+                fprintf(stderr, "Ошибка парсинга preview_fps: %s\n", line + 12);
+                config->preview_fps = 0;
+            }
+        }
+        // Парсим record
+        else if (strncmp(line, "record=", 7) == 0) {
+            config->record = atoi(line + 7);
+        }
+        // Парсим encoder
+        else if (strncmp(line, "encoder=", 8) == 0) {
+            if (!parse_encoder(line + 8, &config->encoder)) {
+                fprintf(stderr, "Ошибка парсинга encoder: %s\n", line + 8);
+            }
+        }
+        // Парсим x264_preset
+        else if (strncmp(line, "x264_preset=", 12) == 0) {
+            if (strlen(line + 12) < MAX_FORMAT_NAME) {
+                strcpy(config->x264_preset, line + 12);
+            } else {
+                fprintf(stderr, "Ошибка парсинга x264_preset: %s\n", line + 12);
+            }
+        }
+        // Парсим x264_tune
+        else if (strncmp(line, "x264_tune=", 10) == 0) {
+            if (strlen(line + 10) < MAX_FORMAT_NAME) {
+                strcpy(config->x264_tune, line + 10);
+            } else {
+                fprintf(stderr, "Ошибка парсинга x264_tune: %s\n", line + 10);
+            }
+        }
+        // Парсим encoder_threads
+        else if (strncmp(line, "encoder_threads=", 16) == 0) {
+            config->encoder_threads = atoi(line + 16);
+            if (config->encoder_threads < 0) {
+                fprintf(stderr, "Ошибка парсинга encoder_threads: %s\n", line + 16);
+                config->encoder_threads = 0;
+            }
+        }
+        // Парсим segment_seconds
+        else if (strncmp(line, "segment_seconds=", 16) == 0) {
+            config->segment_seconds = atoi(line + 16);
+            if (config->segment_seconds <= 0) {
+                fprintf(stderr, "Ошибка парсинга segment_seconds: %s\n", line + 16);
+                config->segment_seconds = DEFAULT_SEGMENT_SECONDS;
+            }
+        }
+        // Парсим record_location
+        else if (strncmp(line, "record_location=", 16) == 0) {
+            strcpy(config->record_location, line + 16);
+        }
+        // Парсим record_muxer
+        else if (strncmp(line, "record_muxer=", 13) == 0) {
+            if (strcmp(line + 13, "mp4") == 0 || strcmp(line + 13, "mkv") == 0) {
+                strcpy(config->record_muxer, line + 13);
+            } else {
+                fprintf(stderr, "Ошибка парсинга record_muxer: %s\n", line + 13);
+            }
+        }
+        // Парсим replay
+        else if (strncmp(line, "replay=", 7) == 0) {
+            config->replay = atoi(line + 7);
+        }
+        // Парсим replay_seconds
+        else if (strncmp(line, "replay_seconds=", 15) == 0) {
+            config->replay_seconds = atoi(line + 15);
+            if (config->replay_seconds <= 0) {
+                fprintf(stderr, "Ошибка парсинга replay_seconds: %s\n", line + 15);
+                config->replay_seconds = DEFAULT_REPLAY_SECONDS;
+            }
+        }
+        // Парсим replay_memory_mb
+        else if (strncmp(line, "replay_memory_mb=", 17) == 0) {
+            config->replay_memory_mb = atoi(line + 17);
+            if (config->replay_memory_mb < 0) {
+                fprintf(stderr, "Ошибка парсинга replay_memory_mb: %s\n", line + 17);
+                config->replay_memory_mb = 0;
+            }
+        }
+        // Парсим replay_location
+        else if (strncmp(line, "replay_location=", 16) == 0) {
+            strcpy(config->replay_location, line + 16);
+        }
+        // Парсим replay_muxer
+        else if (strncmp(line, "replay_muxer=", 13) == 0) {
+            if (strcmp(line + 13, "mp4") == 0 || strcmp(line + 13, "mkv") == 0) {
+                strcpy(config->replay_muxer, line + 13);
+            } else {
+                fprintf(stderr, "Ошибка парсинга replay_muxer: %s\n", line + 13);
+            }
+        }
+        // Парсим control_fifo
+        else if (strncmp(line, "control_fifo=", 13) == 0) {
+            strcpy(config->control_fifo, line + 13);
+        }
+        // Парсим preview_sink
+        else if (strncmp(line, "preview_sink=", 13) == 0) {
+            if (strcmp(line + 13, "xvimagesink") == 0 || strcmp(line + 13, "fakesink") == 0 ||
+                strcmp(line + 13, "appsink") == 0) {
+                strcpy(config->preview_sink, line + 13);
+            } else {
+                fprintf(stderr, "Ошибка парсинга preview_sink: %s\n", line + 13);
+            }
+        }
+        // Парсим source_live
+        else if (strncmp(line, "source_live=", 12) == 0) {
+            config->source_live = atoi(line + 12);
+        }
+        // Парсим bench_frames
+        else if (strncmp(line, "bench_frames=", 13) == 0) {
+            config->bench_frames = atoi(line + 13);
+            if (config->bench_frames < 0) {
+                fprintf(stderr, "Ошибка парсинга bench_frames: %s\n", line + 13);
+                config->bench_frames = 0;
+            }
+        }
+        // Парсим bench_warmup_frames
+        else if (strncmp(line, "bench_warmup_frames=", 20) == 0) {
+            config->bench_warmup_frames = atoi(line + 20);
+            if (config->bench_warmup_frames < 0) {
+                fprintf(stderr, "Ошибка парсинга bench_warmup_frames: %s\n", line + 20);
+                config->bench_warmup_frames = DEFAULT_BENCH_WARMUP_FRAMES;
+            }
+        }
+        // Парсим bench_output
+        else if (strncmp(line, "bench_output=", 13) == 0) {
+            strcpy(config->bench_output, line + 13);
+        }
+        // Парсим trace
+        else if (strncmp(line, "trace=", 6) == 0) {
+            config->trace = atoi(line + 6);
+        }
+        // Парсим trace_sample
+        else if (strncmp(line, "trace_sample=", 13) == 0) {
+            config->trace_sample = atoi(line + 13);
+            if (config->trace_sample <= 0) {
+                fprintf(stderr, "Ошибка парсинга trace_sample: %s\n", line + 13);
+                config->trace_sample = 1;
+            }
+        }
+        // Парсим trace_output
+        else if (strncmp(line, "trace_output=", 13) == 0) {
+            strcpy(config->trace_output, line + 13);
+        }
+        // Парсим metrics_port
+        else if (strncmp(line, "metrics_port=", 13) == 0) {
+            config->metrics_port = atoi(line + 13);
+            if (config->metrics_port < 0 || config->metrics_port > 65535) {
+                fprintf(stderr, "Ошибка парсинга metrics_port: %s\n", line + 13);
+                config->metrics_port = 0;
+            }
+        }
+        // Парсим metrics_file
+        else if (strncmp(line, "metrics_file=", 13) == 0) {
+            strcpy(config->metrics_file, line + 13);
+        }
+        // Парсим metrics_interval_ms
+        else if (strncmp(line, "metrics_interval_ms=", 20) == 0) {
+            config->metrics_interval_ms = atoi(line + 20);
+            if (config->metrics_interval_ms <= 0) {
+                fprintf(stderr, "Ошибка парсинга metrics_interval_ms: %s\n", line + 20);
+                config->metrics_interval_ms = DEFAULT_METRICS_INTERVAL_MS;
+            }
+        }
+        // Парсим adaptive
+        else if (strncmp(line, "adaptive=", 9) == 0) {
+            config->adaptive = atoi(line + 9);
+        }
+        // Парсим adaptive_interval_ms
+        else if (strncmp(line, "adaptive_interval_ms=", 21) == 0) {
+            config->adaptive_interval_ms = atoi(line + 21);
+            if (config->adaptive_interval_ms <= 0) {
+                fprintf(stderr, "Ошибка парсинга adaptive_interval_ms: %s\n", line + 21);
+                config->adaptive_interval_ms = DEFAULT_ADAPTIVE_INTERVAL_MS;
+            }
+        }
+        // Парсим adaptive_cpu_high, adaptive_cpu_low
+        else if (strncmp(line, "adaptive_cpu_high=", 18) == 0) {
+            config->adaptive_cpu_high = atoi(line + 18);
+        }
+        else if (strncmp(line, "adaptive_cpu_low=", 17) == 0) {
+            config->adaptive_cpu_low = atoi(line + 17);
+        }
+        // Парсим adaptive_queue_high, adaptive_queue_low
+        else if (strncmp(line, "adaptive_queue_high=", 20) == 0) {
+            config->adaptive_queue_high = atoi(line + 20);
+        }
+        else if (strncmp(line, "adaptive_queue_low=", 19) == 0) {
+            config->adaptive_queue_low = atoi(line + 19);
+        }
+        // Парсим adaptive_degrade_ticks, adaptive_restore_ticks
+        else if (strncmp(line, "adaptive_degrade_ticks=", 23) == 0) {
+            config->adaptive_degrade_ticks = atoi(line + 23);
+            if (config->adaptive_degrade_ticks <= 0) {
+                fprintf(stderr, "Ошибка парсинга adaptive_degrade_ticks: %s\n", line + 23);
+                config->adaptive_degrade_ticks = 2;
+            }
+        }
+        else if (strncmp(line, "adaptive_restore_ticks=", 23) == 0) {
+            config->adaptive_restore_ticks = atoi(line + 23);
+            if (config->adaptive_restore_ticks <= 0) {
+                fprintf(stderr, "Ошибка парсинга adaptive_restore_ticks: %s\n", line + 23);
+                config->adaptive_restore_ticks = 6;
+            }
+        }
+        // Парсим reload
+        else if (strncmp(line, "reload=", 7) == 0) {
+            config->reload = atoi(line + 7);
+        }
+        // Парсим export_slots
+        else if (strncmp(line, "export_slots=", 13) == 0) {
+            config->export_slots = atoi(line + 13);
+            if (config->export_slots < 2) {
+                fprintf(stderr, "Ошибка парсинга export_slots: %s\n", line + 13);
+                config->export_slots = DEFAULT_EXPORT_SLOTS;
+            }
+        }
+        // Парсим stream_protocol
+        else if (strncmp(line, "stream_protocol=", 16) == 0) {
+            if (!stream_protocol_parse(line + 16, &config->stream_protocol)) {
+                fprintf(stderr, "Ошибка парсинга stream_protocol: %s\n", line + 16);
+            }
+        }
+        // Парсим stream_host
+        else if (strncmp(line, "stream_host=", 12) == 0) {
+            strcpy(config->stream_host, line + 12);
+        }
+        // Парсим stream_keyframe_seconds
+        else if (strncmp(line, "stream_keyframe_seconds=", 24) == 0) {
+            config->stream_keyframe_seconds = atoi(line + 24);
+            if (config->stream_keyframe_seconds <= 0) {
+                fprintf(stderr, "Ошибка парсинга stream_keyframe_seconds: %s\n", line + 24);
+                config->stream_keyframe_seconds = DEFAULT_STREAM_KEYFRAME_SECONDS;
+            }
+        }
+        // Парсим stream_srt_latency_ms
+        else if (strncmp(line, "stream_srt_latency_ms=", 22) == 0) {
+            config->stream_srt_latency_ms = atoi(line + 22);
+            if (config->stream_srt_latency_ms < 0) {
+                fprintf(stderr, "Ошибка парсинга stream_srt_latency_ms: %s\n", line + 22);
+                config->stream_srt_latency_ms = DEFAULT_STREAM_SRT_LATENCY_MS;
+            }
+        }
+        // Парсим stream_jitter_ms
+        else if (strncmp(line, "stream_jitter_ms=", 17) == 0) {
+            config->stream_jitter_ms = atoi(line + 17);
+            if (config->stream_jitter_ms < 0) {
+                fprintf(stderr, "Ошибка парсинга stream_jitter_ms: %s\n", line + 17);
+                config->stream_jitter_ms = 0;
+            }
+        }
+        // Парсим stream_loopback
+        else if (strncmp(line, "stream_loopback=", 16) == 0) {
+            config->stream_loopback = atoi(line + 16);
+        }
+        // Парсим startup_profile
+        else if (strncmp(line, "startup_profile=", 16) == 0) {
+            config->startup_profile = atoi(line + 16);
+        }
+        // Парсим registry_update
+        else if (strncmp(line, "registry_update=", 16) == 0) {
+            config->registry_update = atoi(line + 16);
+        }
+        // Парсим audio
+        else if (strncmp(line, "audio=", 6) == 0) {
+            if (!audio_source_parse(line + 6, &config->audio)) {
+                fprintf(stderr, "Ошибка парсинга audio: %s\n", line + 6);
+            }
+        }
+        // Парсим audio_device
+        else if (strncmp(line, "audio_device=", 13) == 0) {
+            strcpy(config->audio_device, line + 13);
+        }
+        // Парсим audio_rate
+        else if (strncmp(line, "audio_rate=", 11) == 0) {
+            config->audio_rate = atoi(line + 11);
+            if (config->audio_rate < 8000 || config->audio_rate > 192000) {
+                fprintf(stderr, "Ошибка парсинга audio_rate: %s\n", line + 11);
+                config->audio_rate = DEFAULT_AUDIO_RATE;
+            }
+        }
+        // Парсим audio_channels
+        else if (strncmp(line, "audio_channels=", 15) == 0) {
+            config->audio_channels = atoi(line + 15);
+            if (config->audio_channels < 1 || config->audio_channels > 8) {
+                fprintf(stderr, "Ошибка парсинга audio_channels: %s\n", line + 15);
+                config->audio_channels = 2;
+            }
+        }
+        // Парсим audio_buffer_ms
+        else if (strncmp(line, "audio_buffer_ms=", 16) == 0) {
+            config->audio_buffer_ms = atoi(line + 16);
+            if (config->audio_buffer_ms < 1 || config->audio_buffer_ms > MAX_AUDIO_BUFFER_MS) {
+                fprintf(stderr, "Ошибка парсинга audio_buffer_ms: %s\n", line + 16);
+                config->audio_buffer_ms = DEFAULT_AUDIO_BUFFER_MS;
+            }
+        }
+        // Парсим audio_latency_ms
+        else if (strncmp(line, "audio_latency_ms=", 17) == 0) {
+            config->audio_latency_ms = atoi(line + 17);
+            if (config->audio_latency_ms < 1 || config->audio_latency_ms > MAX_AUDIO_BUFFER_MS) {
+                fprintf(stderr, "Ошибка парсинга audio_latency_ms: %s\n", line + 17);
+                config->audio_latency_ms = DEFAULT_AUDIO_LATENCY_MS;
+            }
+        }
+        // Парсим audio_bitrate
+        else if (strncmp(line, "audio_bitrate=", 14) == 0) {
+            config->audio_bitrate = atoi(line + 14);
+            if (config->audio_bitrate <= 0) {
+                fprintf(stderr, "Ошибка парсинга audio_bitrate: %s\n", line + 14);
+                config->audio_bitrate = DEFAULT_AUDIO_BITRATE;
+            }
+        }
+        // Парсим audio_sync_tolerance_ms
+        else if (strncmp(line, "audio_sync_tolerance_ms=", 24) == 0) {
+            config->audio_sync_tolerance_ms = atoi(line + 24);
+            if (config->audio_sync_tolerance_ms < 1) {
+                fprintf(stderr, "Ошибка парсинга audio_sync_tolerance_ms: %s\n", line + 24);
+                config->audio_sync_tolerance_ms = DEFAULT_AUDIO_SYNC_TOLERANCE_MS;
+            }
+        }
+        // Парсим resize_policy
+        else if (strncmp(line, "resize_policy=", 14) == 0) {
+            if (!parse_resize_policy(line + 14, &config->resize_policy)) {
+                fprintf(stderr, "Ошибка парсинга resize_policy: %s\n", line + 14);
+            }
+        }
+        // Парсим resize_check_ms
+        else if (strncmp(line, "resize_check_ms=", 16) == 0) {
+            config->resize_check_ms = atoi(line + 16);
+            if (config->resize_check_ms < 0) {
+                fprintf(stderr, "Ошибка парсинга resize_check_ms: %s\n", line + 16);
+                config->resize_check_ms = DEFAULT_RESIZE_CHECK_MS;
+            }
+        }
+        // Парсим drain_timeout_ms
+        else if (strncmp(line, "drain_timeout_ms=", 17) == 0) {
+            config->drain_timeout_ms = atoi(line + 17);
+            if (config->drain_timeout_ms <= 0) {
+                fprintf(stderr, "Ошибка парсинга drain_timeout_ms: %s\n", line + 17);
+                config->drain_timeout_ms = DEFAULT_DRAIN_TIMEOUT_MS;
+            }
+        }
+        // Парсим trace_max_events
+        else if (strncmp(line, "trace_max_events=", 17) == 0) {
+            config->trace_max_events = atoi(line + 17);
+            if (config->trace_max_events < 0) {
+                fprintf(stderr, "Ошибка парсинга trace_max_events: %s\n", line + 17);
+                config->trace_max_events = DEFAULT_TRACE_MAX_EVENTS;
+            }
+        }
+        // Парсим fused_threads
+        else if (strncmp(line, "fused_threads=", 14) == 0) {
+            config->fused_threads = atoi(line + 14);
+            if (config->fused_threads < 0) {
+                fprintf(stderr, "Ошибка парсинга fused_threads: %s\n", line + 14);
+                config->fused_threads = 1;
+            }
+        }
+    }
+    if (display_pending) {
+        add_display_capture(config, section_display);
+    }
+    // Области до первой строки display= снимаются с display_number
+    for (int r = 0; r < config->region_count; r++) {
+        if (config->regions[r].display < 0) {
+            config->regions[r].display = config->display_number;
+        }
+    }
+
+    fclose(file);
+    return 0;
+}
+
+// Освобождает то, что parse_config_file выделил для config
+void free_config(Config *config) {
+    if (config->video_formats != NULL) {
+        g_array_free(config->video_formats, TRUE);
+        config->video_formats = NULL;
+    }
+}
+
+// Узел плана лестницы: одно масштабирование на размер кадра в области захвата.
+// Остальные ветки того же размера только прореживают кадры узла
+typedef struct {
+    int region;
+    int width;
+    int height;
+    int framerate;  // частота масштабирующей ветки, наибольшая в узле
+    int branch;     // масштабирующая ветка: её tee раздаёт кадры узла
+    int parent;     // узел, из кадров которого масштабируем, -1 - из кадров источника
+} LadderNode;
+
+// План лестницы: узлы масштабирования и для каждой ветки - откуда она берёт кадры
+typedef struct {
+    GArray *nodes;   // LadderNode
+    GArray *feeds;   // int на ветку: ветка, чей tee её питает, -1 - tee источника
+    GArray *node_of; // int на ветку: её узел, -1 - свободный слот
+    gboolean separate; // каждая ветка - свой узел, общих масштабирований нет
+} LadderPlan;
+
+// Из двух источников кадров для ветки с частотой framerate лучше тот, чья частота кратна
+// её частоте (кадры через равные промежутки), затем ближайший, то есть с меньшей частотой
+static gboolean better_feed(int framerate, int candidate, int best) {
+    gboolean even = framerate > 0 && candidate % framerate == 0;
+    gboolean best_even = framerate > 0 && best % framerate == 0;
+
+    return even != best_even ? even : candidate < best;
+}
+
+// Строит план по форматам веток, слот с нулевой шириной свободен. Ветки одного размера в одной
+// области делят масштабирование: узел масштабирует самая частая из них, остальные прореживают
+// кадры ветки узла с ближайшей большей частотой. В каскаде узел масштабирует кадры наименьшего
+// большего узла той же области, иначе кадры источника. separate - каждая ветка сама себе узел
+LadderPlan plan_ladder(const VideoFormat *formats, int count, gboolean cascade, gboolean separate) {
+    LadderPlan plan;
+    int *order = g_new(int, MAX(1, count));
+    int placed = 0;
+
+    plan.separate = separate;
+    plan.nodes = g_array_new(FALSE, FALSE, sizeof(LadderNode));
+    plan.feeds = g_array_sized_new(FALSE, FALSE, sizeof(int), count);
+    plan.node_of = g_array_sized_new(FALSE, FALSE, sizeof(int), count);
+    g_array_set_size(plan.feeds, count);
+    g_array_set_size(plan.node_of, count);
+    // По убыванию частоты: кадры ветке отдают только уже размещённые, у которых их не меньше
+    for (int i = 0; i < count; i++) {
+        g_array_index(plan.feeds, int, i) = -1;
+        g_array_index(plan.node_of, int, i) = -1;
+        if (formats[i].width == 0) {
+            continue;
+        }
+        int k = placed++;
+        while (k > 0 && formats[order[k - 1]].framerate < formats[i].framerate) {
+            order[k] = order[k - 1];
+            k--;
+        }
+        order[k] = i;
+    }
+    for (int k = 0; k < placed; k++) {
+        const VideoFormat *format = &formats[order[k]];
+        int node = -1, feed = -1;
+
+        for (guint n = 0; n < plan.nodes->len && !separate && node < 0; n++) {
+            const LadderNode *candidate = &g_array_index(plan.nodes, LadderNode, n);
+            if (candidate->region == format->region && candidate->width == format->width &&
+                candidate->height == format->height) {
+                node = n;
+            }
+        }
+        if (node < 0) {
+            LadderNode added = {format->region, format->width, format->height, format->framerate, order[k], -1};
+            node = plan.nodes->len;
+            g_array_append_val(plan.nodes, added);
+        }
+        for (int j = 0; j < k && g_array_index(plan.nodes, LadderNode, node).branch != order[k]; j++) {
+            if (g_array_index(plan.node_of, int, order[j]) == node &&
+                (feed < 0 || better_feed(format->framerate, formats[order[j]].framerate, formats[feed].framerate))) {
+                feed = order[j];
+            }
+        }
+        g_array_index(plan.node_of, int, order[k]) = node;
+        g_array_index(plan.feeds, int, order[k]) = feed;
+    }
+    g_free(order);
+    if (!cascade) {
+        return plan;
+    }
+
+    // Масштабирование читает кадр родителя с частотой узла, поэтому выбираем наименьший
+    // больший узел, у которого кадров не меньше
+    for (guint n = 0; n < plan.nodes->len; n++) {
+        LadderNode *node = &g_array_index(plan.nodes, LadderNode, n);
+        gint64 best_area = 0;
+
+        for (guint m = 0; m < plan.nodes->len; m++) {
+            const LadderNode *candidate = &g_array_index(plan.nodes, LadderNode, m);
+            gint64 area = (gint64)candidate->width * candidate->height;
+            if (candidate->region != node->region || candidate->width < node->width ||
+                candidate->height < node->height || candidate->framerate < node->framerate ||
+                (candidate->width == node->width && candidate->height == node->height)) {
+                continue;
+            }
+            if (node->parent < 0 || area < best_area ||
+                (area == best_area && better_feed(node->framerate, candidate->framerate,
+                                                  g_array_index(plan.nodes, LadderNode, node->parent).framerate))) {
+                node->parent = m;
+                best_area = area;
+            }
+        }
+        if (node->parent >= 0) {
+            g_array_index(plan.feeds, int, node->branch) = g_array_index(plan.nodes, LadderNode, node->parent).branch;
+        }
+    }
+    return plan;
+}
+
+void free_ladder_plan(LadderPlan *plan) {
+    g_array_free(plan->nodes, TRUE);
+    g_array_free(plan->feeds, TRUE);
+    g_array_free(plan->node_of, TRUE);
+}
+
+static GstPadProbeReturn count_buffer_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    FrameCounter *counter = user_data;
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+    counter->frames++;
+    counter->bytes += gst_buffer_get_size(buffer);
+    return GST_PAD_PROBE_OK;
+}
+
+// QoS от компоновщика и sink: сколько пришло и с каким опозданием
+static GstPadProbeReturn qos_event_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    Branch *branch = user_data;
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+
+    if (GST_EVENT_TYPE(event) == GST_EVENT_QOS) {
+        GstClockTimeDiff jitter;
+        gst_event_parse_qos(event, NULL, NULL, &jitter, NULL);
+        branch->qos_events++;
+        branch->qos_jitter_ns = jitter;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+// Неравномерность выхода ветки: отклонение интервала между кадрами от 1/fps
+static GstPadProbeReturn output_jitter_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    Branch *branch = user_data;
+    gint64 now = g_get_monotonic_time();
+
+    if (branch->last_out_us != 0 && branch->format.framerate > 0) {
+        gint64 deviation = now - branch->last_out_us - 1000000 / branch->format.framerate;
+        guint64 jitter = (guint64)(deviation < 0 ? -deviation : deviation);
+        branch->jitter_sum_us += jitter;
+        branch->jitter_samples++;
+        if (jitter > branch->jitter_max_us) {
+            branch->jitter_max_us = jitter;
+        }
+    }
+    branch->last_out_us = now;
+    return GST_PAD_PROBE_OK;
+}
+
+// Высшая отметка очереди ветки: уровень, с которым в неё входит кадр. in - out здесь не годится -
+// leaky-очередь отбрасывает кадры внутри себя, и разность бы только росла. Полная очередь
+// кадр отбрасывает или ждёт, поэтому уровень не выше её предела
+static GstPadProbeReturn queue_peak_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    Branch *branch = user_data;
+    guint current, max_buffers;
+    gint peak, seen;
+
+    g_object_get(branch->queue, "current-level-buffers", &current, "max-size-buffers", &max_buffers, NULL);
+    peak = (gint)(max_buffers > 0 ? MIN(current + 1, max_buffers) : current + 1);
+    do {
+        seen = g_atomic_int_get(&branch->queue_high_water);
+    } while (peak > seen && !g_atomic_int_compare_and_exchange(&branch->queue_high_water, seen, peak));
+    return GST_PAD_PROBE_OK;
+}
+
+// Пропускает один кадр из rate_divisor до масштабирования, чтобы ухудшенная ветка
+// не тратила на остальные время. Caps не меняются, поэтому перенастраивать ничего не нужно
+static GstPadProbeReturn degrade_gate_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    Branch *branch = user_data;
+    gint divisor = g_atomic_int_get(&branch->rate_divisor);
+
+    if (divisor > 1 && branch->gate_frames++ % divisor != 0) {
+        branch->degraded_drops++;
+        return GST_PAD_PROBE_DROP;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+// Вешаем счётчик буферов на пад элемента
+void add_counter_probe(GstElement *element, const char *pad_name, FrameCounter *counter) {
+    GstPad *pad = gst_element_get_static_pad(element, pad_name);
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, count_buffer_probe, counter, NULL);
+    gst_object_unref(pad);
+}
+
+// Передаёт номер потерянного дисплея главному циклу. Вызывается из обработчиков Xlib
+// в любом потоке, поэтому только запоминает номер и будит цикл
+static void report_lost_display(Display *display) {
+    const char *colon = strrchr(DisplayString(display), ':');
+    int number = colon != NULL ? atoi(colon + 1) : -1;
+
+    g_mutex_lock(&x_connections.lock);
+    if (x_connections.lost != NULL) {
+        g_array_append_val(x_connections.lost, number);
+        if (x_connections.lost->len == 1) {
+            // Не ниже источников fd: разорванное соединение watch_display будит цикл без конца
+            g_idle_add_full(G_PRIORITY_DEFAULT, x_connections.notify, x_connections.data, NULL);
+        }
+    }
+    g_mutex_unlock(&x_connections.lock);
+}
+
+// Своё соединение потеряно: вместо exit() возвращаемся, вызов Xlib вернёт ошибку,
+// а XCloseDisplay потом только освободит соединение
+static void own_display_lost(Display *display, void *user_data) {
+    report_lost_display(display);
+}
+
+// XOpenDisplay для соединений самого процесса: потеря сервера их не завершает (libX11 1.7+)
+Display* open_own_display(const char *name) {
+    Display *display = XOpenDisplay(name);
+
+    if (display == NULL) {
+        return NULL;
+    }
+    XSetIOErrorExitHandler(display, own_display_lost, NULL);
+    g_mutex_lock(&x_connections.lock);
+    if (x_connections.own == NULL) {
+        x_connections.own = g_ptr_array_new();
+    }
+    g_ptr_array_add(x_connections.own, display);
+    g_mutex_unlock(&x_connections.lock);
+    return display;
+}
+
+void close_own_display(Display *display) {
+    g_mutex_lock(&x_connections.lock);
+    g_ptr_array_remove_fast(x_connections.own, display);
+    g_mutex_unlock(&x_connections.lock);
+    XCloseDisplay(display);
+}
+
+// Ошибка ввода-вывода на любом соединении процесса: сервер X ушёл. Свои соединения дальше
+// разберёт own_display_lost. Поток ximagesrc вернуться отсюда не может - Xlib завершил бы
+// процесс, поэтому он остаётся здесь навсегда, а главный цикл отрезает его источник.
+// Главному циклу ждать некому: тогда процесс завершается, как и без обработчика
+static int x_io_error(Display *display) {
+    gboolean own;
+
+    g_mutex_lock(&x_connections.lock);
+    own = x_connections.own != NULL && g_ptr_array_find(x_connections.own, display, NULL);
+    g_mutex_unlock(&x_connections.lock);
+    if (own) {
+        return 0;
+    }
+    g_printerr("Lost the X connection to %s.\n", DisplayString(display));
+    report_lost_display(display);
+    if (g_main_context_is_owner(g_main_context_default())) {
+        return 0;
+    }
+    for (;;) {
+        g_usleep(G_USEC_PER_SEC);
+    }
+}
+
+// Подписываемся на XDamage корневого окна дисплея
+int damage_monitor_open(DamageMonitor *monitor, const char *display_name) {
+    int error_base;
+
+    monitor->display = open_own_display(display_name);
+    if (monitor->display == NULL) {
+        return -1;
+    }
+    if (!XDamageQueryExtension(monitor->display, &monitor->event_base, &error_base)) {
+        close_own_display(monitor->display);
+        monitor->display = NULL;
+        return -1;
+    }
+    // NonEmpty: одно событие на переход из "ничего не менялось" в "что-то изменилось"
+    monitor->damage = XDamageCreate(monitor->display, DefaultRootWindow(monitor->display), XDamageReportNonEmpty);
+    monitor->frames_to_pass = 1; // первый кадр пропускаем всегда
+    return 0;
+}
+
+void damage_monitor_close(DamageMonitor *monitor) {
+    if (monitor->display != NULL) {
+        XDamageDestroy(monitor->display, monitor->damage);
+        close_own_display(monitor->display);
+        monitor->display = NULL;
+    }
+}
+
+// Отбрасываем кадры, если экран не менялся: tee, ветки и компоновщик их не увидят,
+// а компоновщик продолжит показывать последний кадр ветки
+static GstPadProbeReturn damage_gate_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    DamageMonitor *monitor = user_data;
+    gboolean damaged = FALSE;
+
+    while (XPending(monitor->display) > 0) {
+        XEvent event;
+        XNextEvent(monitor->display, &event);
+        if (event.type == monitor->event_base + XDamageNotify) {
+            damaged = TRUE;
+        }
+    }
+    if (damaged) {
+        // Повреждение могло прийти после того, как ximagesrc снял текущий кадр,
+        // поэтому пропускаем и этот, и следующий
+        XDamageSubtract(monitor->display, monitor->damage, None, None);
+        monitor->frames_to_pass = 2;
+    }
+
+    if (monitor->frames_to_pass > 0) {
+        monitor->frames_to_pass--;
+        return GST_PAD_PROBE_OK;
+    }
+    monitor->frames_skipped++;
+    return GST_PAD_PROBE_DROP;
+}
+
+// Хеш прямоугольника байтов: четыре 32-битные дорожки, (acc ^ v) поворот и умножение.
+// Каждый шаг обратим, поэтому отличие в любом одном слове всегда меняет хеш.
+typedef guint32 HashLanes __attribute__((vector_size(16)));
+
+static guint32 hash_rect(const guint8 *data, int stride, int rows, int row_bytes, guint32 seed) {
+    const HashLanes prime = {0x9E3779B1u, 0x85EBCA77u, 0xC2B2AE3Du, 0x27D4EB2Fu};
+    HashLanes acc = {seed, seed ^ 0x5bd1e995u, seed + 0x6b43a9b5u, ~seed};
+    guint32 tail = seed;
+
+    for (int y = 0; y < rows; y++) {
+        const guint8 *row = data + (gsize)y * stride;
+        int x = 0;
+        for (; x + 16 <= row_bytes; x += 16) {
+            HashLanes v;
+            memcpy(&v, row + x, sizeof(v));
+            acc ^= v;
+            acc = (acc << 13) | (acc >> 19);
+            acc *= prime;
+        }
+        for (; x < row_bytes; x++) {
+            tail = (tail ^ row[x]) * 0x01000193u;
+        }
+    }
+    return acc[0] ^ (acc[1] * 3) ^ (acc[2] * 5) ^ (acc[3] * 7) ^ tail;
+}
+
+// Пересчитываем сетку плиток при смене caps
+static void dedupe_set_caps(DedupeStage *dedupe, GstCaps *caps) {
+    dedupe->have_info = gst_video_info_from_caps(&dedupe->info, caps);
+    g_free(dedupe->hashes);
+    dedupe->hashes = NULL;
+    if (dedupe->have_info) {
+        dedupe->tiles_x = (GST_VIDEO_INFO_WIDTH(&dedupe->info) + dedupe->tile - 1) / dedupe->tile;
+        dedupe->tiles_y = (GST_VIDEO_INFO_HEIGHT(&dedupe->info) + dedupe->tile - 1) / dedupe->tile;
+    }
+}
+
+// Хешируем плитки кадра и сравниваем с предыдущим кадром.
+// Если не изменилась ни одна плитка, кадр отбрасывается до tee: ни масштабирование,
+// ни конвертация веток его не обрабатывают, а компоновщик повторяет их прошлый выход.
+static GstPadProbeReturn dedupe_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    DedupeStage *dedupe = user_data;
+
+    if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+        GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+        if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
+            GstCaps *caps;
+            gst_event_parse_caps(event, &caps);
+            dedupe_set_caps(dedupe, caps);
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    GstVideoFrame frame;
+    if (!dedupe->have_info || !gst_video_frame_map(&frame, &dedupe->info, buffer, GST_MAP_READ)) {
+        return GST_PAD_PROBE_OK;
+    }
+
+    gint64 start = g_get_monotonic_time();
+    gboolean first = dedupe->hashes == NULL;
+    int width = GST_VIDEO_FRAME_WIDTH(&frame);
+    int height = GST_VIDEO_FRAME_HEIGHT(&frame);
+    int changed = 0;
+
+    if (first) {
+        dedupe->hashes = g_new0(guint32, dedupe->tiles_x * dedupe->tiles_y);
+    }
+
+    for (int ty = 0; ty < dedupe->tiles_y; ty++) {
+        for (int tx = 0; tx < dedupe->tiles_x; tx++) {
+            int x0 = tx * dedupe->tile, x1 = MIN(x0 + dedupe->tile, width);
+            int y0 = ty * dedupe->tile, y1 = MIN(y0 + dedupe->tile, height);
+            guint32 hash = 0;
+
+            // Плитка включает все плоскости, с учётом субдискретизации цветности
+            for (guint plane = 0; plane < GST_VIDEO_FRAME_N_PLANES(&frame); plane++) {
+                guint comp = 0;
+                while (GST_VIDEO_FORMAT_INFO_PLANE(frame.info.finfo, comp) != plane) {
+                    comp++;
+                }
+                int comp_width = GST_VIDEO_FRAME_COMP_WIDTH(&frame, comp);
+                int comp_height = GST_VIDEO_FRAME_COMP_HEIGHT(&frame, comp);
+                int pstride = GST_VIDEO_FRAME_COMP_PSTRIDE(&frame, comp);
+                int stride = GST_VIDEO_FRAME_PLANE_STRIDE(&frame, plane);
+                int px0 = x0 * comp_width / width, px1 = (x1 * comp_width + width - 1) / width;
+                int py0 = y0 * comp_height / height, py1 = (y1 * comp_height + height - 1) / height;
+                const guint8 *data = GST_VIDEO_FRAME_PLANE_DATA(&frame, plane);
+
+                hash = hash_rect(data + (gsize)py0 * stride + px0 * pstride, stride,
+                                 py1 - py0, (px1 - px0) * pstride, hash + plane);
+            }
+
+            guint32 *previous = &dedupe->hashes[ty * dedupe->tiles_x + tx];
+            if (first || *previous != hash) {
+                *previous = hash;
+                changed++;
+            }
+        }
+    }
+    gst_video_frame_unmap(&frame);
+
+    dedupe->frames_hashed++;
+    dedupe->tiles_compared += dedupe->tiles_x * dedupe->tiles_y;
+    dedupe->tiles_differing += changed;
+    dedupe->hash_time_us += g_get_monotonic_time() - start;
+
+    if (changed == 0) {
+        dedupe->frames_deduped++;
+        return GST_PAD_PROBE_DROP;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+// Имя элемента области захвата: без номера, если область одна
+char* capture_element_name(Ladder *ladder, const char *name, int r) {
+    return ladder->capture_count > 1 ? concat_string_and_number(name, r) : strdup(name);
+}
+
+// Функция для создания источника кадров области r; region = NULL - весь экран
+GstElement* create_source(Config *config, Ladder *ladder, const char *display_name, const CaptureRegion *region, int r) {
+    GstElement *source = NULL;
+    GError *error = NULL;
+    gchar *description;
+    char *name = capture_element_name(ladder, "source", r);
+    VideoFormat size = config->source_format;
+
+    switch (config->source_type) {
+        case SOURCE_XIMAGE:
+            source = startup_make_element("ximagesrc", name);
+            if (source) {
+                // С use-damage ximagesrc забирает только повреждённые прямоугольники в свой постоянный кадр
+                g_object_set(source, "startx", 0, "use-damage", ladder->damage.display != NULL, "display-name", display_name, NULL);
+            }
+            if (source && region != NULL && region->window != 0) {
+                // ximagesrc сам следит за окном и забирает только его содержимое
+                g_object_set(source, "xid", (guint64)region->window, NULL);
+            } else if (source && region != NULL) {
+                // XShm читает с сервера только этот прямоугольник; endx и endy включительно
+                g_object_set(source, "startx", (guint)region->x, "starty", (guint)region->y,
+                             "endx", (guint)(region->x + region->width - 1), "endy", (guint)(region->y + region->height - 1), NULL);
+            }
+            break;
+        case SOURCE_VIDEOTEST:
+            // Тестовая область генерируется её размера, как ximagesrc, читающий только область
+            if (region != NULL) {
+                size.width = region->width;
+                size.height = region->height;
+            }
+            if (size.width > 0 && size.framerate > 0) {
+                description = g_strdup_printf("videotestsrc is-live=%s ! video/x-raw,width=%d,height=%d,framerate=%d/1",
+                                              config->source_live ? "true" : "false", size.width, size.height, size.framerate);
+            } else if (size.width > 0) {
+                description = g_strdup_printf("videotestsrc is-live=%s ! video/x-raw,width=%d,height=%d",
+                                              config->source_live ? "true" : "false", size.width, size.height);
+            } else {
+                description = g_strdup_printf("videotestsrc is-live=%s", config->source_live ? "true" : "false");
+            }
+            source = gst_parse_bin_from_description(description, TRUE, &error);
+            g_free(description);
+            break;
+        case SOURCE_FILE:
+            description = g_strdup_printf("filesrc location=\"%s\" ! decodebin ! videoconvert", config->source_location);
+            source = gst_parse_bin_from_description(description, TRUE, &error);
+            g_free(description);
+            break;
+    }
+
+    if (error != NULL) {
+        g_printerr("Failed to create source: %s\n", error->message);
+        g_error_free(error);
+        free(name);
+        return NULL;
+    }
+    if (source && config->source_type != SOURCE_XIMAGE) {
+        gst_object_set_name(GST_OBJECT(source), name);
+    }
+    free(name);
+    return source;
+}
+
+// Проверяет области захвата и дисплеи. Несколько источников нельзя вести через один монитор
+// XDamage и одну стадию дедупликации, поэтому с несколькими источниками они выключаются
+int check_capture_regions(Config *config) {
+    if (config->region_count == 0) {
+        return 0;
+    }
+    if (config->source_type == SOURCE_FILE) {
+        g_printerr("capture_region and display need source=ximagesrc or source=videotestsrc.\n");
+        return -1;
+    }
+    for (int r = 0; r < config->region_count; r++) {
+        int formats = 0;
+        if (config->regions[r].window != 0 && config->source_type != SOURCE_XIMAGE) {
+            g_printerr("capture_region %d: window capture needs source=ximagesrc.\n", r);
+            return -1;
+        }
+        for (int i = 0; i < (int)config->video_formats->len; i++) {
+            formats += g_array_index(config->video_formats, VideoFormat, i).region == r;
+        }
+        if (formats == 0 && region_is_display(&config->regions[r])) {
+            g_printerr("display :%d has no video_format after it.\n", config->regions[r].display);
+            return -1;
+        }
+        if (formats == 0) {
+            g_printerr("capture_region %d has no video_format after it.\n", r);
+            return -1;
+        }
+    }
+    if (config->region_count > 1 && config->capture_mode == CAPTURE_DAMAGE) {
+        g_printerr("capture_mode=damage supports one capture source, capturing full frames.\n");
+        config->capture_mode = CAPTURE_FULL;
+    }
+    if (config->region_count > 1 && config->dedupe) {
+        g_printerr("dedupe supports one capture source, disabling it.\n");
+        config->dedupe = 0;
+    }
+    return 0;
+}
+
+// Убирает дисплеи, к которым не удалось подключиться, вместе с их областями и ветками:
+// остальные дисплеи захватываются без них. -1, если не осталось ни одного
+int drop_unavailable_displays(Config *config) {
+    CaptureRegion regions[MAX_CAPTURE_REGIONS];
+    int index[MAX_CAPTURE_REGIONS]; // новый индекс области, -1 = убрана
+    int region_count = 0, format_count = 0;
+
+    if (config->region_count == 0 || config->source_type != SOURCE_XIMAGE) {
+        return 0;
+    }
+    memcpy(regions, config->regions, sizeof(regions));
+    for (int r = 0; r < config->region_count; r++) {
+        int available = -1;
+        // Каждый дисплей проверяется один раз
+        for (int previous = 0; previous < r && available < 0; previous++) {
+            if (regions[previous].display == regions[r].display) {
+                available = index[previous] >= 0;
+            }
+        }
+        if (available < 0) {
+            char *display_name = concat_string_and_number(":", regions[r].display);
+            Display *display = open_own_display(display_name);
+            available = display != NULL;
+            if (display != NULL) {
+                close_own_display(display);
+            } else {
+                g_printerr("Display %s is not available, capturing the other displays without it.\n", display_name);
+            }
+            free(display_name);
+        }
+        index[r] = available ? region_count++ : -1;
+        if (available) {
+            config->regions[index[r]] = regions[r];
+        }
+    }
+    if (region_count == 0) {
+        g_printerr("None of the configured displays is available.\n");
+        return -1;
+    }
+    memset(&config->regions[region_count], 0, (size_t)(config->region_count - region_count) * sizeof(CaptureRegion));
+    config->region_count = region_count;
+    for (guint i = 0; i < config->video_formats->len; i++) {
+        VideoFormat *format = &g_array_index(config->video_formats, VideoFormat, i);
+        if (index[format->region] >= 0) {
+            format->region = index[format->region];
+            g_array_index(config->video_formats, VideoFormat, format_count++) = *format;
+        }
+    }
+    g_array_set_size(config->video_formats, format_count);
+    return 0;
+}
+
+// Создаёт и связывает источник области r: bin(source [-> preconvert -> caps] [-> dedupe]) -> tee.
+// Дедупликация бывает только у единственной области
+int create_capture(Ladder *ladder, Config *config, int r) {
+    Capture *capture = &ladder->captures[r];
+    GstElement *upstream;
+    GstPad *upstream_pad;
+    gboolean linked = TRUE;
+    char *name;
+
+    name = concat_string_and_number(":", capture->display);
+    capture->source = create_source(config, ladder, name, capture->has_region ? &capture->region : NULL, r);
+    free(name);
+    name = capture_element_name(ladder, "capture", r);
+    capture->bin = gst_bin_new(name);
+    free(name);
+    name = capture_element_name(ladder, "tee", r);
+    capture->tee = startup_make_element("tee", name);
+    free(name);
+    if (ladder->working_format[0] != '\0') {
+        name = capture_element_name(ladder, "preconvert", r);
+        capture->preconvert = startup_make_element("videoconvert", name);
+        free(name);
+        name = capture_element_name(ladder, "preconvert_caps", r);
+        capture->preconvert_caps = startup_make_element("capsfilter", name);
+        free(name);
+    }
+    if (!capture->source || !capture->tee ||
+        (ladder->working_format[0] != '\0' && (!capture->preconvert || !capture->preconvert_caps))) {
+        g_printerr("Failed to create one of the elements.\n");
+        return -1;
+    }
+    gst_bin_add(GST_BIN(capture->bin), capture->source);
+    upstream = capture->source;
+    if (capture->preconvert) {
+        GstCaps *caps = gst_caps_new_simple("video/x-raw", "format", G_TYPE_STRING, ladder->working_format, NULL);
+        g_object_set(capture->preconvert_caps, "caps", caps, NULL);
+        gst_caps_unref(caps);
+        gst_bin_add_many(GST_BIN(capture->bin), capture->preconvert, capture->preconvert_caps, NULL);
+        linked = gst_element_link_many(upstream, capture->preconvert, capture->preconvert_caps, NULL);
+        upstream = capture->preconvert_caps;
+    }
+    if (linked && r == 0 && ladder->dedupe_element) {
+        gst_bin_add(GST_BIN(capture->bin), ladder->dedupe_element);
+        linked = gst_element_link(upstream, ladder->dedupe_element);
+        upstream = ladder->dedupe_element;
+    }
+    // Наружу bin выходит одним падом, за ним tee в общем конвейере
+    upstream_pad = gst_element_get_static_pad(upstream, "src");
+    gst_element_add_pad(capture->bin, gst_ghost_pad_new("src", upstream_pad));
+    gst_object_unref(upstream_pad);
+    gst_bin_add_many(GST_BIN(pipeline), capture->bin, capture->tee, NULL);
+    if (!linked || !gst_element_link(capture->bin, capture->tee)) {
+        g_printerr("Failed to link source to tee.\n");
+        return -1;
+    }
+
+    add_counter_probe(capture->source, "src", &capture->source_stats);
+    add_counter_probe(capture->tee, "sink", &capture->tee_stats);
+    return 0;
+}
+
+// Подпись источника r для отчётов: номер, дисплей и что с него захватывается
+void capture_label(Ladder *ladder, int r, char *label, size_t size) {
+    const Capture *capture = &ladder->captures[r];
+
+    if (ladder->capture_count == 1 && !capture->has_region) {
+        snprintf(label, size, "source");
+    } else if (!capture->has_region) {
+        snprintf(label, size, "source %d (:%d)", r, capture->display);
+    } else if (capture->region.window != 0) {
+        snprintf(label, size, "source %d (:%d window 0x%lx)", r, capture->display, capture->region.window);
+    } else {
+        snprintf(label, size, "source %d (:%d %dx%d+%d+%d)", r, capture->display, capture->region.width,
+                 capture->region.height, capture->region.x, capture->region.y);
+    }
+}
+
+// Источник, которому принадлежит элемент, или -1
+int find_capture(Ladder *ladder, GstObject *object) {
+    for (int r = 0; r < ladder->capture_count; r++) {
+        Capture *capture = &ladder->captures[r];
+        if (object == GST_OBJECT(capture->bin) || gst_object_has_as_ancestor(object, GST_OBJECT(capture->bin)) ||
+            object == GST_OBJECT(capture->tee)) {
+            return r;
+        }
+    }
+    return -1;
+}
+
+// Останавливает источник после ошибки и закрывает его ветки через EOS: их записи
+// дописываются, компоновщик продолжает без них, остальные источники работают дальше.
+// abandon - поток источника застрял в Xlib навсегда (см. x_io_error): bin в NULL не дождался
+// бы его, поэтому bin только отцепляется от конвейера и остаётся как есть
+void stop_failed_capture(Ladder *ladder, int r, gboolean abandon) {
+    Capture *capture = &ladder->captures[r];
+    GstPad *tee_pad;
+
+    if (capture->failed) {
+        return;
+    }
+    capture->failed = TRUE;
+    gst_element_set_locked_state(capture->bin, TRUE);
+    if (abandon) {
+        gst_object_ref(capture->bin);
+        gst_bin_remove(GST_BIN(pipeline), capture->bin);
+    } else {
+        // В NULL поток источника останавливается, после этого EOS в tee никто не обгонит
+        gst_element_set_state(capture->bin, GST_STATE_NULL);
+    }
+    tee_pad = gst_element_get_static_pad(capture->tee, "sink");
+    gst_pad_send_event(tee_pad, gst_event_new_eos());
+    gst_object_unref(tee_pad);
+}
+
+// Сколько потоков отдать масштабированию и конвертации ветки: при scaler_threads=auto
+// ветка со своими ядрами получает их все, остальные делят ядра поровну; 0 - не менять
+int branch_scaler_threads(Ladder *ladder, Branch *branch) {
+    if (ladder->scaler_threads >= 0) {
+        return ladder->scaler_threads;
+    }
+    if (branch->placement.has_cpus) {
+        return thread_placement_cpu_count(&branch->placement);
+    }
+    return MAX(1, (int)g_get_num_processors() / MAX(1, ladder->branch_count));
+}
+
+const char* encoder_factory_name(EncoderKind encoder) {
+    switch (encoder) {
+        case ENCODER_OPENH264:
+            return "openh264enc";
+        case ENCODER_VP8:
+            return "vp8enc";
+        default:
+            return "x264enc";
+    }
+}
+
+// Возвращает запрошенный кодировщик, если он установлен, иначе первый доступный
+// в порядке x264, openh264, vp8; ENCODER_AUTO - ни одного нет
+EncoderKind resolve_encoder(EncoderKind requested) {
+    static const EncoderKind fallbacks[] = {ENCODER_X264, ENCODER_OPENH264, ENCODER_VP8};
+
+    if (requested != ENCODER_AUTO) {
+        GstElementFactory *factory = gst_element_factory_find(encoder_factory_name(requested));
+        if (factory != NULL) {
+            gst_object_unref(factory);
+            return requested;
+        }
+        g_printerr("%s is not available, looking for another encoder.\n", encoder_factory_name(requested));
+    }
+    for (size_t i = 0; i < sizeof(fallbacks) / sizeof(fallbacks[0]); i++) {
+        GstElementFactory *factory = gst_element_factory_find(encoder_factory_name(fallbacks[i]));
+        if (factory != NULL) {
+            gst_object_unref(factory);
+            return fallbacks[i];
+        }
+    }
+    return ENCODER_AUTO;
+}
+
+// Битрейт по умолчанию: 0.1 бита на пиксель
+int default_bitrate(const VideoFormat *format) {
+    return MAX(100, (int)((gint64)format->width * format->height * format->framerate / 10000));
+}
+
+// Делит потоки кодирования между ветками пропорционально числу пикселей в секунду,
+// но не меньше одного на ветку, чтобы верхняя ветка не забирала всё. Сверх одного потока
+// остаток делится по наибольшим остаткам, так что в сумме ровно total
+void divide_encoder_threads(Ladder *ladder, int total) {
+    double weight_sum = 0.0, *remainders;
+    int spare, left;
+
+    if (ladder->branch_count == 0) {
+        return;
+    }
+    if (total <= 0) {
+        total = (int)g_get_num_processors();
+    }
+    if (ladder->branch_count > total) {
+        g_printerr("%d encoding branches share %d encoder threads: %d threads started, %d over the budget.\n",
+                   ladder->branch_count, total, ladder->branch_count, ladder->branch_count - total);
+    }
+    spare = left = MAX(0, total - ladder->branch_count);
+    remainders = g_new(double, ladder->branch_count);
+    for (int i = 0; i < ladder->branch_count; i++) {
+        const VideoFormat *format = &ladder_branch(ladder, i)->format;
+        weight_sum += (double)format->width * format->height * format->framerate;
+    }
+    for (int i = 0; i < ladder->branch_count; i++) {
+        const VideoFormat *format = &ladder_branch(ladder, i)->format;
+        double weight = (double)format->width * format->height * format->framerate;
+        double share = weight_sum > 0.0 ? spare * weight / weight_sum : (double)spare / ladder->branch_count;
+        ladder_branch(ladder, i)->encoder_threads = 1 + (int)share;
+        remainders[i] = share - (int)share;
+        left -= (int)share;
+    }
+    while (left > 0) {
+        int largest = 0;
+        for (int i = 1; i < ladder->branch_count; i++) {
+            if (remainders[i] > remainders[largest]) {
+                largest = i;
+            }
+        }
+        ladder_branch(ladder, largest)->encoder_threads++;
+        remainders[largest] = -1.0;
+        left--;
+    }
+    g_free(remainders);
+}
+
+// Сколько кадров очереди нужно, чтобы удержать queue_latency_ms при данной частоте
+guint latency_buffers(Ladder *ladder, int framerate) {
+    guint buffers = (guint)(((gint64)framerate * ladder->queue_latency_ms + 999) / 1000);
+    return buffers > 0 ? buffers : 1;
+}
+
+// Закодированные кадры из appsink ветки уходят в её кольцо повтора
+static GstFlowReturn replay_new_sample(GstAppSink *appsink, gpointer user_data) {
+    ReplayRing *ring = user_data;
+    GstSample *sample = gst_app_sink_pull_sample(appsink);
+
+    if (sample == NULL) {
+        return GST_FLOW_EOS;
+    }
+    replay_ring_push(ring, gst_sample_get_caps(sample), gst_sample_get_buffer(sample));
+    gst_sample_unref(sample);
+    return GST_FLOW_OK;
+}
+
+// Функция для создания кодировщика ветки и его выходов: сегментирующего
+// мультиплексора (record), кольца повтора в памяти (replay) и потока в сеть (stream=)
+int create_recorder(Ladder *ladder, int i) {
+    Branch *branch = ladder_branch(ladder, i);
+    gboolean streamed = branch->format.stream_port > 0;
+    // Ключевой кадр не реже одного на сегмент: границы сегментов совпадают во всех ветках,
+    // потому что splitmuxsink режет по одному и тому же времени и сам запрашивает ключевые кадры.
+    // Буфер повтора обрезается по тем же GOP. Зрителю потока ждать сегмент слишком долго
+    int keyframe_seconds = streamed ? MIN(ladder->segment_seconds, ladder->stream_keyframe_seconds) : ladder->segment_seconds;
+    guint keyframe_interval = (guint)MAX(1, keyframe_seconds * branch->format.framerate);
+    int consumers = (ladder->record ? 1 : 0) + (ladder->replay ? 1 : 0) + (streamed ? 1 : 0);
+    gboolean mkv = strcmp(ladder->record_muxer, "mkv") == 0 || ladder->encoder == ENCODER_VP8;
+    GstElement *muxer = NULL;
+    char *name;
+
+    name = concat_string_and_number("record_queue", i);
+    branch->record_queue = startup_make_element("queue", name);
+    free(name);
+    name = concat_string_and_number("encconvert", i);
+    branch->encconvert = startup_make_element("videoconvert", name);
+    free(name);
+    name = concat_string_and_number("encoder", i);
+    branch->encoder = startup_make_element(encoder_factory_name(ladder->encoder), name);
+    free(name);
+    if (ladder->encoder != ENCODER_VP8) {
+        name = concat_string_and_number("parser", i);
+        branch->parser = startup_make_element("h264parse", name);
+        free(name);
+    }
+    if (ladder->record) {
+        name = concat_string_and_number("splitmux", i);
+        branch->splitmux = startup_make_element("splitmuxsink", name);
+        free(name);
+        muxer = startup_make_element(mkv ? "matroskamux" : "mp4mux", NULL);
+    }
+    if (ladder->replay) {
+        name = concat_string_and_number("replay_sink", i);
+        branch->replay_sink = startup_make_element("appsink", name);
+        free(name);
+    }
+    if (streamed) {
+        name = concat_string_and_number("stream_queue", i);
+        branch->stream_queue = startup_make_element("queue", name);
+        free(name);
+        name = concat_string_and_number("payloader", i);
+        branch->payloader = stream_payloader_new(ladder->encoder == ENCODER_VP8, ladder->stream_protocol, name);
+        free(name);
+        name = concat_string_and_number("stream_sink", i);
+        branch->stream_sink = stream_sink_new(ladder->stream_protocol, ladder->stream_host, branch->format.stream_port,
+                                              ladder->stream_srt_latency_ms, name);
+        free(name);
+    }
+    if (consumers > 1) {
+        name = concat_string_and_number("encoded_tee", i);
+        branch->encoded_tee = startup_make_element("tee", name);
+        free(name);
+    }
+
+    if (!branch->record_queue || !branch->encconvert || !branch->encoder ||
+        (ladder->encoder != ENCODER_VP8 && !branch->parser) ||
+        (ladder->record && (!branch->splitmux || !muxer)) || (ladder->replay && !branch->replay_sink) ||
+        (streamed && (!branch->stream_queue || !branch->payloader || !branch->stream_sink)) ||
+        (consumers > 1 && !branch->encoded_tee)) {
+        if (muxer) {
+            gst_object_unref(muxer);
+        }
+        return -1;
+    }
+
+    branch->bitrate = branch->format.bitrate > 0 ? branch->format.bitrate : default_bitrate(&branch->format);
+    switch (ladder->encoder) {
+        case ENCODER_OPENH264:
+            g_object_set(branch->encoder, "bitrate", (guint)branch->bitrate * 1000, "gop-size", keyframe_interval,
+                         "multi-thread", (guint)branch->encoder_threads, NULL);
+            break;
+        case ENCODER_VP8:
+            g_object_set(branch->encoder, "target-bitrate", branch->bitrate * 1000, "keyframe-max-dist", (int)keyframe_interval,
+                         "threads", branch->encoder_threads, "deadline", (gint64)1, NULL);
+            // По умолчанию libvpx копит кадры для двухпроходного анализа, зритель видел бы их с опозданием
+            if (streamed) {
+                g_object_set(branch->encoder, "lag-in-frames", 0, NULL);
+            }
+            break;
+        default:
+            g_object_set(branch->encoder, "bitrate", (guint)branch->bitrate, "key-int-max", keyframe_interval,
+                         "threads", (guint)branch->encoder_threads, NULL);
+            gst_util_set_object_arg(G_OBJECT(branch->encoder), "speed-preset", ladder->x264_preset);
+            // Поток требует zerolatency: без него x264 держит кадры в lookahead и B-кадрах
+            if (streamed && strstr(ladder->x264_tune, "zerolatency") == NULL) {
+                gchar *tune = strcmp(ladder->x264_tune, "none") != 0 ? g_strdup_printf("%s+zerolatency", ladder->x264_tune) :
+                                                                         g_strdup("zerolatency");
+                gst_util_set_object_arg(G_OBJECT(branch->encoder), "tune", tune);
+                g_free(tune);
+            } else if (strcmp(ladder->x264_tune, "none") != 0) {
+                gst_util_set_object_arg(G_OBJECT(branch->encoder), "tune", ladder->x264_tune);
+            }
+            break;
+    }
+
+    if (branch->splitmux) {
+        gchar *location = g_strdup_printf("%s_%dx%d_%%05d.%s", ladder->record_location,
+                                          branch->format.width, branch->format.height, mkv ? "mkv" : "mp4");
+        g_object_set(branch->splitmux, "location", location, "muxer", muxer,
+                     "max-size-time", (guint64)ladder->segment_seconds * GST_SECOND,
+                     "send-keyframe-requests", TRUE, NULL);
+        g_free(location);
+        gst_bin_add(GST_BIN(pipeline), branch->splitmux);
+    }
+    if (branch->replay_sink) {
+        GstAppSinkCallbacks callbacks = {0};
+        gsize max_bytes = 0;
+        double bitrate_sum = 0.0;
+
+        // Память повтора делится между ветками пропорционально битрейту
+        for (int j = 0; j < ladder->branch_count; j++) {
+            const VideoFormat *format = &ladder_branch(ladder, j)->format;
+            bitrate_sum += format->bitrate > 0 ? format->bitrate : default_bitrate(format);
+        }
+        if (ladder->replay_memory > 0 && bitrate_sum > 0.0) {
+            max_bytes = (gsize)(ladder->replay_memory * (branch->bitrate / bitrate_sum));
+        }
+        replay_ring_init(&branch->replay, ladder->replay_duration, max_bytes);
+        callbacks.new_sample = replay_new_sample;
+        gst_app_sink_set_callbacks(GST_APP_SINK(branch->replay_sink), &callbacks, &branch->replay, NULL);
+        g_object_set(branch->replay_sink, "sync", FALSE, "async", FALSE, NULL);
+        gst_bin_add(GST_BIN(pipeline), branch->replay_sink);
+    }
+    if (branch->stream_queue) {
+        // Закодированный кадр мал, в очереди помещается queue_latency_ms потока
+        g_object_set(branch->stream_queue, "leaky", 2, "max-size-buffers", latency_buffers(ladder, branch->format.framerate),
+                     "max-size-bytes", 0, "max-size-time", (guint64)0, NULL);
+        gst_bin_add_many(GST_BIN(pipeline), branch->stream_queue, branch->payloader, branch->stream_sink, NULL);
+        add_counter_probe(branch->stream_sink, "sink", &branch->streamed);
+        ladder->streaming = TRUE;
+    }
+    if (branch->encoded_tee) {
+        gst_bin_add(GST_BIN(pipeline), branch->encoded_tee);
+    }
+
+    gst_bin_add_many(GST_BIN(pipeline), branch->record_queue, branch->encconvert, branch->encoder, NULL);
+    if (branch->parser) {
+        gst_bin_add(GST_BIN(pipeline), branch->parser);
+    }
+    add_counter_probe(branch->encoder, "src", &branch->encoded);
+    return 0;
+}
+
+// Описание кадров для читателей кольца: caps строкой, формат и раскладка плоскостей
+static void export_set_caps(Branch *branch, GstCaps *caps) {
+    ShmFrameInfo *info = &branch->export_info;
+    GstVideoInfo video_info;
+    gchar *description = gst_caps_to_string(caps);
+
+    gst_caps_replace(&branch->export_caps, caps);
+    memset(info, 0, sizeof(*info));
+    g_strlcpy(info->caps, description, sizeof(info->caps));
+    g_free(description);
+    if (!gst_video_info_from_caps(&video_info, caps)) {
+        return;
+    }
+    info->width = GST_VIDEO_INFO_WIDTH(&video_info);
+    info->height = GST_VIDEO_INFO_HEIGHT(&video_info);
+    info->n_planes = MIN(GST_VIDEO_INFO_N_PLANES(&video_info), SHM_RING_MAX_PLANES);
+    g_strlcpy(info->format, gst_video_format_to_string(GST_VIDEO_INFO_FORMAT(&video_info)), sizeof(info->format));
+    for (guint p = 0; p < info->n_planes; p++) {
+        info->offset[p] = GST_VIDEO_INFO_PLANE_OFFSET(&video_info, p);
+        info->stride[p] = GST_VIDEO_INFO_PLANE_STRIDE(&video_info, p);
+    }
+}
+
+// Кадр ветки из appsink копируется в следующий слот кольца. Писатель не ждёт читателей,
+// а перед appsink стоит протекающая очередь, так что медленное копирование теряет кадры экспорта,
+// но не задерживает ветку
+static GstFlowReturn export_new_sample(GstAppSink *appsink, gpointer user_data) {
+    Branch *branch = user_data;
+    GstSample *sample = gst_app_sink_pull_sample(appsink);
+    GstMapInfo map;
+
+    if (sample == NULL) {
+        return GST_FLOW_EOS;
+    }
+    GstBuffer *buffer = gst_sample_get_buffer(sample);
+    GstCaps *caps = gst_sample_get_caps(sample);
+    if (caps != NULL && caps != branch->export_caps) {
+        export_set_caps(branch, caps);
+    }
+    if (gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+        ShmFrameInfo *info = &branch->export_info;
+        GstVideoMeta *meta = gst_buffer_get_video_meta(buffer);
+
+        // Раскладка из метаданных буфера точнее, чем по caps: у элемента могут быть свои шаги строк
+        if (meta != NULL) {
+            for (guint p = 0; p < MIN(meta->n_planes, SHM_RING_MAX_PLANES); p++) {
+                info->offset[p] = meta->offset[p];
+                info->stride[p] = meta->stride[p];
+            }
+        }
+        info->pts = GST_BUFFER_PTS_IS_VALID(buffer) ? (int64_t)GST_BUFFER_PTS(buffer) : -1;
+        info->duration = GST_BUFFER_DURATION_IS_VALID(buffer) ? (int64_t)GST_BUFFER_DURATION(buffer) : -1;
+        info->size = map.size;
+        // После ошибки создания кольца экспорт ветки выключается, остальное работает дальше
+        if (branch->export_failed == 0 && branch->exporter.header == NULL &&
+            shm_export_open(&branch->exporter, branch->format.export_name, branch->exporter.slot_count, map.size) != 0) {
+            branch->export_failed++;
+        }
+        if (branch->exporter.header != NULL && shm_export_publish(&branch->exporter, info, map.data) != 0) {
+            branch->export_failed++;
+        }
+        gst_buffer_unmap(buffer, &map);
+    }
+    gst_sample_unref(sample);
+    return GST_FLOW_OK;
+}
+
+// Функция для создания выхода ветки в разделяемую память (export=)
+int create_exporter(Ladder *ladder, int i) {
+    Branch *branch = ladder_branch(ladder, i);
+    GstAppSinkCallbacks callbacks = {0};
+    char *name;
+
+    name = concat_string_and_number("export_queue", i);
+    branch->export_queue = startup_make_element("queue", name);
+    free(name);
+    name = concat_string_and_number("export_sink", i);
+    branch->export_sink = startup_make_element("appsink", name);
+    free(name);
+    if (!branch->export_queue || !branch->export_sink) {
+        return -1;
+    }
+    g_object_set(branch->export_queue, "leaky", 2, "max-size-buffers", EXPORT_QUEUE_BUFFERS,
+                 "max-size-bytes", 0, "max-size-time", (guint64)0, NULL);
+    // Кадр держит только кольцо: appsink не хранит последний образец
+    g_object_set(branch->export_sink, "sync", FALSE, "async", FALSE, "enable-last-sample", FALSE, NULL);
+    memset(&branch->exporter, 0, sizeof(branch->exporter));
+    branch->exporter.slot_count = (guint32)ladder->export_slots;
+    ladder->exporting = TRUE;
+    callbacks.new_sample = export_new_sample;
+    gst_app_sink_set_callbacks(GST_APP_SINK(branch->export_sink), &callbacks, branch, NULL);
+    gst_bin_add_many(GST_BIN(pipeline), branch->export_queue, branch->export_sink, NULL);
+    add_counter_probe(branch->export_queue, "sink", &branch->export_in);
+    return 0;
+}
+
+// Закрывает кольцо ветки: читатели дочитают последние кадры и увидят, что кольцо закрыто
+void close_exporter(Branch *branch) {
+    shm_export_close(&branch->exporter);
+    gst_caps_replace(&branch->export_caps, NULL);
+}
+
+// Функция для создания элементов ветки
+// Заполняет параметры ветки из её video_format и общих настроек веток
+void setup_branch(Branch *branch, const Config *config, const VideoFormat *format, int parent) {
+    branch->format = *format;
+    branch->configured = *format;
+    branch->parent = parent;
+    branch->scales = TRUE;
+    branch->isolation = format->isolation != ISOLATION_DEFAULT ? format->isolation : config->branch_isolation;
+    branch->placement = config->branch_placement;
+    branch->qos_priority = format->qos_priority;
+    branch->active = TRUE;
+    if (format->placement.has_cpus) {
+        branch->placement.has_cpus = 1;
+        branch->placement.cpus = format->placement.cpus;
+    }
+    if (format->placement.priority_kind != THREAD_PRIORITY_NONE) {
+        branch->placement.priority_kind = format->placement.priority_kind;
+        branch->placement.priority = format->placement.priority;
+    }
+}
+
+// fastscaleconvert читает только BGRx источника, поэтому берём его для веток,
+// которые масштабируют исходный кадр без предварительной конвертации
+gboolean branch_fuses(Ladder *ladder, Branch *branch) {
+    return ladder->fused_available && branch->scales && branch->parent < 0 && ladder->working_format[0] == '\0' &&
+           (branch->format.format[0] == '\0' || strcmp(branch->format.format, "I420") == 0 ||
+            strcmp(branch->format.format, "NV12") == 0);
+}
+
+// Ветка, чей videoscale делает кадры этой ветки: она сама или масштабирующая ветка её узла
+Branch* scaling_branch(Ladder *ladder, Branch *branch) {
+    while (!branch->scales) {
+        branch = ladder_branch(ladder, branch->parent);
+    }
+    return branch;
+}
+
+// Формат кадров на выходе capsfilter ветки
+const char* branch_scaled_format(Ladder *ladder, Branch *branch) {
+    Branch *scaler = scaling_branch(ladder, branch);
+
+    // Масштабирующая ветка узла может быть ещё не создана, поэтому не её fused
+    if (branch_fuses(ladder, scaler)) {
+        return scaler->format.format[0] != '\0' ? scaler->format.format : "I420";
+    }
+    return ladder->working_format;
+}
+
+// Формат кадров на выходе ветки, "" = формат источника
+const char* branch_output_format(Ladder *ladder, Branch *branch) {
+    return branch->format.format[0] != '\0' ? branch->format.format : branch_scaled_format(ladder, branch);
+}
+
+// Caps масштабирования ветки: её размер и частота в рабочем формате лестницы
+GstCaps* branch_scale_caps(Ladder *ladder, Branch *branch) {
+    const char *format = branch_scaled_format(ladder, branch);
+    GstCaps *caps = gst_caps_new_simple("video/x-raw",
+                                        "framerate", GST_TYPE_FRACTION, branch->format.framerate, 1,
+                                        "width", G_TYPE_INT, branch->format.width,
+                                        "height", G_TYPE_INT, branch->format.height,
+                                        NULL);
+    if (format[0] != '\0') {
+        gst_caps_set_simple(caps, "format", G_TYPE_STRING, format, NULL);
+    }
+    // С квадратными пикселями videoscale вписывает кадр другой формы с полями (add-borders),
+    // а не растягивает его. fastscaleconvert делает то же со своим add-borders
+    if (ladder->resize_policy == RESIZE_KEEP) {
+        gst_caps_set_simple(caps, "pixel-aspect-ratio", GST_TYPE_FRACTION, 1, 1, NULL);
+    }
+    return caps;
+}
+
+// Caps кадров, которые intervideosrc отвязанной ветки отдаёт компоновщику
+GstCaps* branch_inter_caps(Branch *branch) {
+    GstCaps *caps = gst_caps_new_simple("video/x-raw",
+                                        "framerate", GST_TYPE_FRACTION, branch->format.framerate, 1,
+                                        "width", G_TYPE_INT, branch->format.width,
+                                        "height", G_TYPE_INT, branch->format.height,
+                                        NULL);
+    if (branch->format.format[0] != '\0') {
+        gst_caps_set_simple(caps, "format", G_TYPE_STRING, branch->format.format, NULL);
+    }
+    return caps;
+}
+
+// Первый кадр ветки после перестройки: пауза от смены размера на входе tee до него
+static GstPadProbeReturn resize_stall_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    Branch *branch = user_data;
+
+    if (g_atomic_int_compare_and_exchange(&branch->resize_caps_seen, 1, 0)) {
+        branch->stall_last_ms = (g_get_monotonic_time() - branch->resize_from_us) / 1000.0;
+        branch->stall_max_ms = MAX(branch->stall_max_ms, branch->stall_last_ms);
+        branch->resize_from_us = 0;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+int create_branch(Ladder *ladder, int i) {
+    Branch *branch = ladder_branch(ladder, i);
+    char *name;
+
+    name = concat_string_and_number("queue", i);
+    branch->queue = startup_make_element("queue", name);
+    free(name);
+    name = concat_string_and_number("videorate", i);
+    branch->videorate = startup_make_element("videorate", name);
+    free(name);
+    branch->fused = branch_fuses(ladder, branch);
+    if (!branch->scales) {
+        // Кадры узла уже нужного размера, capsfilter задаёт только частоту для videorate
+    } else if (branch->fused) {
+        name = concat_string_and_number("fastscale", i);
+        branch->videoscale = startup_make_element("fastscaleconvert", name);
+        free(name);
+        if (branch->videoscale) {
+            int threads = branch_scaler_threads(ladder, branch);
+            g_object_set(branch->videoscale, "method", ladder->fused_method,
+                         "n-threads", threads > 0 ? threads : ladder->fused_threads,
+                         "add-borders", ladder->resize_policy == RESIZE_KEEP, NULL);
+        }
+    } else {
+        name = concat_string_and_number("videoscale", i);
+        branch->videoscale = startup_make_element("videoscale", name);
+        free(name);
+    }
+    name = concat_string_and_number("caps", i);
+    branch->capsfilter = startup_make_element("capsfilter", name);
+    free(name);
+
+    if (!branch->queue || !branch->videorate || (branch->scales && !branch->videoscale) || !branch->capsfilter) {
+        return -1;
+    }
+    if (branch->scales && !branch->fused && branch_scaler_threads(ladder, branch) > 0) {
+        g_object_set(branch->videoscale, "n-threads", branch_scaler_threads(ladder, branch), NULL);
+    }
+
+    // Переполненная очередь не должна блокировать tee: leaky=upstream отбрасывает новые кадры,
+    // leaky=downstream - самые старые. Отвязанная ветка тоже отбрасывает старые
+    if (branch->isolation == ISOLATION_LEAKY) {
+        g_object_set(branch->queue, "leaky", 1, NULL);
+    } else if (branch->isolation == ISOLATION_DROP_OLDEST || branch->isolation == ISOLATION_DECOUPLED) {
+        g_object_set(branch->queue, "leaky", 2, NULL);
+    }
+
+    GstCaps *caps = branch_scale_caps(ladder, branch);
+    g_object_set(branch->capsfilter, "caps", caps, NULL);
+    gst_caps_unref(caps);
+
+    gst_bin_add_many(GST_BIN(pipeline), branch->queue, branch->videorate, branch->capsfilter, NULL);
+    if (branch->videoscale) {
+        gst_bin_add(GST_BIN(pipeline), branch->videoscale);
+    }
+
+    // В режимах damage и dedupe кадры приходят только при изменениях: videorate не должен
+    // заполнять паузы дубликатами, иначе их всё равно придётся масштабировать
+    if (ladder->damage.display != NULL || ladder->dedupe_element != NULL) {
+        g_object_set(branch->videorate, "drop-only", TRUE, NULL);
+    }
+
+    // Без предварительной конвертации каждая ветка конвертирует сама, как раньше;
+    // с ней - только если формат ветки действительно отличается.
+    // fastscaleconvert уже выдаёт нужный формат, в том числе веткам своего узла
+    const char *scaled_format = branch_scaled_format(ladder, branch);
+    if (!branch->fused && (scaled_format[0] == '\0' ||
+        (branch->format.format[0] != '\0' && strcmp(branch->format.format, scaled_format) != 0))) {
+        name = concat_string_and_number("convert", i);
+        branch->convert = startup_make_element("videoconvert", name);
+        free(name);
+        if (!branch->convert) {
+            return -1;
+        }
+        if (branch_scaler_threads(ladder, branch) > 0) {
+            g_object_set(branch->convert, "n-threads", branch_scaler_threads(ladder, branch), NULL);
+        }
+        gst_bin_add(GST_BIN(pipeline), branch->convert);
+
+        if (branch->format.format[0] != '\0') {
+            name = concat_string_and_number("outcaps", i);
+            branch->outcaps = startup_make_element("capsfilter", name);
+            free(name);
+            if (!branch->outcaps) {
+                return -1;
+            }
+            caps = gst_caps_new_simple("video/x-raw", "format", G_TYPE_STRING, branch->format.format, NULL);
+            g_object_set(branch->outcaps, "caps", caps, NULL);
+            gst_caps_unref(caps);
+            gst_bin_add(GST_BIN(pipeline), branch->outcaps);
+        }
+    }
+
+    // Выход ветки нужен другим веткам её узла или меньшим узлам каскада: ставим после capsfilter свой tee
+    for (int j = 0; j < ladder->branch_count; j++) {
+        if (ladder_branch(ladder, j)->parent == i) {
+            name = concat_string_and_number("branch_tee", i);
+            branch->tee = startup_make_element("tee", name);
+            free(name);
+            if (!branch->tee) {
+                return -1;
+            }
+            gst_bin_add(GST_BIN(pipeline), branch->tee);
+            break;
+        }
+    }
+
+    // Компоновщик получает кадры отвязанной ветки от intervideosrc, который выдаёт их
+    // по своим часам и повторяет последний, если ветка не успела: ожидание на этой
+    // ветке не задерживает остальные
+    if (branch->isolation == ISOLATION_DECOUPLED && ladder->preview) {
+        name = concat_string_and_number("intersink", i);
+        branch->inter_sink = startup_make_element("intervideosink", name);
+        free(name);
+        name = concat_string_and_number("intersrc", i);
+        branch->inter_src = startup_make_element("intervideosrc", name);
+        free(name);
+        name = concat_string_and_number("intercaps", i);
+        branch->inter_caps = startup_make_element("capsfilter", name);
+        free(name);
+        if (!branch->inter_sink || !branch->inter_src || !branch->inter_caps) {
+            return -1;
+        }
+        // Имя канала включает pipeline, чтобы несколько лестниц в процессе не смешивались
+        name = g_strdup_printf("%s-branch%d", GST_OBJECT_NAME(pipeline), i);
+        g_object_set(branch->inter_sink, "channel", name, "sync", FALSE, NULL);
+        g_object_set(branch->inter_src, "channel", name, NULL);
+        g_free(name);
+        caps = branch_inter_caps(branch);
+        g_object_set(branch->inter_caps, "caps", caps, NULL);
+        gst_caps_unref(caps);
+        gst_bin_add_many(GST_BIN(pipeline), branch->inter_sink, branch->inter_src, branch->inter_caps, NULL);
+        add_counter_probe(branch->inter_src, "src", &branch->inter_out);
+    }
+
+    // Выход ветки делится между предпросмотром, кодировщиком и экспортом
+    gboolean encoded = ladder->record || ladder->replay || branch->format.stream_port > 0;
+    int consumers = (ladder->preview ? 1 : 0) + (encoded ? 1 : 0) + (branch->format.export_name[0] != '\0' ? 1 : 0);
+    if (consumers > 1) {
+        name = concat_string_and_number("result_tee", i);
+        branch->result_tee = startup_make_element("tee", name);
+        free(name);
+        if (!branch->result_tee) {
+            return -1;
+        }
+        gst_bin_add(GST_BIN(pipeline), branch->result_tee);
+    }
+    if (encoded && create_recorder(ladder, i) != 0) {
+        return -1;
+    }
+    if (branch->format.export_name[0] != '\0' && create_exporter(ladder, i) != 0) {
+        return -1;
+    }
+
+    add_counter_probe(branch->queue, "sink", &branch->queue_in);
+    add_counter_probe(branch->queue, "src", &branch->queue_out);
+    GstPad *queue_pad = gst_element_get_static_pad(branch->queue, "sink");
+    gst_pad_add_probe(queue_pad, GST_PAD_PROBE_TYPE_BUFFER, queue_peak_probe, branch, NULL);
+    gst_object_unref(queue_pad);
+    // У ветки без videoscale те же пробы стоят на capsfilter сразу после videorate
+    GstElement *scaler = branch->videoscale ? branch->videoscale : branch->capsfilter;
+    if (ladder->adaptive.enabled) {
+        // Ворота стоят перед счётчиком, чтобы вход масштабирования считал только пропущенные кадры
+        if (branch->videoscale) {
+            g_object_get(branch->videoscale, "method", &branch->scale_method, NULL);
+        }
+        g_atomic_int_set(&branch->rate_divisor, 1);
+        GstPad *gate_pad = gst_element_get_static_pad(scaler, "sink");
+        gst_pad_add_probe(gate_pad, GST_PAD_PROBE_TYPE_BUFFER, degrade_gate_probe, branch, NULL);
+        gst_object_unref(gate_pad);
+    }
+    add_counter_probe(scaler, "sink", &branch->stats.in);
+    add_counter_probe(scaler, "src", &branch->stats.out);
+    GstPad *scale_pad = gst_element_get_static_pad(scaler, "src");
+    gst_pad_add_probe(scale_pad, GST_PAD_PROBE_TYPE_BUFFER, output_jitter_probe, branch, NULL);
+    gst_pad_add_probe(scale_pad, GST_PAD_PROBE_TYPE_EVENT_UPSTREAM, qos_event_probe, branch, NULL);
+    gst_pad_add_probe(scale_pad, GST_PAD_PROBE_TYPE_BUFFER, resize_stall_probe, branch, NULL);
+    gst_object_unref(scale_pad);
+    return 0;
+}
+
+// Потоки конвейера сообщают о себе STREAM_STATUS ENTER из самого потока: здесь их
+// можно закрепить за ядрами и задать приоритет до того, как пойдут кадры
+static GstBusSyncReply stream_status_handler(GstBus *bus, GstMessage *msg, gpointer user_data) {
+    Ladder *ladder = user_data;
+    GstStreamStatusType type;
+    GstElement *owner;
+    const ThreadPlacement *placement = NULL;
+    char role[THREAD_NAME_LENGTH];
+
+    // QoS от элементов ветки считаем здесь, в основной цикл они не нужны
+    if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_QOS) {
+        g_mutex_lock(&ladder->table_lock);
+        for (int i = 0; i < ladder->branch_count; i++) {
+            Branch *branch = ladder_branch(ladder, i);
+            GstObject *src = GST_MESSAGE_SRC(msg);
+            if (src == GST_OBJECT(branch->videorate) ||
+                (branch->videoscale != NULL && src == GST_OBJECT(branch->videoscale)) ||
+                (branch->convert != NULL && src == GST_OBJECT(branch->convert))) {
+                branch->qos_messages++;
+                break;
+            }
+        }
+        g_mutex_unlock(&ladder->table_lock);
+        return GST_BUS_DROP;
+    }
+    if (GST_MESSAGE_TYPE(msg) != GST_MESSAGE_STREAM_STATUS) {
+        return GST_BUS_PASS;
+    }
+    gst_message_parse_stream_status(msg, &type, &owner);
+    if (type != GST_STREAM_STATUS_TYPE_ENTER) {
+        return GST_BUS_DROP;
+    }
+
+    g_strlcpy(role, "other", sizeof(role));
+    // Ветки выделены отдельно, поэтому placement остаётся верным и после разблокировки
+    g_mutex_lock(&ladder->table_lock);
+    for (int i = 0; i < ladder->branch_count && placement == NULL; i++) {
+        Branch *branch = ladder_branch(ladder, i);
+        if (owner == branch->queue || (branch->inter_src != NULL && owner == branch->inter_src) ||
+            (branch->record_queue != NULL && owner == branch->record_queue) ||
+            (branch->export_queue != NULL && owner == branch->export_queue) ||
+            (branch->stream_queue != NULL && owner == branch->stream_queue)) {
+            placement = &branch->placement;
+            snprintf(role, sizeof(role), "branch %d", i);
+        }
+    }
+    g_mutex_unlock(&ladder->table_lock);
+    for (int r = 0; r < ladder->capture_count && placement == NULL; r++) {
+        GstElement *source = ladder->captures[r].source;
+        if (owner == source || gst_object_has_as_ancestor(GST_OBJECT(owner), GST_OBJECT(source))) {
+            placement = &ladder->capture_placement;
+            if (ladder->capture_count > 1) {
+                snprintf(role, sizeof(role), "capture %d", r);
+            } else {
+                g_strlcpy(role, "capture", sizeof(role));
+            }
+        }
+    }
+    if (placement == NULL) {
+        if (owner == ladder->compositor || owner == ladder->sink) {
+            placement = &ladder->output_placement;
+            g_strlcpy(role, "output", sizeof(role));
+        }
+    }
+
+    int failed = placement != NULL && thread_placement_apply(placement) != 0;
+    if (failed) {
+        g_printerr("Failed to apply CPU placement for %s thread of %s.\n", role, GST_OBJECT_NAME(owner));
+    }
+    if (ladder->threads.sampler != NULL) {
+        thread_monitor_register(&ladder->threads, role, GST_OBJECT_NAME(owner), failed);
+    }
+    return GST_BUS_DROP;
+}
+
+// Последний элемент обработки ветки
+GstElement* branch_output(Branch *branch) {
+    if (branch->outcaps) {
+        return branch->outcaps;
+    }
+    if (branch->convert) {
+        return branch->convert;
+    }
+    return branch->tee ? branch->tee : branch->capsfilter;
+}
+
+// Выход ветки после разделения на предпросмотр, запись и экспорт
+GstElement* branch_result(Branch *branch) {
+    return branch->result_tee ? branch->result_tee : branch_output(branch);
+}
+
+// Пад, на котором кадр ветки уже полностью обработан. У tee выходы запрашиваемые,
+// а сам tee кадр не меняет, поэтому берём его вход
+const char* branch_output_pad(Branch *branch) {
+    return branch_output(branch) == branch->tee ? "sink" : "src";
+}
+
+// Элемент ветки, который подключается к компоновщику
+GstElement* branch_tail(Branch *branch) {
+    return branch->inter_caps ? branch->inter_caps : branch_result(branch);
+}
+
+// Связывает элементы ветки между собой, кроме входа очереди
+int link_branch_chain(Ladder *ladder, int i) {
+    Branch *branch = ladder_branch(ladder, i);
+    GstElement *last = branch->capsfilter;
+
+    // Список NULL-терминирован, поэтому ветка узла без videoscale связывается отдельно
+    if (branch->videoscale) {
+        if (!gst_element_link_many(branch->queue, branch->videorate, branch->videoscale, branch->capsfilter, NULL)) {
+            return -1;
+        }
+    } else if (!gst_element_link_many(branch->queue, branch->videorate, branch->capsfilter, NULL)) {
+        return -1;
+    }
+    if (branch->tee) {
+        if (!gst_element_link(last, branch->tee)) {
+            return -1;
+        }
+        last = branch->tee;
+    }
+    if (branch->convert) {
+        if (!gst_element_link(last, branch->convert)) {
+            return -1;
+        }
+        last = branch->convert;
+    }
+    if (branch->outcaps && !gst_element_link(last, branch->outcaps)) {
+        return -1;
+    }
+    if (branch->result_tee && !gst_element_link(branch_output(branch), branch->result_tee)) {
+        return -1;
+    }
+    if (branch->export_queue &&
+        !gst_element_link_many(branch_result(branch), branch->export_queue, branch->export_sink, NULL)) {
+        return -1;
+    }
+    if (branch->inter_sink &&
+        (!gst_element_link(branch_result(branch), branch->inter_sink) ||
+         !gst_element_link(branch->inter_src, branch->inter_caps))) {
+        return -1;
+    }
+    if (branch->record_queue) {
+        GstElement *encoded = branch->parser ? branch->parser : branch->encoder;
+        if (!gst_element_link_many(branch_result(branch), branch->record_queue, branch->encconvert, branch->encoder, NULL) ||
+            (branch->parser && !gst_element_link(branch->encoder, branch->parser))) {
+            return -1;
+        }
+        if (branch->encoded_tee) {
+            if (!gst_element_link(encoded, branch->encoded_tee)) {
+                return -1;
+            }
+            encoded = branch->encoded_tee;
+        }
+        if (branch->replay_sink && !gst_element_link(encoded, branch->replay_sink)) {
+            return -1;
+        }
+        if (branch->stream_queue &&
+            !gst_element_link_many(encoded, branch->stream_queue, branch->payloader, branch->stream_sink, NULL)) {
+            return -1;
+        }
+    }
+    if (branch->splitmux) {
+        GstElement *encoded = branch->encoded_tee ? branch->encoded_tee : branch->parser ? branch->parser : branch->encoder;
+        GstPad *src_pad = branch->encoded_tee ? gst_element_request_pad_simple(encoded, "src_%u") :
+                                                gst_element_get_static_pad(encoded, "src");
+        GstPad *video_pad = gst_element_request_pad_simple(branch->splitmux, "video");
+        GstPadLinkReturn link = video_pad ? gst_pad_link(src_pad, video_pad) : GST_PAD_LINK_REFUSED;
+        gst_object_unref(src_pad);
+        if (video_pad) {
+            gst_object_unref(video_pad);
+        }
+        if (link != GST_PAD_LINK_OK) {
+            return -1;
+        }
+        // Звук закодирован один раз, запись каждой ветки получает его из tee
+        if (ladder->audio.source && audio_branch_link(&ladder->audio, GST_BIN(pipeline), branch->splitmux, i) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// tee, от которого питается ветка: tee её области захвата или родительской ветки
+GstElement* branch_upstream(Ladder *ladder, Branch *branch) {
+    return branch->parent < 0 ? ladder->captures[branch->format.region].tee : ladder_branch(ladder, branch->parent)->tee;
+}
+
+// Подключает очередь ветки к tee источника или родительской ветки. Ветка, добавленная
+// на ходу, подключается последней, когда остальная её часть уже собрана и запущена
+int link_branch_input(Ladder *ladder, int i) {
+    Branch *branch = ladder_branch(ladder, i);
+
+    return gst_element_link(branch_upstream(ladder, branch), branch->queue) ? 0 : -1;
+}
+
+// Функция для связывания ветки с её источником
+int link_branch(Ladder *ladder, int i) {
+    if (link_branch_chain(ladder, i) != 0) {
+        return -1;
+    }
+    return link_branch_input(ladder, i);
+}
+
+// Размер кадра в байтах для формата; "" - формат источника, считаем BGRx
+guint64 frame_bytes(int width, int height, const char *format) {
+    GstVideoInfo info;
+    GstVideoFormat video_format = format[0] != '\0' ? gst_video_format_from_string(format) : GST_VIDEO_FORMAT_BGRx;
+
+    if (video_format == GST_VIDEO_FORMAT_UNKNOWN ||
+        !gst_video_info_set_format(&info, video_format, width, height)) {
+        return (guint64)width * height * 4;
+    }
+    return GST_VIDEO_INFO_SIZE(&info);
+}
+
+// Ошибки X при запросе окна не должны завершать процесс: окно могло уже закрыться
+static int ignore_x_error(Display *display, XErrorEvent *event) {
+    return 0;
+}
+
+// Размер и частота источника области до запуска: для ximagesrc - размер экрана,
+// прямоугольника или окна, для videotestsrc - source_size или размер области, иначе неизвестно.
+// region - элемент config->regions; NULL - весь экран, частота по всем веткам
+int estimate_source_geometry(Config *config, const char *display_name, const CaptureRegion *region, VideoFormat *geometry) {
+    gboolean whole = region == NULL || region_is_display(region);
+
+    memset(geometry, 0, sizeof(*geometry));
+    // Без явной частоты источник подстраивается под ветки, берём самую быструю
+    for (int i = 0; i < (int)config->video_formats->len; i++) {
+        if ((region == NULL || &config->regions[g_array_index(config->video_formats, VideoFormat, i).region] == region) &&
+            g_array_index(config->video_formats, VideoFormat, i).framerate > geometry->framerate) {
+            geometry->framerate = g_array_index(config->video_formats, VideoFormat, i).framerate;
+        }
+    }
+
+    if (config->source_type == SOURCE_XIMAGE) {
+        Display *display = open_own_display(display_name);
+        int known = 1;
+        if (display == NULL) {
+            return 0;
+        }
+        if (region != NULL && region->window != 0) {
+            XWindowAttributes attributes;
+            XErrorHandler previous = XSetErrorHandler(ignore_x_error);
+            known = XGetWindowAttributes(display, region->window, &attributes) != 0;
+            XSync(display, False);
+            XSetErrorHandler(previous);
+            if (known) {
+                geometry->width = attributes.width;
+                geometry->height = attributes.height;
+            }
+        } else if (!whole) {
+            geometry->width = region->width;
+            geometry->height = region->height;
+        } else {
+            geometry->width = DisplayWidth(display, DefaultScreen(display));
+            geometry->height = DisplayHeight(display, DefaultScreen(display));
+        }
+        close_own_display(display);
+        return known;
+    }
+    if (config->source_type == SOURCE_VIDEOTEST && !whole) {
+        geometry->width = region->width;
+        geometry->height = region->height;
+        if (config->source_format.framerate > 0) {
+            geometry->framerate = config->source_format.framerate;
+        }
+        return 1;
+    }
+    if (config->source_type == SOURCE_VIDEOTEST && config->source_format.width > 0) {
+        geometry->width = config->source_format.width;
+        geometry->height = config->source_format.height;
+        geometry->framerate = config->source_format.framerate;
+        return 1;
+    }
+    return 0;
+}
+
+// Выставляет пределы очереди ветки по queue_buffers и размеру кадра
+void apply_queue_limits(Ladder *ladder, Branch *branch) {
+    guint64 bytes = (guint64)branch->queue_buffers * branch->in_frame_bytes;
+
+    g_object_set(branch->queue,
+                 "max-size-buffers", branch->queue_buffers,
+                 "max-size-bytes", (guint)MIN(bytes, G_MAXUINT),
+                 "max-size-time", (guint64)ladder->queue_latency_ms * GST_MSECOND,
+                 NULL);
+    // Очередь перед кодировщиком держит кадры выхода ветки, их размер меняется вместе с веткой
+    if (branch->record_queue) {
+        guint64 record_bytes = (guint64)branch->record_buffers *
+                               frame_bytes(branch->format.width, branch->format.height,
+                                           branch_output_format(ladder, branch));
+        g_object_set(branch->record_queue,
+                     "max-size-buffers", branch->record_buffers,
+                     "max-size-bytes", (guint)MIN(record_bytes, G_MAXUINT),
+                     "max-size-time", (guint64)ladder->queue_latency_ms * GST_MSECOND,
+                     NULL);
+    }
+}
+
+// Порядок веток в предпросмотре: слоты действующих веток по убыванию ширины
+GArray* preview_order(Ladder *ladder) {
+    GArray *order = g_array_new(FALSE, FALSE, sizeof(int));
+
+    for (int i = 0; i < ladder->branch_count; i++) {
+        if (!ladder_branch(ladder, i)->active) {
+            continue;
+        }
+        guint k = order->len;
+        while (k > 0 && ladder_branch(ladder, g_array_index(order, int, k - 1))->format.width <
+                        ladder_branch(ladder, i)->format.width) {
+            k--;
+        }
+        g_array_insert_val(order, k, i);
+    }
+    return order;
+}
+
+// Распределяет бюджет памяти между очередями веток. Кадры в обработке и кадры
+// источника и компоновщика считаются постоянными, очередям достаётся остаток.
+// Возвращает -1, если бюджета не хватает даже на один кадр в каждой очереди
+int plan_queue_sizes(Ladder *ladder) {
+    guint64 queued = 0, minimum = 0;
+    int row_width = 0, row_height = 0;
+    GArray *order = preview_order(ladder);
+    int shown = order->len;
+
+    // Каждый источник держит один кадр, preconvert - ещё один в рабочем формате.
+    // Кольца повтора ограничены своим пределом и тоже входят в бюджет
+    ladder->fixed_bytes = 0;
+    for (int r = 0; r < ladder->capture_count; r++) {
+        const VideoFormat *source = &ladder->captures[r].geometry;
+        ladder->fixed_bytes += frame_bytes(source->width, source->height, "");
+        if (ladder->captures[r].preconvert) {
+            ladder->fixed_bytes += frame_bytes(source->width, source->height, ladder->working_format);
+        }
+    }
+    if (ladder->replay) {
+        ladder->fixed_bytes += ladder->replay_memory;
+    }
+
+    for (int i = 0; i < ladder->branch_count; i++) {
+        Branch *branch = ladder_branch(ladder, i);
+        if (!branch->active) {
+            continue;
+        }
+        guint64 scaled = frame_bytes(branch->format.width, branch->format.height, branch_scaled_format(ladder, branch));
+
+        if (branch->parent < 0) {
+            const VideoFormat *source = &ladder->captures[branch->format.region].geometry;
+            branch->in_frame_bytes = frame_bytes(source->width, source->height, ladder->working_format);
+            branch->in_framerate = source->framerate;
+        } else {
+            Branch *parent = ladder_branch(ladder, branch->parent);
+            branch->in_frame_bytes = frame_bytes(parent->format.width, parent->format.height,
+                                                 branch_scaled_format(ladder, parent));
+            branch->in_framerate = parent->format.framerate;
+        }
+        // Кадр на входе масштабирования, его результат, результат конвертации
+        // и по кадру в intervideosink/intervideosrc
+        branch->inflight_bytes = branch->in_frame_bytes + scaled;
+        if (branch->convert) {
+            branch->inflight_bytes += frame_bytes(branch->format.width, branch->format.height, branch->format.format);
+        }
+        if (branch->inter_sink) {
+            branch->inflight_bytes += 2 * scaled;
+        }
+        // Очередь записи держит выход ветки, encconvert - ещё кадр I420 перед кодировщиком
+        if (branch->record_queue) {
+            const char *output_format = branch_output_format(ladder, branch);
+            branch->record_buffers = latency_buffers(ladder, branch->format.framerate);
+            branch->inflight_bytes += branch->record_buffers * frame_bytes(branch->format.width, branch->format.height, output_format) +
+                                      frame_bytes(branch->format.width, branch->format.height, "I420");
+        }
+        // Очередь экспорта и слоты кольца shm держат кадры выхода ветки
+        if (branch->export_queue) {
+            branch->inflight_bytes += (EXPORT_QUEUE_BUFFERS + ladder->export_slots) *
+                                      frame_bytes(branch->format.width, branch->format.height, branch_output_format(ladder, branch));
+        }
+        branch->queue_buffers = latency_buffers(ladder, branch->in_framerate);
+
+        ladder->fixed_bytes += branch->inflight_bytes;
+        queued += branch->queue_buffers * branch->in_frame_bytes;
+        minimum += branch->in_frame_bytes;
+    }
+    // Раскладка компоновщика: самая широкая ветка сверху, остальные в ряд под ней
+    for (int k = 1; k < shown; k++) {
+        Branch *branch = ladder_branch(ladder, g_array_index(order, int, k));
+        row_width += branch->format.width;
+        row_height = MAX(row_height, branch->format.height);
+    }
+    if (shown > 0 && ladder->compositor) {
+        Branch *top = ladder_branch(ladder, g_array_index(order, int, 0));
+        int width = MAX(top->format.width, row_width);
+        int height = top->format.height + row_height;
+
+        if (ladder->tiles) {
+            // tilecompositor держит свои холсты I420: один собирается, остальные ещё у sink
+            ladder->fixed_bytes += TILE_COMPOSITOR_CANVASES * frame_bytes(width, height, "I420");
+        } else {
+            // Компоновщик выдаёт кадры с альфа-каналом: 4 байта на пиксель
+            ladder->fixed_bytes += frame_bytes(width, height, "AYUV");
+        }
+    }
+    g_array_free(order, TRUE);
+
+    if (ladder->memory_budget == 0) {
+        for (int i = 0; i < ladder->branch_count; i++) {
+            ladder_branch(ladder, i)->queue_budget = ladder_branch(ladder, i)->queue_buffers * ladder_branch(ladder, i)->in_frame_bytes;
+        }
+        return 0;
+    }
+    if (ladder->fixed_bytes + minimum > ladder->memory_budget) {
+        g_printerr("memory_budget_mb=%" G_GUINT64_FORMAT " is too small: frames in flight need %.1f MB "
+                   "and one queued frame per branch another %.1f MB.\n",
+                   ladder->memory_budget / (1024 * 1024), ladder->fixed_bytes / 1048576.0, minimum / 1048576.0);
+        return -1;
+    }
+
+    // Убираем по кадру из самой большой очереди, пока все очереди не поместятся в остаток
+    guint64 available = ladder->memory_budget - ladder->fixed_bytes;
+    while (queued > available) {
+        Branch *largest = NULL;
+        for (int i = 0; i < ladder->branch_count; i++) {
+            Branch *branch = ladder_branch(ladder, i);
+            if (branch->active && branch->queue_buffers > 1 &&
+                (largest == NULL || branch->queue_buffers * branch->in_frame_bytes >
+                                    largest->queue_buffers * largest->in_frame_bytes)) {
+                largest = branch;
+            }
+        }
+        largest->queue_buffers--;
+        queued -= largest->in_frame_bytes;
+    }
+    for (int i = 0; i < ladder->branch_count; i++) {
+        ladder_branch(ladder, i)->queue_budget = ladder_branch(ladder, i)->queue_buffers * ladder_branch(ladder, i)->in_frame_bytes;
+    }
+    return 0;
+}
+
+// Пересчитывает бюджет после того, как ветки появились, исчезли или сменили размер, и выставляет
+// пределы всех очередей. Если бюджета не хватает, очереди держат по кадру до следующей перестройки.
+// Вызывается под topology_lock
+static void replan_queues(Ladder *ladder, const char *reason) {
+    g_mutex_lock(&ladder->budget_lock);
+    if (plan_queue_sizes(ladder) != 0) {
+        g_printerr("%s: queues keep one frame each until the branches change again.\n", reason);
+        for (int i = 0; i < ladder->branch_count; i++) {
+            ladder_branch(ladder, i)->queue_buffers = 1;
+            ladder_branch(ladder, i)->queue_budget = ladder_branch(ladder, i)->in_frame_bytes;
+        }
+    }
+    for (int i = 0; i < ladder->branch_count; i++) {
+        if (ladder_branch(ladder, i)->active) {
+            apply_queue_limits(ladder, ladder_branch(ladder, i));
+        }
+    }
+    g_mutex_unlock(&ladder->budget_lock);
+}
+
+// Очередь всегда пропускает хотя бы один буфер, поэтому кадр, не помещающийся в бюджет очереди,
+// оплачивается кадрами самых больших других очередей. FALSE - забрать больше не у кого
+static gboolean charge_queue_budget(Ladder *ladder, Branch *branch) {
+    while (branch->queue_budget < branch->in_frame_bytes) {
+        Branch *largest = NULL;
+        // budget_lock уже взят, table_lock берётся после него
+        g_mutex_lock(&ladder->table_lock);
+        for (int i = 0; i < ladder->branch_count; i++) {
+            Branch *other = ladder_branch(ladder, i);
+            if (other != branch && other->active && other->queue_buffers > 1 &&
+                (largest == NULL || other->queue_buffers * other->in_frame_bytes >
+                                    largest->queue_buffers * largest->in_frame_bytes)) {
+                largest = other;
+            }
+        }
+        g_mutex_unlock(&ladder->table_lock);
+        if (largest == NULL) {
+            return FALSE;
+        }
+        largest->queue_buffers--;
+        largest->queue_budget -= largest->in_frame_bytes;
+        branch->queue_budget += largest->in_frame_bytes;
+        apply_queue_limits(ladder, largest);
+    }
+    return TRUE;
+}
+
+// Когда становятся известны настоящие caps на входе очереди, пересчитываем её пределы
+// в пределах уже выделенных ей байтов
+static GstPadProbeReturn queue_caps_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    Ladder *ladder = user_data;
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+    GstCaps *caps;
+    GstVideoInfo video_info;
+
+    if (GST_EVENT_TYPE(event) != GST_EVENT_CAPS) {
+        return GST_PAD_PROBE_OK;
+    }
+    gst_event_parse_caps(event, &caps);
+    if (!gst_video_info_from_caps(&video_info, caps)) {
+        return GST_PAD_PROBE_OK;
+    }
+
+    // Ветка ищется под table_lock: перезагрузка может в это время расширять таблицу
+    Branch *branch = NULL;
+    int i;
+    g_mutex_lock(&ladder->table_lock);
+    for (i = 0; i < ladder->branch_count; i++) {
+        if (GST_OBJECT_PARENT(pad) == GST_OBJECT(ladder_branch(ladder, i)->queue)) {
+            branch = ladder_branch(ladder, i);
+            break;
+        }
+    }
+    g_mutex_unlock(&ladder->table_lock);
+    if (branch == NULL) {
+        return GST_PAD_PROBE_OK;
+    }
+
+    int framerate = GST_VIDEO_INFO_FPS_D(&video_info) > 0 ?
+                    (GST_VIDEO_INFO_FPS_N(&video_info) + GST_VIDEO_INFO_FPS_D(&video_info) - 1) / GST_VIDEO_INFO_FPS_D(&video_info) :
+                    branch->in_framerate;
+    guint buffers = latency_buffers(ladder, framerate > 0 ? framerate : branch->in_framerate);
+
+    branch->in_frame_bytes = GST_VIDEO_INFO_SIZE(&video_info);
+    if (ladder->memory_budget > 0) {
+        g_mutex_lock(&ladder->budget_lock);
+        if (branch->queue_budget < branch->in_frame_bytes && !charge_queue_budget(ladder, branch)) {
+            g_mutex_unlock(&ladder->budget_lock);
+            GST_ELEMENT_ERROR(branch->queue, RESOURCE, NO_SPACE_LEFT,
+                              ("Branch %d: a %dx%d input frame does not fit memory_budget_mb, raise it.", i,
+                               GST_VIDEO_INFO_WIDTH(&video_info), GST_VIDEO_INFO_HEIGHT(&video_info)),
+                              ("queue budget %" G_GUINT64_FORMAT " bytes, frame %" G_GUINT64_FORMAT " bytes",
+                               branch->queue_budget, branch->in_frame_bytes));
+            return GST_PAD_PROBE_DROP;
+        }
+        buffers = (guint)CLAMP(branch->queue_budget / branch->in_frame_bytes, 1, buffers);
+        g_mutex_unlock(&ladder->budget_lock);
+    }
+    branch->in_framerate = framerate;
+    branch->queue_buffers = buffers;
+    apply_queue_limits(ladder, branch);
+    return GST_PAD_PROBE_OK;
+}
+
+// Пикселей в секунду, которые прочитает масштабирование ветки i, если она питается от parent
+// (-1 - от источника). videorate стоит до масштабирования, так что кадров столько, сколько
+// выдаёт ветка. Кадр того же размера проходит насквозь
+double plan_pixel_rate(Ladder *ladder, int i, int parent) {
+    const VideoFormat *format = &ladder_branch(ladder, i)->format;
+    const VideoFormat *input = parent < 0 ? &ladder->captures[format->region].geometry : &ladder_branch(ladder, parent)->format;
+    int framerate = input->framerate > 0 ? MIN(format->framerate, input->framerate) : format->framerate;
+
+    if (input->width == format->width && input->height == format->height) {
+        return 0.0;
+    }
+    return (double)input->width * input->height * framerate;
+}
+
+// Форматы занятых слотов для оценки другого плана; у неактивных нулевая ширина,
+// и plan_ladder их пропускает
+VideoFormat* ladder_formats(Ladder *ladder) {
+    VideoFormat *formats = g_new0(VideoFormat, MAX(1, ladder->branch_count));
+
+    for (int i = 0; i < ladder->branch_count; i++) {
+        if (ladder_branch(ladder, i)->active) {
+            formats[i] = ladder_branch(ladder, i)->format;
+        }
+    }
+    return formats;
+}
+
+// Ветка, чей tee питает масштабирование узла плана, -1 - tee источника
+static int node_feed(const LadderPlan *plan, const LadderNode *node) {
+    return node->parent < 0 ? -1 : g_array_index(plan->nodes, LadderNode, node->parent).branch;
+}
+
+// Пикселей в секунду, которые масштабируют узлы плана
+double plan_scaler_rate(Ladder *ladder, const LadderPlan *plan) {
+    double total = 0.0;
+
+    for (guint n = 0; n < plan->nodes->len; n++) {
+        const LadderNode *node = &g_array_index(plan->nodes, LadderNode, n);
+        total += plan_pixel_rate(ladder, node->branch, node_feed(plan, node));
+    }
+    return total;
+}
+
+// Откуда берёт кадры ветка или узел: источник его области или другая ветка
+static void feed_label(Ladder *ladder, int region, int feed, char *label, size_t size) {
+    if (feed >= 0) {
+        snprintf(label, size, "branch %d", feed);
+    } else if (ladder->capture_count > 1) {
+        snprintf(label, size, "source %d", region);
+    } else {
+        snprintf(label, size, "source");
+    }
+}
+
+// План лестницы до сборки: узлы масштабирования, откуда каждый берёт кадры и сколько
+// пикселей в секунду масштабирует, и ветки узла, которые только прореживают его кадры.
+// Для сравнения - та же оценка без общих узлов, для плана от источника и для каскада
+void print_ladder_plan(Ladder *ladder, const LadderPlan *plan) {
+    const double mpx = 1e6;
+    double planned = plan_scaler_rate(ladder, plan), unshared = 0.0;
+    gboolean assumed = FALSE;
+    VideoFormat *formats = ladder_formats(ladder);
+    LadderPlan fanout = plan_ladder(formats, ladder->branch_count, FALSE, FALSE);
+    LadderPlan cascade = plan_ladder(formats, ladder->branch_count, TRUE, FALSE);
+
+    g_print("Ladder plan (%s mode, %d branches, %u scalers):\n", ladder_mode_name(ladder->mode),
+            ladder->branch_count, plan->nodes->len);
+    for (guint n = 0; n < plan->nodes->len; n++) {
+        const LadderNode *node = &g_array_index(plan->nodes, LadderNode, n);
+        int feed = node_feed(plan, node);
+        const VideoFormat *input = feed < 0 ? &ladder->captures[node->region].geometry : &ladder_branch(ladder, feed)->format;
+        double rate = plan_pixel_rate(ladder, node->branch, feed);
+        char label[32], work[96];
+        int used = 0;
+
+        feed_label(ladder, node->region, feed, label, sizeof(label));
+        assumed = assumed || (feed < 0 && !ladder->captures[node->region].geometry_known);
+        if (input->framerate > node->framerate) {
+            used += snprintf(work + used, sizeof(work) - used, "decimate %d -> %d fps, ", input->framerate, node->framerate);
+        }
+        if (rate > 0.0) {
+            snprintf(work + used, sizeof(work) - used, "scale %dx%d -> %dx%d",
+                     input->width, input->height, node->width, node->height);
+        } else {
+            snprintf(work + used, sizeof(work) - used, "no scaling");
+        }
+        g_print("  scaler %u %dx%d@%d <- %s: %s, %.1f Mpx/s\n", n, node->width, node->height, node->framerate,
+                label, work, rate / mpx);
+
+        for (int i = 0; i < ladder->branch_count; i++) {
+            Branch *branch = ladder_branch(ladder, i);
+            if (g_array_index(plan->node_of, int, i) != (int)n) {
+                continue;
+            }
+            if (i == node->branch) {
+                g_print("    branch %d %dx%d@%d\n", i, branch->format.width, branch->format.height, branch->format.framerate);
+            } else {
+                g_print("    branch %d %dx%d@%d <- branch %d: decimate %d -> %d fps\n", i, branch->format.width,
+                        branch->format.height, branch->format.framerate, branch->parent,
+                        ladder_branch(ladder, branch->parent)->format.framerate, branch->format.framerate);
+            }
+        }
+    }
+    for (int i = 0; i < ladder->branch_count; i++) {
+        unshared += plan_pixel_rate(ladder, i, -1);
+    }
+    if (plan->separate) {
+        g_print("  reload is on: one scaler per branch, so a branch can be replaced on its own\n");
+    }
+    g_print("  estimated scaler work: %.1f Mpx/s planned, unshared %.1f Mpx/s, fanout %.1f Mpx/s, cascade %.1f Mpx/s%s\n",
+            planned / mpx, unshared / mpx, plan_scaler_rate(ladder, &fanout) / mpx,
+            plan_scaler_rate(ladder, &cascade) / mpx, assumed ? " (source size assumed)" : "");
+    free_ladder_plan(&fanout);
+    free_ladder_plan(&cascade);
+    g_free(formats);
+}
+
+// Отчёт о худшем случае памяти под кадры: заполненные очереди плюс кадры в обработке
+void print_memory_report(Ladder *ladder) {
+    const double mb = 1024.0 * 1024.0;
+    guint64 total = ladder->fixed_bytes;
+
+    if (ladder->capture_count == 1) {
+        g_print("Queue memory plan (%s source %dx%d@%d, latency %d ms):\n",
+                ladder->captures[0].geometry_known ? "detected" : "assumed",
+                ladder->captures[0].geometry.width, ladder->captures[0].geometry.height,
+                ladder->captures[0].geometry.framerate, ladder->queue_latency_ms);
+    } else {
+        g_print("Queue memory plan (%d capture sources, latency %d ms):\n", ladder->capture_count, ladder->queue_latency_ms);
+        for (int r = 0; r < ladder->capture_count; r++) {
+            const Capture *capture = &ladder->captures[r];
+            char label[80];
+
+            capture_label(ladder, r, label, sizeof(label));
+            g_print("  %s: %s %dx%d@%d\n", label, capture->geometry_known ? "detected" : "assumed",
+                    capture->geometry.width, capture->geometry.height, capture->geometry.framerate);
+        }
+    }
+    for (int i = 0; i < ladder->branch_count; i++) {
+        Branch *branch = ladder_branch(ladder, i);
+        guint64 queue_bytes = (guint64)branch->queue_buffers * branch->in_frame_bytes;
+
+        total += queue_bytes;
+        g_print("  branch %d %dx%d@%d: queue %u frames (%.1f MB) at %d fps, in flight %.1f MB, worst case %.1f MB\n",
+                i, branch->format.width, branch->format.height, branch->format.framerate,
+                branch->queue_buffers, queue_bytes / mb, branch->in_framerate, branch->inflight_bytes / mb,
+                (queue_bytes + branch->inflight_bytes) / mb);
+    }
+    if (ladder->memory_budget > 0) {
+        g_print("  total worst case %.1f MB of %.1f MB budget\n", total / mb, ladder->memory_budget / mb);
+    } else {
+        g_print("  total worst case %.1f MB, no budget set\n", total / mb);
+    }
+}
+
+// Средний размер кадра по счётчику
+double average_frame_bytes(const FrameCounter *counter) {
+    return counter->frames > 0 ? (double)counter->bytes / counter->frames : 0.0;
+}
+
+// Сколько байтов в секунду читают источники. Для областей - сравнение с захватом
+// каждого дисплея целиком на частоте его самой быстрой области, которым лестница обходилась без них
+void print_capture_report(Ladder *ladder, double seconds) {
+    const double mb = 1024.0 * 1024.0;
+    double captured_total = 0.0, full_total = 0.0;
+    gboolean regions = FALSE, known = TRUE;
+
+    for (int r = 0; r < ladder->capture_count; r++) {
+        Capture *capture = &ladder->captures[r];
+        char label[80];
+
+        capture_label(ladder, r, label, sizeof(label));
+        g_print("  %s: %" G_GUINT64_FORMAT " frames, %.1f MB/s%s\n", label,
+                capture->source_stats.frames, capture->source_stats.bytes / mb / seconds,
+                capture->failed ? ", stopped after an error" : "");
+        if (capture->preconvert) {
+            g_print("  preconverted to %s: %.1f MB/s\n", ladder->working_format, capture->tee_stats.bytes / mb / seconds);
+        }
+        captured_total += capture->source_stats.bytes;
+        regions = regions || capture->has_region;
+        // Каждый дисплей целиком, на частоте самого быстрого из его источников
+        int first = 0;
+        while (ladder->captures[first].display != capture->display) {
+            first++;
+        }
+        if (first < r) {
+            continue;
+        }
+        guint64 frames = 0;
+        for (int other = r; other < ladder->capture_count; other++) {
+            if (ladder->captures[other].display == capture->display) {
+                frames = MAX(frames, ladder->captures[other].source_stats.frames);
+            }
+        }
+        known = known && capture->display_width > 0;
+        full_total += (double)frames * frame_bytes(capture->display_width, capture->display_height, "");
+    }
+    if (regions && known && full_total > 0.0) {
+        g_print("  capture total: %.1f MB/s, whole displays at the same rate %.1f MB/s (%.0f%% less read)\n",
+                captured_total / mb / seconds, full_total / mb / seconds, 100.0 * (1.0 - captured_total / full_total));
+    }
+}
+
+// Байт, которые прочитали бы узлы плана при тех же кадрах на входе масштабирующих веток
+double plan_scaler_bytes(Ladder *ladder, const LadderPlan *plan) {
+    double total = 0.0;
+
+    for (guint n = 0; n < plan->nodes->len; n++) {
+        const LadderNode *node = &g_array_index(plan->nodes, LadderNode, n);
+        Branch *branch = ladder_branch(ladder, node->branch);
+        int feed = node_feed(plan, node);
+        const FrameCounter *input = feed < 0 ? &ladder->captures[node->region].tee_stats : &ladder_branch(ladder, feed)->stats.out;
+        total += branch->stats.in.frames * average_frame_bytes(input);
+    }
+    return total;
+}
+
+// Отчёт о нагрузке на масштабирование: измеренный для текущего плана и оценка
+// без общих узлов, для плана от источника и для каскада по тем же счётчикам кадров
+void print_scaler_report(Ladder *ladder, double seconds, double cpu_seconds) {
+    const double mb = 1024.0 * 1024.0;
+    double measured_total = 0.0, unshared_total = 0.0;
+
+    if (seconds <= 0.0) {
+        return;
+    }
+
+    g_print("Scaler bandwidth report (%s mode, %.1f s, CPU %.1f s = %.1f%% of one core):\n",
+            ladder_mode_name(ladder->mode), seconds, cpu_seconds, 100.0 * cpu_seconds / seconds);
+    print_capture_report(ladder, seconds);
+
+    for (int i = 0; i < ladder->branch_count; i++) {
+        Branch *branch = ladder_branch(ladder, i);
+        if (!branch->active) {
+            continue;
+        }
+        double source_frame = average_frame_bytes(&ladder->captures[branch->format.region].tee_stats);
+        char feed[32];
+
+        feed_label(ladder, branch->format.region, branch->parent, feed, sizeof(feed));
+        // Ветка узла без videoscale только прореживает уже масштабированные кадры
+        if (branch->scales) {
+            measured_total += branch->stats.in.bytes;
+        }
+        unshared_total += branch->stats.in.frames * source_frame;
+
+        g_print("  branch %d %dx%d@%d <- %s: %" G_GUINT64_FORMAT " frames, %s in %.1f MB/s, out %.1f MB/s%s\n",
+                i, branch->format.width, branch->format.height, branch->format.framerate, feed,
+                branch->stats.in.frames, branch->scales ? "scaler" : "rate only",
+                branch->stats.in.bytes / mb / seconds, branch->stats.out.bytes / mb / seconds,
+                branch->fused ? ", fused scale+convert" : branch->convert ? ", converted" : "");
+    }
+
+    // Форматы веток на момент остановки: после перезагрузки они могли измениться.
+    // Для текущего плана оценка совпадает с измерением, для других - показывает,
+    // сколько читали бы масштабировщики при том же числе кадров
+    VideoFormat *formats = ladder_formats(ladder);
+    LadderPlan fanout = plan_ladder(formats, ladder->branch_count, FALSE, FALSE);
+    LadderPlan cascade = plan_ladder(formats, ladder->branch_count, TRUE, FALSE);
+    g_print("  total scaler input: %.1f MB/s measured, unshared %.1f MB/s, fanout %.1f MB/s, cascade %.1f MB/s\n",
+            measured_total / mb / seconds, unshared_total / mb / seconds,
+            plan_scaler_bytes(ladder, &fanout) / mb / seconds, plan_scaler_bytes(ladder, &cascade) / mb / seconds);
+    free_ladder_plan(&fanout);
+    free_ladder_plan(&cascade);
+    g_free(formats);
+}
+
+// Отчёт об изоляции веток: сколько кадров ветка отбросила в своей очереди
+// и какую частоту кадров при этом удержала
+void print_isolation_report(Ladder *ladder, double seconds) {
+    if (seconds <= 0.0) {
+        return;
+    }
+    g_print("Branch isolation report:\n");
+    for (int i = 0; i < ladder->branch_count; i++) {
+        Branch *branch = ladder_branch(ladder, i);
+        if (!branch->active) {
+            continue;
+        }
+        guint64 passed = branch->queue_out.frames + branch->queued_at_stop;
+        guint64 dropped = branch->queue_in.frames > passed ? branch->queue_in.frames - passed : 0;
+
+        g_print("  branch %d %dx%d@%d %s: %.1f fps out, dropped %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " frames (%.1f%%)",
+                i, branch->format.width, branch->format.height, branch->format.framerate,
+                isolation_name(branch->isolation), branch->stats.out.frames / seconds, dropped, branch->queue_in.frames,
+                branch->queue_in.frames > 0 ? 100.0 * dropped / branch->queue_in.frames : 0.0);
+        if (branch->inter_src) {
+            // intervideosrc повторяет последний кадр, если ветка не успела дать новый
+            guint64 repeated = branch->inter_out.frames > branch->stats.out.frames ?
+                               branch->inter_out.frames - branch->stats.out.frames : 0;
+            g_print(", compositor input %.1f fps, %" G_GUINT64_FORMAT " repeated", branch->inter_out.frames / seconds, repeated);
+        }
+        g_print("\n");
+    }
+}
+
+// Отчёт о записи: кадры и средний битрейт каждой ветки
+void print_record_report(Ladder *ladder, double seconds) {
+    if (!ladder->record || seconds <= 0.0) {
+        return;
+    }
+    g_print("Recording report (%s, %d s segments):\n", encoder_factory_name(ladder->encoder), ladder->segment_seconds);
+    for (int i = 0; i < ladder->branch_count; i++) {
+        Branch *branch = ladder_branch(ladder, i);
+        g_print("  branch %d %dx%d@%d: %" G_GUINT64_FORMAT " frames encoded, %.0f kbit/s (target %d), %d encoder threads\n",
+                i, branch->format.width, branch->format.height, branch->format.framerate, branch->encoded.frames,
+                branch->encoded.bytes * 8.0 / 1000.0 / seconds, branch->bitrate, branch->encoder_threads);
+    }
+}
+
+// Сбрасывает кольца повтора всех веток в файлы, захват при этом продолжается
+void dump_replay(Ladder *ladder) {
+    GDateTime *now = g_date_time_new_now_local();
+    gchar *stamp = g_date_time_format(now, "%Y%m%d-%H%M%S");
+    gsize ring_bytes = 0;
+
+    g_date_time_unref(now);
+    for (int i = 0; i < ladder->branch_count; i++) {
+        Branch *branch = ladder_branch(ladder, i);
+        ReplaySnapshot snapshot;
+        gboolean mkv = strcmp(ladder->replay_muxer, "mkv") == 0 || ladder->encoder == ENCODER_VP8;
+
+        if (branch->replay_sink == NULL) {
+            continue;
+        }
+        if (!replay_ring_snapshot(&branch->replay, &snapshot)) {
+            g_print("Replay dump: branch %d has no keyframe yet, skipped\n", i);
+            replay_snapshot_clear(&snapshot);
+            continue;
+        }
+        ring_bytes += snapshot.bytes;
+
+        gchar *location = g_strdup_printf("%s_%dx%d_%s.%s", ladder->replay_location,
+                                          branch->format.width, branch->format.height, stamp, mkv ? "mkv" : "mp4");
+        gint64 start = g_get_monotonic_time();
+        int result = replay_snapshot_write(&snapshot, mkv ? "matroskamux" : "mp4mux", location);
+        g_print("Replay dump: branch %d %dx%d: %.1f s, %u frames, %.1f MB -> %s in %.0f ms%s\n",
+                i, branch->format.width, branch->format.height, (double)snapshot.duration / GST_SECOND,
+                snapshot.buffers->len, snapshot.bytes / 1048576.0, location,
+                (g_get_monotonic_time() - start) / 1000.0, result != 0 ? " (FAILED)" : "");
+        g_free(location);
+        replay_snapshot_clear(&snapshot);
+    }
+    g_print("Replay dump: %.1f MB held in memory\n", ring_bytes / 1048576.0);
+    g_free(stamp);
+}
+
+// Поток управления: команды из канала сигналов и из control_fifo
+static gpointer control_thread(gpointer data) {
+    Ladder *ladder = data;
+    char line[MAX_LINE_LENGTH];
+    size_t line_length = 0;
+
+    while (TRUE) {
+        struct pollfd fds[2] = {
+            {control_pipe[0], POLLIN, 0},
+            {ladder->control_fifo, POLLIN, 0}
+        };
+        nfds_t count = ladder->control_fifo >= 0 ? 2 : 1;
+
+        if (poll(fds, count, -1) < 0) {
+            continue;
+        }
+        if (fds[0].revents & POLLIN) {
+            char command;
+            if (read(control_pipe[0], &command, 1) == 1) {
+                if (command == 'q') {
+                    break;
+                }
+                if (command == 'd') {
+                    dump_replay(ladder);
+                }
+            }
+        }
+        if (count > 1 && (fds[1].revents & POLLIN)) {
+            char buffer[64];
+            ssize_t length = read(ladder->control_fifo, buffer, sizeof(buffer));
+            for (ssize_t i = 0; i < length; i++) {
+                if (buffer[i] != '\n' && line_length < sizeof(line) - 1) {
+                    line[line_length++] = buffer[i];
+                    continue;
+                }
+                line[line_length] = '\0';
+                line_length = 0;
+                if (strcmp(line, "dump") == 0) {
+                    dump_replay(ladder);
+                } else if (line[0] != '\0') {
+                    g_printerr("Unknown control command: %s\n", line);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+// Запускает поток управления и открывает control_fifo, если он задан
+int control_start(Ladder *ladder, const char *fifo_path) {
+    ladder->control_fifo = -1;
+    if (pipe(control_pipe) != 0) {
+        return -1;
+    }
+    if (fifo_path[0] != '\0') {
+        // O_RDWR держит канал открытым на запись, чтобы poll не видел EOF после каждого писателя
+        ladder->control_fifo = open(fifo_path, O_RDWR | O_NONBLOCK);
+        if (ladder->control_fifo < 0) {
+            g_printerr("Failed to open control fifo %s, use SIGUSR1 instead.\n", fifo_path);
+        }
+    }
+    ladder->control = g_thread_new("control", control_thread, ladder);
+    signal(SIGUSR1, sigusr1_handler);
+    return 0;
+}
+
+void control_stop(Ladder *ladder) {
+    char command = 'q';
+
+    if (ladder->control == NULL) {
+        return;
+    }
+    signal(SIGUSR1, SIG_DFL);
+    if (write(control_pipe[1], &command, 1) == 1) {
+        g_thread_join(ladder->control);
+    }
+    ladder->control = NULL;
+    if (ladder->control_fifo >= 0) {
+        close(ladder->control_fifo);
+    }
+    close(control_pipe[0]);
+    close(control_pipe[1]);
+}
+
+// Отчёт буфера повтора: сколько держим сейчас и максимум за время работы
+void print_replay_report(Ladder *ladder) {
+    if (!ladder->replay) {
+        return;
+    }
+    g_print("Replay buffer (%.0f s, cap %.1f MB):\n", (double)ladder->replay_duration / GST_SECOND,
+            ladder->replay_memory / 1048576.0);
+    for (int i = 0; i < ladder->branch_count; i++) {
+        Branch *branch = ladder_branch(ladder, i);
+        g_print("  branch %d %dx%d@%d: %.1f s held, %.1f MB (peak %.1f MB, cap %.1f MB), %" G_GUINT64_FORMAT " GOPs evicted\n",
+                i, branch->format.width, branch->format.height, branch->format.framerate,
+                (double)replay_ring_duration(&branch->replay) / GST_SECOND, branch->replay.bytes / 1048576.0,
+                branch->replay.peak_bytes / 1048576.0, branch->replay.max_bytes / 1048576.0, branch->replay.gops_evicted);
+    }
+}
+
+// Отчёт об экспорте в разделяемую память: сколько кадров дошло до кольца каждой ветки
+void print_export_report(Ladder *ladder) {
+    if (!ladder->exporting) {
+        return;
+    }
+    g_print("Shared memory export (%d slots per ring):\n", ladder->export_slots);
+    for (int i = 0; i < ladder->branch_count; i++) {
+        Branch *branch = ladder_branch(ladder, i);
+        if (branch->export_sink == NULL) {
+            continue;
+        }
+        g_print("  branch %d %dx%d@%d -> %s: %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " frames published, "
+                "%.1f MB mapped, ring recreated %" G_GUINT64_FORMAT " times%s\n",
+                i, branch->format.width, branch->format.height, branch->format.framerate, branch->format.export_name,
+                branch->exporter.published, branch->export_in.frames, branch->exporter.map_size / 1048576.0,
+                branch->exporter.replaced, branch->export_failed > 0 ? " (FAILED)" : "");
+    }
+}
+
+// Отчёт о потоках веток: сколько ушло в сеть и, в режиме loopback, задержка
+// от захвата до декодированного кадра у зрителя
+void print_stream_report(Ladder *ladder, double seconds) {
+    if (!ladder->streaming || seconds <= 0.0) {
+        return;
+    }
+    g_print("Stream report (%s over %s):\n", encoder_factory_name(ladder->encoder), stream_protocol_name(ladder->stream_protocol));
+    for (int i = 0; i < ladder->branch_count; i++) {
+        Branch *branch = ladder_branch(ladder, i);
+        if (branch->stream_sink == NULL) {
+            continue;
+        }
+        g_print("  branch %d %dx%d@%d -> %s://%s:%d: %" G_GUINT64_FORMAT " frames encoded, %" G_GUINT64_FORMAT
+                " packets, %.0f kbit/s\n",
+                i, branch->format.width, branch->format.height, branch->format.framerate,
+                stream_protocol_name(ladder->stream_protocol), ladder->stream_host, branch->format.stream_port,
+                branch->encoded.frames, branch->streamed.frames, branch->streamed.bytes * 8.0 / 1000.0 / seconds);
+        if (!ladder->stream_loopback) {
+            continue;
+        }
+        StreamReceiver *receiver = &branch->receiver;
+        LatencyStats latency = latency_recorder_stats(&receiver->latency);
+        g_print("    loopback: %" G_GUINT64_FORMAT " frames decoded, %u measured, %" G_GUINT64_FORMAT " without stamp "
+                "(%" G_GUINT64_FORMAT " stamped of %" G_GUINT64_FORMAT " encoded)\n",
+                receiver->frames, receiver->latency.count, receiver->unreadable,
+                branch->stamper.stamped, branch->stamper.stamped + branch->stamper.unstamped);
+        if (receiver->latency.count > 0) {
+            g_print("    capture to decoded frame: p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms, mean %.1f ms\n",
+                    latency.p50_us / 1000.0, latency.p90_us / 1000.0, latency.p99_us / 1000.0,
+                    latency.max_us / 1000.0, latency.mean_us / 1000.0);
+        }
+        if (receiver->error != NULL) {
+            g_print("    receiver error: %s\n", receiver->error);
+        }
+    }
+}
+
+// Отчёт о пропущенных кадрах в режиме damage
+void print_damage_report(Ladder *ladder) {
+    guint64 captured = ladder->captures[0].source_stats.frames;
+
+    if (ladder->damage.display == NULL || captured == 0) {
+        return;
+    }
+    g_print("Damage capture: %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " frames unchanged and skipped (%.1f%%)\n",
+            ladder->damage.frames_skipped, captured, 100.0 * ladder->damage.frames_skipped / captured);
+}
+
+// Отчёт стадии дедупликации: доля повторов и оценка сэкономленного времени
+void print_dedupe_report(Ladder *ladder, double cpu_seconds) {
+    DedupeStage *dedupe = &ladder->dedupe;
+    guint64 passed = dedupe->frames_hashed - dedupe->frames_deduped;
+    double hash_seconds = dedupe->hash_time_us / 1e6;
+
+    if (ladder->dedupe_element == NULL || dedupe->frames_hashed == 0) {
+        return;
+    }
+    // Время на один пропущенный дальше кадр, умноженное на число отброшенных
+    double saved = passed > 0 ? (cpu_seconds - hash_seconds) / passed * dedupe->frames_deduped : 0.0;
+
+    g_print("Dedupe: %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " frames unchanged (hit rate %.1f%%), "
+            "%.1f%% tiles differed (changed frames are reprocessed whole), hashing %.2f s, CPU saved ~%.1f s (estimated)\n",
+            dedupe->frames_deduped, dedupe->frames_hashed, 100.0 * dedupe->frames_deduped / dedupe->frames_hashed,
+            dedupe->tiles_compared > 0 ? 100.0 * dedupe->tiles_differing / dedupe->tiles_compared : 0.0,
+            hash_seconds, saved);
+}
+
+// Метрика Prometheus по всем веткам: заголовок и по строке на ветку
+static void branch_metric(GString *out, const char *name, const char *type, const char *help,
+                          char labels[][64], const double *values, int count) {
+    g_string_append_printf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    for (int i = 0; i < count; i++) {
+        g_string_append_printf(out, "%s{%s} %.15g\n", name, labels[i], values[i]);
+    }
+}
+
+// Кадры всех источников
+guint64 captured_frames(Ladder *ladder) {
+    guint64 frames = 0;
+
+    for (int r = 0; r < ladder->capture_count; r++) {
+        frames += ladder->captures[r].source_stats.frames;
+    }
+    return frames;
+}
+
+// Одна метрика без меток
+static void ladder_metric(GString *out, const char *name, const char *type, const char *help, double value) {
+    g_string_append_printf(out, "# HELP %s %s\n# TYPE %s %s\n%s %.15g\n", name, help, name, type, name, value);
+}
+
+// Снимок метрик в потоке метрик: читает счётчики пробников и свойства элементов,
+// частоты считает по разнице с прошлым снимком
+void collect_metrics(GString *out, gpointer data) {
+    Ladder *ladder = data;
+    int count = 0;
+    gint64 now = g_get_monotonic_time();
+    double seconds = ladder->metrics_last_us != 0 ? (now - ladder->metrics_last_us) / 1e6 : 0.0;
+    char (*labels)[64], (*export_labels)[64], (*stream_labels)[64];
+    double *values, *capture_fps, *delivered_fps, *rate_dropped, *rate_duplicated, *queue_dropped;
+    double *level, *high_water, *limit, *qos_events, *qos_jitter, *jitter, *jitter_max;
+    double *degrade_level, *degraded_drops, *exported, *streamed_bytes;
+    int export_count = 0;
+    int stream_count = 0;
+    char capture_labels[MAX_CAPTURE_REGIONS][64];
+    double capture_bytes[MAX_CAPTURE_REGIONS], capture_up[MAX_CAPTURE_REGIONS];
+
+    if (seconds > 0.0) {
+        ladder->source_fps = (captured_frames(ladder) - ladder->metrics_source_frames) / seconds;
+        ladder->output_fps = (ladder->output_stats.frames - ladder->metrics_output_frames) / seconds;
+    }
+    ladder->metrics_source_frames = captured_frames(ladder);
+    ladder->metrics_output_frames = ladder->output_stats.frames;
+    ladder->metrics_last_us = now;
+
+    g_mutex_lock(&ladder->topology_lock);
+    // Строка на каждый занятый слот; буферы берутся под блокировкой, пока число слотов не меняется
+    int rows = MAX(1, ladder->branch_count);
+    labels = g_malloc_n(3 * rows, sizeof(*labels));
+    export_labels = labels + rows;
+    stream_labels = labels + 2 * rows;
+    values = g_new(double, 16 * rows);
+    capture_fps = values;
+    delivered_fps = values + rows;
+    rate_dropped = values + 2 * rows;
+    rate_duplicated = values + 3 * rows;
+    queue_dropped = values + 4 * rows;
+    level = values + 5 * rows;
+    high_water = values + 6 * rows;
+    limit = values + 7 * rows;
+    qos_events = values + 8 * rows;
+    qos_jitter = values + 9 * rows;
+    jitter = values + 10 * rows;
+    jitter_max = values + 11 * rows;
+    degrade_level = values + 12 * rows;
+    degraded_drops = values + 13 * rows;
+    exported = values + 14 * rows;
+    streamed_bytes = values + 15 * rows;
+    for (int i = 0; i < ladder->branch_count; i++) {
+        Branch *branch = ladder_branch(ladder, i);
+        if (!branch->active) {
+            continue;
+        }
+        guint64 jitter_samples = branch->jitter_samples - branch->metrics_jitter_samples;
+        guint64 dropped, duplicated;
+        guint current, max_buffers;
+
+        int n = count++;
+        snprintf(labels[n], sizeof(labels[n]), "branch=\"%d\",size=\"%dx%d\",fps=\"%d\"",
+                 i, branch->format.width, branch->format.height, branch->format.framerate);
+        g_object_get(branch->videorate, "drop", &dropped, "duplicate", &duplicated, NULL);
+        g_object_get(branch->queue, "current-level-buffers", &current, "max-size-buffers", &max_buffers, NULL);
+        if (seconds > 0.0) {
+            branch->capture_fps = (branch->queue_in.frames - branch->metrics_in_frames) / seconds;
+            branch->delivered_fps = (branch->stats.out.frames - branch->metrics_out_frames) / seconds;
+            branch->mean_jitter_us = jitter_samples > 0 ?
+                (double)(branch->jitter_sum_us - branch->metrics_jitter_sum_us) / jitter_samples : 0.0;
+        }
+        branch->metrics_in_frames = branch->queue_in.frames;
+        branch->metrics_out_frames = branch->stats.out.frames;
+        branch->metrics_jitter_sum_us = branch->jitter_sum_us;
+        branch->metrics_jitter_samples = branch->jitter_samples;
+
+        guint64 passed = branch->queue_out.frames + current;
+        capture_fps[n] = branch->capture_fps;
+        delivered_fps[n] = branch->delivered_fps;
+        rate_dropped[n] = (double)dropped;
+        rate_duplicated[n] = (double)duplicated;
+        queue_dropped[n] = branch->queue_in.frames > passed ? (double)(branch->queue_in.frames - passed) : 0.0;
+        level[n] = current;
+        high_water[n] = g_atomic_int_get(&branch->queue_high_water);
+        limit[n] = max_buffers;
+        qos_events[n] = (double)(branch->qos_events + branch->qos_messages);
+        qos_jitter[n] = branch->qos_jitter_ns / 1e9;
+        jitter[n] = branch->mean_jitter_us / 1e6;
+        jitter_max[n] = branch->jitter_max_us / 1e6;
+        degrade_level[n] = g_atomic_int_get(&branch->degrade_level);
+        degraded_drops[n] = (double)branch->degraded_drops;
+        if (branch->export_sink != NULL) {
+            int e = export_count++;
+            snprintf(export_labels[e], sizeof(export_labels[e]), "branch=\"%d\",ring=\"%s\"", i, branch->format.export_name);
+            exported[e] = (double)branch->exporter.published;
+        }
+        if (branch->stream_sink != NULL) {
+            int k = stream_count++;
+            snprintf(stream_labels[k], sizeof(stream_labels[k]), "branch=\"%d\",port=\"%d\"", i, branch->format.stream_port);
+            streamed_bytes[k] = (double)branch->streamed.bytes;
+        }
+    }
+    g_mutex_unlock(&ladder->topology_lock);
+
+    ladder_metric(out, "ladder_source_fps", "gauge", "Frames per second leaving the capture sources.", ladder->source_fps);
+    ladder_metric(out, "ladder_source_frames_total", "counter", "Frames produced by the capture sources.",
+                  (double)captured_frames(ladder));
+    for (int r = 0; r < ladder->capture_count; r++) {
+        snprintf(capture_labels[r], sizeof(capture_labels[r]), "region=\"%d\",display=\":%d\"", r, ladder->captures[r].display);
+        capture_bytes[r] = (double)ladder->captures[r].source_stats.bytes;
+        capture_up[r] = ladder->captures[r].failed ? 0.0 : 1.0;
+    }
+    branch_metric(out, "ladder_capture_bytes_total", "counter", "Bytes read by the capture source of each region.",
+                  capture_labels, capture_bytes, ladder->capture_count);
+    branch_metric(out, "ladder_capture_up", "gauge", "1 while the capture source runs, 0 after it stopped on an error.",
+                  capture_labels, capture_up, ladder->capture_count);
+    if (ladder->compositor != NULL) {
+        ladder_metric(out, "ladder_compositor_fps", "gauge", "Frames per second leaving the compositor.", ladder->output_fps);
+        ladder_metric(out, "ladder_compositor_frames_total", "counter", "Frames produced by the compositor.",
+                      (double)ladder->output_stats.frames);
+        if (ladder->tiles) {
+            guint64 copied = 0, skipped = 0;
+            g_object_get(ladder->compositor, "pads-copied", &copied, "pads-skipped", &skipped, NULL);
+            ladder_metric(out, "ladder_compositor_tiles_copied_total", "counter",
+                          "Branch frames copied onto the preview canvas.", (double)copied);
+            ladder_metric(out, "ladder_compositor_tiles_skipped_total", "counter",
+                          "Branch tiles left in place because the branch had no new frame.", (double)skipped);
+        }
+    }
+    branch_metric(out, "ladder_branch_capture_fps", "gauge", "Frames per second entering the branch queue.",
+                  labels, capture_fps, count);
+    branch_metric(out, "ladder_branch_delivered_fps", "gauge", "Frames per second leaving the branch scaler.",
+                  labels, delivered_fps, count);
+    branch_metric(out, "ladder_branch_videorate_dropped_total", "counter", "Frames dropped by the branch videorate.",
+                  labels, rate_dropped, count);
+    branch_metric(out, "ladder_branch_videorate_duplicated_total", "counter", "Frames duplicated by the branch videorate.",
+                  labels, rate_duplicated, count);
+    branch_metric(out, "ladder_branch_queue_dropped_total", "counter", "Frames dropped by the leaky branch queue.",
+                  labels, queue_dropped, count);
+    branch_metric(out, "ladder_branch_queue_level_buffers", "gauge", "Buffers waiting in the branch queue.",
+                  labels, level, count);
+    branch_metric(out, "ladder_branch_queue_high_water_buffers", "gauge", "Highest branch queue level seen by an incoming frame.",
+                  labels, high_water, count);
+    branch_metric(out, "ladder_branch_queue_limit_buffers", "gauge", "Branch queue max-size-buffers.",
+                  labels, limit, count);
+    branch_metric(out, "ladder_branch_qos_events_total", "counter", "QoS events and messages seen by the branch.",
+                  labels, qos_events, count);
+    branch_metric(out, "ladder_branch_qos_jitter_seconds", "gauge", "Jitter reported by the last QoS event.",
+                  labels, qos_jitter, count);
+    branch_metric(out, "ladder_branch_jitter_seconds", "gauge", "Mean deviation of the output frame interval from 1/fps.",
+                  labels, jitter, count);
+    branch_metric(out, "ladder_branch_jitter_max_seconds", "gauge", "Largest deviation of the output frame interval from 1/fps.",
+                  labels, jitter_max, count);
+    if (ladder->adaptive.enabled) {
+        ladder_metric(out, "ladder_adaptive_changes_total", "counter", "Degradation level changes made by the controller.",
+                      (double)ladder->adaptive.changes);
+        ladder_metric(out, "ladder_adaptive_cpu_percent", "gauge", "Process CPU load seen by the controller, percent of all cores.",
+                      ladder->adaptive.cpu_percent);
+        branch_metric(out, "ladder_branch_degradation_level", "gauge",
+                      "0 normal, 1 cheap scaling, 2 half rate, 3 one frame per second.", labels, degrade_level, count);
+        branch_metric(out, "ladder_branch_degraded_drops_total", "counter", "Frames skipped by the degradation gate.",
+                      labels, degraded_drops, count);
+    }
+    if (ladder->exporting) {
+        branch_metric(out, "ladder_branch_exported_frames_total", "counter",
+                      "Frames published to the branch shared memory ring.", export_labels, exported, export_count);
+    }
+    if (ladder->streaming) {
+        branch_metric(out, "ladder_branch_streamed_bytes_total", "counter",
+                      "RTP bytes sent by the branch stream.", stream_labels, streamed_bytes, stream_count);
+    }
+    if (ladder->reload.enabled) {
+        ladder_metric(out, "ladder_reloads_total", "counter", "Config reloads applied to the running ladder.",
+                      (double)ladder->reload.applied);
+        ladder_metric(out, "ladder_reload_apply_seconds", "gauge", "Time the last config reload took to apply.",
+                      ladder->reload.last_ms / 1000.0);
+    }
+    g_free(labels);
+    g_free(values);
+}
+
+// Вешает трассировку на все элементы, которые создаёт построитель лестницы
+void trace_ladder(Ladder *ladder) {
+    char category[THREAD_NAME_LENGTH];
+
+    for (int r = 0; r < ladder->capture_count; r++) {
+        GstElement *capture[] = {ladder->captures[r].preconvert, ladder->captures[r].preconvert_caps,
+                                 r == 0 ? ladder->dedupe_element : NULL};
+
+        if (ladder->capture_count > 1) {
+            snprintf(category, sizeof(category), "capture %d", r);
+        } else {
+            g_strlcpy(category, "capture", sizeof(category));
+        }
+        for (size_t i = 0; i < G_N_ELEMENTS(capture); i++) {
+            if (capture[i] != NULL) {
+                element_tracer_add(&ladder->tracer, capture[i], category);
+            }
+        }
+    }
+    for (int i = 0; i < ladder->branch_count; i++) {
+        Branch *branch = ladder_branch(ladder, i);
+        GstElement *elements[] = {branch->queue, branch->videorate, branch->videoscale, branch->capsfilter,
+                                  branch->convert, branch->outcaps, branch->inter_caps,
+                                  branch->record_queue, branch->encconvert, branch->export_queue,
+                                  branch->stream_queue, branch->payloader};
+
+        snprintf(category, sizeof(category), "branch %d", i);
+        for (size_t j = 0; j < G_N_ELEMENTS(elements); j++) {
+            if (elements[j] != NULL) {
+                element_tracer_add(&ladder->tracer, elements[j], category);
+            }
+        }
+    }
+    if (ladder->compositor != NULL) {
+        element_tracer_add(&ladder->tracer, ladder->compositor, "output");
+    }
+}
+
+// Строка JSON с экранированием кавычек, '\\' и управляющих символов
+static void write_json_string(FILE *out, const char *str) {
+    fputc('"', out);
+    for (const unsigned char *p = (const unsigned char*)str; *p != '\0'; p++) {
+        if (*p == '"' || *p == '\\') {
+            fprintf(out, "\\%c", *p);
+        } else if (*p < 0x20) {
+            fprintf(out, "\\u%04x", *p);
+        } else {
+            fputc(*p, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// Результат прогона в JSON, чтобы сравнивать сборки между собой.
+// Задержка - от выхода источника до конца обработки ветки, fps - по измеренным кадрам ветки
+int write_bench_report(Ladder *ladder, Config *config, const char *config_name, double wall_seconds) {
+    Bench *bench = &ladder->bench;
+    double seconds = bench->end_us > bench->start_us ? (bench->end_us - bench->start_us) / 1e6 : 0.0;
+    double cpu_seconds = bench->end_cpu_seconds - bench->start_cpu_seconds;
+    FILE *out = strcmp(config->bench_output, "-") == 0 ? stdout : fopen(config->bench_output, "w");
+
+    if (out == NULL) {
+        g_printerr("Failed to open %s for the benchmark report.\n", config->bench_output);
+        return -1;
+    }
+    fprintf(out, "{\n  \"config\": ");
+    write_json_string(out, config_name);
+    fprintf(out, ",\n  \"source\": \"%s\",\n",
+            config->source_type == SOURCE_XIMAGE ? "ximagesrc" : config->source_type == SOURCE_VIDEOTEST ? "videotestsrc" : "file");
+    fprintf(out, "  \"source_live\": %s,\n", config->source_type == SOURCE_FILE || !config->source_live ? "false" : "true");
+    fprintf(out, "  \"source_geometry\": {\"width\": %d, \"height\": %d, \"framerate\": %d, \"detected\": %s},\n",
+            ladder->captures[0].geometry.width, ladder->captures[0].geometry.height, ladder->captures[0].geometry.framerate,
+            ladder->captures[0].geometry_known ? "true" : "false");
+    fprintf(out, "  \"captures\": [");
+    for (int r = 0; r < ladder->capture_count; r++) {
+        Capture *capture = &ladder->captures[r];
+        fprintf(out, "%s{\"display\": %d, \"width\": %d, \"height\": %d, \"frames\": %" G_GUINT64_FORMAT
+                ", \"bytes_per_second\": %.0f, \"failed\": %s}",
+                r > 0 ? ", " : "", capture->display, capture->geometry.width, capture->geometry.height, capture->source_stats.frames,
+                wall_seconds > 0.0 ? capture->source_stats.bytes / wall_seconds : 0.0, capture->failed ? "true" : "false");
+    }
+    fprintf(out, "],\n");
+    fprintf(out, "  \"ladder_mode\": \"%s\",\n  \"working_format\": \"%s\",\n  \"preview_sink\": \"%s\",\n",
+            ladder_mode_name(ladder->mode), ladder->working_format, ladder->preview ? config->preview_sink : "none");
+    fprintf(out, "  \"frames\": %" G_GUINT64_FORMAT ",\n  \"warmup_frames\": %" G_GUINT64_FORMAT ",\n"
+            "  \"source_frames\": %" G_GUINT64_FORMAT ",\n",
+            bench->frames, bench->warmup_frames, bench->source_frames);
+    fprintf(out, "  \"seconds\": %.3f,\n  \"wall_seconds\": %.3f,\n", seconds, wall_seconds);
+    fprintf(out, "  \"source_fps\": %.2f,\n",
+            seconds > 0.0 ? (bench->source_frames - bench->warmup_frames - 1) / seconds : 0.0);
+    fprintf(out, "  \"cpu_seconds\": %.3f,\n  \"cpu_percent\": %.1f,\n  \"peak_rss_kb\": %ld,\n",
+            cpu_seconds, seconds > 0.0 ? 100.0 * cpu_seconds / seconds : 0.0, bench_peak_rss_kb());
+    // Время до первого кадра от входа в main, -1 - кадр не дошёл до выхода
+    fprintf(out, "  \"first_frame_ms\": %.1f,\n",
+            ladder->startup.first_frame_us > 0 ? (ladder->startup.first_frame_us - ladder->startup.main_us) / 1000.0 : -1.0);
+    fprintf(out, "  \"branches\": [");
+    gboolean first = TRUE;
+    for (int i = 0; i < ladder->branch_count; i++) {
+        Branch *branch = ladder_branch(ladder, i);
+        if (!branch->active) {
+            continue;
+        }
+        LatencyStats latency = latency_recorder_stats(&branch->latency);
+        guint64 passed = branch->queue_out.frames + branch->queued_at_stop;
+        guint64 dropped = branch->queue_in.frames > passed ? branch->queue_in.frames - passed : 0;
+
+        fprintf(out, "%s\n    {\"index\": %d, \"width\": %d, \"height\": %d, \"framerate\": %d, \"format\": \"%s\", "
+                "\"parent\": %d, \"scales\": %s, \"isolation\": \"%s\", \"fused\": %s,\n",
+                first ? "" : ",", i, branch->format.width, branch->format.height, branch->format.framerate,
+                branch->format.format, branch->parent, branch->scales ? "true" : "false",
+                isolation_name(branch->isolation), branch->fused ? "true" : "false");
+        fprintf(out, "     \"frames_out\": %" G_GUINT64_FORMAT ", \"dropped\": %" G_GUINT64_FORMAT ", "
+                "\"measured_frames\": %u, \"fps\": %.2f,\n",
+                branch->stats.out.frames, dropped, branch->latency.count, latency.fps);
+        fprintf(out, "     \"latency_us\": {\"p50\": %.0f, \"p90\": %.0f, \"p99\": %.0f, \"max\": %.0f, \"mean\": %.0f},\n",
+                latency.p50_us, latency.p90_us, latency.p99_us, latency.max_us, latency.mean_us);
+        if (branch->stream_sink != NULL && ladder->stream_loopback) {
+            LatencyStats stream = latency_recorder_stats(&branch->receiver.latency);
+            fprintf(out, "     \"stream\": {\"protocol\": \"%s\", \"port\": %d, \"decoded_frames\": %" G_GUINT64_FORMAT
+                    ", \"measured_frames\": %u,\n"
+                    "       \"latency_us\": {\"p50\": %.0f, \"p90\": %.0f, \"p99\": %.0f, \"max\": %.0f, \"mean\": %.0f}},\n",
+                    stream_protocol_name(ladder->stream_protocol), branch->format.stream_port, branch->receiver.frames,
+                    branch->receiver.latency.count, stream.p50_us, stream.p90_us, stream.p99_us, stream.max_us, stream.mean_us);
+        }
+        // RSS у веток общий, поэтому для ветки даём её худший случай по плану памяти
+        fprintf(out, "     \"thread_cpu_seconds\": %.3f, \"planned_bytes\": %" G_GUINT64_FORMAT "}",
+                branch->thread_cpu_seconds, (guint64)branch->queue_buffers * branch->in_frame_bytes + branch->inflight_bytes);
+        first = FALSE;
+    }
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout) {
+        fclose(out);
+        g_print("Benchmark report written to %s\n", config->bench_output);
+    }
+    return 0;
+}
+
+// Ставит вход ветки на место. tilecompositor не масштабирует и не смешивает:
+// кадр ветки уже нужного размера и кладётся как есть
+static void place_preview_pad(Ladder *ladder, Branch *branch, int xpos, int ypos) {
+    if (ladder->tiles) {
+        g_object_set(branch->compositor_pad, "xpos", xpos, "ypos", ypos, NULL);
+    } else {
+        g_object_set(branch->compositor_pad, "xpos", xpos, "ypos", ypos, "width", branch->format.width,
+                     "height", branch->format.height, "operator", 0, "sizing-policy", 1, NULL);
+    }
+}
+
+// Раскладывает действующие ветки в компоновщике: самая широкая сверху по центру,
+// остальные в ряд под ней. Вызывается и на ходу после перезагрузки
+void layout_preview(Ladder *ladder) {
+    GArray *order = preview_order(ladder);
+    int xpos_sum = 0;
+
+    if (order->len > 0) {
+        Branch *top = ladder_branch(ladder, g_array_index(order, int, 0));
+        for (guint k = 1; k < order->len; k++) {
+            Branch *branch = ladder_branch(ladder, g_array_index(order, int, k));
+            place_preview_pad(ladder, branch, xpos_sum, top->format.height);
+            xpos_sum += branch->format.width;
+        }
+        place_preview_pad(ladder, top, xpos_sum <= top->format.width ? 0 : (xpos_sum - top->format.width) / 2, 0);
+    }
+    g_array_free(order, TRUE);
+}
+
+// Запрашивает вход компоновщика для ветки и подключает к нему её выход
+int link_branch_preview(Ladder *ladder, int i) {
+    Branch *branch = ladder_branch(ladder, i);
+    GstPad *src_pad = gst_element_get_static_pad(branch_tail(branch), "src");
+    GstPadLinkReturn link;
+
+    branch->compositor_pad = gst_element_request_pad_simple(ladder->compositor, "sink_%u");
+    link = branch->compositor_pad ? gst_pad_link(src_pad, branch->compositor_pad) : GST_PAD_LINK_REFUSED;
+    gst_object_unref(src_pad);
+    return link == GST_PAD_LINK_OK ? 0 : -1;
+}
+
+// Функция для подключения веток к компоновщику предпросмотра
+int link_preview(Ladder *ladder) {
+    gboolean linked = ladder->preview_caps != NULL ?
+                      gst_element_link_many(ladder->compositor, ladder->preview_caps, ladder->sink, NULL) :
+                      gst_element_link(ladder->compositor, ladder->sink);
+
+    if (!linked) {
+        g_printerr("Failed to link compositor to sink.\n");
+        return -1;
+    }
+
+    for (int i = 0; i < ladder->branch_count; i++) {
+        if (link_branch_preview(ladder, i) != 0) {
+            g_printerr("Failed to link queues to compositor.\n");
+            return -1;
+        }
+    }
+    layout_preview(ladder);
+
+    g_object_set(ladder->sink, "sync", 0, NULL);
+    return 0;
+}
+
+// Создаёт компоновщик предпросмотра. tilecompositor не конвертирует входы, поэтому
+// берётся, только если все ветки отдают I420; иначе обычный compositor
+int create_preview_compositor(Ladder *ladder, const Config *config) {
+    ladder->tiles = config->preview_tiles;
+    for (int i = 0; i < ladder->branch_count && ladder->tiles; i++) {
+        if (strcmp(branch_output_format(ladder, ladder_branch(ladder, i)), "I420") != 0) {
+            g_printerr("Branch %d does not output I420, using compositor for the preview.\n", i);
+            ladder->tiles = FALSE;
+        }
+    }
+    if (ladder->tiles && !tile_compositor_register()) {
+        g_printerr("tilecompositor is not available, using compositor for the preview.\n");
+        ladder->tiles = FALSE;
+    }
+    ladder->compositor = startup_make_element(ladder->tiles ? "tilecompositor" : "compositor", "compositor");
+    if (!ladder->compositor) {
+        return -1;
+    }
+    if (!ladder->tiles) {
+        g_object_set(ladder->compositor, "background", 1, NULL);
+    }
+    gst_bin_add(GST_BIN(pipeline), ladder->compositor);
+
+    // Окно не обязано обновляться с частотой самой быстрой ветки: компоновщик
+    // выдаёт кадры с частотой, которую разрешает caps после него
+    if (config->preview_fps > 0) {
+        GstCaps *caps = gst_caps_new_simple("video/x-raw", "framerate", GST_TYPE_FRACTION, config->preview_fps, 1, NULL);
+        ladder->preview_caps = startup_make_element("capsfilter", "preview_caps");
+        if (!ladder->preview_caps) {
+            gst_caps_unref(caps);
+            return -1;
+        }
+        g_object_set(ladder->preview_caps, "caps", caps, NULL);
+        gst_caps_unref(caps);
+        gst_bin_add(GST_BIN(pipeline), ladder->preview_caps);
+    }
+    return 0;
+}
+
+// Отчёт tilecompositor: сколько плиток скопировано и сколько оставлено без нового кадра
+void print_preview_report(Ladder *ladder) {
+    guint64 copied = 0, skipped = 0, redraws = 0;
+
+    if (!ladder->tiles) {
+        return;
+    }
+    g_object_get(ladder->compositor, "pads-copied", &copied, "pads-skipped", &skipped, "redraws", &redraws, NULL);
+    g_print("Tile compositor: %" G_GUINT64_FORMAT " frames, %" G_GUINT64_FORMAT " tiles copied, %" G_GUINT64_FORMAT
+            " unchanged tiles skipped (%.0f%%), %" G_GUINT64_FORMAT " full redraws\n",
+            ladder->output_stats.frames, copied, skipped,
+            copied + skipped > 0 ? 100.0 * skipped / (copied + skipped) : 0.0, redraws);
+}
+
+// Процессорное время процесса в секундах
+double process_cpu_seconds(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+// Имя уровня деградации для журнала и отчёта
+const char* degrade_level_name(int level) {
+    switch (level) {
+        case DEGRADE_CHEAP_SCALE:
+            return "cheap-scale";
+        case DEGRADE_HALF_RATE:
+            return "half-rate";
+        case DEGRADE_ONE_FPS:
+            return "one-fps";
+        default:
+            return "normal";
+    }
+}
+
+// Есть ли ветке что удешевить: у ветки узла без videoscale масштабирования нет, а bilinear
+// у fastscaleconvert и nearest у videoscale - уже самые дешёвые методы
+gboolean cheap_scale_helps(Branch *branch) {
+    if (branch->videoscale == NULL) {
+        return FALSE;
+    }
+    return branch->fused ? branch->scale_method != FAST_SCALE_BILINEAR : branch->scale_method != 0;
+}
+
+// Наибольший уровень ветки: от ветки с tee питаются другие, поэтому частоту ей не снижаем
+int max_degrade_level(Branch *branch) {
+    if (branch->tee != NULL) {
+        return cheap_scale_helps(branch) ? DEGRADE_CHEAP_SCALE : DEGRADE_NONE;
+    }
+    return DEGRADE_ONE_FPS;
+}
+
+// Приводит элементы ветки к её уровню деградации; вызывается из потока контроллера
+void apply_degrade_level(Ladder *ladder, Branch *branch) {
+    int level = g_atomic_int_get(&branch->degrade_level);
+    int divisor = 1;
+
+    // Дешёвое масштабирование: nearest у videoscale, bilinear вместо box у fastscaleconvert
+    if (branch->videoscale != NULL) {
+        if (level >= DEGRADE_CHEAP_SCALE) {
+            g_object_set(branch->videoscale, "method", branch->fused ? FAST_SCALE_BILINEAR : 0, NULL);
+        } else {
+            g_object_set(branch->videoscale, "method", branch->scale_method, NULL);
+        }
+    }
+    if (level == DEGRADE_HALF_RATE) {
+        divisor = 2;
+    } else if (level == DEGRADE_ONE_FPS) {
+        // Один кадр в секунду, чтобы компоновщик и кодировщик не остались без входа
+        divisor = MAX(1, branch->format.framerate);
+    }
+    g_atomic_int_set(&branch->rate_divisor, divisor);
+}
+
+static guint64 total_qos(Ladder *ladder) {
+    guint64 total = 0;
+    for (int i = 0; i < ladder->branch_count; i++) {
+        if (ladder_branch(ladder, i)->active) {
+            total += ladder_branch(ladder, i)->qos_events + ladder_branch(ladder, i)->qos_messages;
+        }
+    }
+    return total;
+}
+
+// Порядок деградации: сначала меньший qos_priority, при равных - ветка с большим числом пикселей в секунду
+static gboolean degrade_before(Branch *a, Branch *b) {
+    if (a->qos_priority != b->qos_priority) {
+        return a->qos_priority < b->qos_priority;
+    }
+    return (guint64)a->format.width * a->format.height * a->format.framerate >
+           (guint64)b->format.width * b->format.height * b->format.framerate;
+}
+
+// Шаг деградации: самая неважная ветка, которую ещё можно ухудшить. -1, если таких нет
+int pick_branch_to_degrade(Ladder *ladder) {
+    int pick = -1;
+    for (int i = 0; i < ladder->branch_count; i++) {
+        Branch *branch = ladder_branch(ladder, i);
+        if (branch->active && branch->degrade_level < max_degrade_level(branch) &&
+            (pick < 0 || degrade_before(branch, ladder_branch(ladder, pick)))) {
+            pick = i;
+        }
+    }
+    return pick;
+}
+
+// Восстанавливаем в обратном порядке: сначала самую важную из ухудшенных
+int pick_branch_to_restore(Ladder *ladder) {
+    int pick = -1;
+    for (int i = 0; i < ladder->branch_count; i++) {
+        Branch *branch = ladder_branch(ladder, i);
+        if (branch->active && branch->degrade_level > 0 && (pick < 0 || degrade_before(ladder_branch(ladder, pick), branch))) {
+            pick = i;
+        }
+    }
+    return pick;
+}
+
+static void change_degrade_level(Ladder *ladder, int i, int step, const char *reason) {
+    Branch *branch = ladder_branch(ladder, i);
+    int from = branch->degrade_level;
+    int to = from + step;
+
+    // Уровень, который ничего не меняет, проходим сразу: иначе шаг контроллера ушёл бы впустую
+    if (to == DEGRADE_CHEAP_SCALE && !cheap_scale_helps(branch)) {
+        to += step;
+    }
+    g_atomic_int_set(&branch->degrade_level, to);
+    apply_degrade_level(ladder, branch);
+    ladder->adaptive.changes++;
+    g_print("Adaptive: branch %d %dx%d@%d %s -> %s (%s)\n", i, branch->format.width, branch->format.height,
+            branch->format.framerate, degrade_level_name(from), degrade_level_name(to), reason);
+}
+
+// Поток контроллера: раз в interval_ms оценивает нагрузку. Давление - CPU выше cpu_high,
+// очередь заполнена выше queue_high или пришли новые QoS; запас - всё ниже нижних порогов.
+// Между порогами счётчики сбрасываются, поэтому уровни не дёргаются туда-обратно
+static gpointer adaptive_thread(gpointer data) {
+    Ladder *ladder = data;
+    AdaptiveController *adaptive = &ladder->adaptive;
+    double cores = MAX(1, (int)g_get_num_processors());
+    double last_cpu = process_cpu_seconds();
+    gint64 last_time = g_get_monotonic_time();
+    guint64 last_qos = total_qos(ladder);
+    int pressure_ticks = 0, headroom_ticks = 0;
+
+    while (g_atomic_int_get(&adaptive->running)) {
+        g_usleep(adaptive->interval_ms * 1000);
+
+        gint64 now = g_get_monotonic_time();
+        double cpu = process_cpu_seconds();
+        double fill = 0.0;
+        char reason[128];
+
+        g_mutex_lock(&ladder->topology_lock);
+        guint64 qos = total_qos(ladder);
+        for (int i = 0; i < ladder->branch_count; i++) {
+            guint level, limit;
+            if (!ladder_branch(ladder, i)->active) {
+                continue;
+            }
+            g_object_get(ladder_branch(ladder, i)->queue, "current-level-buffers", &level, "max-size-buffers", &limit, NULL);
+            if (limit > 0) {
+                fill = MAX(fill, 100.0 * level / limit);
+            }
+        }
+        adaptive->cpu_percent = now > last_time ? 100.0 * (cpu - last_cpu) / ((now - last_time) / 1e6) / cores : 0.0;
+        adaptive->queue_fill = fill;
+        // Счётчики удалённой ветки пропадают из суммы вместе с ней
+        guint64 new_qos = qos > last_qos ? qos - last_qos : 0;
+        last_cpu = cpu;
+        last_time = now;
+        last_qos = qos;
+
+        if (adaptive->cpu_percent > adaptive->cpu_high || fill >= adaptive->queue_high || new_qos > 0) {
+            pressure_ticks++;
+            headroom_ticks = 0;
+        } else if (adaptive->cpu_percent < adaptive->cpu_low && fill <= adaptive->queue_low) {
+            headroom_ticks++;
+            pressure_ticks = 0;
+        } else {
+            pressure_ticks = 0;
+            headroom_ticks = 0;
+        }
+
+        snprintf(reason, sizeof(reason), "cpu %.0f%%, queue %.0f%%, %" G_GUINT64_FORMAT " QoS",
+                 adaptive->cpu_percent, fill, new_qos);
+        if (pressure_ticks >= adaptive->degrade_ticks) {
+            int i = pick_branch_to_degrade(ladder);
+            if (i >= 0) {
+                change_degrade_level(ladder, i, 1, reason);
+            }
+            pressure_ticks = 0;
+        } else if (headroom_ticks >= adaptive->restore_ticks) {
+            int i = pick_branch_to_restore(ladder);
+            if (i >= 0) {
+                change_degrade_level(ladder, i, -1, reason);
+            }
+            headroom_ticks = 0;
+        }
+        g_mutex_unlock(&ladder->topology_lock);
+    }
+    return NULL;
+}
+
+void adaptive_start(Ladder *ladder) {
+    g_atomic_int_set(&ladder->adaptive.running, 1);
+    ladder->adaptive.thread = g_thread_new("adaptive", adaptive_thread, ladder);
+}
+
+void adaptive_stop(Ladder *ladder) {
+    if (ladder->adaptive.thread == NULL) {
+        return;
+    }
+    g_atomic_int_set(&ladder->adaptive.running, 0);
+    g_thread_join(ladder->adaptive.thread);
+    ladder->adaptive.thread = NULL;
+}
+
+// Отчёт контроллера: сколько было изменений и где ветки остались
+void print_adaptive_report(Ladder *ladder) {
+    if (!ladder->adaptive.enabled) {
+        return;
+    }
+    g_print("Adaptive degradation report: %" G_GUINT64_FORMAT " changes\n", ladder->adaptive.changes);
+    for (int i = 0; i < ladder->branch_count; i++) {
+        Branch *branch = ladder_branch(ladder, i);
+        if (!branch->active) {
+            continue;
+        }
+        g_print("  branch %d %dx%d@%d qos_priority %d: %s, %" G_GUINT64_FORMAT " frames skipped, %" G_GUINT64_FORMAT " QoS\n",
+                i, branch->format.width, branch->format.height, branch->format.framerate, branch->qos_priority,
+                degrade_level_name(branch->degrade_level), branch->degraded_drops,
+                branch->qos_events + branch->qos_messages);
+    }
+}
+
+// Все элементы ветки без записи: перезагрузка работает только с ними
+#define MAX_BRANCH_ELEMENTS 12
+static int branch_elements(Branch *branch, GstElement *elements[]) {
+    GstElement *all[MAX_BRANCH_ELEMENTS] = {branch->queue, branch->videorate, branch->videoscale, branch->capsfilter,
+                                            branch->convert, branch->outcaps, branch->result_tee, branch->inter_sink,
+                                            branch->inter_src, branch->inter_caps, branch->export_queue, branch->export_sink};
+    int count = 0;
+
+    for (int i = 0; i < MAX_BRANCH_ELEMENTS; i++) {
+        if (all[i] != NULL) {
+            elements[count++] = all[i];
+        }
+    }
+    return count;
+}
+
+// Останавливает и убирает элементы ветки, освобождает её вход компоновщика и слот
+static void discard_branch(Ladder *ladder, Branch *branch) {
+    GstElement *elements[MAX_BRANCH_ELEMENTS];
+    int count = branch_elements(branch, elements);
+
+    for (int k = 0; k < count; k++) {
+        gst_element_set_state(elements[k], GST_STATE_NULL);
+        if (GST_OBJECT_PARENT(elements[k]) != NULL) {
+            gst_bin_remove(GST_BIN(pipeline), elements[k]);
+        } else {
+            gst_object_unref(gst_object_ref_sink(elements[k]));
+        }
+    }
+    if (branch->compositor_pad != NULL) {
+        gst_element_release_request_pad(ladder->compositor, branch->compositor_pad);
+        gst_object_unref(branch->compositor_pad);
+    }
+    close_exporter(branch);
+    latency_recorder_clear(&branch->latency);
+    memset(branch, 0, sizeof(*branch));
+}
+
+typedef struct {
+    ConfigReload *reload;
+    Branch *branch;
+} DrainProbe;
+
+// IDLE на выходе tee: между двумя буферами отключаем очередь удаляемой ветки
+// и отправляем в неё EOS, чтобы она выдала то, что уже держит
+static GstPadProbeReturn unlink_branch_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    GstPad *queue_pad = user_data;
+
+    gst_pad_unlink(pad, queue_pad);
+    gst_pad_send_event(queue_pad, gst_event_new_eos());
+    return GST_PAD_PROBE_REMOVE;
+}
+
+// EOS дошёл до выхода удаляемой ветки: ветка пуста. Дальше EOS не пускаем,
+// компоновщик и остальные ветки продолжают работать
+static GstPadProbeReturn drain_eos_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    DrainProbe *probe = user_data;
+
+    if (GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(info)) != GST_EVENT_EOS) {
+        return GST_PAD_PROBE_OK;
+    }
+    g_mutex_lock(&probe->reload->drain_lock);
+    probe->branch->drained = TRUE;
+    g_cond_broadcast(&probe->reload->drained);
+    g_mutex_unlock(&probe->reload->drain_lock);
+    return GST_PAD_PROBE_DROP;
+}
+
+// Удаляемая ветка между отключением от tee и освобождением
+typedef struct {
+    int slot;
+    GstPad *tee_pad;   // выход tee, отданный ветке, NULL - ветка не была подключена
+    GstPad *queue_pad;
+} RetiringBranch;
+
+// Отключает ветку от tee и пускает в неё EOS. Ничего не ждёт, поэтому вызывается под topology_lock:
+// ветка сразу перестаёт действовать, а слот остаётся занят, пока release_branch её не освободит
+static void detach_branch(Ladder *ladder, int i, RetiringBranch *retiring) {
+    Branch *branch = ladder_branch(ladder, i);
+    // У tee выходы запрашиваемые, поэтому EOS ловится до result_tee
+    GstPad *result_pad = gst_element_get_static_pad(branch_output(branch), "src");
+    DrainProbe *probe = g_new(DrainProbe, 1);
+
+    retiring->slot = i;
+    retiring->queue_pad = gst_element_get_static_pad(branch->queue, "sink");
+    retiring->tee_pad = gst_pad_get_peer(retiring->queue_pad);
+    probe->reload = &ladder->reload;
+    probe->branch = branch;
+    branch->drained = FALSE;
+    branch->active = FALSE;
+    branch->retiring = TRUE;
+    // Раскладка превью уже без неё, а вход компоновщика освобождается только в release_branch
+    if (branch->compositor_pad != NULL) {
+        g_object_set(branch->compositor_pad, "alpha", 0.0, NULL);
+    }
+    gst_pad_add_probe(result_pad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, drain_eos_probe, probe, g_free);
+    gst_object_unref(result_pad);
+    if (retiring->tee_pad != NULL) {
+        gst_pad_add_probe(retiring->tee_pad, GST_PAD_PROBE_TYPE_IDLE, unlink_branch_probe,
+                          gst_object_ref(retiring->queue_pad), gst_object_unref);
+    }
+}
+
+// Ждёт, пока отключённая ветка опустеет, но не дольше deadline, и освобождает её.
+// Вызывается без topology_lock: ветка уже не действующая, и метрики с контроллером её пропускают
+static void release_branch(Ladder *ladder, RetiringBranch *retiring, gint64 deadline) {
+    ConfigReload *reload = &ladder->reload;
+    Branch *branch = ladder_branch(ladder, retiring->slot);
+    gboolean drained;
+
+    // Ветка, которая стоит (например, заблокированный компоновщик), не должна держать перезагрузку
+    g_mutex_lock(&reload->drain_lock);
+    while (!branch->drained && g_cond_wait_until(&reload->drained, &reload->drain_lock, deadline)) {
+    }
+    drained = branch->drained;
+    g_mutex_unlock(&reload->drain_lock);
+    if (!drained) {
+        g_printerr("Reload: branch %d did not drain within a second, releasing it anyway.\n", retiring->slot);
+    }
+
+    if (retiring->tee_pad != NULL) {
+        gst_element_release_request_pad(branch_upstream(ladder, branch), retiring->tee_pad);
+        gst_object_unref(retiring->tee_pad);
+    }
+    gst_object_unref(retiring->queue_pad);
+    discard_branch(ladder, branch);
+}
+
+// Новые caps получают только capsfilter и intercaps ветки, videoscale и videorate
+// перенастраиваются по ним сами
+static void apply_branch_caps(Ladder *ladder, Branch *branch) {
+    GstCaps *caps = branch_scale_caps(ladder, branch);
+
+    g_object_set(branch->capsfilter, "caps", caps, NULL);
+    gst_caps_unref(caps);
+    if (branch->inter_caps != NULL) {
+        caps = branch_inter_caps(branch);
+        g_object_set(branch->inter_caps, "caps", caps, NULL);
+        gst_caps_unref(caps);
+    }
+}
+
+// После смены размера источника при resize_policy=fit ветка получает наибольший чётный размер
+// с его пропорциями, вписанный в её размер из конфигурации. До первой смены размер из конфигурации
+static void fit_branch_size(Ladder *ladder, Branch *branch) {
+    const Capture *capture = &ladder->captures[branch->format.region];
+    int width = branch->configured.width, height = branch->configured.height;
+
+    if (ladder->resize_policy != RESIZE_FIT || capture->resizes == 0) {
+        return;
+    }
+    if ((gint64)capture->negotiated_width * height > (gint64)capture->negotiated_height * width) {
+        height = (int)((gint64)width * capture->negotiated_height / capture->negotiated_width);
+    } else {
+        width = (int)((gint64)height * capture->negotiated_width / capture->negotiated_height);
+    }
+    branch->format.width = MAX(2, width & ~1);
+    branch->format.height = MAX(2, height & ~1);
+}
+
+// Меняет размер и частоту ветки на ходу
+static void resize_branch(Ladder *ladder, int i, const VideoFormat *format) {
+    Branch *branch = ladder_branch(ladder, i);
+
+    branch->format = *format;
+    branch->configured = *format;
+    branch->qos_priority = format->qos_priority;
+    fit_branch_size(ladder, branch);
+    apply_branch_caps(ladder, branch);
+    if (ladder->adaptive.enabled) {
+        // Пропуск кадров на уровне one-fps зависит от частоты ветки
+        apply_degrade_level(ladder, branch);
+    }
+}
+
+// Источник r сменил размер. Ветки вписываются в новые пропорции (resize_policy=fit), и новые caps
+// получают только те, чей размер стал другим: у остальных кодировщик и запись идут как шли.
+// Вызывается из главного цикла: новые caps уже прошли tee, и до этого videoscale веток
+// выдавал кадры прежнего размера
+static void renegotiate_capture(Ladder *ladder, int r, int width, int height) {
+    Capture *capture = &ladder->captures[r];
+    gboolean *changed;
+    int old_width = capture->negotiated_width, old_height = capture->negotiated_height;
+    int rescaled = 0, kept = 0;
+    gint64 from;
+    char label[80];
+
+    // Перезапуск источника мог вернуть тот же размер
+    if (width == old_width && height == old_height) {
+        capture->restart_us = 0;
+        return;
+    }
+    capture->negotiated_width = width;
+    capture->negotiated_height = height;
+    if (old_width == 0) {
+        return;
+    }
+    from = capture->restart_us != 0 ? capture->restart_us : g_get_monotonic_time();
+
+    g_mutex_lock(&ladder->topology_lock);
+    changed = g_new0(gboolean, ladder->branch_count);
+    capture->geometry.width = width;
+    capture->geometry.height = height;
+    capture->geometry_known = TRUE;
+    capture->resizes++;
+    capture->restart_us = 0;
+    for (int i = 0; i < ladder->branch_count; i++) {
+        Branch *branch = ladder_branch(ladder, i);
+        int branch_width = branch->format.width, branch_height = branch->format.height;
+
+        if (!branch->active || branch->format.region != r) {
+            continue;
+        }
+        branch->renegotiations++;
+        fit_branch_size(ladder, branch);
+        if (branch->format.width == branch_width && branch->format.height == branch_height) {
+            kept++;
+            continue;
+        }
+        // Кодировщик перенастраивается по новым caps сам, а mp4 и matroska не меняют размер
+        // посреди файла: запись начинает новый сегмент
+        if (branch->splitmux != NULL) {
+            g_signal_emit_by_name(branch->splitmux, "split-now");
+        }
+        apply_branch_caps(ladder, branch);
+        changed[i] = TRUE;
+        rescaled++;
+    }
+    // Ветка, чья питающая ветка сохранила размер, новых caps не увидит - её пауза не измеряется
+    for (int i = 0; i < ladder->branch_count; i++) {
+        Branch *branch = ladder_branch(ladder, i);
+        if (branch->active && branch->format.region == r) {
+            gboolean sees_caps = branch->parent < 0 || changed[branch->parent];
+            branch->resize_from_us = sees_caps ? from : 0;
+            g_atomic_int_set(&branch->resize_caps_seen, sees_caps);
+        }
+    }
+    g_free(changed);
+    // Кадры источника, очередей и записи теперь другого размера: record_buffers и бюджет очередей считаются заново
+    replan_queues(ladder, "Resize");
+    if (rescaled > 0 && ladder->compositor != NULL) {
+        layout_preview(ladder);
+    }
+    g_mutex_unlock(&ladder->topology_lock);
+
+    capture_label(ladder, r, label, sizeof(label));
+    g_print("%s resized %dx%d -> %dx%d: %d branches rescaled, %d keep their output caps\n",
+            label, old_width, old_height, width, height, rescaled, kept);
+}
+
+// Пока источник не перезапущен, XShmGetImage прежнего размера получает BadMatch от уменьшившегося
+// экрана. Обработчик Xlib по умолчанию завершил бы процесс, а так пропадает несколько кадров
+static int count_x_error(Display *display, XErrorEvent *event) {
+    g_atomic_int_inc(&x_errors);
+    return 0;
+}
+
+// Перезапускает источники, чей экран или окно сменили размер с последних caps - они пришлют
+// новые caps, и renegotiate_pending перестроит ветки. Прямоугольник экрана свой размер не меняет
+static gboolean restart_resized_captures(gpointer user_data) {
+    Ladder *ladder = user_data;
+
+    ladder->resize_timer = 0;
+    for (int r = 0; r < ladder->capture_count; r++) {
+        Capture *capture = &ladder->captures[r];
+        char label[80];
+
+        if (capture->failed || capture->negotiated_width == 0 || capture->restart_us != 0 ||
+            capture->watched_width == 0 ||
+            (capture->watched_width == capture->negotiated_width &&
+             capture->watched_height == capture->negotiated_height) ||
+            (capture->watched_width == capture->restarted_width &&
+             capture->watched_height == capture->restarted_height)) {
+            continue;
+        }
+        capture_label(ladder, r, label, sizeof(label));
+        g_print("%s is now %dx%d, restarting it at the new size.\n", label, capture->watched_width,
+                capture->watched_height);
+        capture->restart_us = g_get_monotonic_time();
+        capture->restarted_width = capture->watched_width;
+        capture->restarted_height = capture->watched_height;
+        gst_element_set_state(capture->source, GST_STATE_NULL);
+        if (!gst_element_sync_state_with_parent(capture->source)) {
+            g_printerr("Failed to restart %s.\n", label);
+            stop_failed_capture(ladder, r, FALSE);
+        }
+    }
+    return G_SOURCE_REMOVE;
+}
+
+// xrandr и перетаскивание окна присылают несколько ConfigureNotify подряд: источник
+// перезапускается один раз, когда размер не меняется resize_check_ms
+static void schedule_capture_restart(Ladder *ladder) {
+    if (ladder->resize_timer != 0) {
+        g_source_remove(ladder->resize_timer);
+    }
+    ladder->resize_timer = g_timeout_add(ladder->resize_check_ms, restart_resized_captures, ladder);
+}
+
+// Соединения источников с X можно читать: разбираем все накопившиеся события
+static gboolean capture_size_events(gint fd, GIOCondition condition, gpointer user_data) {
+    Ladder *ladder = user_data;
+    gboolean resized = FALSE;
+
+    for (int r = 0; r < ladder->capture_count; r++) {
+        Capture *capture = &ladder->captures[r];
+
+        if (capture->watch_display == NULL) {
+            continue;
+        }
+        while (XPending(capture->watch_display) > 0) {
+            XEvent event;
+            XNextEvent(capture->watch_display, &event);
+            if (event.type == ConfigureNotify && event.xconfigure.window == capture->watch_window &&
+                (event.xconfigure.width != capture->watched_width ||
+                 event.xconfigure.height != capture->watched_height)) {
+                capture->watched_width = event.xconfigure.width;
+                capture->watched_height = event.xconfigure.height;
+                resized = TRUE;
+            }
+        }
+    }
+    if (resized) {
+        schedule_capture_restart(ladder);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+// ximagesrc читает размер экрана только при запуске и xrandr не замечает. Каждый источник экрана
+// или окна держит своё соединение с X и получает ConfigureNotify корневого окна (его шлёт и xrandr)
+// или своего окна. Соединение читает только главный цикл, потоки ximagesrc его не трогают
+static void watch_capture_sizes(Ladder *ladder) {
+    for (int r = 0; r < ladder->capture_count; r++) {
+        Capture *capture = &ladder->captures[r];
+        char name[32];
+        XWindowAttributes attributes;
+
+        if (capture->has_region && capture->region.window == 0) {
+            continue;
+        }
+        snprintf(name, sizeof(name), ":%d", capture->display);
+        capture->watch_display = open_own_display(name);
+        if (capture->watch_display == NULL) {
+            continue;
+        }
+        capture->watch_window = capture->has_region ? capture->region.window
+                                                    : RootWindow(capture->watch_display,
+                                                                 DefaultScreen(capture->watch_display));
+        // Ошибку исчезнувшего окна учтёт count_x_error, размер тогда останется неизвестным
+        XSelectInput(capture->watch_display, capture->watch_window, StructureNotifyMask);
+        if (XGetWindowAttributes(capture->watch_display, capture->watch_window, &attributes) != 0) {
+            capture->watched_width = attributes.width;
+            capture->watched_height = attributes.height;
+        }
+        XSync(capture->watch_display, False);
+        capture->watch_source = g_unix_fd_add(ConnectionNumber(capture->watch_display), G_IO_IN,
+                                              capture_size_events, ladder);
+    }
+}
+
+static void stop_capture_watch(Capture *capture) {
+    if (capture->watch_display != NULL) {
+        g_source_remove(capture->watch_source);
+        close_own_display(capture->watch_display);
+        capture->watch_display = NULL;
+    }
+}
+
+static void stop_size_watch(Ladder *ladder) {
+    if (ladder->resize_timer != 0) {
+        g_source_remove(ladder->resize_timer);
+        ladder->resize_timer = 0;
+    }
+    for (int r = 0; r < ladder->capture_count; r++) {
+        stop_capture_watch(&ladder->captures[r]);
+    }
+}
+
+// Сервер X дисплея ушёл (см. report_lost_display): источники этого дисплея отцепляются,
+// их ветки закрываются EOS, остальные дисплеи работают дальше
+static gboolean stop_lost_displays(gpointer user_data) {
+    Ladder *ladder = user_data;
+    GArray *lost;
+
+    g_mutex_lock(&x_connections.lock);
+    lost = x_connections.lost;
+    x_connections.lost = g_array_new(FALSE, FALSE, sizeof(int));
+    g_mutex_unlock(&x_connections.lock);
+    for (guint i = 0; i < lost->len; i++) {
+        for (int r = 0; r < ladder->capture_count; r++) {
+            Capture *capture = &ladder->captures[r];
+            char label[80];
+
+            if (capture->display != g_array_index(lost, int, i)) {
+                continue;
+            }
+            stop_capture_watch(capture);
+            if (capture->failed) {
+                continue;
+            }
+            capture_label(ladder, r, label, sizeof(label));
+            g_printerr("X display :%d is gone, stopping %s%s.\n", capture->display, label,
+                       ladder->capture_count > 1 ? ", the other capture sources keep running" : "");
+            stop_failed_capture(ladder, r, TRUE);
+        }
+    }
+    g_array_free(lost, TRUE);
+    return G_SOURCE_REMOVE;
+}
+
+// Разбирает в главном цикле размеры, которые source_caps_probe запомнил с прошлого раза
+static gboolean renegotiate_pending(gpointer user_data) {
+    Ladder *ladder = user_data;
+
+    for (int r = 0; r < ladder->capture_count; r++) {
+        Capture *capture = &ladder->captures[r];
+        int width, height;
+
+        g_mutex_lock(&ladder->resize_lock);
+        width = capture->pending_width;
+        height = capture->pending_height;
+        capture->pending_width = 0;
+        capture->pending_height = 0;
+        g_mutex_unlock(&ladder->resize_lock);
+        if (width != 0) {
+            renegotiate_capture(ladder, r, width, height);
+        }
+        // Пока источник перезапускался, экран мог смениться ещё раз
+        if (capture->watched_width != 0 && capture->restart_us == 0 && ladder->resize_timer == 0 &&
+            (capture->watched_width != capture->restarted_width ||
+             capture->watched_height != capture->restarted_height) &&
+            (capture->watched_width != capture->negotiated_width ||
+             capture->watched_height != capture->negotiated_height)) {
+            schedule_capture_restart(ladder);
+        }
+    }
+    g_mutex_lock(&ladder->resize_lock);
+    ladder->renegotiate_idle = 0;
+    g_mutex_unlock(&ladder->resize_lock);
+    return G_SOURCE_REMOVE;
+}
+
+// Caps на входе tee источника. Поток источника только запоминает размер и пропускает caps дальше:
+// ветки, запись и компоновщик перестраивает главный цикл (renegotiate_pending)
+static GstPadProbeReturn source_caps_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    Ladder *ladder = user_data;
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+    GstVideoInfo video_info;
+    GstCaps *caps;
+
+    if (GST_EVENT_TYPE(event) != GST_EVENT_CAPS) {
+        return GST_PAD_PROBE_OK;
+    }
+    gst_event_parse_caps(event, &caps);
+    if (!gst_video_info_from_caps(&video_info, caps)) {
+        return GST_PAD_PROBE_OK;
+    }
+    for (int r = 0; r < ladder->capture_count; r++) {
+        if (GST_OBJECT_PARENT(pad) == GST_OBJECT(ladder->captures[r].tee)) {
+            g_mutex_lock(&ladder->resize_lock);
+            ladder->captures[r].pending_width = GST_VIDEO_INFO_WIDTH(&video_info);
+            ladder->captures[r].pending_height = GST_VIDEO_INFO_HEIGHT(&video_info);
+            if (ladder->renegotiate_idle == 0) {
+                ladder->renegotiate_idle = g_idle_add(renegotiate_pending, ladder);
+            }
+            g_mutex_unlock(&ladder->resize_lock);
+            break;
+        }
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+// Собирает новую ветку в слоте i и запускает её. С tee она ещё не связана
+static int build_branch(Ladder *ladder, int i) {
+    Branch *branch = ladder_branch(ladder, i);
+    GstElement *elements[MAX_BRANCH_ELEMENTS];
+
+    if (create_branch(ladder, i) != 0 || link_branch_chain(ladder, i) != 0 ||
+        (ladder->compositor != NULL && link_branch_preview(ladder, i) != 0)) {
+        return -1;
+    }
+    GstPad *queue_pad = gst_element_get_static_pad(branch->queue, "sink");
+    gst_pad_add_probe(queue_pad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, queue_caps_probe, ladder, NULL);
+    gst_object_unref(queue_pad);
+
+    int count = branch_elements(branch, elements);
+    for (int k = 0; k < count; k++) {
+        if (!gst_element_sync_state_with_parent(elements[k])) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// parse_video_format обнуляет структуру перед разбором, поэтому форматы можно сравнивать побайтно
+static gboolean same_video_format(const VideoFormat *a, const VideoFormat *b) {
+    return memcmp(a, b, sizeof(VideoFormat)) == 0;
+}
+
+// Ветку можно перенастроить на месте, если изменились только размер, частота и qos_priority
+static gboolean resizable_video_format(const VideoFormat *from, const VideoFormat *to) {
+    VideoFormat a = *from, b = *to;
+
+    a.width = b.width = 0;
+    a.height = b.height = 0;
+    a.framerate = b.framerate = 0;
+    a.qos_priority = b.qos_priority = 0;
+    return same_video_format(&a, &b);
+}
+
+// Отличаются ли настройки, кроме списка веток. Обе конфигурации разобраны в обнулённые структуры
+static gboolean same_settings(const Config *a, const Config *b) {
+    Config x = *a, y = *b;
+
+    x.video_formats = y.video_formats = NULL;
+    return memcmp(&x, &y, sizeof(Config)) == 0;
+}
+
+// Сравнивает ветки с новым списком video_format и меняет только разницу.
+// Совпавшие ветки не трогаются; оставшиеся пары с тем же форматом пикселей, изоляцией
+// и размещением меняют размер на месте; остальное удаляется и добавляется заново
+static void apply_reload(Ladder *ladder, const Config *config) {
+    ConfigReload *reload = &ladder->reload;
+    int slots = ladder->branch_count, formats = config->video_formats->len;
+    gboolean *kept = g_new0(gboolean, slots), *placed = g_new0(gboolean, formats), *resize = g_new0(gboolean, slots);
+    int *old_left = g_new(int, slots), *new_left = g_new(int, formats), *added = g_new(int, formats);
+    int old_count = 0, new_count = 0, add_count = 0, removed = 0, resized = 0, untouched = 0, failed = 0;
+    gint64 start = g_get_monotonic_time();
+    GArray *retiring = g_array_new(FALSE, FALSE, sizeof(RetiringBranch));
+
+    for (int f = 0; f < formats; f++) {
+        for (int i = 0; i < slots; i++) {
+            if (ladder_branch(ladder, i)->active && !kept[i] &&
+                same_video_format(&ladder_branch(ladder, i)->configured, &g_array_index(config->video_formats, VideoFormat, f))) {
+                kept[i] = placed[f] = TRUE;
+                untouched++;
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < slots; i++) {
+        if (ladder_branch(ladder, i)->active && !kept[i]) {
+            old_left[old_count++] = i;
+        }
+    }
+    for (int f = 0; f < formats; f++) {
+        if (!placed[f]) {
+            new_left[new_count++] = f;
+        }
+    }
+    g_free(kept);
+    g_free(placed);
+    if (old_count == 0 && new_count == 0) {
+        g_free(resize);
+        g_free(old_left);
+        g_free(new_left);
+        g_free(added);
+        g_array_free(retiring, TRUE);
+        return;
+    }
+
+    // Под замком только отключение и публикация нового набора: удаляемые ветки опустошаются
+    // и освобождаются после него, чтобы метрики, контроллер и пробники источников не ждали их EOS
+    g_mutex_lock(&ladder->topology_lock);
+    for (int k = 0; k < old_count; k++) {
+        resize[k] = k < new_count && resizable_video_format(&ladder_branch(ladder, old_left[k])->configured,
+                                                            &g_array_index(config->video_formats, VideoFormat, new_left[k]));
+        if (!resize[k]) {
+            RetiringBranch branch;
+            detach_branch(ladder, old_left[k], &branch);
+            g_array_append_val(retiring, branch);
+            removed++;
+        }
+    }
+    for (int k = 0; k < new_count; k++) {
+        const VideoFormat *format = &g_array_index(config->video_formats, VideoFormat, new_left[k]);
+
+        if (k < old_count && resize[k]) {
+            resize_branch(ladder, old_left[k], format);
+            resized++;
+            continue;
+        }
+        if (format->stream_port > 0) {
+            g_printerr("Reload: branch %dx%d@%d has stream=, streams need a restart.\n",
+                       format->width, format->height, format->framerate);
+            failed++;
+            continue;
+        }
+        int i = 0;
+        while (i < (int)ladder->branches->len && (ladder_branch(ladder, i)->active || ladder_branch(ladder, i)->retiring)) {
+            i++;
+        }
+        if (i == (int)ladder->branches->len) {
+            g_mutex_lock(&ladder->table_lock);
+            g_ptr_array_add(ladder->branches, g_new0(Branch, 1));
+            g_mutex_unlock(&ladder->table_lock);
+        }
+        ladder->branch_count = MAX(ladder->branch_count, i + 1);
+        setup_branch(ladder_branch(ladder, i), config, format, -1);
+        fit_branch_size(ladder, ladder_branch(ladder, i));
+        if (build_branch(ladder, i) != 0) {
+            g_printerr("Reload: failed to create branch %dx%d@%d.\n", format->width, format->height, format->framerate);
+            discard_branch(ladder, ladder_branch(ladder, i));
+            failed++;
+            continue;
+        }
+        if (!ladder->preview && format->export_name[0] == '\0') {
+            g_printerr("Reload: branch %dx%d@%d has no output without preview, give it export=.\n",
+                       format->width, format->height, format->framerate);
+            discard_branch(ladder, ladder_branch(ladder, i));
+            failed++;
+            continue;
+        }
+        if (ladder->tiles && strcmp(branch_output_format(ladder, ladder_branch(ladder, i)), "I420") != 0) {
+            g_printerr("Reload: tilecompositor takes only I420, branch %dx%d@%d not added.\n",
+                       format->width, format->height, format->framerate);
+            discard_branch(ladder, ladder_branch(ladder, i));
+            failed++;
+            continue;
+        }
+        added[add_count++] = i;
+    }
+
+    // Пределы очередей пересчитываются по новому набору веток до того, как новые ветки получат кадры
+    replan_queues(ladder, "Reload");
+    for (int k = 0; k < add_count; k++) {
+        if (link_branch_input(ladder, added[k]) != 0) {
+            g_printerr("Reload: failed to link branch %d.\n", added[k]);
+            discard_branch(ladder, ladder_branch(ladder, added[k]));
+            failed++;
+        }
+    }
+    int add_ok = new_count - resized - failed;
+    if (ladder->compositor != NULL) {
+        layout_preview(ladder);
+    }
+    reload->last_ms = (g_get_monotonic_time() - start) / 1000.0;
+    reload->max_ms = MAX(reload->max_ms, reload->last_ms);
+    reload->applied++;
+    g_mutex_unlock(&ladder->topology_lock);
+
+    gint64 deadline = g_get_monotonic_time() + G_TIME_SPAN_SECOND;
+    for (guint k = 0; k < retiring->len; k++) {
+        release_branch(ladder, &g_array_index(retiring, RetiringBranch, k), deadline);
+    }
+    g_array_free(retiring, TRUE);
+    g_free(resize);
+    g_free(old_left);
+    g_free(new_left);
+    g_free(added);
+    g_mutex_lock(&ladder->topology_lock);
+    while (ladder->branch_count > 0 && !ladder_branch(ladder, ladder->branch_count - 1)->active &&
+           !ladder_branch(ladder, ladder->branch_count - 1)->retiring) {
+        ladder->branch_count--;
+    }
+    g_mutex_unlock(&ladder->topology_lock);
+    g_print("Reload: +%d -%d ~%d branches applied in %.1f ms, %d untouched%s\n",
+            add_ok, removed, resized, reload->last_ms, untouched, failed > 0 ? ", some new branches FAILED" : "");
+}
+
+// Перечитывает файл конфигурации и применяет изменения веток
+static void reload_config(Ladder *ladder) {
+    ConfigReload *reload = &ladder->reload;
+    Config *config = g_new0(Config, 1);
+
+    if (parse_config_file(reload->path, config) != 0 || config->video_formats->len == 0) {
+        g_printerr("Reload: %s has no valid video_format, keeping the running ladder.\n", reload->path);
+        reload->rejected++;
+        free_config(config);
+        g_free(config);
+        return;
+    }
+    selectionSort((VideoFormat *)config->video_formats->data, config->video_formats->len);
+    // Недоступные дисплеи убираются так же, как при запуске: вернувшийся дисплей - это новый источник
+    if (drop_unavailable_displays(config) != 0) {
+        reload->rejected++;
+        free_config(config);
+        g_free(config);
+        return;
+    }
+    // Источники на ходу не пересоздаются: ветки меняются только внутри тех же областей,
+    // и у каждой области должна остаться хотя бы одна ветка
+    if (config->region_count != reload->current.region_count ||
+        memcmp(config->regions, reload->current.regions, sizeof(config->regions)) != 0) {
+        g_printerr("Reload: capture_region and display changes need a restart, keeping the running ladder.\n");
+        reload->rejected++;
+        free_config(config);
+        g_free(config);
+        return;
+    }
+    for (int r = 0; r < ladder->capture_count; r++) {
+        int formats = 0;
+        for (int i = 0; i < (int)config->video_formats->len; i++) {
+            formats += g_array_index(config->video_formats, VideoFormat, i).region == r;
+        }
+        if (formats == 0) {
+            g_printerr("Reload: capture region %d would have no video_format, keeping the running ladder.\n", r);
+            reload->rejected++;
+            free_config(config);
+            g_free(config);
+            return;
+        }
+    }
+    if (!same_settings(&reload->current, config)) {
+        g_printerr("Reload: only video_format changes are applied live, other settings need a restart.\n");
+    }
+    apply_reload(ladder, config);
+    free_config(&reload->current);
+    reload->current = *config;
+    g_free(config);
+}
+
+// Поток перезагрузки: inotify на каталоге файла конфигурации. Редакторы часто сохраняют
+// через новый файл и переименование, поэтому смотрим и IN_CLOSE_WRITE, и IN_MOVED_TO
+static gpointer reload_thread(gpointer data) {
+    Ladder *ladder = data;
+    ConfigReload *reload = &ladder->reload;
+    gchar *name = g_path_get_basename(reload->path);
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (TRUE) {
+        struct pollfd fds[2] = {
+            {reload->wake[0], POLLIN, 0},
+            {reload->inotify_fd, POLLIN, 0}
+        };
+        gboolean changed = FALSE;
+
+        if (poll(fds, 2, -1) < 0) {
+            continue;
+        }
+        if (fds[0].revents & POLLIN) {
+            break;
+        }
+        ssize_t length = read(reload->inotify_fd, events, sizeof(events));
+        for (char *p = events; length > 0 && p < events + length; ) {
+            const struct inotify_event *event = (const struct inotify_event*)p;
+            if (event->len > 0 && strcmp(event->name, name) == 0) {
+                changed = TRUE;
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+        if (changed) {
+            reload_config(ladder);
+        }
+    }
+    g_free(name);
+    return NULL;
+}
+
+// Ветки каскада зависят друг от друга, а запись, буфер повтора и потоки держат файлы,
+// порты и кодировщики - их набор меняется только перезапуском. Без каскада ветки
+// масштабируют каждая сама, общий узел мешал бы менять их по одной
+gboolean reload_supported(Ladder *ladder) {
+    return ladder->mode != LADDER_CASCADE && !ladder->record && !ladder->replay && !ladder->streaming;
+}
+
+// Запускает слежение за файлом конфигурации
+int reload_start(Ladder *ladder, const char *path) {
+    ConfigReload *reload = &ladder->reload;
+    gchar *directory;
+
+    if (!reload_supported(ladder)) {
+        g_printerr("reload=1 needs ladder_mode=fanout without record, replay and stream=, config changes need a restart.\n");
+        return -1;
+    }
+    reload->path = path;
+    memset(&reload->current, 0, sizeof(reload->current));
+    if (parse_config_file(path, &reload->current) != 0) {
+        return -1;
+    }
+    selectionSort((VideoFormat *)reload->current.video_formats->data, reload->current.video_formats->len);
+    if (drop_unavailable_displays(&reload->current) != 0) {
+        return -1;
+    }
+
+    directory = g_path_get_dirname(path);
+    reload->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (reload->inotify_fd < 0 || inotify_add_watch(reload->inotify_fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        g_printerr("Failed to watch %s for config changes.\n", directory);
+        if (reload->inotify_fd >= 0) {
+            close(reload->inotify_fd);
+        }
+        g_free(directory);
+        return -1;
+    }
+    g_free(directory);
+    if (pipe(reload->wake) != 0) {
+        close(reload->inotify_fd);
+        return -1;
+    }
+    g_mutex_init(&reload->drain_lock);
+    g_cond_init(&reload->drained);
+    reload->thread = g_thread_new("reload", reload_thread, ladder);
+    return 0;
+}
+
+void reload_stop(Ladder *ladder) {
+    ConfigReload *reload = &ladder->reload;
+    char command = 'q';
+
+    if (reload->thread == NULL) {
+        return;
+    }
+    if (write(reload->wake[1], &command, 1) == 1) {
+        g_thread_join(reload->thread);
+    }
+    reload->thread = NULL;
+    close(reload->wake[0]);
+    close(reload->wake[1]);
+    close(reload->inotify_fd);
+    g_mutex_clear(&reload->drain_lock);
+    g_cond_clear(&reload->drained);
+    free_config(&reload->current);
+}
+
+// Отчёт перезагрузок: сколько применено и сколько занимало применение
+void print_reload_report(Ladder *ladder) {
+    ConfigReload *reload = &ladder->reload;
+
+    if (!reload->enabled) {
+        return;
+    }
+    g_print("Config reload: %" G_GUINT64_FORMAT " applied, %" G_GUINT64_FORMAT " rejected, last %.1f ms, max %.1f ms\n",
+            reload->applied, reload->rejected, reload->last_ms, reload->max_ms);
+}
+
+// EOS прошёл один из выходов ветки. Компоновщик decoupled ветки читает intervideosrc,
+// до которого EOS сам не дойдёт: отправляем его туда, когда опустел выход обработки
+static GstPadProbeReturn shutdown_eos_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    Branch *branch = user_data;
+
+    if (GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(info)) != GST_EVENT_EOS) {
+        return GST_PAD_PROBE_OK;
+    }
+    if (g_atomic_int_dec_and_test(&branch->shutdown_pending)) {
+        branch->shutdown_drained_us = g_get_monotonic_time();
+    }
+    if (branch->inter_src != NULL && GST_PAD_PARENT(pad) == branch_output(branch)) {
+        gst_element_send_event(branch->inter_src, gst_event_new_eos());
+    }
+    return GST_PAD_PROBE_REMOVE;
+}
+
+// Выходы, через которые должен пройти EOS, чтобы ветка считалась опустевшей:
+// конец обработки, кодировщик, экспорт и поток в сеть
+static void attach_shutdown_probes(Branch *branch) {
+    GstPad *pads[4];
+    int count = 0;
+
+    pads[count++] = gst_element_get_static_pad(branch_output(branch), branch_output_pad(branch));
+    if (branch->encoder != NULL) {
+        pads[count++] = gst_element_get_static_pad(branch->parser ? branch->parser : branch->encoder, "src");
+    }
+    if (branch->export_queue != NULL) {
+        pads[count++] = gst_element_get_static_pad(branch->export_queue, "src");
+    }
+    if (branch->stream_queue != NULL) {
+        pads[count++] = gst_element_get_static_pad(branch->stream_queue, "src");
+    }
+    g_atomic_int_set(&branch->shutdown_pending, count);
+    for (int p = 0; p < count; p++) {
+        gst_pad_add_probe(pads[p], GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, shutdown_eos_probe, branch, NULL);
+        gst_object_unref(pads[p]);
+    }
+}
+
+// После срока кадры, которые ветка ещё держит в очередях, выбрасываются; события проходят
+static GstPadProbeReturn drop_frames_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    return GST_PAD_PROBE_DROP;
+}
+
+// EOS в пад из своего потока: пад может быть занят потоком, который ещё отдаёт кадр,
+// а основной цикл ждать нельзя
+static gpointer force_eos_thread(gpointer user_data) {
+    GstPad *pad = user_data;
+
+    gst_pad_send_event(pad, gst_event_new_eos());
+    gst_object_unref(pad);
+    return NULL;
+}
+
+static void force_eos(GstPad *pad) {
+    if (pad != NULL) {
+        g_thread_unref(g_thread_new("force-eos", force_eos_thread, pad));
+    }
+}
+
+// Ветка не опустела за срок. Настоящий flush дошёл бы до muxer и сбросил его, поэтому кадры
+// в очередях выбрасываются пробниками, а EOS идёт сразу за кодировщик, чтобы muxer записал
+// заголовки и индекс, не дожидаясь кодирования отложенных кадров, и в голову ветки
+static void force_branch_eos(Branch *branch) {
+    GstElement *queues[] = {branch->queue, branch->record_queue, branch->stream_queue, branch->export_queue};
+
+    for (size_t q = 0; q < sizeof(queues) / sizeof(queues[0]); q++) {
+        if (queues[q] != NULL) {
+            GstPad *pad = gst_element_get_static_pad(queues[q], "src");
+            gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST, drop_frames_probe, NULL, NULL);
+            gst_object_unref(pad);
+        }
+    }
+    branch->shutdown_forced = TRUE;
+    if (branch->encoder != NULL) {
+        GstPad *encoded_pad = gst_element_get_static_pad(branch->parser ? branch->parser : branch->encoder, "src");
+        force_eos(gst_pad_get_peer(encoded_pad));
+        gst_object_unref(encoded_pad);
+    }
+    // Уже стоящий в очереди EOS пад второй раз не примет: он пройдёт сам вслед за выброшенными кадрами
+    force_eos(gst_element_get_static_pad(branch->queue, "sink"));
+}
+
+static gboolean branch_capture_failed(Ladder *ladder, Branch *branch) {
+    return ladder->captures[branch->format.region].failed;
+}
+
+// Ветки остановлены, а EOS конвейера так и нет: что-то стоит в компоновщике или sink
+static gboolean finalize_deadline(gpointer user_data) {
+    Ladder *ladder = user_data;
+
+    g_printerr("Pipeline did not finish %d ms after the drain deadline, exiting anyway.\n", ladder->drain_timeout_ms);
+    ladder->shutdown_timer = 0;
+    g_main_loop_quit(ladder->loop);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean drain_deadline(gpointer user_data) {
+    Ladder *ladder = user_data;
+    int forced = 0, active = 0;
+
+    ladder->shutdown_stage = 2;
+    for (int i = 0; i < ladder->branch_count; i++) {
+        Branch *branch = ladder_branch(ladder, i);
+        if (!branch->active || branch_capture_failed(ladder, branch)) {
+            continue;
+        }
+        active++;
+        if (g_atomic_int_get(&branch->shutdown_pending) > 0) {
+            force_branch_eos(branch);
+            forced++;
+        }
+    }
+    if (forced > 0) {
+        g_printerr("Drain deadline of %d ms passed, forcing EOS into %d of %d branches.\n",
+                   ladder->drain_timeout_ms, forced, active);
+    } else {
+        g_printerr("Drain deadline of %d ms passed, all branches drained, waiting for the sinks.\n", ladder->drain_timeout_ms);
+    }
+    ladder->shutdown_timer = g_timeout_add(ladder->drain_timeout_ms, finalize_deadline, ladder);
+    return G_SOURCE_REMOVE;
+}
+
+// Остановка: EOS от источников, у веток drain_timeout_ms, чтобы опустеть
+static void begin_shutdown(Ladder *ladder) {
+    if (ladder->shutdown_stage != 0) {
+        return;
+    }
+    ladder->shutdown_stage = 1;
+    ladder->shutdown_us = g_get_monotonic_time();
+    // Источник, перезапущенный после EOS, снова пошёл бы в ветки
+    stop_size_watch(ladder);
+    // Набор веток и их уровни больше не меняются
+    reload_stop(ladder);
+    adaptive_stop(ladder);
+    for (int i = 0; i < ladder->branch_count; i++) {
+        // EOS в ветки упавшего источника уже прошёл
+        if (ladder_branch(ladder, i)->active && !branch_capture_failed(ladder, ladder_branch(ladder, i))) {
+            attach_shutdown_probes(ladder_branch(ladder, i));
+        }
+    }
+    gst_element_send_event(pipeline, gst_event_new_eos());
+    ladder->shutdown_timer = g_timeout_add(ladder->drain_timeout_ms, drain_deadline, ladder);
+}
+
+// SIGINT и SIGTERM через g_unix_signal_add: вызывается в основном цикле, не в обработчике сигнала.
+// Повторный сигнал не ждёт срока текущей стадии
+static gboolean stop_signal(gpointer user_data) {
+    Ladder *ladder = user_data;
+
+    switch (ladder->shutdown_stage) {
+        case 0:
+            g_print("Stop requested, draining branches (deadline %d ms)...\n", ladder->drain_timeout_ms);
+            begin_shutdown(ladder);
+            break;
+        case 1:
+            g_print("Stop requested again, forcing EOS now...\n");
+            g_source_remove(ladder->shutdown_timer);
+            drain_deadline(ladder);
+            break;
+        default:
+            g_print("Stop requested again, exiting without waiting for the sinks.\n");
+            g_main_loop_quit(ladder->loop);
+            break;
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+// Сообщения шины в основном цикле
+static gboolean bus_message(GstBus *bus, GstMessage *msg, gpointer user_data) {
+    Ladder *ladder = user_data;
+    GError *err;
+    gchar *debug_info;
+
+    switch (GST_MESSAGE_TYPE(msg)) {
+        case GST_MESSAGE_ERROR: {
+            int failed_capture = find_capture(ladder, GST_MESSAGE_SRC(msg));
+            gboolean over_budget;
+            gst_message_parse_error(msg, &err, &debug_info);
+            g_printerr("Error: %s\n", err->message);
+            over_budget = g_error_matches(err, GST_RESOURCE_ERROR, GST_RESOURCE_ERROR_NO_SPACE_LEFT);
+            g_error_free(err);
+            g_free(debug_info);
+            // Упавший источник завершает только свои ветки, остальные продолжают захват
+            if (failed_capture >= 0) {
+                char label[80];
+                capture_label(ladder, failed_capture, label, sizeof(label));
+                g_printerr("Stopping %s%s.\n", label,
+                           ladder->capture_count > 1 ? ", the other capture sources keep running" : "");
+                stop_failed_capture(ladder, failed_capture, FALSE);
+            }
+            // Кадр ветки не помещается в memory_budget_mb: предел не нарушаем, а останавливаемся
+            if (over_budget) {
+                g_printerr("Stopping: memory_budget_mb cannot hold the negotiated frames.\n");
+                begin_shutdown(ladder);
+            }
+            break;
+        }
+        case GST_MESSAGE_EOS:
+            g_print("End of stream reached.\n");
+            ladder->finalized_us = g_get_monotonic_time();
+            if (ladder->shutdown_timer != 0) {
+                g_source_remove(ladder->shutdown_timer);
+                ladder->shutdown_timer = 0;
+            }
+            g_main_loop_quit(ladder->loop);
+            break;
+        case GST_MESSAGE_APPLICATION:
+            if (gst_message_has_name(msg, "bench-done")) {
+                g_print("Benchmark: %" G_GUINT64_FORMAT " frames captured, stopping...\n", ladder->bench.frames);
+                begin_shutdown(ladder);
+            } else if (gst_message_has_name(msg, "startup-first-frame") && ladder->startup_profile) {
+                startup_profile_report(&ladder->startup);
+            }
+            break;
+        default:
+            break;
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+// Отчёт об остановке: за сколько опустела каждая ветка
+void print_shutdown_report(Ladder *ladder) {
+    if (ladder->shutdown_us == 0) {
+        return;
+    }
+    if (ladder->finalized_us > 0) {
+        g_print("Shutdown: pipeline finished in %.1f ms, drain deadline %d ms\n",
+                (ladder->finalized_us - ladder->shutdown_us) / 1000.0, ladder->drain_timeout_ms);
+    } else {
+        g_print("Shutdown: pipeline did not finish, recordings may be unfinalized, drain deadline %d ms\n",
+                ladder->drain_timeout_ms);
+    }
+    for (int i = 0; i < ladder->branch_count; i++) {
+        Branch *branch = ladder_branch(ladder, i);
+        if (!branch->active) {
+            continue;
+        }
+        g_print("  branch %d %dx%d@%d: ", i, branch->format.width, branch->format.height, branch->format.framerate);
+        if (branch_capture_failed(ladder, branch)) {
+            g_print("stopped earlier with its capture source\n");
+        } else if (branch->shutdown_drained_us > 0) {
+            g_print("drained in %.1f ms%s\n", (branch->shutdown_drained_us - ladder->shutdown_us) / 1000.0,
+                    branch->shutdown_forced ? " after forced EOS" : "");
+        } else {
+            g_print("did not drain%s\n", branch->shutdown_forced ? " even after forced EOS" : "");
+        }
+    }
+}
+
+// Смены размера источников и пауза каждой ветки от новых caps до первого кадра из них
+void print_resize_report(Ladder *ladder) {
+    guint resizes = 0;
+
+    for (int r = 0; r < ladder->capture_count; r++) {
+        resizes += ladder->captures[r].resizes;
+    }
+    if (resizes == 0) {
+        return;
+    }
+    g_print("Source resizes: %u, resize_policy=%s, %d X errors skipped during restarts\n",
+            resizes, resize_policy_name(ladder->resize_policy), g_atomic_int_get(&x_errors));
+    for (int r = 0; r < ladder->capture_count; r++) {
+        const Capture *capture = &ladder->captures[r];
+        char label[80];
+        if (capture->resizes > 0) {
+            capture_label(ladder, r, label, sizeof(label));
+            g_print("  %s: %u resizes, now %dx%d\n", label, capture->resizes,
+                    capture->negotiated_width, capture->negotiated_height);
+        }
+    }
+    for (int i = 0; i < ladder->branch_count; i++) {
+        const Branch *branch = ladder_branch(ladder, i);
+        if (!branch->active || branch->renegotiations == 0) {
+            continue;
+        }
+        g_print("  branch %d %dx%d (configured %dx%d): ", i, branch->format.width, branch->format.height,
+                branch->configured.width, branch->configured.height);
+        if (branch->stall_max_ms > 0.0) {
+            g_print("stall %.1f ms last, %.1f ms max\n", branch->stall_last_ms, branch->stall_max_ms);
+        } else {
+            g_print("input caps unchanged, no stall\n");
+        }
+    }
+}
+
+// Фабрики, которые понадобятся конвейеру: их плагины загружаются заранее в отдельном потоке.
+// Кодировщик auto ещё не выбран, загружается первый из списка resolve_encoder
+int list_startup_factories(const Config *config, const char **names, int capacity) {
+    gboolean encoded = config->record || config->replay, exported = FALSE, decoupled = FALSE;
+    int count = 0;
+
+    for (int i = 0; i < (int)config->video_formats->len; i++) {
+        const VideoFormat *format = &g_array_index(config->video_formats, VideoFormat, i);
+        encoded = encoded || format->stream_port > 0;
+        exported = exported || format->export_name[0] != '\0';
+        decoupled = decoupled || format->isolation == ISOLATION_DECOUPLED;
+    }
+#define ADD_FACTORY(factory) do { if (count < capacity) names[count++] = (factory); } while (0)
+    // Сначала то, что создаётся первым
+    if (config->source_type == SOURCE_XIMAGE) {
+        ADD_FACTORY("ximagesrc");
+    } else if (config->source_type == SOURCE_VIDEOTEST) {
+        ADD_FACTORY("videotestsrc");
+    } else {
+        ADD_FACTORY("filesrc");
+        ADD_FACTORY("decodebin");
+    }
+    ADD_FACTORY("tee");
+    ADD_FACTORY("queue");
+    ADD_FACTORY("videorate");
+    ADD_FACTORY("videoscale");
+    ADD_FACTORY("videoconvert");
+    ADD_FACTORY("capsfilter");
+    if (config->dedupe) {
+        ADD_FACTORY("identity");
+    }
+    if (decoupled) {
+        ADD_FACTORY("intervideosink");
+        ADD_FACTORY("intervideosrc");
+    }
+    if (encoded) {
+        ADD_FACTORY(encoder_factory_name(config->encoder));
+        if (config->encoder != ENCODER_VP8) {
+            ADD_FACTORY("h264parse");
+        }
+    }
+    if (config->record) {
+        ADD_FACTORY("splitmuxsink");
+        ADD_FACTORY(strcmp(config->record_muxer, "mkv") == 0 ? "matroskamux" : "mp4mux");
+    }
+    if (config->replay || exported) {
+        ADD_FACTORY("appsink");
+    }
+    if (config->preview) {
+        ADD_FACTORY("compositor");
+        ADD_FACTORY(config->preview_sink);
+    }
+    if (config->record && config->audio != AUDIO_NONE) {
+        ADD_FACTORY(audio_source_factory(config->audio));
+        ADD_FACTORY("audioconvert");
+        ADD_FACTORY("audioresample");
+        ADD_FACTORY("audiorate");
+    }
+#undef ADD_FACTORY
+    return count;
+}
+
+int main(int argc, char *argv[]) {
+    // Startup phases are measured from here
+    gint64 main_us = g_get_monotonic_time();
+    if (argc == 1) {
+        printf("Not enough arguments! Please enter configuration file name!");
+        return -1;
+    }
+    const char* filename = argv[1];
+    //const char* filename = "config.txt";
+    Config config;
+
+    if (parse_config_file(filename, &config) != 0) {
+        fprintf(stderr, "Error of parsing configuration file.\n");
+        return EXIT_FAILURE;
+    }
+
+    selectionSort((VideoFormat *)config.video_formats->data, config.video_formats->len);
+
+    static Ladder ladder;
+    GstBus *bus;
+    GstStateChangeReturn ret;
+
+    startup_profile_init(&ladder.startup, main_us);
+    startup_mark(&ladder.startup, "config parsed");
+    // Without the scan gst_init only reads the registry cache; new plugins need a run with registry_update=1
+    if (!config.registry_update) {
+        startup_skip_registry_update();
+    }
+
+    // Initialize GStreamer
+    gst_init(&argc, &argv);
+    startup_mark(&ladder.startup, "gst_init");
+    // Plugins load while the X displays are being probed
+    const char *preload_names[32];
+    GThread *preload = startup_preload_start(preload_names, list_startup_factories(&config, preload_names, 32));
+
+    // A display that is not up yet only loses its own branches
+    if (drop_unavailable_displays(&config) != 0 || check_capture_regions(&config) != 0) {
+        return EXIT_FAILURE;
+    }
+    ladder.mode = config.ladder_mode;
+    ladder.working_format = config.preconvert_format;
+    char *display_name = concat_string_and_number(":", config.region_count > 0 ? config.regions[0].display : config.display_number);
+    if (config.capture_mode == CAPTURE_DAMAGE) {
+        if (config.source_type != SOURCE_XIMAGE) {
+            g_printerr("capture_mode=damage needs source=ximagesrc, capturing full frames.\n");
+        } else if (damage_monitor_open(&ladder.damage, display_name) != 0) {
+            g_printerr("XDamage is not available on display %s, capturing full frames.\n", display_name);
+        }
+    }
+    ladder.dedupe.tile = config.dedupe_tile;
+    ladder.capture_placement = config.capture_placement;
+    ladder.output_placement = config.output_placement;
+    ladder.scaler_threads = config.scaler_threads;
+    ladder.preview = config.preview;
+    ladder.record = config.record;
+    ladder.x264_preset = config.x264_preset;
+    ladder.x264_tune = config.x264_tune;
+    ladder.segment_seconds = config.segment_seconds;
+    ladder.record_location = config.record_location;
+    ladder.record_muxer = config.record_muxer;
+    ladder.replay = config.replay;
+    ladder.replay_duration = (GstClockTime)config.replay_seconds * GST_SECOND;
+    ladder.replay_memory = (guint64)config.replay_memory_mb * 1024 * 1024;
+    ladder.replay_location = config.replay_location;
+    ladder.replay_muxer = config.replay_muxer;
+    ladder.export_slots = config.export_slots;
+    ladder.stream_protocol = config.stream_protocol;
+    ladder.stream_host = config.stream_host;
+    ladder.stream_keyframe_seconds = config.stream_keyframe_seconds;
+    ladder.stream_srt_latency_ms = config.stream_srt_latency_ms;
+    ladder.stream_jitter_ms = config.stream_jitter_ms;
+    ladder.stream_loopback = config.stream_loopback;
+    ladder.startup_profile = config.startup_profile;
+    ladder.drain_timeout_ms = config.drain_timeout_ms;
+    ladder.source_type = config.source_type;
+    ladder.resize_policy = config.resize_policy;
+    ladder.resize_check_ms = config.resize_check_ms;
+    gboolean streaming = FALSE;
+    for (int i = 0; i < (int)config.video_formats->len; i++) {
+        const VideoFormat *format = &g_array_index(config.video_formats, VideoFormat, i);
+        for (int j = 0; j < i && format->stream_port > 0; j++) {
+            if (g_array_index(config.video_formats, VideoFormat, j).stream_port == format->stream_port) {
+                g_printerr("Branches %dx%d@%d and %dx%d@%d both stream to port %d.\n",
+                           g_array_index(config.video_formats, VideoFormat, j).width, g_array_index(config.video_formats, VideoFormat, j).height, g_array_index(config.video_formats, VideoFormat, j).framerate,
+                           format->width, format->height, format->framerate, format->stream_port);
+                return -1;
+            }
+        }
+        streaming = streaming || format->stream_port > 0;
+    }
+    ladder.streaming = streaming;
+    // The loopback receivers listen on 127.0.0.1
+    if (streaming && ladder.stream_loopback && strcmp(ladder.stream_host, "127.0.0.1") != 0) {
+        g_printerr("stream_loopback=1 streams to 127.0.0.1 instead of %s.\n", ladder.stream_host);
+        ladder.stream_host = "127.0.0.1";
+    }
+    if (!ladder.preview && !ladder.record && !ladder.replay) {
+        gboolean exporting = FALSE;
+        for (int i = 0; i < (int)config.video_formats->len; i++) {
+            exporting = exporting || g_array_index(config.video_formats, VideoFormat, i).export_name[0] != '\0';
+        }
+        if (!exporting && !streaming) {
+            g_printerr("Preview, record, replay, export and stream are all disabled, nothing to do.\n");
+            return -1;
+        }
+        // Only exported and streamed branches have somewhere to send their frames
+        for (int i = 0; i < (int)config.video_formats->len; i++) {
+            const VideoFormat *format = &g_array_index(config.video_formats, VideoFormat, i);
+            if (format->export_name[0] == '\0' && format->stream_port == 0) {
+                g_printerr("Branch %dx%d@%d has no output: enable preview, record or replay, or give it export= or stream=.\n",
+                           format->width, format->height, format->framerate);
+                return -1;
+            }
+        }
+    }
+    if (ladder.record || ladder.replay || streaming) {
+        ladder.encoder = resolve_encoder(config.encoder);
+        if (ladder.encoder == ENCODER_AUTO) {
+            g_printerr("No encoder found: install x264enc, openh264enc or vp8enc.\n");
+            return -1;
+        }
+    }
+    ladder.adaptive.enabled = config.adaptive;
+    ladder.adaptive.interval_ms = config.adaptive_interval_ms;
+    ladder.adaptive.cpu_high = config.adaptive_cpu_high;
+    ladder.adaptive.cpu_low = config.adaptive_cpu_low;
+    ladder.adaptive.queue_high = config.adaptive_queue_high;
+    ladder.adaptive.queue_low = config.adaptive_queue_low;
+    ladder.adaptive.degrade_ticks = config.adaptive_degrade_ticks;
+    ladder.adaptive.restore_ticks = config.adaptive_restore_ticks;
+    g_mutex_init(&ladder.topology_lock);
+    g_mutex_init(&ladder.budget_lock);
+    g_mutex_init(&ladder.resize_lock);
+    g_mutex_init(&ladder.table_lock);
+    ladder.memory_budget = (guint64)config.memory_budget_mb * 1024 * 1024;
+    ladder.queue_latency_ms = config.queue_latency_ms;
+    ladder.capture_count = MAX(config.region_count, 1);
+    for (int r = 0; r < ladder.capture_count; r++) {
+        Capture *capture = &ladder.captures[r];
+        const CaptureRegion *region = config.region_count > 0 ? &config.regions[r] : NULL;
+        capture->display = region != NULL ? region->display : config.display_number;
+        capture->has_region = region != NULL && !region_is_display(region);
+        if (capture->has_region) {
+            capture->region = *region;
+        }
+        char *capture_display = concat_string_and_number(":", capture->display);
+        capture->geometry_known = estimate_source_geometry(&config, capture_display, region, &capture->geometry);
+        if (!capture->has_region && capture->geometry_known) {
+            capture->display_width = capture->geometry.width;
+            capture->display_height = capture->geometry.height;
+        } else if (capture->has_region) {
+            // Regions are compared against reading their whole display
+            VideoFormat display;
+            if (estimate_source_geometry(&config, capture_display, NULL, &display)) {
+                capture->display_width = display.width;
+                capture->display_height = display.height;
+            }
+        }
+        free(capture_display);
+        if (!capture->geometry_known) {
+            // The real size comes with the caps, assume 1080p until then
+            capture->geometry.width = 1920;
+            capture->geometry.height = 1080;
+        }
+    }
+    startup_mark(&ladder.startup, "displays probed");
+    ladder.fused_method = config.fused_method;
+    ladder.fused_threads = config.fused_threads;
+    if (config.fused_scale) {
+        ladder.fused_available = fast_scale_convert_register();
+        if (!ladder.fused_available) {
+            g_printerr("fastscaleconvert is not available, using videoscale and videoconvert.\n");
+        }
+    }
+    // Scaler nodes are shared in every mode; the mode only decides whether a node scales
+    // the source frame or the nearest larger node's frame
+    ladder.branches = g_ptr_array_new_with_free_func(g_free);
+    ladder.branch_count = (int)config.video_formats->len;
+    for (int i = 0; i < ladder.branch_count; i++) {
+        g_ptr_array_add(ladder.branches, g_new0(Branch, 1));
+        setup_branch(ladder_branch(&ladder, i), &config, &g_array_index(config.video_formats, VideoFormat, i), -1);
+    }
+    LadderPlan plan = plan_ladder((const VideoFormat *)config.video_formats->data, ladder.branch_count,
+                                  ladder.mode == LADDER_CASCADE, config.reload && reload_supported(&ladder));
+    for (int i = 0; i < ladder.branch_count; i++) {
+        const LadderNode *node = &g_array_index(plan.nodes, LadderNode, g_array_index(plan.node_of, int, i));
+        ladder_branch(&ladder, i)->parent = g_array_index(plan.feeds, int, i);
+        ladder_branch(&ladder, i)->scales = node->branch == i;
+    }
+
+    if (ladder.record || ladder.replay || streaming) {
+        divide_encoder_threads(&ladder, config.encoder_threads);
+    }
+    print_ladder_plan(&ladder, &plan);
+    free_ladder_plan(&plan);
+    startup_preload_join(preload);
+    startup_mark(&ladder.startup, "plugins loaded");
+
+    // Create pipeline
+    pipeline = gst_pipeline_new("multi-screen-recorder");
+
+    // Create elements
+    if (ladder.preview) {
+        ladder.sink = startup_make_element(config.preview_sink, "sink");
+    }
+    if (config.dedupe) {
+        ladder.dedupe_element = startup_make_element("identity", "dedupe");
+    }
+
+    // Check that all elements are created successfully
+    if (!pipeline || (ladder.preview && !ladder.sink) || (config.dedupe && !ladder.dedupe_element)) {
+        g_printerr("Failed to create one of the elements.\n");
+        return -1;
+    }
+    if (ladder.preview) {
+        gst_bin_add(GST_BIN(pipeline), ladder.sink);
+    }
+    if (ladder.dedupe_element) {
+        GstPad *dedupe_pad = gst_element_get_static_pad(ladder.dedupe_element, "src");
+        gst_pad_add_probe(dedupe_pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, dedupe_probe, &ladder.dedupe, NULL);
+        gst_object_unref(dedupe_pad);
+    }
+    // One bin per capture region or display: bin(source [-> preconvert -> caps] [-> dedupe]) -> tee
+    for (int r = 0; r < ladder.capture_count; r++) {
+        if (create_capture(&ladder, &config, r) != 0) {
+            gst_object_unref(pipeline);
+            return -1;
+        }
+    }
+    // New caps at a capture tee rescale only that capture's branches, see renegotiate_capture
+    for (int r = 0; r < ladder.capture_count; r++) {
+        GstPad *tee_pad = gst_element_get_static_pad(ladder.captures[r].tee, "sink");
+        gst_pad_add_probe(tee_pad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, source_caps_probe, &ladder, NULL);
+        gst_object_unref(tee_pad);
+    }
+    // Audio is encoded once and muxed into every recording, see link_branch_chain
+    if (config.audio != AUDIO_NONE && !ladder.record) {
+        g_printerr("audio=%s is only recorded, set record=1. Running without audio.\n", audio_source_name(config.audio));
+    } else if (config.audio != AUDIO_NONE) {
+        AudioSettings audio = {
+            .source = config.audio,
+            .device = config.audio_device,
+            .rate = config.audio_rate,
+            .channels = config.audio_channels,
+            .buffer_ms = config.audio_buffer_ms,
+            .latency_ms = MIN(config.audio_latency_ms, config.audio_buffer_ms),
+            .bitrate_kbps = config.audio_bitrate,
+            .sync_tolerance_ms = config.audio_sync_tolerance_ms,
+            .mkv = strcmp(config.record_muxer, "mkv") == 0 || ladder.encoder == ENCODER_VP8
+        };
+        if (audio_branch_create(&ladder.audio, GST_BIN(pipeline), &audio) != 0) {
+            gst_object_unref(pipeline);
+            return -1;
+        }
+        // Audio timestamps are compared with the frames of the capture sources
+        for (int r = 0; r < ladder.capture_count; r++) {
+            audio_attach_video(&ladder.audio, ladder.captures[r].source, "src");
+        }
+    }
+
+    for (int i = 0; i < ladder.branch_count; i++) {
+        if (create_branch(&ladder, i) != 0) {
+            g_printerr("Failed to create one of the elements.\n");
+            gst_object_unref(pipeline);
+            return -1;
+        }
+    }
+
+    // The compositor kind depends on the formats the branches ended up with
+    if (ladder.preview && create_preview_compositor(&ladder, &config) != 0) {
+        g_printerr("Failed to create one of the elements.\n");
+        gst_object_unref(pipeline);
+        return -1;
+    }
+
+    // Size branch queues from frame sizes and the memory budget
+    if (plan_queue_sizes(&ladder) != 0) {
+        gst_object_unref(pipeline);
+        return -1;
+    }
+    for (int i = 0; i < ladder.branch_count; i++) {
+        apply_queue_limits(&ladder, ladder_branch(&ladder, i));
+        GstPad *queue_pad = gst_element_get_static_pad(ladder_branch(&ladder, i)->queue, "sink");
+        gst_pad_add_probe(queue_pad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, queue_caps_probe, &ladder, NULL);
+        gst_object_unref(queue_pad);
+    }
+    print_memory_report(&ladder);
+    startup_mark(&ladder.startup, "elements created");
+
+    // Set properties for elements
+    if (ladder.sink && strcmp(config.preview_sink, "appsink") == 0) {
+        // Nobody pulls samples in benchmark runs, keep only the latest one
+        g_object_set(ladder.sink, "drop", TRUE, "max-buffers", 1, NULL);
+    }
+    // A live source never prerolls: the sink goes to PLAYING without waiting for its first frame
+    if (ladder.sink && (config.source_type == SOURCE_XIMAGE || (config.source_type == SOURCE_VIDEOTEST && config.source_live))) {
+        g_object_set(ladder.sink, "async", FALSE, NULL);
+    }
+
+    if (ladder.compositor) {
+        add_counter_probe(ladder.compositor, "src", &ladder.output_stats);
+    }
+    // Loopback streams measure latency from the same capture stamps as benchmark runs
+    gboolean stamping = config.bench_frames > 0 || (ladder.streaming && ladder.stream_loopback);
+    if (stamping) {
+        bench_init(&ladder.bench, config.bench_frames, config.bench_warmup_frames);
+        for (int r = 0; r < ladder.capture_count; r++) {
+            bench_attach_source(&ladder.bench, ladder.captures[r].source, "src");
+        }
+    }
+    if (ladder.streaming && ladder.stream_loopback) {
+        for (int i = 0; i < ladder.branch_count; i++) {
+            if (ladder_branch(&ladder, i)->stream_sink != NULL) {
+                stream_stamper_attach(&ladder_branch(&ladder, i)->stamper, ladder.bench.stamp_caps, ladder_branch(&ladder, i)->encoder, "sink");
+            }
+        }
+    }
+    if (config.bench_frames > 0) {
+        for (int i = 0; i < ladder.branch_count; i++) {
+            Branch *branch = ladder_branch(&ladder, i);
+            // videorate may duplicate frames for branches faster than the source
+            latency_recorder_init(&branch->latency, config.bench_frames * 4);
+            bench_attach_branch(&ladder.bench, &branch->latency, branch_output(branch), branch_output_pad(branch));
+        }
+    }
+    if (ladder.damage.display != NULL) {
+        GstPad *source_pad = gst_element_get_static_pad(ladder.captures[0].source, "src");
+        gst_pad_add_probe(source_pad, GST_PAD_PROBE_TYPE_BUFFER, damage_gate_probe, &ladder.damage, NULL);
+        gst_object_unref(source_pad);
+    }
+
+    for (int i = 0; i < ladder.branch_count; i++) {
+        if (link_branch(&ladder, i) != 0) {
+            g_printerr("Failed to link elements for branch %d.\n", i);
+            gst_object_unref(pipeline);
+            return -1;
+        }
+        if (ladder_branch(&ladder, i)->parent >= 0) {
+            g_print("Branch %dx%d@%d is fed from branch %dx%d@%d\n",
+                    ladder_branch(&ladder, i)->format.width, ladder_branch(&ladder, i)->format.height, ladder_branch(&ladder, i)->format.framerate,
+                    ladder_branch(&ladder, ladder_branch(&ladder, i)->parent)->format.width,
+                    ladder_branch(&ladder, ladder_branch(&ladder, i)->parent)->format.height,
+                    ladder_branch(&ladder, ladder_branch(&ladder, i)->parent)->format.framerate);
+        }
+    }
+
+    if (ladder.compositor && link_preview(&ladder) != 0) {
+        gst_object_unref(pipeline);
+        return -1;
+    }
+    startup_mark(&ladder.startup, "linked");
+
+    // First buffers of the sources and of the preview sink, or of the branches without preview
+    if (config.startup_profile || config.bench_frames > 0) {
+        for (int r = 0; r < ladder.capture_count; r++) {
+            startup_attach_source(&ladder.startup, ladder.captures[r].source, "src");
+        }
+        if (ladder.sink) {
+            ladder.startup.frame_point = "preview sink";
+            startup_attach_output(&ladder.startup, ladder.sink, "sink");
+        } else {
+            ladder.startup.frame_point = "branch output";
+            for (int i = 0; i < ladder.branch_count; i++) {
+                startup_attach_output(&ladder.startup, branch_output(ladder_branch(&ladder, i)),
+                                      branch_output_pad(ladder_branch(&ladder, i)));
+            }
+        }
+    }
+
+    // Per-element timing, after linking so that compositor request pads exist
+    if (config.trace) {
+        element_tracer_init(&ladder.tracer, config.trace_sample,
+                            config.trace_output[0] != '\0' ? config.trace_max_events : 0);
+        trace_ladder(&ladder);
+    }
+
+    // Place streaming threads as they start
+    bus = gst_element_get_bus(pipeline);
+    gst_bus_set_sync_handler(bus, stream_status_handler, &ladder, NULL);
+    gboolean placed = config.capture_placement.has_cpus || config.output_placement.has_cpus ||
+                      config.capture_placement.priority_kind != THREAD_PRIORITY_NONE ||
+                      config.output_placement.priority_kind != THREAD_PRIORITY_NONE;
+    for (int i = 0; i < ladder.branch_count; i++) {
+        placed = placed || ladder_branch(&ladder, i)->placement.has_cpus ||
+                 ladder_branch(&ladder, i)->placement.priority_kind != THREAD_PRIORITY_NONE;
+    }
+    // Benchmark runs need the registered threads for per-branch CPU time, traces for thread names
+    if (config.thread_report || placed || config.bench_frames > 0 || config.trace) {
+        thread_monitor_start(&ladder.threads, 50);
+    }
+
+    // Replay dumps are requested by SIGUSR1 or the control fifo and written from the control thread
+    if (ladder.replay && control_start(&ladder, config.control_fifo) != 0) {
+        g_printerr("Failed to start replay control thread.\n");
+    }
+
+    // Metrics are collected on their own thread from counters the probes keep
+    if ((config.metrics_port > 0 || config.metrics_file[0] != '\0') &&
+        metrics_server_start(&ladder.metrics, config.metrics_port, config.metrics_file,
+                             config.metrics_interval_ms, collect_metrics, &ladder) == 0 && config.metrics_port > 0) {
+        g_print("Metrics at http://127.0.0.1:%d/metrics\n", config.metrics_port);
+    }
+
+    // Installed once before ximagesrc threads start using Xlib, see count_x_error and x_io_error
+    if (ladder.source_type == SOURCE_XIMAGE) {
+        XSetErrorHandler(count_x_error);
+        g_mutex_lock(&x_connections.lock);
+        x_connections.lost = g_array_new(FALSE, FALSE, sizeof(int));
+        x_connections.notify = stop_lost_displays;
+        x_connections.data = &ladder;
+        g_mutex_unlock(&x_connections.lock);
+        XSetIOErrorHandler(x_io_error);
+    }
+
+    // Set the pipeline to the PLAYING state. Live sources return NO_PREROLL from PAUSED at once,
+    // the separate step only shows how long opening the elements takes
+    ret = gst_element_set_state(pipeline, GST_STATE_PAUSED);
+    startup_mark(&ladder.startup, "PAUSED");
+    if (ret != GST_STATE_CHANGE_FAILURE) {
+        ret = gst_element_set_state(pipeline, GST_STATE_PLAYING);
+        startup_mark(&ladder.startup, "PLAYING");
+    }
+    if (ret == GST_STATE_CHANGE_FAILURE) {
+        g_printerr("Failed to set pipeline to PLAYING state.\n");
+        metrics_server_stop(&ladder.metrics);
+        control_stop(&ladder);
+        thread_monitor_stop(&ladder.threads);
+        gst_object_unref(bus);
+        gst_object_unref(pipeline);
+        return -1;
+    }
+    gint64 start_time = g_get_monotonic_time();
+    double start_cpu = process_cpu_seconds();
+    // Receivers start once the senders are up: an SRT caller needs the listener.
+    // UDP frames sent before that are lost until the next keyframe
+    if (ladder.streaming && ladder.stream_loopback) {
+        for (int i = 0; i < ladder.branch_count; i++) {
+            Branch *branch = ladder_branch(&ladder, i);
+            if (branch->stream_sink != NULL &&
+                stream_receiver_start(&branch->receiver, ladder.stream_protocol, branch->format.stream_port,
+                                      ladder.encoder == ENCODER_VP8, ladder.stream_jitter_ms,
+                                      ladder.stream_srt_latency_ms, STREAM_LATENCY_SAMPLES) != 0) {
+                g_printerr("Loopback receiver for port %d: %s.\n", branch->format.stream_port, branch->receiver.error);
+            }
+        }
+    }
+    if (ladder.adaptive.enabled) {
+        adaptive_start(&ladder);
+    }
+    // Branches follow video_format lines of the config file while running
+    if (config.reload) {
+        ladder.reload.enabled = reload_start(&ladder, filename) == 0;
+    }
+
+    // Stop requests and bus messages are handled on the main loop: nothing runs inside a signal handler
+    ladder.loop = g_main_loop_new(NULL, FALSE);
+    gst_bus_add_watch(bus, bus_message, &ladder);
+    g_unix_signal_add(SIGINT, stop_signal, &ladder);
+    g_unix_signal_add(SIGTERM, stop_signal, &ladder);
+    // ximagesrc does not follow xrandr by itself: screen and window sizes are watched and the source restarted
+    if (ladder.source_type == SOURCE_XIMAGE && ladder.resize_check_ms > 0) {
+        watch_capture_sizes(&ladder);
+    }
+    g_main_loop_run(ladder.loop);
+    gst_bus_remove_watch(bus);
+
+    // Stop pipeline and release resources
+    for (int i = 0; i < ladder.branch_count; i++) {
+        if (!ladder_branch(&ladder, i)->active) {
+            continue;
+        }
+        g_object_get(ladder_branch(&ladder, i)->queue, "current-level-buffers", &ladder_branch(&ladder, i)->queued_at_stop, NULL);
+        if (ladder.threads.sampler != NULL) {
+            // Streaming threads are gone after NULL, read their CPU time now
+            char role[THREAD_NAME_LENGTH];
+            snprintf(role, sizeof(role), "branch %d", i);
+            ladder_branch(&ladder, i)->thread_cpu_seconds = thread_monitor_role_cpu_seconds(&ladder.threads, role);
+        }
+    }
+    control_stop(&ladder);
+    reload_stop(&ladder);
+    adaptive_stop(&ladder);
+    metrics_server_stop(&ladder.metrics);
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    for (int i = 0; i < ladder.branch_count; i++) {
+        stream_receiver_stop(&ladder_branch(&ladder, i)->receiver);
+    }
+    thread_monitor_stop(&ladder.threads);
+    double cpu_seconds = process_cpu_seconds() - start_cpu;
+    print_scaler_report(&ladder, (g_get_monotonic_time() - start_time) / 1e6, cpu_seconds);
+    print_isolation_report(&ladder, (g_get_monotonic_time() - start_time) / 1e6);
+    print_record_report(&ladder, (g_get_monotonic_time() - start_time) / 1e6);
+    print_replay_report(&ladder);
+    print_export_report(&ladder);
+    print_stream_report(&ladder, (g_get_monotonic_time() - start_time) / 1e6);
+    print_adaptive_report(&ladder);
+    print_reload_report(&ladder);
+    print_preview_report(&ladder);
+    print_shutdown_report(&ladder);
+    print_resize_report(&ladder);
+    audio_branch_report(&ladder.audio);
+    if (config.trace) {
+        element_tracer_report(&ladder.tracer);
+        element_tracer_write_chrome(&ladder.tracer, config.trace_output, &ladder.threads);
+        element_tracer_clear(&ladder.tracer);
+    }
+    if (config.bench_frames > 0) {
+        write_bench_report(&ladder, &config, filename, (g_get_monotonic_time() - start_time) / 1e6);
+        for (int i = 0; i < ladder.branch_count; i++) {
+            latency_recorder_clear(&ladder_branch(&ladder, i)->latency);
+        }
+    }
+    if (stamping) {
+        bench_clear(&ladder.bench);
+    }
+    print_damage_report(&ladder);
+    print_dedupe_report(&ladder, cpu_seconds);
+    thread_monitor_report(&ladder.threads);
+    damage_monitor_close(&ladder.damage);
+    for (int i = 0; i < ladder.branch_count; i++) {
+        if (ladder_branch(&ladder, i)->replay_sink != NULL) {
+            replay_ring_clear(&ladder_branch(&ladder, i)->replay);
+        }
+        if (ladder_branch(&ladder, i)->export_sink != NULL) {
+            close_exporter(ladder_branch(&ladder, i));
+        }
+        stream_receiver_clear(&ladder_branch(&ladder, i)->receiver);
+    }
+    audio_branch_clear(&ladder.audio);
+    // The profile is printed at the first frame, or here if none arrived
+    if (config.startup_profile && ladder.startup.first_frame_us == 0) {
+        startup_profile_report(&ladder.startup);
+    }
+    g_main_loop_unref(ladder.loop);
+    gst_object_unref(bus);
+    gst_object_unref(pipeline);
+    g_ptr_array_unref(ladder.branches);
+    startup_factory_cache_clear();
+    free_config(&config);
+
+    return 0;
+}
@@ -0,0 +1,191 @@
+#include "metrics.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// Сколько поток метрик ждёт медленного клиента, прежде чем бросить ответ
+#define SEND_DEADLINE_MS 2000
+#define SEND_POLL_MS 200
+
+// Снимок пишется во временный файл и переименовывается, чтобы читатель не увидел половину
+static void write_file(MetricsServer *server, const GString *text) {
+    gchar *temporary = g_strdup_printf("%s.tmp", server->file);
+    FILE *file = fopen(temporary, "w");
+
+    if (file == NULL) {
+        g_free(temporary);
+        return;
+    }
+    fwrite(text->str, 1, text->len, file);
+    if (fclose(file) == 0) {
+        rename(temporary, server->file);
+    }
+    g_free(temporary);
+}
+
+static void refresh(MetricsServer *server) {
+    GString *text = g_string_new(NULL);
+
+    server->collect(text, server->data);
+    g_string_append_printf(text, "# TYPE ladder_metrics_scrapes_total counter\n"
+                           "ladder_metrics_scrapes_total %" G_GUINT64_FORMAT "\n", server->scrapes);
+    if (server->file[0] != '\0') {
+        write_file(server, text);
+    }
+    g_mutex_lock(&server->lock);
+    g_string_free(server->snapshot, TRUE);
+    server->snapshot = text;
+    g_mutex_unlock(&server->lock);
+}
+
+// Отвечает на один запрос: путь не важен, всегда отдаём последний снимок
+static void serve(MetricsServer *server, int client) {
+    char request[1024];
+    struct pollfd fd = {client, POLLIN, 0};
+    struct timeval timeout = {0, SEND_POLL_MS * 1000};
+
+    // Без таймаута send на блокирующем сокете ждал бы клиента, который не читает, бесконечно
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // Ждём запрос недолго, чтобы медленный клиент не остановил обновление снимка
+    if (poll(&fd, 1, 200) > 0) {
+        ssize_t length = read(client, request, sizeof(request));
+        (void)length;
+    }
+    g_mutex_lock(&server->lock);
+    gchar *response = g_strdup_printf("HTTP/1.0 200 OK\r\n"
+                                      "Content-Type: text/plain; version=0.0.4\r\n"
+                                      "Content-Length: %" G_GSIZE_FORMAT "\r\n"
+                                      "Connection: close\r\n\r\n%s",
+                                      server->snapshot->len, server->snapshot->str);
+    g_mutex_unlock(&server->lock);
+
+    // MSG_NOSIGNAL: клиент, закрывший соединение раньше времени, не должен убить процесс SIGPIPE.
+    // Прерванную или не прошедшую за таймаут отправку продолжаем, пока не выйдет срок ответа
+    size_t total = strlen(response), sent = 0;
+    gint64 deadline = g_get_monotonic_time() + SEND_DEADLINE_MS * 1000;
+    while (sent < total) {
+        ssize_t n = send(client, response + sent, total - sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            sent += (size_t)n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && g_get_monotonic_time() < deadline) {
+            struct pollfd out = {client, POLLOUT, 0};
+            poll(&out, 1, SEND_POLL_MS);
+        } else {
+            break;
+        }
+    }
+    g_free(response);
+    close(client);
+    server->scrapes++;
+}
+
+static gpointer metrics_thread(gpointer data) {
+    MetricsServer *server = data;
+    gint64 next_refresh = g_get_monotonic_time();
+
+    while (TRUE) {
+        struct pollfd fds[2] = {
+            {server->wake[0], POLLIN, 0},
+            {server->listen_fd, POLLIN, 0}
+        };
+        nfds_t count = server->listen_fd >= 0 ? 2 : 1;
+        gint64 now = g_get_monotonic_time();
+
+        if (now >= next_refresh) {
+            refresh(server);
+            next_refresh = now + (gint64)server->interval_ms * 1000;
+        }
+        int timeout = (int)((next_refresh - now + 999) / 1000);
+        if (poll(fds, count, MAX(timeout, 0)) < 0 && errno != EINTR) {
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            break;
+        }
+        if (count > 1 && (fds[1].revents & POLLIN)) {
+            int client = accept(server->listen_fd, NULL, NULL);
+            if (client >= 0) {
+                serve(server, client);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Слушаем только на loopback: метрики не должны быть видны снаружи машины
+static int open_listener(int port) {
+    struct sockaddr_in address;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0) {
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t)port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, 8) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int metrics_server_start(MetricsServer *server, int port, const char *file, guint interval_ms,
+                         MetricsCollect collect, gpointer data) {
+    server->collect = collect;
+    server->data = data;
+    server->interval_ms = interval_ms > 0 ? interval_ms : 1000;
+    server->listen_fd = -1;
+    server->scrapes = 0;
+    g_strlcpy(server->file, file, sizeof(server->file));
+    if (port > 0) {
+        server->listen_fd = open_listener(port);
+        if (server->listen_fd < 0) {
+            g_printerr("Failed to listen for metrics on 127.0.0.1:%d.\n", port);
+            return -1;
+        }
+    }
+    if (pipe(server->wake) != 0) {
+        if (server->listen_fd >= 0) {
+            close(server->listen_fd);
+        }
+        return -1;
+    }
+    g_mutex_init(&server->lock);
+    server->snapshot = g_string_new(NULL);
+    server->thread = g_thread_new("metrics", metrics_thread, server);
+    return 0;
+}
+
+void metrics_server_stop(MetricsServer *server) {
+    char command = 'q';
+
+    if (server->thread == NULL) {
+        return;
+    }
+    if (write(server->wake[1], &command, 1) == 1) {
+        g_thread_join(server->thread);
+    }
+    server->thread = NULL;
+    close(server->wake[0]);
+    close(server->wake[1]);
+    if (server->listen_fd >= 0) {
+        close(server->listen_fd);
+    }
+    g_string_free(server->snapshot, TRUE);
+    g_mutex_clear(&server->lock);
+}
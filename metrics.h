@@ -0,0 +1,31 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <glib.h>
+
+#define METRICS_PATH_LENGTH 256
+
+// Собирает метрики в текст формата Prometheus; вызывается только из потока метрик
+typedef void (*MetricsCollect)(GString *out, gpointer data);
+
+// Поток метрик: раз в interval_ms собирает снимок, переписывает файл и отдаёт
+// последний снимок по HTTP на 127.0.0.1:port. Потоки конвейера он не трогает
+typedef struct {
+    MetricsCollect collect;
+    gpointer data;
+    guint interval_ms;
+    int listen_fd;  // -1, если порт не задан
+    char file[METRICS_PATH_LENGTH]; // "" = без файла
+    int wake[2];    // канал для остановки потока
+    GThread *thread;
+    GMutex lock;
+    GString *snapshot;
+    guint64 scrapes;
+} MetricsServer;
+
+// port = 0 - без HTTP, file = "" - без файла. 0 - успешно
+int metrics_server_start(MetricsServer *server, int port, const char *file, guint interval_ms,
+                         MetricsCollect collect, gpointer data);
+void metrics_server_stop(MetricsServer *server);
+
+#endif
@@ -0,0 +1,218 @@
+#include "replay.h"
+
+#include <gst/app/gstappsrc.h>
+
+// GOP: ключевой кадр и зависящие от него кадры
+typedef struct {
+    GPtrArray *buffers;
+    gsize bytes;
+    GstClockTime start;
+    GstClockTime end;
+} ReplayGop;
+
+static GstClockTime buffer_time(GstBuffer *buffer) {
+    return GST_BUFFER_DTS_IS_VALID(buffer) ? GST_BUFFER_DTS(buffer) : GST_BUFFER_PTS(buffer);
+}
+
+static void replay_gop_free(ReplayGop *gop) {
+    g_ptr_array_free(gop->buffers, TRUE);
+    g_free(gop);
+}
+
+void replay_ring_init(ReplayRing *ring, GstClockTime max_duration, gsize max_bytes) {
+    g_mutex_init(&ring->lock);
+    g_queue_init(&ring->gops);
+    ring->caps = NULL;
+    ring->bytes = 0;
+    ring->peak_bytes = 0;
+    ring->max_bytes = max_bytes;
+    ring->max_duration = max_duration;
+    ring->gops_evicted = 0;
+}
+
+// Вызывается под lock
+static void drop_all(ReplayRing *ring) {
+    ReplayGop *gop;
+
+    while ((gop = g_queue_pop_head(&ring->gops)) != NULL) {
+        replay_gop_free(gop);
+    }
+    ring->bytes = 0;
+}
+
+void replay_ring_clear(ReplayRing *ring) {
+    g_mutex_lock(&ring->lock);
+    drop_all(ring);
+    gst_caps_replace(&ring->caps, NULL);
+    g_mutex_unlock(&ring->lock);
+    g_mutex_clear(&ring->lock);
+}
+
+void replay_ring_push(ReplayRing *ring, GstCaps *caps, GstBuffer *buffer) {
+    gboolean keyframe = !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+    gsize size = gst_buffer_get_size(buffer);
+    GstClockTime time = buffer_time(buffer);
+    ReplayGop *gop;
+
+    g_mutex_lock(&ring->lock);
+
+    // Новые caps (например, другой codec_data) несовместимы со старыми кадрами
+    if (caps != NULL && (ring->caps == NULL || !gst_caps_is_equal(caps, ring->caps))) {
+        drop_all(ring);
+        gst_caps_replace(&ring->caps, caps);
+    }
+
+    if (keyframe) {
+        gop = g_new0(ReplayGop, 1);
+        gop->buffers = g_ptr_array_new_with_free_func((GDestroyNotify)gst_buffer_unref);
+        gop->start = time;
+        g_queue_push_tail(&ring->gops, gop);
+    }
+    gop = g_queue_peek_tail(&ring->gops);
+    if (gop == NULL) {
+        g_mutex_unlock(&ring->lock);
+        return;
+    }
+    g_ptr_array_add(gop->buffers, gst_buffer_ref(buffer));
+    gop->bytes += size;
+    if (GST_CLOCK_TIME_IS_VALID(time)) {
+        gop->end = time + (GST_BUFFER_DURATION_IS_VALID(buffer) ? GST_BUFFER_DURATION(buffer) : 0);
+    }
+    ring->bytes += size;
+
+    // Старый GOP уходит, если без него всё ещё остаётся нужная длительность,
+    // или если кольцо не помещается в память. Текущий GOP не вытесняется никогда
+    while (g_queue_get_length(&ring->gops) > 1) {
+        ReplayGop *oldest = g_queue_peek_head(&ring->gops);
+        ReplayGop *next = g_queue_peek_nth(&ring->gops, 1);
+        GstClockTime end = ((ReplayGop*)g_queue_peek_tail(&ring->gops))->end;
+        gboolean long_enough = GST_CLOCK_TIME_IS_VALID(next->start) && end >= next->start &&
+                               end - next->start >= ring->max_duration;
+
+        if (!long_enough && (ring->max_bytes == 0 || ring->bytes <= ring->max_bytes)) {
+            break;
+        }
+        g_queue_pop_head(&ring->gops);
+        ring->bytes -= oldest->bytes;
+        ring->gops_evicted++;
+        replay_gop_free(oldest);
+    }
+    if (ring->bytes > ring->peak_bytes) {
+        ring->peak_bytes = ring->bytes;
+    }
+    g_mutex_unlock(&ring->lock);
+}
+
+GstClockTime replay_ring_duration(ReplayRing *ring) {
+    GstClockTime duration = 0;
+
+    g_mutex_lock(&ring->lock);
+    ReplayGop *first = g_queue_peek_head(&ring->gops);
+    ReplayGop *last = g_queue_peek_tail(&ring->gops);
+    if (first != NULL && GST_CLOCK_TIME_IS_VALID(first->start) && last->end > first->start) {
+        duration = last->end - first->start;
+    }
+    g_mutex_unlock(&ring->lock);
+    return duration;
+}
+
+gboolean replay_ring_snapshot(ReplayRing *ring, ReplaySnapshot *snapshot) {
+    snapshot->caps = NULL;
+    snapshot->buffers = g_ptr_array_new_with_free_func((GDestroyNotify)gst_buffer_unref);
+    snapshot->bytes = 0;
+    snapshot->duration = 0;
+
+    g_mutex_lock(&ring->lock);
+    for (GList *link = ring->gops.head; link != NULL; link = link->next) {
+        ReplayGop *gop = link->data;
+        for (guint i = 0; i < gop->buffers->len; i++) {
+            g_ptr_array_add(snapshot->buffers, gst_buffer_ref(g_ptr_array_index(gop->buffers, i)));
+        }
+        snapshot->bytes += gop->bytes;
+    }
+    if (ring->caps != NULL) {
+        snapshot->caps = gst_caps_ref(ring->caps);
+    }
+    ReplayGop *first = g_queue_peek_head(&ring->gops);
+    ReplayGop *last = g_queue_peek_tail(&ring->gops);
+    if (first != NULL && GST_CLOCK_TIME_IS_VALID(first->start) && last->end > first->start) {
+        snapshot->duration = last->end - first->start;
+    }
+    g_mutex_unlock(&ring->lock);
+
+    return snapshot->buffers->len > 0 && snapshot->caps != NULL;
+}
+
+void replay_snapshot_clear(ReplaySnapshot *snapshot) {
+    if (snapshot->buffers != NULL) {
+        g_ptr_array_free(snapshot->buffers, TRUE);
+        snapshot->buffers = NULL;
+    }
+    gst_caps_replace(&snapshot->caps, NULL);
+}
+
+int replay_snapshot_write(const ReplaySnapshot *snapshot, const char *muxer_name, const char *location) {
+    GstElement *dump = gst_pipeline_new("replay-dump");
+    GstElement *src = gst_element_factory_make("appsrc", NULL);
+    GstElement *mux = gst_element_factory_make(muxer_name, NULL);
+    GstElement *sink = gst_element_factory_make("filesink", NULL);
+    int result = 0;
+
+    if (!dump || !src || !mux || !sink) {
+        g_printerr("Failed to create replay dump elements.\n");
+        if (dump) {
+            gst_object_unref(dump);
+        }
+        return -1;
+    }
+    g_object_set(src, "caps", snapshot->caps, "format", GST_FORMAT_TIME, NULL);
+    g_object_set(sink, "location", location, NULL);
+    gst_bin_add_many(GST_BIN(dump), src, mux, sink, NULL);
+    if (!gst_element_link_many(src, mux, sink, NULL)) {
+        g_printerr("Failed to link replay dump pipeline.\n");
+        gst_object_unref(dump);
+        return -1;
+    }
+    gst_element_set_state(dump, GST_STATE_PLAYING);
+
+    // Время в файле начинается с нуля: сдвигаем метки на начало первого GOP
+    GstBuffer *first = g_ptr_array_index(snapshot->buffers, 0);
+    GstClockTime base = buffer_time(first);
+    for (guint i = 0; i < snapshot->buffers->len; i++) {
+        GstBuffer *buffer = gst_buffer_copy(g_ptr_array_index(snapshot->buffers, i));
+        if (GST_BUFFER_PTS_IS_VALID(buffer) && GST_CLOCK_TIME_IS_VALID(base)) {
+            GST_BUFFER_PTS(buffer) = GST_BUFFER_PTS(buffer) >= base ? GST_BUFFER_PTS(buffer) - base : 0;
+        }
+        if (GST_BUFFER_DTS_IS_VALID(buffer) && GST_CLOCK_TIME_IS_VALID(base)) {
+            GST_BUFFER_DTS(buffer) = GST_BUFFER_DTS(buffer) >= base ? GST_BUFFER_DTS(buffer) - base : 0;
+        }
+        if (gst_app_src_push_buffer(GST_APP_SRC(src), buffer) != GST_FLOW_OK) {
+            result = -1;
+            break;
+        }
+    }
+    gst_app_src_end_of_stream(GST_APP_SRC(src));
+
+    GstBus *bus = gst_element_get_bus(dump);
+    GstMessage *msg = gst_bus_timed_pop_filtered(bus, 30 * GST_SECOND, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+    if (msg == NULL || GST_MESSAGE_TYPE(msg) != GST_MESSAGE_EOS) {
+        if (msg != NULL) {
+            GError *err;
+            gchar *debug_info;
+            gst_message_parse_error(msg, &err, &debug_info);
+            g_printerr("Replay dump error: %s\n", err->message);
+            g_error_free(err);
+            g_free(debug_info);
+        } else {
+            g_printerr("Replay dump timed out.\n");
+        }
+        result = -1;
+    }
+    if (msg != NULL) {
+        gst_message_unref(msg);
+    }
+    gst_object_unref(bus);
+    gst_element_set_state(dump, GST_STATE_NULL);
+    gst_object_unref(dump);
+    return result;
+}
@@ -0,0 +1,41 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <gst/gst.h>
+
+// Кольцо закодированных GOP одной ветки: всегда начинается с ключевого кадра,
+// старые GOP вытесняются по длительности и по памяти
+typedef struct {
+    GMutex lock;
+    GQueue gops;          // ReplayGop*, от старых к новым
+    GstCaps *caps;        // caps закодированного потока, NULL до первого кадра
+    gsize bytes;
+    gsize peak_bytes;
+    gsize max_bytes;
+    GstClockTime max_duration;
+    guint64 gops_evicted;
+} ReplayRing;
+
+// Снимок кольца для записи в файл: буферы только со ссылками, без копирования данных
+typedef struct {
+    GstCaps *caps;
+    GPtrArray *buffers;
+    gsize bytes;
+    GstClockTime duration;
+} ReplaySnapshot;
+
+void replay_ring_init(ReplayRing *ring, GstClockTime max_duration, gsize max_bytes);
+void replay_ring_clear(ReplayRing *ring);
+// Добавляет закодированный буфер; до первого ключевого кадра буферы отбрасываются
+void replay_ring_push(ReplayRing *ring, GstCaps *caps, GstBuffer *buffer);
+GstClockTime replay_ring_duration(ReplayRing *ring);
+
+// Снимок текущего содержимого; FALSE, если кольцо пустое
+gboolean replay_ring_snapshot(ReplayRing *ring, ReplaySnapshot *snapshot);
+void replay_snapshot_clear(ReplaySnapshot *snapshot);
+
+// Записывает снимок в файл через appsrc ! muxer ! filesink в отдельном конвейере,
+// захват при этом не останавливается. 0 - успешно
+int replay_snapshot_write(const ReplaySnapshot *snapshot, const char *muxer_name, const char *location);
+
+#endif
@@ -0,0 +1,290 @@
+#include "scheduler.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Разбирает список "0-3,8" (разделители ',' и '+') в набор ядер
+static int parse_cpu_list(const char *str, cpu_set_t *cpus) {
+    const char *p = str;
+
+    CPU_ZERO(cpus);
+    while (*p != '\0') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+
+        if (end == p || first < 0 || first >= CPU_SETSIZE) {
+            return 0;
+        }
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first || last >= CPU_SETSIZE) {
+                return 0;
+            }
+            p = end;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, cpus);
+        }
+        if (*p == ',' || *p == '+') {
+            p++;
+        } else if (*p != '\0' && *p != '\n') {
+            return 0;
+        } else {
+            break;
+        }
+    }
+    return CPU_COUNT(cpus) > 0;
+}
+
+int thread_placement_parse_cpus(const char *str, ThreadPlacement *placement) {
+    if (strcmp(str, "none") == 0) {
+        placement->has_cpus = 0;
+        return 1;
+    }
+    if (strncmp(str, "node:", 5) == 0) {
+        // Ядра узла NUMA берём из sysfs, без libnuma
+        char path[64], list[256];
+        char *end;
+        long node = strtol(str + 5, &end, 10);
+        FILE *file;
+
+        if (end == str + 5 || *end != '\0' || node < 0) {
+            return 0;
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%ld/cpulist", node);
+        file = fopen(path, "r");
+        if (file == NULL) {
+            return 0;
+        }
+        if (fgets(list, sizeof(list), file) == NULL) {
+            fclose(file);
+            return 0;
+        }
+        fclose(file);
+        placement->has_cpus = parse_cpu_list(list, &placement->cpus);
+        return placement->has_cpus;
+    }
+    placement->has_cpus = parse_cpu_list(str, &placement->cpus);
+    return placement->has_cpus;
+}
+
+int thread_placement_parse_priority(const char *str, ThreadPlacement *placement) {
+    char *end;
+
+    if (strcmp(str, "none") == 0) {
+        placement->priority_kind = THREAD_PRIORITY_NONE;
+        return 1;
+    }
+    if (strncmp(str, "rt:", 3) == 0) {
+        placement->priority = (int)strtol(str + 3, &end, 10);
+        if (end == str + 3 || *end != '\0' || placement->priority < 1 || placement->priority > 99) {
+            return 0;
+        }
+        placement->priority_kind = THREAD_PRIORITY_REALTIME;
+        return 1;
+    }
+    if (strncmp(str, "nice:", 5) == 0) {
+        placement->priority = (int)strtol(str + 5, &end, 10);
+        if (end == str + 5 || *end != '\0' || placement->priority < -20 || placement->priority > 19) {
+            return 0;
+        }
+        placement->priority_kind = THREAD_PRIORITY_NICE;
+        return 1;
+    }
+    return 0;
+}
+
+int thread_placement_cpu_count(const ThreadPlacement *placement) {
+    if (placement->has_cpus) {
+        return CPU_COUNT(&placement->cpus);
+    }
+    return (int)g_get_num_processors();
+}
+
+int thread_placement_apply(const ThreadPlacement *placement) {
+    int result = 0;
+
+    // Потоки, которые создаст этот поток (пулы videoconvert и fastscaleconvert), наследуют affinity
+    if (placement->has_cpus && pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &placement->cpus) != 0) {
+        result = -1;
+    }
+    if (placement->priority_kind == THREAD_PRIORITY_REALTIME) {
+        struct sched_param param;
+        param.sched_priority = placement->priority;
+        if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0) {
+            result = -1;
+        }
+    } else if (placement->priority_kind == THREAD_PRIORITY_NICE) {
+        // В Linux nice относится к потоку, если передать его tid
+        if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), placement->priority) != 0) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+// Читает /proc/self/task/<tid>/stat и возвращает числовое поле с номером field (с 1), -1 при ошибке
+static long long task_stat_field(pid_t tid, int field) {
+    char path[64], buffer[1024];
+    FILE *file;
+    size_t length;
+
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stat", (int)tid);
+    file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    length = fread(buffer, 1, sizeof(buffer) - 1, file);
+    fclose(file);
+    buffer[length] = '\0';
+
+    // Имя потока может содержать пробелы, поэтому считаем поля после последней ')'
+    char *p = strrchr(buffer, ')');
+    if (p == NULL) {
+        return -1;
+    }
+    int index = 2;
+    char *saveptr;
+    char *token = strtok_r(p + 1, " ", &saveptr);
+    while (token != NULL) {
+        index++;
+        if (index == field) {
+            return atoll(token);
+        }
+        token = strtok_r(NULL, " ", &saveptr);
+    }
+    return -1;
+}
+
+// Номер ядра, на котором поток работал последним: поле 39
+static int last_cpu(pid_t tid) {
+    return (int)task_stat_field(tid, 39);
+}
+
+static gpointer sampler_thread(gpointer data) {
+    ThreadMonitor *monitor = data;
+
+    while (g_atomic_int_get(&monitor->running)) {
+        g_mutex_lock(&monitor->lock);
+        for (int i = 0; i < monitor->count; i++) {
+            int cpu = last_cpu(monitor->threads[i].tid);
+            if (cpu >= 0 && cpu < CPU_SETSIZE) {
+                CPU_SET(cpu, &monitor->threads[i].seen);
+                monitor->threads[i].samples++;
+            }
+        }
+        g_mutex_unlock(&monitor->lock);
+        g_usleep(monitor->interval_ms * 1000);
+    }
+    return NULL;
+}
+
+void thread_monitor_start(ThreadMonitor *monitor, guint interval_ms) {
+    g_mutex_init(&monitor->lock);
+    monitor->count = 0;
+    monitor->interval_ms = interval_ms > 0 ? interval_ms : 100;
+    g_atomic_int_set(&monitor->running, 1);
+    monitor->sampler = g_thread_new("thread-sampler", sampler_thread, monitor);
+}
+
+void thread_monitor_register(ThreadMonitor *monitor, const char *role, const char *name, int placement_failed) {
+    g_mutex_lock(&monitor->lock);
+    if (monitor->count < MAX_MONITORED_THREADS) {
+        MonitoredThread *thread = &monitor->threads[monitor->count++];
+        g_strlcpy(thread->role, role, sizeof(thread->role));
+        g_strlcpy(thread->name, name, sizeof(thread->name));
+        thread->tid = (pid_t)syscall(SYS_gettid);
+        thread->placement_failed = placement_failed;
+        pthread_getaffinity_np(pthread_self(), sizeof(thread->allowed), &thread->allowed);
+        thread->policy = sched_getscheduler(0);
+        errno = 0;
+        thread->nice = getpriority(PRIO_PROCESS, (id_t)thread->tid);
+        CPU_ZERO(&thread->seen);
+        thread->samples = 0;
+    }
+    g_mutex_unlock(&monitor->lock);
+}
+
+void thread_monitor_stop(ThreadMonitor *monitor) {
+    if (monitor->sampler == NULL) {
+        return;
+    }
+    g_atomic_int_set(&monitor->running, 0);
+    g_thread_join(monitor->sampler);
+    monitor->sampler = NULL;
+}
+
+// Печатает набор ядер диапазонами: "2-3,8"
+static void format_cpus(const cpu_set_t *cpus, char *out, size_t size) {
+    size_t used = 0;
+
+    out[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE && used < size; cpu++) {
+        if (!CPU_ISSET(cpu, cpus)) {
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, cpus)) {
+            last++;
+        }
+        if (last > cpu) {
+            used += snprintf(out + used, size - used, "%s%d-%d", used > 0 ? "," : "", cpu, last);
+        } else {
+            used += snprintf(out + used, size - used, "%s%d", used > 0 ? "," : "", cpu);
+        }
+        cpu = last;
+    }
+}
+
+double thread_cpu_seconds(pid_t tid) {
+    // utime и stime - поля 14 и 15, в тиках часов
+    long long utime = task_stat_field(tid, 14);
+    long long stime = task_stat_field(tid, 15);
+
+    if (utime < 0 || stime < 0) {
+        return 0.0;
+    }
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+double thread_monitor_role_cpu_seconds(ThreadMonitor *monitor, const char *role) {
+    double seconds = 0.0;
+
+    g_mutex_lock(&monitor->lock);
+    for (int i = 0; i < monitor->count; i++) {
+        if (strcmp(monitor->threads[i].role, role) == 0) {
+            seconds += thread_cpu_seconds(monitor->threads[i].tid);
+        }
+    }
+    g_mutex_unlock(&monitor->lock);
+    return seconds;
+}
+
+void thread_monitor_report(ThreadMonitor *monitor) {
+    char seen[128], allowed[128];
+
+    if (monitor->sampler == NULL && monitor->count == 0) {
+        return;
+    }
+    g_print("Thread placement report:\n");
+    g_mutex_lock(&monitor->lock);
+    for (int i = 0; i < monitor->count; i++) {
+        MonitoredThread *thread = &monitor->threads[i];
+
+        format_cpus(&thread->seen, seen, sizeof(seen));
+        format_cpus(&thread->allowed, allowed, sizeof(allowed));
+        g_print("  %-10s %-14s tid %d: ran on %s (%" G_GUINT64_FORMAT " samples), allowed %s, %s nice %d%s\n",
+                thread->role, thread->name, (int)thread->tid, seen[0] != '\0' ? seen : "-", thread->samples,
+                allowed, thread->policy == SCHED_FIFO ? "SCHED_FIFO" : thread->policy == SCHED_RR ? "SCHED_RR" : "SCHED_OTHER",
+                thread->nice, thread->placement_failed ? ", placement FAILED" : "");
+    }
+    g_mutex_unlock(&monitor->lock);
+}
@@ -0,0 +1,71 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <glib.h>
+#include <sched.h>
+#include <sys/types.h>
+
+#define THREAD_NAME_LENGTH 32
+#define MAX_MONITORED_THREADS 64
+
+// Приоритет потока: не трогать, SCHED_FIFO с приоритетом или nice
+typedef enum {
+    THREAD_PRIORITY_NONE,
+    THREAD_PRIORITY_REALTIME,
+    THREAD_PRIORITY_NICE
+} ThreadPriorityKind;
+
+// Куда и с каким приоритетом ставить поток
+typedef struct {
+    int has_cpus;
+    cpu_set_t cpus;
+    ThreadPriorityKind priority_kind;
+    int priority; // 1..99 для SCHED_FIFO, -20..19 для nice
+} ThreadPlacement;
+
+// Поток, о котором знает монитор, и ядра, на которых его видели
+typedef struct {
+    char role[THREAD_NAME_LENGTH]; // capture, branch N, output
+    char name[THREAD_NAME_LENGTH]; // элемент, владеющий потоком
+    pid_t tid;
+    int placement_failed;
+    cpu_set_t allowed; // affinity после размещения
+    int policy;        // SCHED_OTHER, SCHED_FIFO, ...
+    int nice;
+    cpu_set_t seen;
+    guint64 samples;
+} MonitoredThread;
+
+// Периодически смотрит, на каком ядре был каждый зарегистрированный поток
+typedef struct {
+    GMutex lock;
+    MonitoredThread threads[MAX_MONITORED_THREADS];
+    int count;
+    GThread *sampler;
+    volatile gint running;
+    guint interval_ms;
+} ThreadMonitor;
+
+// "0-3,8", "2+5" (в строке video_format) или "node:1"
+int thread_placement_parse_cpus(const char *str, ThreadPlacement *placement);
+// "none", "rt:N" или "nice:N"
+int thread_placement_parse_priority(const char *str, ThreadPlacement *placement);
+// Число ядер, на которых может работать поток; без affinity - все ядра
+int thread_placement_cpu_count(const ThreadPlacement *placement);
+// Применяет к вызывающему потоку; 0 - успешно
+int thread_placement_apply(const ThreadPlacement *placement);
+
+void thread_monitor_start(ThreadMonitor *monitor, guint interval_ms);
+// Вызывается из самого потока
+void thread_monitor_register(ThreadMonitor *monitor, const char *role, const char *name, int placement_failed);
+void thread_monitor_stop(ThreadMonitor *monitor);
+void thread_monitor_report(ThreadMonitor *monitor);
+// Процессорное время потока; пока поток жив
+double thread_cpu_seconds(pid_t tid);
+// Сумма по всем потокам роли ("capture", "branch 2", ...); вызывать до остановки конвейера
+double thread_monitor_role_cpu_seconds(ThreadMonitor *monitor, const char *role);
+
+#endif
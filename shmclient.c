@@ -0,0 +1,200 @@
+#define _GNU_SOURCE
+#include "shmclient.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Отображает кольцо client->name только на чтение
+static int map_ring(ShmClient *client) {
+    struct stat st;
+    const ShmRingHeader *header;
+    int fd = shm_open(client->name, O_RDONLY | O_CLOEXEC, 0);
+
+    if (fd < 0) {
+        return -1;
+    }
+    // Писатель сначала задаёт размер объекта, потом заполняет заголовок
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ShmRingHeader)) {
+        close(fd);
+        errno = EAGAIN;
+        return -1;
+    }
+    header = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    if (header->magic != SHM_RING_MAGIC) {
+        munmap((void*)header, (size_t)st.st_size);
+        close(fd);
+        errno = EAGAIN;
+        return -1;
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if (header->version != SHM_RING_VERSION || header->slot_count < 2 ||
+        header->slot_offset + (uint64_t)header->slot_count * header->slot_stride > (uint64_t)st.st_size) {
+        munmap((void*)header, (size_t)st.st_size);
+        close(fd);
+        errno = EPROTO;
+        return -1;
+    }
+    client->fd = fd;
+    client->header = header;
+    client->map_size = (size_t)st.st_size;
+    return 0;
+}
+
+static void unmap_ring(ShmClient *client) {
+    if (client->header != NULL) {
+        munmap((void*)client->header, client->map_size);
+        close(client->fd);
+        client->header = NULL;
+        client->fd = -1;
+    }
+}
+
+// Переходит на кольцо, созданное писателем вместо заменённого. Если новое ещё не готово,
+// остаётся на старом и попробует в следующий раз
+static int reopen_ring(ShmClient *client) {
+    ShmClient old = *client;
+
+    if (map_ring(client) != 0) {
+        return -1;
+    }
+    munmap((void*)old.header, old.map_size);
+    close(old.fd);
+    if (client->next < client->header->first) {
+        client->skipped += client->header->first - client->next;
+        client->next = client->header->first;
+    }
+    client->reopened++;
+    return 0;
+}
+
+// Копирует описание кадра frame и проверяет, что слот не перезаписывался во время копирования
+static int read_slot(ShmClient *client, uint64_t number, ShmClientFrame *frame) {
+    const ShmRingHeader *header = client->header;
+    const ShmRingSlot *slot = shm_ring_slot(header, number);
+    uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+
+    if (sequence != 2 * number + 2) {
+        return 0;
+    }
+    memcpy(&frame->info, &slot->info, sizeof(ShmFrameInfo));
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&slot->sequence, memory_order_relaxed) != sequence ||
+        frame->info.size > header->data_capacity) {
+        return 0;
+    }
+    frame->data = (const uint8_t*)slot + header->data_offset;
+    frame->slot = slot;
+    frame->sequence = sequence;
+    return 1;
+}
+
+int shm_client_open(ShmClient *client, const char *name) {
+    memset(client, 0, sizeof(*client));
+    client->fd = -1;
+    if (shm_ring_name(name, client->name) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (map_ring(client) != 0) {
+        return -1;
+    }
+    uint64_t published = atomic_load_explicit(&client->header->published, memory_order_acquire);
+    client->next = published > client->header->first ? published - 1 : client->header->first;
+    return 0;
+}
+
+void shm_client_close(ShmClient *client) {
+    unmap_ring(client);
+}
+
+int shm_client_next(ShmClient *client, ShmClientFrame *frame) {
+    if (client->header == NULL) {
+        return SHM_CLIENT_ERROR;
+    }
+    // Каждая неудачная попытка продвигает next, так что цикл конечен
+    while (1) {
+        const ShmRingHeader *header = client->header;
+        // Состояние читается до published: REPLACED и CLOSED пишутся после последнего кадра кольца
+        uint32_t state = atomic_load_explicit(&header->state, memory_order_acquire);
+        uint64_t published = atomic_load_explicit(&header->published, memory_order_acquire);
+
+        // Писатель помечает кольцо заменённым, когда новое уже готово: переходим сразу,
+        // оставшиеся в старом кольце кадры считаются пропущенными
+        if (state == SHM_RING_REPLACED) {
+            if (reopen_ring(client) == 0) {
+                continue;
+            }
+            // Нового кольца уже нет: писатель закрыл и его. Дочитываем старое
+            if (client->next >= published) {
+                return errno == ENOENT ? SHM_CLIENT_CLOSED : SHM_CLIENT_NONE;
+            }
+        } else if (client->next >= published) {
+            return state == SHM_RING_CLOSED ? SHM_CLIENT_CLOSED : SHM_CLIENT_NONE;
+        }
+        // Слот кадра published пишется сейчас, кадры до published - slot_count + 1 уже перезаписаны
+        uint64_t oldest = published - header->slot_count + 1;
+        if (published < header->slot_count || oldest < header->first) {
+            oldest = header->first;
+        }
+        if (client->next < oldest) {
+            client->skipped += published - 1 - client->next;
+            client->next = published - 1;
+        }
+        if (read_slot(client, client->next, frame)) {
+            client->received++;
+            client->next++;
+            return SHM_CLIENT_FRAME;
+        }
+        // Писатель обогнал нас во время чтения
+        client->skipped++;
+        client->next++;
+    }
+}
+
+int shm_client_latest(ShmClient *client, ShmClientFrame *frame) {
+    if (client->header == NULL) {
+        return SHM_CLIENT_ERROR;
+    }
+    if (atomic_load_explicit(&client->header->state, memory_order_acquire) == SHM_RING_REPLACED) {
+        reopen_ring(client);
+    }
+    uint64_t published = atomic_load_explicit(&client->header->published, memory_order_acquire);
+    if (published > client->next + 1) {
+        client->skipped += published - 1 - client->next;
+        client->next = published - 1;
+    }
+    return shm_client_next(client, frame);
+}
+
+int shm_client_wait(ShmClient *client, ShmClientFrame *frame, int timeout_ms) {
+    const struct timespec pause = {0, 1000000};
+    struct timespec start, now;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (1) {
+        int result = shm_client_next(client, frame);
+        if (result != SHM_CLIENT_NONE) {
+            return result;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (timeout_ms >= 0 &&
+            (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 >= timeout_ms) {
+            return SHM_CLIENT_NONE;
+        }
+        nanosleep(&pause, NULL);
+    }
+}
+
+int shm_client_frame_valid(const ShmClientFrame *frame) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&frame->slot->sequence, memory_order_relaxed) == frame->sequence;
+}
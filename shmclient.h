@@ -0,0 +1,60 @@
+#ifndef SHMCLIENT_H
+#define SHMCLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "shmring.h"
+
+// Читатель кольца кадров, которое выкладывает main (export= в video_format).
+// Отображает кольцо только на чтение и отдаёт указатель прямо на кадр в разделяемой памяти.
+// Писатель читателя не ждёт: кадр может быть перезаписан, пока его обрабатывают,
+// поэтому после обработки нужно проверить shm_client_frame_valid.
+// Библиотека не зависит от GStreamer и GLib: shmclient.c и этот заголовок
+// можно собрать в любой инструмент
+
+#define SHM_CLIENT_FRAME 1    // кадр получен
+#define SHM_CLIENT_NONE 0     // нового кадра ещё нет
+#define SHM_CLIENT_CLOSED -1  // писатель закрыл кольцо, кадров больше не будет
+#define SHM_CLIENT_ERROR -2
+
+typedef struct {
+    char name[SHM_RING_NAME_LENGTH];
+    int fd;
+    const ShmRingHeader *header;
+    size_t map_size;
+    uint64_t next;      // следующий кадр для shm_client_next
+    uint64_t received;
+    uint64_t skipped;   // кадры, перезаписанные писателем раньше, чем читатель до них дошёл
+    uint64_t reopened;  // сколько раз кольцо пересоздавалось под больший кадр
+} ShmClient;
+
+// Кадр в разделяемой памяти. info - копия, data указывает в кольцо
+typedef struct {
+    ShmFrameInfo info;
+    const uint8_t *data; // info.size байтов, плоскость p начинается с data + info.offset[p]
+    const ShmRingSlot *slot;
+    uint64_t sequence;
+} ShmClientFrame;
+
+// Открывает кольцо по имени ("ocr" или "/ocr"). Первым будет последний уже выложенный кадр.
+// 0 - успешно, -1 - кольца нет или оно ещё создаётся (errno)
+int shm_client_open(ShmClient *client, const char *name);
+void shm_client_close(ShmClient *client);
+
+// Следующий кадр по порядку. Отставший больше чем на кольцо читатель перескакивает к последнему
+// кадру, пропущенные считаются в skipped. Не блокирует. SHM_CLIENT_FRAME, NONE, CLOSED или ERROR
+int shm_client_next(ShmClient *client, ShmClientFrame *frame);
+
+// Последний выложенный кадр, всё до него пропускается
+int shm_client_latest(ShmClient *client, ShmClientFrame *frame);
+
+// shm_client_next с ожиданием до timeout_ms (-1 - без предела). Процесс отображает кольцо
+// только на чтение и не может ждать на нём futex, поэтому кольцо опрашивается каждую миллисекунду
+int shm_client_wait(ShmClient *client, ShmClientFrame *frame, int timeout_ms);
+
+// 1, если писатель ещё не начал перезаписывать слот кадра. Результат обработки кадра
+// можно использовать, только если после неё эта проверка вернула 1
+int shm_client_frame_valid(const ShmClientFrame *frame);
+
+#endif
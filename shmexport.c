@@ -0,0 +1,164 @@
+#include "shmexport.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static uint64_t page_align(uint64_t bytes) {
+    return (bytes + SHM_RING_PAGE - 1) / SHM_RING_PAGE * SHM_RING_PAGE;
+}
+
+// Отображение кольца, оставшегося под этим именем (например, от упавшего процесса),
+// с уже удалённым именем. NULL, если кольца не было
+static ShmRingHeader* unlink_existing(const char *name) {
+    ShmRingHeader *header = NULL;
+    int fd = shm_open(name, O_RDWR, 0);
+    struct stat st;
+
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(ShmRingHeader)) {
+        header = mmap(NULL, sizeof(ShmRingHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (header == MAP_FAILED || header->magic != SHM_RING_MAGIC) {
+            if (header != MAP_FAILED) {
+                munmap(header, sizeof(ShmRingHeader));
+            }
+            header = NULL;
+        }
+    }
+    close(fd);
+    shm_unlink(name);
+    return header;
+}
+
+// Создаёт объект под кадры до frame_bytes байтов; нумерация продолжается с exporter->published
+static int create_ring(ShmExport *exporter, uint64_t frame_bytes) {
+    uint64_t slot_offset = page_align(sizeof(ShmRingHeader));
+    uint64_t data_offset = page_align(sizeof(ShmRingSlot));
+    uint64_t slot_stride = data_offset + page_align(frame_bytes > 0 ? frame_bytes : 1);
+    size_t map_size = (size_t)(slot_offset + exporter->slot_count * slot_stride);
+    ShmRingHeader *header;
+    int fd;
+
+    // Кадры экрана читают только процессы того же пользователя и группы
+    fd = shm_open(exporter->name, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0640);
+    if (fd < 0) {
+        fprintf(stderr, "shm export %s: %s\n", exporter->name, strerror(errno));
+        return -1;
+    }
+    if (ftruncate(fd, (off_t)map_size) != 0) {
+        fprintf(stderr, "shm export %s: %s\n", exporter->name, strerror(errno));
+        close(fd);
+        shm_unlink(exporter->name);
+        return -1;
+    }
+    header = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        fprintf(stderr, "shm export %s: %s\n", exporter->name, strerror(errno));
+        close(fd);
+        shm_unlink(exporter->name);
+        return -1;
+    }
+
+    // ftruncate заполнил объект нулями: все слоты пусты
+    header->version = SHM_RING_VERSION;
+    header->slot_count = exporter->slot_count;
+    header->slot_offset = slot_offset;
+    header->slot_stride = slot_stride;
+    header->data_offset = data_offset;
+    header->data_capacity = slot_stride - data_offset;
+    header->first = exporter->published;
+    atomic_store_explicit(&header->published, exporter->published, memory_order_relaxed);
+    atomic_store_explicit(&header->state, SHM_RING_LIVE, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    header->magic = SHM_RING_MAGIC;
+
+    exporter->fd = fd;
+    exporter->header = header;
+    exporter->map_size = map_size;
+    return 0;
+}
+
+// Снимает отображение и имя, оставляя кольцо закрытым для тех, кто его ещё держит
+static void release_ring(ShmExport *exporter) {
+    if (exporter->header == NULL) {
+        return;
+    }
+    atomic_store_explicit(&exporter->header->state, SHM_RING_CLOSED, memory_order_release);
+    munmap(exporter->header, exporter->map_size);
+    close(exporter->fd);
+    shm_unlink(exporter->name);
+    exporter->header = NULL;
+    exporter->fd = -1;
+}
+
+int shm_export_open(ShmExport *exporter, const char *name, uint32_t slot_count, uint64_t frame_bytes) {
+    memset(exporter, 0, sizeof(*exporter));
+    exporter->fd = -1;
+    if (shm_ring_name(name, exporter->name) != 0) {
+        fprintf(stderr, "shm export: invalid name \"%s\"\n", name);
+        return -1;
+    }
+    // Читатель кадра published - 1 не должен делить слот с кадром, который пишется сейчас
+    exporter->slot_count = slot_count >= 2 ? slot_count : 2;
+    // Старое кольцо помечается заменённым только после того, как новое готово:
+    // читатель, увидевший REPLACED, сразу находит новое под тем же именем
+    ShmRingHeader *old = unlink_existing(exporter->name);
+    int result = create_ring(exporter, frame_bytes);
+    if (old != NULL) {
+        atomic_store_explicit(&old->state, SHM_RING_REPLACED, memory_order_release);
+        munmap(old, sizeof(ShmRingHeader));
+    }
+    return result;
+}
+
+int shm_export_publish(ShmExport *exporter, const ShmFrameInfo *info, const void *data) {
+    ShmRingHeader *header = exporter->header;
+
+    if (header == NULL) {
+        return -1;
+    }
+    if (info->size > header->data_capacity) {
+        // Как и при открытии, REPLACED ставится, когда новое кольцо уже готово
+        ShmRingHeader *old = header;
+        size_t old_size = exporter->map_size;
+        int old_fd = exporter->fd;
+
+        shm_unlink(exporter->name);
+        int result = create_ring(exporter, info->size);
+        atomic_store_explicit(&old->state, result == 0 ? SHM_RING_REPLACED : SHM_RING_CLOSED, memory_order_release);
+        munmap(old, old_size);
+        close(old_fd);
+        if (result != 0) {
+            exporter->header = NULL;
+            exporter->fd = -1;
+            return -1;
+        }
+        exporter->replaced++;
+        header = exporter->header;
+    }
+
+    uint64_t frame = exporter->published;
+    ShmRingSlot *slot = shm_ring_slot(header, frame);
+
+    // Нечётный номер закрывает слот на время записи; читатель, заставший его,
+    // или увидевший другой номер после чтения, отбрасывает кадр
+    atomic_store_explicit(&slot->sequence, 2 * frame + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->info = *info;
+    slot->info.frame = frame;
+    memcpy((uint8_t*)slot + header->data_offset, data, info->size);
+    atomic_store_explicit(&slot->sequence, 2 * frame + 2, memory_order_release);
+    atomic_store_explicit(&header->published, frame + 1, memory_order_release);
+    exporter->published = frame + 1;
+    return 0;
+}
+
+void shm_export_close(ShmExport *exporter) {
+    release_ring(exporter);
+}
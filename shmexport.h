@@ -0,0 +1,32 @@
+#ifndef SHMEXPORT_H
+#define SHMEXPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "shmring.h"
+
+// Писатель кольца кадров одной ветки. Кадр копируется в следующий слот, и читатели берут его
+// оттуда без копирования. Писатель никого не ждёт: медленный читатель просто пропускает кадры
+typedef struct {
+    char name[SHM_RING_NAME_LENGTH]; // имя объекта shm, с '/' в начале
+    uint32_t slot_count;
+    int fd;
+    ShmRingHeader *header;
+    size_t map_size;
+    uint64_t published;
+    uint64_t replaced;  // сколько раз кольцо пересоздавалось под больший кадр
+} ShmExport;
+
+// Создаёт кольцо из slot_count (не меньше 2) слотов под кадры до frame_bytes байтов. Старое
+// кольцо с тем же именем помечается заменённым, чтобы его читатели переоткрылись. 0 - успешно
+int shm_export_open(ShmExport *exporter, const char *name, uint32_t slot_count, uint64_t frame_bytes);
+
+// Выкладывает кадр: info->size байтов из data. Номер кадра ставит сам писатель.
+// Кадр больше слота пересоздаёт кольцо под его размер. 0 - успешно
+int shm_export_publish(ShmExport *exporter, const ShmFrameInfo *info, const void *data);
+
+// Помечает кольцо закрытым и удаляет имя; уже отобразившие его читатели дочитают последние кадры
+void shm_export_close(ShmExport *exporter);
+
+#endif
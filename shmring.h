@@ -0,0 +1,85 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+// Раскладка кольца кадров в разделяемой памяти (shm_open, /dev/shm/<имя>).
+// Пишет один процесс, читают любые локальные процессы, отобразив объект только на чтение.
+// Всё, что видят оба конца, лежит здесь; поля только фиксированного размера
+
+#define SHM_RING_MAGIC 0x474e5253u   // "SRNG"
+#define SHM_RING_VERSION 1
+#define SHM_RING_MAX_PLANES 4
+#define SHM_RING_FORMAT_LENGTH 16
+#define SHM_RING_CAPS_LENGTH 512
+#define SHM_RING_NAME_LENGTH 64
+#define SHM_RING_PAGE 4096           // данные кадров выровнены на страницу
+
+// Состояние кольца
+#define SHM_RING_LIVE 0
+#define SHM_RING_CLOSED 1            // писатель остановился, новых кадров не будет
+#define SHM_RING_REPLACED 2          // под тем же именем создано новое кольцо, его нужно открыть заново
+
+_Static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the ring needs lock-free 64-bit atomics shared between processes");
+
+// Описание кадра: caps, время и номер. Писатель заполняет, читатель получает копию
+typedef struct {
+    uint64_t frame;     // номер кадра с начала экспорта, без пропусков; сохраняется при пересоздании кольца
+    int64_t pts;        // нс, -1 = нет
+    int64_t duration;   // нс, -1 = нет
+    uint32_t width;
+    uint32_t height;
+    uint32_t n_planes;
+    uint32_t reserved;
+    uint64_t size;      // байты данных кадра
+    uint64_t offset[SHM_RING_MAX_PLANES]; // начало плоскости в данных кадра
+    int32_t stride[SHM_RING_MAX_PLANES];
+    char format[SHM_RING_FORMAT_LENGTH];  // формат GStreamer: I420, NV12, BGRx...
+    char caps[SHM_RING_CAPS_LENGTH];      // caps целиком, строкой
+} ShmFrameInfo;
+
+// Слот кольца. sequence - seqlock: 2 * frame + 1, пока писатель пишет слот, 2 * frame + 2,
+// когда кадр готов, 0 - слот ещё пуст. Данные идут с header->data_offset от начала слота
+typedef struct {
+    _Atomic uint64_t sequence;
+    uint64_t reserved;
+    ShmFrameInfo info;
+} ShmRingSlot;
+
+// Заголовок в начале объекта. Слоты идут с slot_offset через slot_stride.
+// magic записывается последним: кольцо без него ещё создаётся
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t reserved;
+    uint64_t slot_offset;
+    uint64_t slot_stride;
+    uint64_t data_offset;        // начало данных кадра внутри слота
+    uint64_t data_capacity;      // наибольший кадр, который помещается в слот
+    uint64_t first;              // номер первого кадра этого кольца
+    _Atomic uint64_t published;  // номер следующего кадра; последний готовый - published - 1
+    _Atomic uint32_t state;
+} ShmRingHeader;
+
+static inline ShmRingSlot* shm_ring_slot(const ShmRingHeader *header, uint64_t frame) {
+    return (ShmRingSlot*)((uint8_t*)header + header->slot_offset + (frame % header->slot_count) * header->slot_stride);
+}
+
+// Имя объекта shm: "ocr" и "/ocr" - одно и то же кольцо. -1, если имя пустое,
+// слишком длинное или содержит '/' после первого символа
+static inline int shm_ring_name(const char *name, char out[SHM_RING_NAME_LENGTH]) {
+    const char *base = name[0] == '/' ? name + 1 : name;
+    size_t length = strlen(base);
+
+    if (length == 0 || length + 1 >= SHM_RING_NAME_LENGTH || strchr(base, '/') != NULL) {
+        return -1;
+    }
+    out[0] = '/';
+    memcpy(out + 1, base, length + 1);
+    return 0;
+}
+
+#endif
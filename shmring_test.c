@@ -0,0 +1,310 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shmclient.h"
+#include "shmexport.h"
+
+#define CHECK_FRAMES 2000
+#define BENCH_FRAMES 600
+#define SLOTS 4
+#define SLOW_READER_US 5000 // медленный читатель тратит на кадр 5 мс
+#define PROBE_STEP 4096     // шаг проверки содержимого кадра
+
+typedef struct {
+    uint64_t received;
+    uint64_t skipped;
+    uint64_t torn;      // перезаписаны во время обработки и отброшены по shm_client_frame_valid
+    uint64_t corrupt;   // прошли проверку, но содержимое не того кадра
+    uint64_t disorder;  // номер кадра не вырос
+    uint64_t reopened;
+    uint64_t checksum;
+    double seconds;
+} ReaderResult;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Кадр I420 width x height: плоскости подряд, как их выдаёт ветка
+static void frame_info(ShmFrameInfo *info, int width, int height) {
+    memset(info, 0, sizeof(*info));
+    info->width = width;
+    info->height = height;
+    info->n_planes = 3;
+    info->stride[0] = width;
+    info->stride[1] = info->stride[2] = width / 2;
+    info->offset[1] = (uint64_t)width * height;
+    info->offset[2] = info->offset[1] + (uint64_t)width * height / 4;
+    info->size = info->offset[2] + (uint64_t)width * height / 4;
+    info->duration = 1000000000 / 30;
+    strcpy(info->format, "I420");
+    snprintf(info->caps, sizeof(info->caps), "video/x-raw, format=(string)I420, width=(int)%d, height=(int)%d", width, height);
+}
+
+// Содержимое зависит от номера кадра: байт номера везде и сам номер в начале и в конце
+static void fill_frame(uint8_t *data, uint64_t size, uint64_t frame) {
+    memset(data, (int)(frame & 0xff), size);
+    memcpy(data, &frame, sizeof(frame));
+    memcpy(data + size - sizeof(frame), &frame, sizeof(frame));
+}
+
+static int frame_matches(const uint8_t *data, uint64_t size, uint64_t frame) {
+    uint64_t head, tail;
+
+    memcpy(&head, data, sizeof(head));
+    memcpy(&tail, data + size - sizeof(tail), sizeof(tail));
+    if (head != frame || tail != frame) {
+        return 0;
+    }
+    for (uint64_t offset = PROBE_STEP; offset + sizeof(tail) < size; offset += PROBE_STEP) {
+        if (data[offset] != (uint8_t)(frame & 0xff)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Читает кольцо до закрытия. delay_us изображает обработку кадра; sum - прочитать кадр целиком
+static ReaderResult read_ring(const char *name, int ready_fd, int delay_us, int sum) {
+    ReaderResult result = {0};
+    ShmClient client;
+    ShmClientFrame frame;
+    uint64_t last = 0;
+    int have_last = 0;
+
+    if (shm_client_open(&client, name) != 0) {
+        perror("shm_client_open");
+        result.corrupt = 1;
+        return result;
+    }
+    if (write(ready_fd, "r", 1) != 1) {
+        result.corrupt = 1;
+    }
+    double start = now_seconds();
+    while (shm_client_wait(&client, &frame, 5000) == SHM_CLIENT_FRAME) {
+        if (sum) {
+            const uint64_t *words = (const uint64_t*)frame.data;
+            for (uint64_t i = 0; i < frame.info.size / sizeof(uint64_t); i++) {
+                result.checksum += words[i];
+            }
+        }
+        if (delay_us > 0) {
+            const struct timespec pause = {0, delay_us * 1000L};
+            nanosleep(&pause, NULL);
+        }
+        int matches = frame_matches(frame.data, frame.info.size, frame.info.frame);
+        if (!shm_client_frame_valid(&frame)) {
+            result.torn++;
+            continue;
+        }
+        if (!matches || frame.info.pts != (int64_t)(frame.info.frame * frame.info.duration)) {
+            result.corrupt++;
+        }
+        if (have_last && frame.info.frame <= last) {
+            result.disorder++;
+        }
+        last = frame.info.frame;
+        have_last = 1;
+    }
+    result.seconds = now_seconds() - start;
+    result.received = client.received;
+    result.skipped = client.skipped;
+    result.reopened = client.reopened;
+    shm_client_close(&client);
+    return result;
+}
+
+typedef struct {
+    pid_t pid;
+    int result_fd;
+} Reader;
+
+// Запускает читателя в отдельном процессе и ждёт, пока он отобразит кольцо
+static int start_reader(Reader *reader, const char *name, int delay_us, int sum) {
+    int ready[2], results[2];
+
+    if (pipe(ready) != 0 || pipe(results) != 0) {
+        return -1;
+    }
+    reader->pid = fork();
+    if (reader->pid < 0) {
+        return -1;
+    }
+    if (reader->pid == 0) {
+        close(ready[0]);
+        close(results[0]);
+        ReaderResult result = read_ring(name, ready[1], delay_us, sum);
+        ssize_t written = write(results[1], &result, sizeof(result));
+        _exit(written == sizeof(result) ? 0 : 1);
+    }
+    close(ready[1]);
+    close(results[1]);
+    char byte;
+    int ok = read(ready[0], &byte, 1) == 1;
+    close(ready[0]);
+    reader->result_fd = results[0];
+    return ok ? 0 : -1;
+}
+
+static int finish_reader(Reader *reader, ReaderResult *result) {
+    int status = 0;
+    int ok = read(reader->result_fd, result, sizeof(*result)) == sizeof(*result);
+
+    close(reader->result_fd);
+    waitpid(reader->pid, &status, 0);
+    return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+// Выкладывает frames кадров width x height без пауз; с frame switch_at кадры становятся
+// вдвое больше по каждой стороне, и кольцо пересоздаётся. Возвращает время записи
+static double write_frames(ShmExport *exporter, int width, int height, int frames, int switch_at) {
+    ShmFrameInfo info;
+    uint8_t *data = malloc((size_t)width * height * 6);
+    double start = now_seconds();
+
+    for (int i = 0; i < frames; i++) {
+        int scale = switch_at > 0 && i >= switch_at ? 2 : 1;
+        frame_info(&info, width * scale, height * scale);
+        info.pts = (int64_t)i * info.duration;
+        fill_frame(data, info.size, (uint64_t)i);
+        if (shm_export_publish(exporter, &info, data) != 0) {
+            fprintf(stderr, "FAIL publish frame %d\n", i);
+            break;
+        }
+    }
+    double seconds = now_seconds() - start;
+    free(data);
+    return seconds;
+}
+
+static int check_reader(const char *label, const ReaderResult *result, int frames) {
+    int failed = 0;
+
+    printf("%s reader: %llu received, %llu skipped, %llu torn, %llu reopened\n", label,
+           (unsigned long long)result->received, (unsigned long long)result->skipped,
+           (unsigned long long)result->torn, (unsigned long long)result->reopened);
+    if (result->received + result->skipped != (uint64_t)frames) {
+        fprintf(stderr, "FAIL %s reader accounted for %llu of %d frames\n", label,
+                (unsigned long long)(result->received + result->skipped), frames);
+        failed = 1;
+    }
+    if (result->corrupt > 0 || result->disorder > 0) {
+        fprintf(stderr, "FAIL %s reader: %llu frames with wrong content, %llu out of order\n", label,
+                (unsigned long long)result->corrupt, (unsigned long long)result->disorder);
+        failed = 1;
+    }
+    if (result->reopened != 1) {
+        fprintf(stderr, "FAIL %s reader did not follow the replaced ring\n", label);
+        failed = 1;
+    }
+    return failed;
+}
+
+// Быстрый и медленный читатели в других процессах. Писатель их не ждёт: медленный
+// пропускает кадры, каждый полученный кадр цел, а кольцо, пересозданное под больший кадр,
+// оба находят сами
+static int check_readers(void) {
+    const char *name = "shmring_test_check";
+    ShmExport exporter;
+    Reader fast, slow;
+    ReaderResult fast_result, slow_result;
+    int failed = 0;
+
+    if (shm_export_open(&exporter, name, SLOTS, 640 * 360 * 3 / 2) != 0) {
+        return 1;
+    }
+    if (start_reader(&fast, name, 0, 0) != 0 || start_reader(&slow, name, SLOW_READER_US, 0) != 0) {
+        fprintf(stderr, "FAIL starting readers\n");
+        return 1;
+    }
+    double seconds = write_frames(&exporter, 640, 360, CHECK_FRAMES, CHECK_FRAMES / 2);
+    if (exporter.replaced != 1) {
+        fprintf(stderr, "FAIL ring replaced %llu times\n", (unsigned long long)exporter.replaced);
+        failed = 1;
+    }
+    shm_export_close(&exporter);
+    if (finish_reader(&fast, &fast_result) != 0 || finish_reader(&slow, &slow_result) != 0) {
+        fprintf(stderr, "FAIL reader process\n");
+        return 1;
+    }
+
+    printf("%d frames written in %.3f s\n", CHECK_FRAMES, seconds);
+    failed |= check_reader("fast", &fast_result, CHECK_FRAMES);
+    failed |= check_reader("slow", &slow_result, CHECK_FRAMES);
+    if (slow_result.skipped == 0) {
+        fprintf(stderr, "FAIL slow reader skipped nothing\n");
+        failed = 1;
+    }
+    // Писатель, ждущий медленного читателя, писал бы не быстрее его
+    if (seconds >= CHECK_FRAMES * (SLOW_READER_US / 1e6) / 2) {
+        fprintf(stderr, "FAIL writer took %.3f s, it waits for the slow reader\n", seconds);
+        failed = 1;
+    }
+
+    ShmClient client;
+    if (shm_client_open(&client, name) == 0) {
+        fprintf(stderr, "FAIL ring name still exists after close\n");
+        shm_client_close(&client);
+        failed = 1;
+    }
+    return failed;
+}
+
+// Пропускная способность на кадрах 1080p I420: писатель один и с читателем,
+// который читает каждый кадр целиком прямо из кольца
+static void benchmark(void) {
+    const char *name = "shmring_test_bench";
+    const double gb = 1024.0 * 1024.0 * 1024.0;
+    const double frame_bytes = 1920 * 1080 * 3 / 2;
+    ShmExport exporter;
+    Reader reader;
+    ReaderResult result;
+
+    if (shm_export_open(&exporter, name, SLOTS, 1920 * 1080 * 3 / 2) != 0) {
+        return;
+    }
+    double alone = write_frames(&exporter, 1920, 1080, BENCH_FRAMES, 0);
+    shm_export_close(&exporter);
+    printf("1080p I420 writer alone        %8.1f fps, %5.2f GB/s\n",
+           BENCH_FRAMES / alone, BENCH_FRAMES * frame_bytes / gb / alone);
+
+    if (shm_export_open(&exporter, name, SLOTS, 1920 * 1080 * 3 / 2) != 0) {
+        return;
+    }
+    if (start_reader(&reader, name, 0, 1) != 0) {
+        shm_export_close(&exporter);
+        return;
+    }
+    double shared = write_frames(&exporter, 1920, 1080, BENCH_FRAMES, 0);
+    shm_export_close(&exporter);
+    if (finish_reader(&reader, &result) != 0) {
+        return;
+    }
+    printf("1080p I420 writer with reader  %8.1f fps, %5.2f GB/s\n",
+           BENCH_FRAMES / shared, BENCH_FRAMES * frame_bytes / gb / shared);
+    printf("1080p I420 zero-copy reader    %8.1f fps, %5.2f GB/s read, %llu of %d frames (%llu skipped)\n",
+           result.received / result.seconds, result.received * frame_bytes / gb / result.seconds,
+           (unsigned long long)result.received, BENCH_FRAMES, (unsigned long long)result.skipped);
+}
+
+int main(int argc, char *argv[]) {
+    int failed = 0;
+
+    // 1. Читатели в других процессах: целые кадры, пропуски у медленного, пересоздание кольца
+    failed |= check_readers();
+
+    // 2. Пропускная способность
+    if (argc < 2 || strcmp(argv[1], "--no-bench") != 0) {
+        benchmark();
+    }
+
+    printf(failed ? "FAILED\n" : "OK\n");
+    return failed;
+}
@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+#include <gst/gst.h>
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Останавливает main сигналом посреди записи и проверяет, что он выходит за срок
+// и что каждый сегмент записи читается: у mp4 без EOS в muxer нет индекса (moov)
+
+#define EXIT_MARGIN_MS 5000 // сверх двух сроков остановки: запуск, NULL и отчёты
+
+typedef struct {
+    const char *name;
+    const char *x264_preset;
+    int run_ms;            // сколько работать до сигнала
+    int drain_timeout_ms;
+    int signal_number;
+} ShutdownCase;
+
+static const ShutdownCase cases[] = {
+    // Кодировщик успевает: ветки опустеют сами
+    {"idle", "ultrafast", 3000, 5000, SIGINT},
+    // Кодировщик 1080p60 не успевает, очереди полны к сигналу: ветки останавливаются принудительно
+    {"overloaded", "veryslow", 3000, 300, SIGTERM}
+};
+
+static const struct {
+    int width;
+    int height;
+    int framerate;
+} branches[] = {
+    {1920, 1080, 60},
+    {1280, 720, 30},
+    {640, 360, 30}
+};
+
+static double now_ms(void) {
+    return g_get_monotonic_time() / 1000.0;
+}
+
+static int write_config(const char *path, const char *location, const ShutdownCase *test) {
+    FILE *file = fopen(path, "w");
+
+    if (file == NULL) {
+        g_printerr("FAIL %s: cannot write %s\n", test->name, path);
+        return 1;
+    }
+    for (size_t b = 0; b < sizeof(branches) / sizeof(branches[0]); b++) {
+        fprintf(file, "video_format=%dx%d, %d\n", branches[b].width, branches[b].height, branches[b].framerate);
+    }
+    fprintf(file, "source=videotestsrc\nsource_size=1920x1080, 60\nsource_live=1\n");
+    fprintf(file, "preview=1\npreview_sink=fakesink\n");
+    fprintf(file, "record=1\nencoder=x264\nx264_preset=%s\nsegment_seconds=2\nrecord_muxer=mp4\n", test->x264_preset);
+    fprintf(file, "record_location=%s\ndrain_timeout_ms=%d\n", location, test->drain_timeout_ms);
+    fclose(file);
+    return 0;
+}
+
+// Запускает main, через run_ms посылает сигнал и ждёт выхода. Время от сигнала до выхода в *exit_ms
+static int run_main(const char *main_path, const char *config_path, const char *log_path,
+                    const ShutdownCase *test, double *exit_ms) {
+    int status = 0;
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        g_printerr("FAIL %s: fork: %s\n", test->name, strerror(errno));
+        return 1;
+    }
+    if (pid == 0) {
+        int log = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (log >= 0) {
+            dup2(log, STDOUT_FILENO);
+            dup2(log, STDERR_FILENO);
+            close(log);
+        }
+        execl(main_path, main_path, config_path, (char*)NULL);
+        _exit(127);
+    }
+
+    g_usleep((gulong)test->run_ms * 1000);
+    double signalled = now_ms();
+    double limit = signalled + 2 * test->drain_timeout_ms + EXIT_MARGIN_MS;
+    kill(pid, test->signal_number);
+    while (waitpid(pid, &status, WNOHANG) == 0) {
+        if (now_ms() > limit) {
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+            g_printerr("FAIL %s: main did not exit %.0f ms after the signal\n", test->name, limit - signalled);
+            return 1;
+        }
+        g_usleep(10000);
+    }
+    *exit_ms = now_ms() - signalled;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        g_printerr("FAIL %s: main exited with status %d, see %s\n", test->name, status, log_path);
+        return 1;
+    }
+    return 0;
+}
+
+static GstPadProbeReturn count_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    (*(guint64*)user_data)++;
+    return GST_PAD_PROBE_OK;
+}
+
+// Сегмент читается до конца: demuxer находит индекс, парсер принимает кадры. Возвращает число кадров, -1 - ошибка
+static gint64 read_segment(const char *path) {
+    gchar *description = g_strdup_printf("filesrc location=\"%s\" ! qtdemux ! h264parse ! fakesink name=sink sync=false", path);
+    GError *error = NULL;
+    GstElement *pipeline = gst_parse_launch(description, &error);
+    guint64 frames = 0;
+    gint64 result = -1;
+
+    g_free(description);
+    if (error != NULL) {
+        g_printerr("Failed to create pipeline: %s\n", error->message);
+        g_error_free(error);
+        return -1;
+    }
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+    GstPad *pad = gst_element_get_static_pad(sink, "sink");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, count_probe, &frames, NULL);
+    gst_object_unref(pad);
+    gst_object_unref(sink);
+
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    GstBus *bus = gst_element_get_bus(pipeline);
+    GstMessage *msg = gst_bus_timed_pop_filtered(bus, 10 * GST_SECOND, GST_MESSAGE_ERROR | GST_MESSAGE_EOS);
+    if (msg != NULL && GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS) {
+        result = (gint64)frames;
+    } else if (msg != NULL) {
+        gst_message_parse_error(msg, &error, NULL);
+        g_printerr("%s: %s\n", path, error->message);
+        g_error_free(error);
+    } else {
+        g_printerr("%s: no EOS within 10 s\n", path);
+    }
+    if (msg != NULL) {
+        gst_message_unref(msg);
+    }
+    gst_object_unref(bus);
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(pipeline);
+    return result;
+}
+
+// Все сегменты каждой ветки читаются, у каждой ветки есть кадры
+static int check_segments(const char *dir, const ShutdownCase *test) {
+    int failed = 0;
+
+    for (size_t b = 0; b < sizeof(branches) / sizeof(branches[0]); b++) {
+        gchar *prefix = g_strdup_printf("rec_%dx%d_", branches[b].width, branches[b].height);
+        GDir *listing = g_dir_open(dir, 0, NULL);
+        const gchar *entry;
+        int segments = 0;
+        gint64 frames = 0;
+
+        while (listing != NULL && (entry = g_dir_read_name(listing)) != NULL) {
+            if (!g_str_has_prefix(entry, prefix)) {
+                continue;
+            }
+            gchar *path = g_build_filename(dir, entry, NULL);
+            gint64 read = read_segment(path);
+            if (read < 0) {
+                g_printerr("FAIL %s: %s is not playable\n", test->name, entry);
+                failed = 1;
+            } else {
+                frames += read;
+            }
+            segments++;
+            g_free(path);
+        }
+        if (listing != NULL) {
+            g_dir_close(listing);
+        }
+        if (frames == 0) {
+            g_printerr("FAIL %s: branch %dx%d recorded no frames in %d segments\n", test->name,
+                       branches[b].width, branches[b].height, segments);
+            failed = 1;
+        }
+        g_print("  %s %dx%d: %d segments, %" G_GINT64_FORMAT " frames\n", test->name,
+                branches[b].width, branches[b].height, segments, frames);
+        g_free(prefix);
+    }
+    return failed;
+}
+
+static void remove_dir(const char *dir) {
+    GDir *listing = g_dir_open(dir, 0, NULL);
+    const gchar *entry;
+
+    while (listing != NULL && (entry = g_dir_read_name(listing)) != NULL) {
+        gchar *path = g_build_filename(dir, entry, NULL);
+        g_remove(path);
+        g_free(path);
+    }
+    if (listing != NULL) {
+        g_dir_close(listing);
+    }
+    g_rmdir(dir);
+}
+
+static int check_case(const char *main_path, const ShutdownCase *test) {
+    gchar *dir = g_dir_make_tmp("shutdown_test_XXXXXX", NULL);
+    int failed = 0;
+    double exit_ms = 0.0;
+
+    if (dir == NULL) {
+        g_printerr("FAIL %s: cannot create a temporary directory\n", test->name);
+        return 1;
+    }
+    gchar *config_path = g_build_filename(dir, "config.txt", NULL);
+    gchar *log_path = g_build_filename(dir, "main.log", NULL);
+    gchar *location = g_build_filename(dir, "rec", NULL);
+
+    failed = write_config(config_path, location, test) || run_main(main_path, config_path, log_path, test, &exit_ms);
+    if (!failed) {
+        gchar *log = NULL;
+        g_file_get_contents(log_path, &log, NULL, NULL);
+        g_print("%s: exited %.0f ms after %s%s\n", test->name, exit_ms, strsignal(test->signal_number),
+                log != NULL && strstr(log, "forcing EOS into") != NULL ? ", branches forced to EOS" : "");
+        if (log == NULL || strstr(log, "Shutdown: pipeline finished") == NULL) {
+            g_printerr("FAIL %s: pipeline did not finish, see %s\n", test->name, log_path);
+            failed = 1;
+        }
+        g_free(log);
+        failed |= check_segments(dir, test);
+    }
+    // Журнал и сегменты остаются для разбора, если проверка не прошла
+    if (!failed) {
+        remove_dir(dir);
+    }
+    g_free(location);
+    g_free(log_path);
+    g_free(config_path);
+    g_free(dir);
+    return failed;
+}
+
+int main(int argc, char *argv[]) {
+    const char *main_path = "./main";
+    int failed = 0;
+
+    gst_init(&argc, &argv);
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) != 0) {
+            main_path = argv[i];
+        }
+    }
+    GstElementFactory *encoder = gst_element_factory_find("x264enc");
+    if (encoder == NULL) {
+        g_print("x264enc is not installed, skipping\nOK\n");
+        return 0;
+    }
+    gst_object_unref(encoder);
+
+    // 1. Сигнал посреди записи: выход за срок, все сегменты читаются
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        failed |= check_case(main_path, &cases[c]);
+    }
+
+    g_print(failed ? "FAILED\n" : "OK\n");
+    return failed;
+}
@@ -0,0 +1,217 @@
+#include "startup.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static GMutex factories_lock;
+static GHashTable *factories; // имя -> загруженная GstElementFactory
+
+// Флаги первых буферов: пробники срабатывают в потоках источников и веток
+static gint source_seen;
+static gint frame_seen;
+
+// Время от exec процесса до вызова main. starttime в /proc считается от загрузки системы
+// в тиках часов, поэтому точность - один тик (обычно 10 мс)
+static gint64 exec_to_main_us(void) {
+    char buffer[1024];
+    FILE *file = fopen("/proc/self/stat", "r");
+    struct timespec now;
+    unsigned long long start_ticks = 0;
+    long ticks_per_second = sysconf(_SC_CLK_TCK);
+
+    if (file == NULL) {
+        return -1;
+    }
+    size_t length = fread(buffer, 1, sizeof(buffer) - 1, file);
+    fclose(file);
+    buffer[length] = '\0';
+    // Имя процесса в скобках может содержать пробелы, поля считаются после последней ')'
+    char *field = strrchr(buffer, ')');
+    if (field == NULL || ticks_per_second <= 0 || clock_gettime(CLOCK_BOOTTIME, &now) != 0) {
+        return -1;
+    }
+    // После ')' идёт поле 3 (state), starttime - поле 22
+    for (int i = 3; i <= 22 && field != NULL; i++) {
+        field = strchr(field + 1, ' ');
+    }
+    if (field == NULL || sscanf(field, "%llu", &start_ticks) != 1) {
+        return -1;
+    }
+    gint64 now_us = (gint64)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    gint64 start_us = (gint64)(start_ticks * 1000000 / (unsigned long long)ticks_per_second);
+    return now_us > start_us ? now_us - start_us : 0;
+}
+
+void startup_profile_init(StartupProfile *profile, gint64 main_us) {
+    memset(profile, 0, sizeof(*profile));
+    profile->main_us = main_us;
+    profile->exec_us = exec_to_main_us();
+    profile->frame_point = "output";
+}
+
+void startup_mark(StartupProfile *profile, const char *phase) {
+    if (profile->count < STARTUP_MAX_PHASES) {
+        profile->names[profile->count] = phase;
+        profile->times_us[profile->count] = g_get_monotonic_time();
+        profile->count++;
+    }
+}
+
+static GstPadProbeReturn source_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    StartupProfile *profile = user_data;
+
+    (void)pad;
+    (void)info;
+    if (g_atomic_int_compare_and_exchange(&source_seen, 0, 1)) {
+        profile->first_source_us = g_get_monotonic_time();
+    }
+    return GST_PAD_PROBE_REMOVE;
+}
+
+static GstPadProbeReturn output_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    StartupProfile *profile = user_data;
+
+    (void)info;
+    if (g_atomic_int_compare_and_exchange(&frame_seen, 0, 1)) {
+        profile->first_frame_us = g_get_monotonic_time();
+        // Шина передаёт сообщение под своим мьютексом: main прочитает уже записанное время
+        GstElement *element = gst_pad_get_parent_element(pad);
+        gst_element_post_message(element, gst_message_new_application(GST_OBJECT(element),
+                                 gst_structure_new_empty("startup-first-frame")));
+        gst_object_unref(element);
+    }
+    return GST_PAD_PROBE_REMOVE;
+}
+
+static void attach_probe(GstElement *element, const char *pad_name, GstPadProbeCallback callback, StartupProfile *profile) {
+    GstPad *pad = gst_element_get_static_pad(element, pad_name);
+
+    if (pad == NULL) {
+        return;
+    }
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST, callback, profile, NULL);
+    gst_object_unref(pad);
+}
+
+void startup_attach_source(StartupProfile *profile, GstElement *element, const char *pad_name) {
+    attach_probe(element, pad_name, source_probe, profile);
+}
+
+void startup_attach_output(StartupProfile *profile, GstElement *element, const char *pad_name) {
+    attach_probe(element, pad_name, output_probe, profile);
+}
+
+void startup_profile_report(const StartupProfile *profile) {
+    gint64 previous = profile->main_us;
+
+    g_print("Startup profile, ms since main:\n");
+    if (profile->exec_us >= 0) {
+        g_print("  %-28s %8.1f before main (clock ticks)\n", "exec and library loading", profile->exec_us / 1000.0);
+    }
+    for (int i = 0; i < profile->count; i++) {
+        g_print("  %-28s %8.1f  +%.1f\n", profile->names[i], (profile->times_us[i] - profile->main_us) / 1000.0,
+                (profile->times_us[i] - previous) / 1000.0);
+        previous = profile->times_us[i];
+    }
+    if (profile->first_source_us > 0) {
+        g_print("  %-28s %8.1f  +%.1f\n", "first source buffer", (profile->first_source_us - profile->main_us) / 1000.0,
+                (profile->first_source_us - previous) / 1000.0);
+        previous = profile->first_source_us;
+    }
+    if (profile->first_frame_us > 0) {
+        char label[64];
+        snprintf(label, sizeof(label), "first frame at %s", profile->frame_point);
+        g_print("  %-28s %8.1f  +%.1f\n", label, (profile->first_frame_us - profile->main_us) / 1000.0,
+                (profile->first_frame_us - previous) / 1000.0);
+        if (profile->exec_us >= 0) {
+            g_print("Time to first frame: %.1f ms since exec\n",
+                    (profile->first_frame_us - profile->main_us + profile->exec_us) / 1000.0);
+        }
+    } else {
+        g_print("  no frame reached the %s\n", profile->frame_point);
+    }
+}
+
+void startup_skip_registry_update(void) {
+    g_setenv("GST_REGISTRY_UPDATE", "no", FALSE);
+}
+
+static GstElementFactory* cached_factory(const char *factory_name) {
+    GstElementFactory *factory;
+
+    g_mutex_lock(&factories_lock);
+    if (factories == NULL) {
+        factories = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, gst_object_unref);
+    }
+    factory = g_hash_table_lookup(factories, factory_name);
+    g_mutex_unlock(&factories_lock);
+    if (factory != NULL) {
+        return factory;
+    }
+
+    // Загрузка плагина может идти долго, без блокировки: второй поток ждёт только реестр
+    GstElementFactory *found = gst_element_factory_find(factory_name);
+    if (found == NULL) {
+        return NULL;
+    }
+    GstPluginFeature *loaded = gst_plugin_feature_load(GST_PLUGIN_FEATURE(found));
+    gst_object_unref(found);
+    if (loaded == NULL) {
+        return NULL;
+    }
+    g_mutex_lock(&factories_lock);
+    factory = g_hash_table_lookup(factories, factory_name);
+    if (factory == NULL) {
+        factory = GST_ELEMENT_FACTORY(loaded);
+        g_hash_table_insert(factories, g_strdup(factory_name), factory);
+    } else {
+        gst_object_unref(loaded);
+    }
+    g_mutex_unlock(&factories_lock);
+    return factory;
+}
+
+GstElement* startup_make_element(const char *factory_name, const char *name) {
+    GstElementFactory *factory = cached_factory(factory_name);
+
+    if (factory == NULL) {
+        return NULL;
+    }
+    return gst_element_factory_create(factory, name);
+}
+
+static gpointer preload_thread(gpointer data) {
+    gchar **names = data;
+
+    for (int i = 0; names[i] != NULL; i++) {
+        cached_factory(names[i]);
+    }
+    g_strfreev(names);
+    return NULL;
+}
+
+GThread* startup_preload_start(const char *const *factory_names, int count) {
+    gchar **names = g_new0(gchar*, count + 1);
+
+    for (int i = 0; i < count; i++) {
+        names[i] = g_strdup(factory_names[i]);
+    }
+    return g_thread_new("preload", preload_thread, names);
+}
+
+void startup_preload_join(GThread *thread) {
+    if (thread != NULL) {
+        g_thread_join(thread);
+    }
+}
+
+void startup_factory_cache_clear(void) {
+    g_mutex_lock(&factories_lock);
+    if (factories != NULL) {
+        g_hash_table_destroy(factories);
+        factories = NULL;
+    }
+    g_mutex_unlock(&factories_lock);
+}
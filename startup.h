@@ -0,0 +1,46 @@
+#ifndef STARTUP_H
+#define STARTUP_H
+
+#include <gst/gst.h>
+
+// Время запуска по фазам: от exec процесса до первого кадра на выходе.
+// Фазы отмечает main, первый кадр источника и выхода ловят пробники,
+// о первом кадре выхода на шину уходит сообщение "startup-first-frame"
+
+#define STARTUP_MAX_PHASES 24
+
+typedef struct {
+    gint64 main_us;          // вход в main, от него считаются все фазы
+    gint64 exec_us;          // от exec до main: загрузка библиотек, -1 = неизвестно
+    const char *names[STARTUP_MAX_PHASES];
+    gint64 times_us[STARTUP_MAX_PHASES];
+    int count;
+    gint64 first_source_us;  // 0 - ещё не было
+    gint64 first_frame_us;
+    const char *frame_point; // где ловится первый кадр выхода
+} StartupProfile;
+
+// main_us - g_get_monotonic_time() в самом начале main
+void startup_profile_init(StartupProfile *profile, gint64 main_us);
+// Конец фазы phase (строка должна жить до отчёта)
+void startup_mark(StartupProfile *profile, const char *phase);
+// Первый буфер на паде источника
+void startup_attach_source(StartupProfile *profile, GstElement *element, const char *pad_name);
+// Первый буфер на любом из подключённых падов выхода
+void startup_attach_output(StartupProfile *profile, GstElement *element, const char *pad_name);
+void startup_profile_report(const StartupProfile *profile);
+
+// GST_REGISTRY_UPDATE=no до gst_init: готовый кэш реестра читается без обхода
+// каталогов плагинов. Переменную окружения, заданную снаружи, не трогает
+void startup_skip_registry_update(void);
+
+// Фабрики ищутся в реестре и загружаются один раз, дальше элементы создаются из кэша.
+// Потокобезопасно: элементы создаёт и поток перезагрузки
+GstElement* startup_make_element(const char *factory_name, const char *name);
+// Загружает плагины фабрик в отдельном потоке, пока main занят дисплеями X.
+// Неизвестные фабрики пропускаются: об ошибке скажет создание элемента
+GThread* startup_preload_start(const char *const *factory_names, int count);
+void startup_preload_join(GThread *thread);
+void startup_factory_cache_clear(void);
+
+#endif
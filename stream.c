@@ -0,0 +1,289 @@
+#include "stream.h"
+
+#include <string.h>
+
+#include "framestamp.h"
+
+#define STAMP_VALUE_MASK ((G_GUINT64_CONSTANT(1) << FRAME_STAMP_VALUE_BITS) - 1)
+
+int stream_protocol_parse(const char *str, StreamProtocol *protocol) {
+    if (strcmp(str, "udp") == 0) {
+        *protocol = STREAM_UDP;
+    } else if (strcmp(str, "srt") == 0) {
+        *protocol = STREAM_SRT;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+const char* stream_protocol_name(StreamProtocol protocol) {
+    return protocol == STREAM_SRT ? "srt" : "udp";
+}
+
+GstElement* stream_payloader_new(gboolean vp8, StreamProtocol protocol, const char *name) {
+    GstElement *payloader = gst_element_factory_make(vp8 ? "rtpvp8pay" : "rtph264pay", name);
+
+    if (payloader == NULL) {
+        return NULL;
+    }
+    g_object_set(payloader, "pt", (guint)STREAM_PAYLOAD_TYPE,
+                 "mtu", (guint)(protocol == STREAM_SRT ? STREAM_SRT_MTU : STREAM_UDP_MTU), NULL);
+    if (!vp8) {
+        // SPS/PPS перед каждым ключевым кадром: зритель, подключившийся посреди потока,
+        // начинает показывать со следующего ключевого кадра
+        g_object_set(payloader, "config-interval", -1, NULL);
+    }
+    return payloader;
+}
+
+GstElement* stream_sink_new(StreamProtocol protocol, const char *host, int port, int srt_latency_ms, const char *name) {
+    GstElement *sink;
+
+    if (protocol == STREAM_SRT) {
+        gchar *uri = g_strdup_printf("srt://%s:%d?mode=listener", host, port);
+        sink = gst_element_factory_make("srtsink", name);
+        if (sink != NULL) {
+            // Без зрителя пакеты отбрасываются, а не копятся и не держат ветку
+            g_object_set(sink, "uri", uri, "latency", srt_latency_ms, "wait-for-connection", FALSE, NULL);
+        }
+        g_free(uri);
+    } else {
+        sink = gst_element_factory_make("udpsink", name);
+        if (sink != NULL) {
+            g_object_set(sink, "host", host, "port", port, NULL);
+        }
+    }
+    if (sink != NULL) {
+        g_object_set(sink, "sync", FALSE, "async", FALSE, NULL);
+    }
+    return sink;
+}
+
+// Формат с плоскостью яркости 8 бит, в которую можно вписать метку
+static gboolean has_luma_plane(const GstVideoInfo *info) {
+    return GST_VIDEO_INFO_IS_YUV(info) && GST_VIDEO_INFO_COMP_DEPTH(info, 0) == 8 &&
+           GST_VIDEO_INFO_COMP_PLANE(info, 0) == 0 && GST_VIDEO_INFO_COMP_PSTRIDE(info, 0) == 1;
+}
+
+static GstPadProbeReturn stamp_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    StreamStamper *stamper = user_data;
+    GstReferenceTimestampMeta *meta;
+    GstVideoFrame frame;
+    GstBuffer *buffer;
+
+    if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+        GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+        if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
+            GstCaps *caps;
+            gst_event_parse_caps(event, &caps);
+            stamper->have_info = gst_video_info_from_caps(&stamper->info, caps) && has_luma_plane(&stamper->info);
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    meta = gst_buffer_get_reference_timestamp_meta(buffer, stamper->stamp_caps);
+    if (meta == NULL || !stamper->have_info ||
+        frame_stamp_block(GST_VIDEO_INFO_WIDTH(&stamper->info), GST_VIDEO_INFO_HEIGHT(&stamper->info)) == 0) {
+        stamper->unstamped++;
+        return GST_PAD_PROBE_OK;
+    }
+    // Буфер может быть общим с предпросмотром и экспортом: map на запись копирует общую память
+    buffer = gst_buffer_make_writable(buffer);
+    GST_PAD_PROBE_INFO_DATA(info) = buffer;
+    if (!gst_video_frame_map(&frame, &stamper->info, buffer, GST_MAP_WRITE)) {
+        stamper->unstamped++;
+        return GST_PAD_PROBE_OK;
+    }
+    frame_stamp_write(GST_VIDEO_FRAME_PLANE_DATA(&frame, 0), GST_VIDEO_FRAME_PLANE_STRIDE(&frame, 0),
+                      GST_VIDEO_FRAME_WIDTH(&frame), GST_VIDEO_FRAME_HEIGHT(&frame),
+                      (guint64)(meta->timestamp / GST_USECOND));
+    gst_video_frame_unmap(&frame);
+    stamper->stamped++;
+    return GST_PAD_PROBE_OK;
+}
+
+void stream_stamper_attach(StreamStamper *stamper, GstCaps *stamp_caps, GstElement *element, const char *pad_name) {
+    GstPad *pad = gst_element_get_static_pad(element, pad_name);
+
+    stamper->stamp_caps = stamp_caps;
+    stamper->have_info = FALSE;
+    stamper->stamped = 0;
+    stamper->unstamped = 0;
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, stamp_probe, stamper, NULL);
+    gst_object_unref(pad);
+}
+
+// Декодированный кадр у зрителя: задержка от захвата до этого момента
+static GstPadProbeReturn receiver_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    StreamReceiver *receiver = user_data;
+    GstVideoFrame frame;
+    guint64 stamp;
+    int found;
+
+    if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+        GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+        if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
+            GstCaps *caps;
+            gst_event_parse_caps(event, &caps);
+            receiver->have_info = gst_video_info_from_caps(&receiver->info, caps);
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    gint64 now = g_get_monotonic_time();
+    receiver->frames++;
+    if (!receiver->have_info ||
+        !gst_video_frame_map(&frame, &receiver->info, GST_PAD_PROBE_INFO_BUFFER(info), GST_MAP_READ)) {
+        receiver->unreadable++;
+        return GST_PAD_PROBE_OK;
+    }
+    found = frame_stamp_read(GST_VIDEO_FRAME_PLANE_DATA(&frame, 0), GST_VIDEO_FRAME_PLANE_STRIDE(&frame, 0),
+                             GST_VIDEO_FRAME_WIDTH(&frame), GST_VIDEO_FRAME_HEIGHT(&frame), &stamp) == 0;
+    gst_video_frame_unmap(&frame);
+    if (!found) {
+        receiver->unreadable++;
+        return GST_PAD_PROBE_OK;
+    }
+    // В метке 48 бит микросекунд, разность берётся по тому же модулю
+    latency_recorder_add(&receiver->latency, now, ((guint64)now - stamp) & STAMP_VALUE_MASK);
+    return GST_PAD_PROBE_OK;
+}
+
+// Первый установленный декодер H.264. avdec_h264 по умолчанию распараллеливает по кадрам,
+// а это по кадру задержки на поток: зрителю с низкой задержкой нужны потоки по срезам
+static GstElement* make_h264_decoder(void) {
+    GstElement *decoder = gst_element_factory_make("avdec_h264", "decoder");
+
+    if (decoder != NULL) {
+        if (g_object_class_find_property(G_OBJECT_GET_CLASS(decoder), "thread-type") != NULL) {
+            gst_util_set_object_arg(G_OBJECT(decoder), "thread-type", "slice");
+        }
+        return decoder;
+    }
+    return gst_element_factory_make("openh264dec", "decoder");
+}
+
+int stream_receiver_start(StreamReceiver *receiver, StreamProtocol protocol, int port, gboolean vp8,
+                          int jitter_ms, int srt_latency_ms, guint capacity) {
+    GstElement *source, *rtpcaps, *jitter, *depay, *parser = NULL, *decoder, *convert, *rawcaps, *sink;
+    GstCaps *caps;
+    GstPad *sink_pad;
+    gchar *name = g_strdup_printf("stream-receiver-%d", port);
+
+    memset(receiver, 0, sizeof(*receiver));
+    receiver->pipeline = gst_pipeline_new(name);
+    g_free(name);
+    if (protocol == STREAM_SRT) {
+        gchar *uri = g_strdup_printf("srt://127.0.0.1:%d?mode=caller", port);
+        source = gst_element_factory_make("srtsrc", "source");
+        if (source != NULL) {
+            g_object_set(source, "uri", uri, "latency", srt_latency_ms, NULL);
+        }
+        g_free(uri);
+    } else {
+        source = gst_element_factory_make("udpsrc", "source");
+        if (source != NULL) {
+            g_object_set(source, "address", "127.0.0.1", "port", port, NULL);
+        }
+    }
+    rtpcaps = gst_element_factory_make("capsfilter", "rtpcaps");
+    jitter = gst_element_factory_make("rtpjitterbuffer", "jitter");
+    depay = gst_element_factory_make(vp8 ? "rtpvp8depay" : "rtph264depay", "depay");
+    if (!vp8) {
+        parser = gst_element_factory_make("h264parse", "parser");
+    }
+    decoder = vp8 ? gst_element_factory_make("vp8dec", "decoder") : make_h264_decoder();
+    convert = gst_element_factory_make("videoconvert", "convert");
+    rawcaps = gst_element_factory_make("capsfilter", "rawcaps");
+    sink = gst_element_factory_make("fakesink", "sink");
+
+    if (!receiver->pipeline || !source || !rtpcaps || !jitter || !depay || (!vp8 && !parser) || !decoder ||
+        !convert || !rawcaps || !sink) {
+        GstElement *elements[] = {source, rtpcaps, jitter, depay, parser, decoder, convert, rawcaps, sink};
+        for (size_t i = 0; i < G_N_ELEMENTS(elements); i++) {
+            if (elements[i] != NULL) {
+                gst_object_unref(elements[i]);
+            }
+        }
+        if (receiver->pipeline) {
+            gst_object_unref(receiver->pipeline);
+            receiver->pipeline = NULL;
+        }
+        receiver->error = g_strdup("missing receiver elements");
+        return -1;
+    }
+
+    caps = gst_caps_new_simple("application/x-rtp", "media", G_TYPE_STRING, "video", "clock-rate", G_TYPE_INT, 90000,
+                               "encoding-name", G_TYPE_STRING, vp8 ? "VP8" : "H264",
+                               "payload", G_TYPE_INT, STREAM_PAYLOAD_TYPE, NULL);
+    g_object_set(rtpcaps, "caps", caps, NULL);
+    gst_caps_unref(caps);
+    caps = gst_caps_new_simple("video/x-raw", "format", G_TYPE_STRING, "I420", NULL);
+    g_object_set(rawcaps, "caps", caps, NULL);
+    gst_caps_unref(caps);
+    g_object_set(jitter, "latency", (guint)jitter_ms, NULL);
+    // Кадр показывается сразу по приходе, как у зрителя, который не ждёт часов
+    g_object_set(sink, "sync", FALSE, "async", FALSE, NULL);
+
+    gst_bin_add_many(GST_BIN(receiver->pipeline), source, rtpcaps, jitter, depay, decoder, convert, rawcaps, sink, NULL);
+    if (parser) {
+        gst_bin_add(GST_BIN(receiver->pipeline), parser);
+    }
+    if (!gst_element_link_many(source, rtpcaps, jitter, depay, NULL) ||
+        !gst_element_link(parser ? parser : depay, decoder) ||
+        (parser && !gst_element_link(depay, parser)) ||
+        !gst_element_link_many(decoder, convert, rawcaps, sink, NULL)) {
+        gst_object_unref(receiver->pipeline);
+        receiver->pipeline = NULL;
+        receiver->error = g_strdup("failed to link receiver elements");
+        return -1;
+    }
+
+    latency_recorder_init(&receiver->latency, capacity);
+    sink_pad = gst_element_get_static_pad(sink, "sink");
+    gst_pad_add_probe(sink_pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+                      receiver_probe, receiver, NULL);
+    gst_object_unref(sink_pad);
+
+    if (gst_element_set_state(receiver->pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+        stream_receiver_stop(receiver);
+        if (receiver->error == NULL) {
+            receiver->error = g_strdup("failed to start");
+        }
+        return -1;
+    }
+    return 0;
+}
+
+void stream_receiver_stop(StreamReceiver *receiver) {
+    GstBus *bus;
+    GstMessage *msg;
+
+    if (receiver->pipeline == NULL) {
+        return;
+    }
+    // Переход в NULL очищает шину, поэтому ошибки забираются до него
+    bus = gst_element_get_bus(receiver->pipeline);
+    while ((msg = gst_bus_pop_filtered(bus, GST_MESSAGE_ERROR)) != NULL) {
+        if (receiver->error == NULL) {
+            GError *err;
+            gst_message_parse_error(msg, &err, NULL);
+            receiver->error = g_strdup(err->message);
+            g_error_free(err);
+        }
+        gst_message_unref(msg);
+    }
+    gst_object_unref(bus);
+    gst_element_set_state(receiver->pipeline, GST_STATE_NULL);
+    gst_object_unref(receiver->pipeline);
+    receiver->pipeline = NULL;
+}
+
+void stream_receiver_clear(StreamReceiver *receiver) {
+    stream_receiver_stop(receiver);
+    latency_recorder_clear(&receiver->latency);
+    g_free(receiver->error);
+    receiver->error = NULL;
+}
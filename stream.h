@@ -0,0 +1,64 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+
+#include "bench.h"
+
+// Поток ветки в сеть: закодированные кадры -> RTP -> udpsink или srtsink.
+// В режиме loopback тот же процесс принимает поток обратно, декодирует
+// и по вписанному в кадр времени захвата считает задержку от захвата до кадра у зрителя
+
+typedef enum {
+    STREAM_UDP,
+    STREAM_SRT
+} StreamProtocol;
+
+#define STREAM_PAYLOAD_TYPE 96
+#define STREAM_UDP_MTU 1400
+#define STREAM_SRT_MTU 1316 // сообщение SRT в режиме live, один пакет RTP на сообщение
+
+// Переносит время захвата из метки bench в пиксели кадра перед кодировщиком:
+// метаданные буфера дальше кодировщика не проходят
+typedef struct {
+    GstCaps *stamp_caps;
+    GstVideoInfo info;
+    gboolean have_info;
+    guint64 stamped;
+    guint64 unstamped; // кадры разогрева без метки или в формате без плоскости яркости 8 бит
+} StreamStamper;
+
+// Приёмник loopback одной ветки: src -> rtpjitterbuffer -> depay -> decoder -> I420 -> fakesink
+typedef struct {
+    GstElement *pipeline;
+    LatencyRecorder latency;
+    GstVideoInfo info;
+    gboolean have_info;
+    guint64 frames;     // декодированные кадры
+    guint64 unreadable; // кадры без метки: разогрев, неполный GOP после старта или испорченная метка
+    gchar *error;       // первая ошибка конвейера приёмника
+} StreamReceiver;
+
+// 1 - успешно
+int stream_protocol_parse(const char *str, StreamProtocol *protocol);
+const char* stream_protocol_name(StreamProtocol protocol);
+
+// Упаковщик RTP под кодек и транспорт ветки
+GstElement* stream_payloader_new(gboolean vp8, StreamProtocol protocol, const char *name);
+// udpsink на host:port или srtsink, слушающий на host:port. Не синхронизируется с часами:
+// кадр уходит, как только закодирован
+GstElement* stream_sink_new(StreamProtocol protocol, const char *host, int port, int srt_latency_ms, const char *name);
+
+// Пробник на входе кодировщика, stamp_caps - ключ метки bench
+void stream_stamper_attach(StreamStamper *stamper, GstCaps *stamp_caps, GstElement *element, const char *pad_name);
+
+// Запускает приёмник потока с 127.0.0.1:port в отдельном конвейере. capacity - сколько
+// задержек хранить для процентилей. 0 - успешно
+int stream_receiver_start(StreamReceiver *receiver, StreamProtocol protocol, int port, gboolean vp8,
+                          int jitter_ms, int srt_latency_ms, guint capacity);
+// Останавливает конвейер и запоминает его первую ошибку
+void stream_receiver_stop(StreamReceiver *receiver);
+void stream_receiver_clear(StreamReceiver *receiver);
+
+#endif
@@ -0,0 +1,404 @@
+#include "tilecompositor.h"
+
+#include <string.h>
+
+GST_DEBUG_CATEGORY_STATIC(tile_compositor_debug);
+#define GST_CAT_DEFAULT tile_compositor_debug
+
+#define NO_LAYOUT G_MAXUINT64
+
+struct _GstTileCompositorPad {
+    GstVideoAggregatorPad parent;
+
+    int xpos;
+    int ypos;
+    GstBuffer *last;     // последний кадр входа; ссылка не даёт новому буферу получить тот же адрес
+    guint64 generation;  // растёт с каждым новым кадром входа
+    guint64 drawn[TILE_COMPOSITOR_CANVASES]; // поколение, которое уже лежит на каждом холсте
+    int drawn_width;     // размер кадра, под который посчитана раскладка
+    int drawn_height;
+};
+
+// Холст - память, которую выходные буферы только разделяют. Пока её держит sink,
+// холст занят; освободившийся холст дорисовывается, а не собирается заново
+typedef struct {
+    GstMemory *memory;
+    guint64 layout; // раскладка, под которую нарисован холст, NO_LAYOUT = нарисовать целиком
+} TileCanvas;
+
+struct _GstTileCompositor {
+    GstVideoAggregator parent;
+
+    TileCanvas canvases[TILE_COMPOSITOR_CANVASES];
+    int current;          // холст выходного буфера, который сейчас собирается
+    volatile gint layout; // меняется при добавлении и удалении входов и смене их места или размера
+    guint64 pads_copied;
+    guint64 pads_skipped;
+    guint64 redraws;
+};
+
+enum {
+    PROP_PAD_0,
+    PROP_PAD_XPOS,
+    PROP_PAD_YPOS
+};
+
+enum {
+    PROP_0,
+    PROP_PADS_COPIED,
+    PROP_PADS_SKIPPED,
+    PROP_REDRAWS
+};
+
+static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE("sink_%u", GST_PAD_SINK, GST_PAD_REQUEST,
+    GST_STATIC_CAPS(GST_VIDEO_CAPS_MAKE("I420")));
+
+static GstStaticPadTemplate src_template = GST_STATIC_PAD_TEMPLATE("src", GST_PAD_SRC, GST_PAD_ALWAYS,
+    GST_STATIC_CAPS(GST_VIDEO_CAPS_MAKE("I420")));
+
+G_DEFINE_TYPE(GstTileCompositorPad, gst_tile_compositor_pad, GST_TYPE_VIDEO_AGGREGATOR_PAD)
+G_DEFINE_TYPE(GstTileCompositor, gst_tile_compositor, GST_TYPE_VIDEO_AGGREGATOR)
+
+// Раскладка изменилась: все холсты рисуются заново, размер выхода пересчитывается
+static void layout_changed(GstTileCompositor *self) {
+    g_atomic_int_inc(&self->layout);
+    gst_pad_mark_reconfigure(GST_AGGREGATOR_SRC_PAD(self));
+}
+
+static void gst_tile_compositor_pad_set_property(GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec) {
+    GstTileCompositorPad *pad = GST_TILE_COMPOSITOR_PAD(object);
+    GstObject *parent;
+
+    switch (prop_id) {
+        case PROP_PAD_XPOS:
+            pad->xpos = g_value_get_int(value);
+            break;
+        case PROP_PAD_YPOS:
+            pad->ypos = g_value_get_int(value);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+            return;
+    }
+    parent = gst_object_get_parent(GST_OBJECT(pad));
+    if (parent != NULL) {
+        layout_changed(GST_TILE_COMPOSITOR(parent));
+        gst_object_unref(parent);
+    }
+}
+
+static void gst_tile_compositor_pad_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *pspec) {
+    GstTileCompositorPad *pad = GST_TILE_COMPOSITOR_PAD(object);
+
+    switch (prop_id) {
+        case PROP_PAD_XPOS:
+            g_value_set_int(value, pad->xpos);
+            break;
+        case PROP_PAD_YPOS:
+            g_value_set_int(value, pad->ypos);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+            break;
+    }
+}
+
+// Кадры копируются в aggregate_frames и только новые, поэтому базовый класс их не отображает
+static gboolean gst_tile_compositor_pad_prepare_frame(GstVideoAggregatorPad *pad, GstVideoAggregator *vagg,
+                                                      GstBuffer *buffer, GstVideoFrame *prepared_frame) {
+    return TRUE;
+}
+
+static void gst_tile_compositor_pad_clean_frame(GstVideoAggregatorPad *pad, GstVideoAggregator *vagg,
+                                                GstVideoFrame *prepared_frame) {
+}
+
+static void gst_tile_compositor_pad_finalize(GObject *object) {
+    GstTileCompositorPad *pad = GST_TILE_COMPOSITOR_PAD(object);
+
+    gst_buffer_replace(&pad->last, NULL);
+    G_OBJECT_CLASS(gst_tile_compositor_pad_parent_class)->finalize(object);
+}
+
+static void gst_tile_compositor_pad_class_init(GstTileCompositorPadClass *klass) {
+    GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+    GstVideoAggregatorPadClass *vpad_class = GST_VIDEO_AGGREGATOR_PAD_CLASS(klass);
+
+    gobject_class->set_property = gst_tile_compositor_pad_set_property;
+    gobject_class->get_property = gst_tile_compositor_pad_get_property;
+    gobject_class->finalize = gst_tile_compositor_pad_finalize;
+
+    g_object_class_install_property(gobject_class, PROP_PAD_XPOS,
+        g_param_spec_int("xpos", "X Position", "X position of the frame on the canvas",
+                         0, G_MAXINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property(gobject_class, PROP_PAD_YPOS,
+        g_param_spec_int("ypos", "Y Position", "Y position of the frame on the canvas",
+                         0, G_MAXINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    vpad_class->prepare_frame = gst_tile_compositor_pad_prepare_frame;
+    vpad_class->clean_frame = gst_tile_compositor_pad_clean_frame;
+}
+
+static void gst_tile_compositor_pad_init(GstTileCompositorPad *pad) {
+}
+
+static void free_canvas(TileCanvas *canvas) {
+    if (canvas->memory != NULL) {
+        gst_memory_unref(canvas->memory);
+        canvas->memory = NULL;
+    }
+}
+
+// Чёрный I420 в ограниченном диапазоне
+static void fill_black(guint8 *data, const GstVideoInfo *info) {
+    static const guint8 black[3] = {16, 128, 128};
+
+    for (guint plane = 0; plane < GST_VIDEO_INFO_N_PLANES(info); plane++) {
+        memset(data + GST_VIDEO_INFO_PLANE_OFFSET(info, plane), black[plane],
+               (gsize)GST_VIDEO_INFO_PLANE_STRIDE(info, plane) * GST_VIDEO_INFO_COMP_HEIGHT(info, plane));
+    }
+}
+
+// Копирует кадр входа на его место на холсте, обрезая по краю холста
+static gboolean blit(GstTileCompositorPad *pad, GstBuffer *buffer, const GstVideoInfo *out_info, guint8 *data) {
+    GstVideoFrame frame;
+
+    if (!gst_video_frame_map(&frame, &GST_VIDEO_AGGREGATOR_PAD(pad)->info, buffer, GST_MAP_READ)) {
+        return FALSE;
+    }
+    for (guint plane = 0; plane < GST_VIDEO_FRAME_N_PLANES(&frame); plane++) {
+        // У I420 плоскости U и V вдвое меньше по обеим осям
+        int x = plane == 0 ? pad->xpos : pad->xpos / 2;
+        int y = plane == 0 ? pad->ypos : pad->ypos / 2;
+        int width = MIN(GST_VIDEO_FRAME_COMP_WIDTH(&frame, plane), GST_VIDEO_INFO_COMP_WIDTH(out_info, plane) - x);
+        int height = MIN(GST_VIDEO_FRAME_COMP_HEIGHT(&frame, plane), GST_VIDEO_INFO_COMP_HEIGHT(out_info, plane) - y);
+        int out_stride = GST_VIDEO_INFO_PLANE_STRIDE(out_info, plane);
+        int in_stride = GST_VIDEO_FRAME_PLANE_STRIDE(&frame, plane);
+        guint8 *dst = data + GST_VIDEO_INFO_PLANE_OFFSET(out_info, plane) + (gsize)y * out_stride + x;
+        const guint8 *src = GST_VIDEO_FRAME_PLANE_DATA(&frame, plane);
+
+        for (int row = 0; row < height && width > 0; row++) {
+            memcpy(dst + (gsize)row * out_stride, src + (gsize)row * in_stride, width);
+        }
+    }
+    gst_video_frame_unmap(&frame);
+    return TRUE;
+}
+
+// Выходной буфер разделяет память свободного холста. Если все холсты у sink,
+// самый старый отдаём ему насовсем и начинаем новый
+static GstFlowReturn gst_tile_compositor_create_output_buffer(GstVideoAggregator *vagg, GstBuffer **outbuffer) {
+    GstTileCompositor *self = GST_TILE_COMPOSITOR(vagg);
+    gsize size = GST_VIDEO_INFO_SIZE(&vagg->info);
+    int pick = -1;
+
+    for (int i = 0; i < TILE_COMPOSITOR_CANVASES; i++) {
+        TileCanvas *canvas = &self->canvases[i];
+        if (canvas->memory != NULL && gst_memory_get_sizes(canvas->memory, NULL, NULL) != size) {
+            free_canvas(canvas);
+        }
+        if (canvas->memory != NULL && GST_MINI_OBJECT_REFCOUNT_VALUE(canvas->memory) == 1) {
+            pick = i;
+            break;
+        }
+        if (canvas->memory == NULL && pick < 0) {
+            pick = i;
+        }
+    }
+    if (pick < 0) {
+        pick = (self->current + 1) % TILE_COMPOSITOR_CANVASES;
+        free_canvas(&self->canvases[pick]);
+    }
+
+    TileCanvas *canvas = &self->canvases[pick];
+    if (canvas->memory == NULL) {
+        canvas->memory = gst_allocator_alloc(NULL, size, NULL);
+        if (canvas->memory == NULL) {
+            return GST_FLOW_ERROR;
+        }
+        canvas->layout = NO_LAYOUT;
+    }
+    self->current = pick;
+    *outbuffer = gst_buffer_new();
+    gst_buffer_append_memory(*outbuffer, gst_memory_ref(canvas->memory));
+    return GST_FLOW_OK;
+}
+
+static GstFlowReturn gst_tile_compositor_aggregate_frames(GstVideoAggregator *vagg, GstBuffer *outbuffer) {
+    GstTileCompositor *self = GST_TILE_COMPOSITOR(vagg);
+    TileCanvas *canvas = &self->canvases[self->current];
+    GstMapInfo map;
+    gboolean redraw;
+
+    // Пишем в память холста напрямую: через буфер GStreamer мог бы отдать копию
+    if (!gst_memory_map(canvas->memory, &map, GST_MAP_WRITE)) {
+        GST_ERROR_OBJECT(self, "Failed to map canvas %d", self->current);
+        return GST_FLOW_ERROR;
+    }
+
+    GST_OBJECT_LOCK(vagg);
+    for (GList *l = GST_ELEMENT(vagg)->sinkpads; l != NULL; l = l->next) {
+        GstTileCompositorPad *pad = l->data;
+        const GstVideoInfo *info = &GST_VIDEO_AGGREGATOR_PAD(pad)->info;
+        if (GST_VIDEO_INFO_WIDTH(info) != pad->drawn_width || GST_VIDEO_INFO_HEIGHT(info) != pad->drawn_height) {
+            pad->drawn_width = GST_VIDEO_INFO_WIDTH(info);
+            pad->drawn_height = GST_VIDEO_INFO_HEIGHT(info);
+            g_atomic_int_inc(&self->layout);
+        }
+    }
+    redraw = canvas->layout != (guint64)g_atomic_int_get(&self->layout);
+    if (redraw) {
+        fill_black(map.data, &vagg->info);
+        canvas->layout = (guint64)g_atomic_int_get(&self->layout);
+        self->redraws++;
+    }
+    for (GList *l = GST_ELEMENT(vagg)->sinkpads; l != NULL; l = l->next) {
+        GstTileCompositorPad *pad = l->data;
+        GstBuffer *buffer = gst_video_aggregator_pad_get_current_buffer(GST_VIDEO_AGGREGATOR_PAD(pad));
+
+        // Вход ещё не дал кадр или уже закончился
+        if (buffer == NULL) {
+            continue;
+        }
+        if (buffer != pad->last) {
+            gst_buffer_replace(&pad->last, buffer);
+            pad->generation++;
+        }
+        if (!redraw && pad->drawn[self->current] == pad->generation) {
+            self->pads_skipped++;
+            continue;
+        }
+        if (blit(pad, buffer, &vagg->info, map.data)) {
+            pad->drawn[self->current] = pad->generation;
+            self->pads_copied++;
+        }
+    }
+    GST_OBJECT_UNLOCK(vagg);
+
+    gst_memory_unmap(canvas->memory, &map);
+    return GST_FLOW_OK;
+}
+
+// Размер выхода охватывает все входы, частота - как у самого быстрого входа,
+// если ниже по течению её не ограничили
+static GstCaps* gst_tile_compositor_fixate_src_caps(GstAggregator *agg, GstCaps *caps) {
+    int width = 1, height = 1, fps_n = 0, fps_d = 1;
+    GstStructure *structure;
+
+    GST_OBJECT_LOCK(agg);
+    for (GList *l = GST_ELEMENT(agg)->sinkpads; l != NULL; l = l->next) {
+        GstTileCompositorPad *pad = l->data;
+        const GstVideoInfo *info = &GST_VIDEO_AGGREGATOR_PAD(pad)->info;
+
+        if (GST_VIDEO_INFO_WIDTH(info) == 0) {
+            continue;
+        }
+        width = MAX(width, pad->xpos + GST_VIDEO_INFO_WIDTH(info));
+        height = MAX(height, pad->ypos + GST_VIDEO_INFO_HEIGHT(info));
+        if (GST_VIDEO_INFO_FPS_D(info) > 0 &&
+            gst_util_fraction_compare(GST_VIDEO_INFO_FPS_N(info), GST_VIDEO_INFO_FPS_D(info), fps_n, fps_d) > 0) {
+            fps_n = GST_VIDEO_INFO_FPS_N(info);
+            fps_d = GST_VIDEO_INFO_FPS_D(info);
+        }
+    }
+    GST_OBJECT_UNLOCK(agg);
+    if (fps_n == 0) {
+        fps_n = 25;
+        fps_d = 1;
+    }
+
+    caps = gst_caps_make_writable(gst_caps_truncate(caps));
+    structure = gst_caps_get_structure(caps, 0);
+    gst_structure_fixate_field_nearest_int(structure, "width", width);
+    gst_structure_fixate_field_nearest_int(structure, "height", height);
+    gst_structure_fixate_field_nearest_fraction(structure, "framerate", fps_n, fps_d);
+    return gst_caps_fixate(caps);
+}
+
+static void gst_tile_compositor_release_pad(GstElement *element, GstPad *pad) {
+    GST_ELEMENT_CLASS(gst_tile_compositor_parent_class)->release_pad(element, pad);
+    layout_changed(GST_TILE_COMPOSITOR(element));
+}
+
+static gboolean gst_tile_compositor_stop(GstAggregator *agg) {
+    GstTileCompositor *self = GST_TILE_COMPOSITOR(agg);
+
+    for (int i = 0; i < TILE_COMPOSITOR_CANVASES; i++) {
+        free_canvas(&self->canvases[i]);
+    }
+    return GST_AGGREGATOR_CLASS(gst_tile_compositor_parent_class)->stop(agg);
+}
+
+static void gst_tile_compositor_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *pspec) {
+    GstTileCompositor *self = GST_TILE_COMPOSITOR(object);
+
+    GST_OBJECT_LOCK(self);
+    switch (prop_id) {
+        case PROP_PADS_COPIED:
+            g_value_set_uint64(value, self->pads_copied);
+            break;
+        case PROP_PADS_SKIPPED:
+            g_value_set_uint64(value, self->pads_skipped);
+            break;
+        case PROP_REDRAWS:
+            g_value_set_uint64(value, self->redraws);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+            break;
+    }
+    GST_OBJECT_UNLOCK(self);
+}
+
+static void gst_tile_compositor_finalize(GObject *object) {
+    GstTileCompositor *self = GST_TILE_COMPOSITOR(object);
+
+    for (int i = 0; i < TILE_COMPOSITOR_CANVASES; i++) {
+        free_canvas(&self->canvases[i]);
+    }
+    G_OBJECT_CLASS(gst_tile_compositor_parent_class)->finalize(object);
+}
+
+static void gst_tile_compositor_class_init(GstTileCompositorClass *klass) {
+    GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+    GstElementClass *element_class = GST_ELEMENT_CLASS(klass);
+    GstAggregatorClass *agg_class = GST_AGGREGATOR_CLASS(klass);
+    GstVideoAggregatorClass *vagg_class = GST_VIDEO_AGGREGATOR_CLASS(klass);
+
+    GST_DEBUG_CATEGORY_INIT(tile_compositor_debug, "tilecompositor", 0, "Update-aware grid compositor");
+
+    gobject_class->get_property = gst_tile_compositor_get_property;
+    gobject_class->finalize = gst_tile_compositor_finalize;
+
+    g_object_class_install_property(gobject_class, PROP_PADS_COPIED,
+        g_param_spec_uint64("pads-copied", "Pads copied", "Input frames copied onto a canvas",
+                            0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property(gobject_class, PROP_PADS_SKIPPED,
+        g_param_spec_uint64("pads-skipped", "Pads skipped", "Inputs left as they were because the canvas already had their frame",
+                            0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property(gobject_class, PROP_REDRAWS,
+        g_param_spec_uint64("redraws", "Redraws", "Canvases filled and drawn from scratch",
+                            0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+    gst_element_class_add_static_pad_template_with_gtype(element_class, &sink_template, GST_TYPE_TILE_COMPOSITOR_PAD);
+    gst_element_class_add_static_pad_template_with_gtype(element_class, &src_template, GST_TYPE_AGGREGATOR_PAD);
+    gst_element_class_set_static_metadata(element_class, "Tile compositor", "Filter/Editor/Video/Compositor",
+                                          "Places opaque non-overlapping I420 inputs on a canvas, copying only inputs with new frames",
+                                          "cppGstreamTest");
+    element_class->release_pad = gst_tile_compositor_release_pad;
+
+    agg_class->fixate_src_caps = gst_tile_compositor_fixate_src_caps;
+    agg_class->stop = gst_tile_compositor_stop;
+    vagg_class->create_output_buffer = gst_tile_compositor_create_output_buffer;
+    vagg_class->aggregate_frames = gst_tile_compositor_aggregate_frames;
+}
+
+static void gst_tile_compositor_init(GstTileCompositor *self) {
+    for (int i = 0; i < TILE_COMPOSITOR_CANVASES; i++) {
+        self->canvases[i].layout = NO_LAYOUT;
+    }
+}
+
+gboolean tile_compositor_register(void) {
+    return gst_element_register(NULL, "tilecompositor", GST_RANK_NONE, GST_TYPE_TILE_COMPOSITOR);
+}
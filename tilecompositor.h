@@ -0,0 +1,26 @@
+#ifndef TILECOMPOSITOR_H
+#define TILECOMPOSITOR_H
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <gst/video/gstvideoaggregator.h>
+
+G_BEGIN_DECLS
+
+#define TILE_COMPOSITOR_CANVASES 3 // холсты: один собирается, остальные могут ещё быть у sink
+
+// Вход tilecompositor: место кадра на холсте
+#define GST_TYPE_TILE_COMPOSITOR_PAD (gst_tile_compositor_pad_get_type())
+G_DECLARE_FINAL_TYPE(GstTileCompositorPad, gst_tile_compositor_pad, GST, TILE_COMPOSITOR_PAD, GstVideoAggregatorPad)
+
+// Элемент tilecompositor: непрозрачные входы I420 без наложения. Холст не заливается фоном
+// и не смешивается заново: в каждый выходной кадр копируются только входы с новым кадром
+#define GST_TYPE_TILE_COMPOSITOR (gst_tile_compositor_get_type())
+G_DECLARE_FINAL_TYPE(GstTileCompositor, gst_tile_compositor, GST, TILE_COMPOSITOR, GstVideoAggregator)
+
+// Регистрирует элемент в процессе, без отдельного плагина
+gboolean tile_compositor_register(void);
+
+G_END_DECLS
+
+#endif
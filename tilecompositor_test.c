@@ -0,0 +1,239 @@
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <gst/video/video.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tilecompositor.h"
+
+// Минимальное совпадение с compositor background=black, дБ: оба просто копируют непрозрачные кадры
+#define MIN_PSNR 50.0
+#define CHECK_FRAMES 60
+#define BENCH_FRAMES 300
+
+typedef struct {
+    int width;
+    int height;
+    int framerate;
+    int xpos;
+    int ypos;
+} TileCase;
+
+// Входы разной частоты: у медленного на каждом выходном кадре нет нового кадра
+static const TileCase check_tiles[] = {
+    {320, 180, 30, 0, 0},
+    {160, 90, 5, 320, 0},
+    {160, 90, 30, 320, 90}
+};
+
+// Лестница по умолчанию: как раскладывает её main
+static const TileCase bench_tiles[] = {
+    {1920, 1080, 60, 0, 0},
+    {1280, 720, 30, 0, 1080},
+    {640, 360, 15, 1280, 1080}
+};
+
+// Собирает описание конвейера: videotestsrc на каждый вход, компоновщик, выход
+static gchar* describe(const TileCase *tiles, size_t count, int output_frames, const char *compositor, const char *sink) {
+    GString *description = g_string_new(NULL);
+
+    g_string_append_printf(description, "%s name=mix", compositor);
+    for (size_t i = 0; i < count; i++) {
+        g_string_append_printf(description, " sink_%u::xpos=%d sink_%u::ypos=%d",
+                               (guint)i, tiles[i].xpos, (guint)i, tiles[i].ypos);
+    }
+    g_string_append_printf(description, " ! video/x-raw,format=I420 ! %s", sink);
+    for (size_t i = 0; i < count; i++) {
+        // Источники кончаются вместе: число кадров пропорционально частоте
+        int frames = MAX(output_frames * tiles[i].framerate / tiles[0].framerate, 1);
+        g_string_append_printf(description,
+                               " videotestsrc pattern=ball num-buffers=%d ! "
+                               "video/x-raw,format=I420,width=%d,height=%d,framerate=%d/1 ! mix.sink_%u",
+                               frames, tiles[i].width, tiles[i].height, tiles[i].framerate, (guint)i);
+    }
+    return g_string_free(description, FALSE);
+}
+
+static GstElement* launch(const char *description) {
+    GError *error = NULL;
+    GstElement *pipeline = gst_parse_launch(description, &error);
+
+    if (error != NULL) {
+        g_printerr("Failed to create pipeline: %s\n", error->message);
+        g_error_free(error);
+        return NULL;
+    }
+    return pipeline;
+}
+
+// PSNR одной плоскости
+static double plane_psnr(const GstVideoFrame *a, const GstVideoFrame *b, int plane) {
+    int width = GST_VIDEO_FRAME_COMP_WIDTH(a, plane);
+    int height = GST_VIDEO_FRAME_COMP_HEIGHT(a, plane);
+    double sum = 0.0;
+
+    for (int y = 0; y < height; y++) {
+        const guint8 *row_a = (const guint8*)GST_VIDEO_FRAME_PLANE_DATA(a, plane) + (gsize)y * GST_VIDEO_FRAME_PLANE_STRIDE(a, plane);
+        const guint8 *row_b = (const guint8*)GST_VIDEO_FRAME_PLANE_DATA(b, plane) + (gsize)y * GST_VIDEO_FRAME_PLANE_STRIDE(b, plane);
+        for (int x = 0; x < width; x++) {
+            double d = (double)row_a[x] - row_b[x];
+            sum += d * d;
+        }
+    }
+    if (sum == 0.0) {
+        return 99.0;
+    }
+    return 10.0 * log10(255.0 * 255.0 * width * height / sum);
+}
+
+// Сравнивает два выходных кадра: размер и все плоскости
+static int compare_samples(GstSample *tiles, GstSample *reference, int index) {
+    GstVideoInfo tiles_info, reference_info;
+    GstVideoFrame tiles_frame, reference_frame;
+    int failed = 0;
+
+    gst_video_info_from_caps(&tiles_info, gst_sample_get_caps(tiles));
+    gst_video_info_from_caps(&reference_info, gst_sample_get_caps(reference));
+    if (GST_VIDEO_INFO_WIDTH(&tiles_info) != GST_VIDEO_INFO_WIDTH(&reference_info) ||
+        GST_VIDEO_INFO_HEIGHT(&tiles_info) != GST_VIDEO_INFO_HEIGHT(&reference_info)) {
+        g_printerr("FAIL frame %d: canvas %dx%d, compositor %dx%d\n", index,
+                   GST_VIDEO_INFO_WIDTH(&tiles_info), GST_VIDEO_INFO_HEIGHT(&tiles_info),
+                   GST_VIDEO_INFO_WIDTH(&reference_info), GST_VIDEO_INFO_HEIGHT(&reference_info));
+        return 1;
+    }
+    gst_video_frame_map(&tiles_frame, &tiles_info, gst_sample_get_buffer(tiles), GST_MAP_READ);
+    gst_video_frame_map(&reference_frame, &reference_info, gst_sample_get_buffer(reference), GST_MAP_READ);
+    for (guint plane = 0; plane < GST_VIDEO_FRAME_N_PLANES(&tiles_frame); plane++) {
+        double psnr = plane_psnr(&tiles_frame, &reference_frame, plane);
+        if (psnr < MIN_PSNR) {
+            g_printerr("FAIL frame %d plane %u: %.1f dB\n", index, plane, psnr);
+            failed = 1;
+        }
+    }
+    gst_video_frame_unmap(&tiles_frame);
+    gst_video_frame_unmap(&reference_frame);
+    return failed;
+}
+
+// Прогоняет одни и те же входы через tilecompositor и compositor и сравнивает кадр за кадром.
+// Выход забирается по одному кадру, поэтому холсты переиспользуются и дорисовываются
+static int check_against_compositor(void) {
+    const size_t count = sizeof(check_tiles) / sizeof(check_tiles[0]);
+    const char *sink = "appsink name=out sync=false max-buffers=1";
+    gchar *tiles_desc = describe(check_tiles, count, CHECK_FRAMES, "tilecompositor", sink);
+    gchar *reference_desc = describe(check_tiles, count, CHECK_FRAMES, "compositor background=black", sink);
+    GstElement *tiles = launch(tiles_desc);
+    GstElement *reference = launch(reference_desc);
+    guint64 copied = 0, skipped = 0, redraws = 0;
+    int frames = 0, failed = 0;
+
+    g_free(tiles_desc);
+    g_free(reference_desc);
+    if (!tiles || !reference) {
+        return 1;
+    }
+
+    GstElement *tiles_out = gst_bin_get_by_name(GST_BIN(tiles), "out");
+    GstElement *reference_out = gst_bin_get_by_name(GST_BIN(reference), "out");
+    gst_element_set_state(tiles, GST_STATE_PLAYING);
+    gst_element_set_state(reference, GST_STATE_PLAYING);
+    while (TRUE) {
+        GstSample *tiles_sample = gst_app_sink_try_pull_sample(GST_APP_SINK(tiles_out), 5 * GST_SECOND);
+        GstSample *reference_sample = gst_app_sink_try_pull_sample(GST_APP_SINK(reference_out), 5 * GST_SECOND);
+
+        if (!tiles_sample || !reference_sample) {
+            if (tiles_sample || reference_sample) {
+                g_printerr("FAIL frame %d: only one compositor produced it\n", frames);
+                failed = 1;
+            }
+            if (tiles_sample) {
+                gst_sample_unref(tiles_sample);
+            }
+            if (reference_sample) {
+                gst_sample_unref(reference_sample);
+            }
+            break;
+        }
+        failed |= compare_samples(tiles_sample, reference_sample, frames);
+        gst_sample_unref(tiles_sample);
+        gst_sample_unref(reference_sample);
+        frames++;
+    }
+    GstElement *mix = gst_bin_get_by_name(GST_BIN(tiles), "mix");
+    g_object_get(mix, "pads-copied", &copied, "pads-skipped", &skipped, "redraws", &redraws, NULL);
+    gst_object_unref(mix);
+    gst_element_set_state(tiles, GST_STATE_NULL);
+    gst_element_set_state(reference, GST_STATE_NULL);
+
+    g_print("%d frames compared, %" G_GUINT64_FORMAT " tiles copied, %" G_GUINT64_FORMAT " skipped, %"
+            G_GUINT64_FORMAT " redraws\n", frames, copied, skipped, redraws);
+    if (frames < CHECK_FRAMES / 2) {
+        g_printerr("FAIL only %d frames\n", frames);
+        failed = 1;
+    }
+    // Медленный вход даёт новый кадр на каждый шестой выходной, остальные пять он пропускается
+    if (skipped == 0) {
+        g_printerr("FAIL no unchanged tile was skipped\n");
+        failed = 1;
+    }
+
+    gst_object_unref(tiles_out);
+    gst_object_unref(reference_out);
+    gst_object_unref(tiles);
+    gst_object_unref(reference);
+    return failed;
+}
+
+// Прогоняет BENCH_FRAMES выходных кадров лестницы через компоновщик и возвращает кадры в секунду
+static double benchmark(const char *compositor) {
+    const size_t count = sizeof(bench_tiles) / sizeof(bench_tiles[0]);
+    gchar *description = describe(bench_tiles, count, BENCH_FRAMES, compositor, "fakesink sync=false");
+    GstElement *pipeline = launch(description);
+
+    g_free(description);
+    if (!pipeline) {
+        return 0.0;
+    }
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+
+    gint64 start = g_get_monotonic_time();
+    GstBus *bus = gst_element_get_bus(pipeline);
+    GstMessage *msg = gst_bus_timed_pop_filtered(bus, GST_CLOCK_TIME_NONE, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+    double seconds = (g_get_monotonic_time() - start) / 1e6;
+    double fps = GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS ? BENCH_FRAMES / seconds : 0.0;
+
+    gst_message_unref(msg);
+    gst_object_unref(bus);
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(pipeline);
+    return fps;
+}
+
+int main(int argc, char *argv[]) {
+    int failed = 0;
+
+    gst_init(&argc, &argv);
+    if (!tile_compositor_register()) {
+        g_printerr("Failed to register tilecompositor.\n");
+        return 1;
+    }
+
+    // 1. Кадры совпадают с compositor, хотя медленный вход копируется только при новом кадре
+    failed |= check_against_compositor();
+
+    // 2. Пропускная способность на раскладке лестницы. Источники входят в замер у обоих
+    if (argc < 2 || strcmp(argv[1], "--no-bench") != 0) {
+        static const char *compositors[] = {
+            "compositor background=black",
+            "tilecompositor"
+        };
+        for (size_t c = 0; c < sizeof(compositors) / sizeof(compositors[0]); c++) {
+            g_print("1080p60 + 720p30 + 360p15 %-28s %.1f fps\n", compositors[c], benchmark(compositors[c]));
+        }
+    }
+
+    g_print(failed ? "FAILED\n" : "OK\n");
+    return failed;
+}
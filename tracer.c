@@ -0,0 +1,278 @@
+#include "tracer.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Очередь, из которой leaky-политика выбрасывает буферы, никогда не выпустит их записи
+#define MAX_PENDING_BUFFERS 4096
+
+static pid_t current_tid(void) {
+    static __thread pid_t tid = 0;
+    if (tid == 0) {
+        tid = (pid_t)syscall(SYS_gettid);
+    }
+    return tid;
+}
+
+static gboolean sampled(ElementTracer *tracer, TracedElement *traced) {
+    return traced->seen++ % tracer->sample_every == 0;
+}
+
+// Записывает одно измерение в гистограмму и, если есть место, в trace
+static void record(TracedElement *traced, gint64 start_us, gint64 end_us) {
+    ElementTracer *tracer = traced->tracer;
+    guint64 duration = end_us > start_us ? (guint64)(end_us - start_us) : 0;
+    int bucket = 0;
+
+    while (bucket < TRACE_BUCKETS - 1 && duration >= (G_GUINT64_CONSTANT(1) << bucket)) {
+        bucket++;
+    }
+    traced->histogram[bucket]++;
+    traced->count++;
+    traced->sum_us += duration;
+    if (duration > traced->max_us) {
+        traced->max_us = duration;
+    }
+
+    if (tracer->events != NULL) {
+        gint i = g_atomic_int_add(&tracer->next_event, 1);
+        if (i >= 0 && (guint)i < tracer->max_events) {
+            TraceEvent *event = &tracer->events[i];
+            event->start_us = start_us - tracer->origin_us;
+            event->duration_us = (gint64)duration;
+            event->tid = current_tid();
+            event->element = traced->index;
+        }
+    }
+}
+
+static GstPadProbeReturn sync_enter_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    TracedElement *traced = user_data;
+
+    // Элемент вызывается из одного потока, поэтому хватает одного времени входа
+    traced->enter_us = sampled(traced->tracer, traced) ? g_get_monotonic_time() : 0;
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn sync_exit_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    TracedElement *traced = user_data;
+
+    if (traced->enter_us != 0) {
+        record(traced, traced->enter_us, g_get_monotonic_time());
+        // videorate может отправить кадр повторно - повтор уже не время обработки входа
+        traced->enter_us = 0;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn queue_enter_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    TracedElement *traced = user_data;
+
+    if (!sampled(traced->tracer, traced)) {
+        return GST_PAD_PROBE_OK;
+    }
+    g_mutex_lock(&traced->lock);
+    if (g_hash_table_size(traced->pending) >= MAX_PENDING_BUFFERS) {
+        g_hash_table_remove_all(traced->pending);
+    }
+    g_hash_table_insert(traced->pending, GST_PAD_PROBE_INFO_BUFFER(info), (gpointer)(gintptr)g_get_monotonic_time());
+    g_mutex_unlock(&traced->lock);
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn queue_exit_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    TracedElement *traced = user_data;
+    gpointer enter;
+    gboolean found;
+
+    g_mutex_lock(&traced->lock);
+    found = g_hash_table_lookup_extended(traced->pending, GST_PAD_PROBE_INFO_BUFFER(info), NULL, &enter);
+    if (found) {
+        g_hash_table_remove(traced->pending, GST_PAD_PROBE_INFO_BUFFER(info));
+    }
+    g_mutex_unlock(&traced->lock);
+    if (found) {
+        record(traced, (gint64)(gintptr)enter, g_get_monotonic_time());
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn aggregator_enter_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    TracedElement *traced = user_data;
+
+    g_mutex_lock(&traced->lock);
+    if (traced->first_input_us == 0) {
+        traced->first_input_us = g_get_monotonic_time();
+    }
+    g_mutex_unlock(&traced->lock);
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn aggregator_exit_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    TracedElement *traced = user_data;
+    gint64 first;
+
+    g_mutex_lock(&traced->lock);
+    first = traced->first_input_us;
+    traced->first_input_us = 0;
+    g_mutex_unlock(&traced->lock);
+    if (first != 0 && sampled(traced->tracer, traced)) {
+        record(traced, first, g_get_monotonic_time());
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+void element_tracer_init(ElementTracer *tracer, guint sample_every, guint max_events) {
+    tracer->count = 0;
+    tracer->sample_every = sample_every > 0 ? sample_every : 1;
+    tracer->max_events = max_events;
+    tracer->events = max_events > 0 ? g_new0(TraceEvent, max_events) : NULL;
+    tracer->next_event = 0;
+    tracer->origin_us = g_get_monotonic_time();
+}
+
+void element_tracer_clear(ElementTracer *tracer) {
+    for (int i = 0; i < tracer->count; i++) {
+        TracedElement *traced = tracer->elements[i];
+        if (traced->pending != NULL) {
+            g_hash_table_destroy(traced->pending);
+        }
+        g_mutex_clear(&traced->lock);
+        g_free(traced);
+    }
+    tracer->count = 0;
+    g_free(tracer->events);
+    tracer->events = NULL;
+}
+
+void element_tracer_add(ElementTracer *tracer, GstElement *element, const char *category) {
+    GstElementFactory *factory = gst_element_get_factory(element);
+    const char *factory_name = factory != NULL ? GST_OBJECT_NAME(factory) : "";
+    GstPadProbeCallback enter, exit;
+    TracedElement *traced;
+
+    if (tracer->count >= MAX_TRACED_ELEMENTS) {
+        return;
+    }
+    traced = g_new0(TracedElement, 1);
+    g_strlcpy(traced->name, GST_OBJECT_NAME(element), sizeof(traced->name));
+    g_strlcpy(traced->category, category, sizeof(traced->category));
+    g_mutex_init(&traced->lock);
+    traced->tracer = tracer;
+    traced->index = tracer->count;
+    if (strcmp(factory_name, "queue") == 0) {
+        traced->kind = TRACE_QUEUE;
+        traced->pending = g_hash_table_new(g_direct_hash, g_direct_equal);
+        enter = queue_enter_probe;
+        exit = queue_exit_probe;
+    } else if (strcmp(factory_name, "compositor") == 0 || strcmp(factory_name, "tilecompositor") == 0) {
+        traced->kind = TRACE_AGGREGATOR;
+        enter = aggregator_enter_probe;
+        exit = aggregator_exit_probe;
+    } else {
+        traced->kind = TRACE_SYNC;
+        enter = sync_enter_probe;
+        exit = sync_exit_probe;
+    }
+    tracer->elements[tracer->count++] = traced;
+
+    // У компоновщиков входы запрашиваемые, поэтому обходим все уже созданные пады
+    GstIterator *pads = gst_element_iterate_pads(element);
+    GValue item = G_VALUE_INIT;
+    while (gst_iterator_next(pads, &item) == GST_ITERATOR_OK) {
+        GstPad *pad = g_value_get_object(&item);
+        gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER,
+                          GST_PAD_DIRECTION(pad) == GST_PAD_SINK ? enter : exit, traced, NULL);
+        g_value_reset(&item);
+    }
+    g_value_unset(&item);
+    gst_iterator_free(pads);
+}
+
+// Верхняя граница корзины, в которую попадает процентиль p
+static guint64 histogram_percentile(const TracedElement *traced, double p) {
+    guint64 target = (guint64)(p / 100.0 * traced->count + 0.5);
+    guint64 seen = 0;
+
+    for (int bucket = 0; bucket < TRACE_BUCKETS; bucket++) {
+        seen += traced->histogram[bucket];
+        if (seen >= MAX(target, 1)) {
+            return G_GUINT64_CONSTANT(1) << bucket;
+        }
+    }
+    return traced->max_us;
+}
+
+void element_tracer_report(ElementTracer *tracer) {
+    g_print("Element timing report (1 of %u buffers sampled):\n", tracer->sample_every);
+    for (int i = 0; i < tracer->count; i++) {
+        TracedElement *traced = tracer->elements[i];
+
+        if (traced->count == 0) {
+            g_print("  %-10s %-16s no samples\n", traced->category, traced->name);
+            continue;
+        }
+        g_print("  %-10s %-16s %s %" G_GUINT64_FORMAT " samples, mean %.0f us, p50 <%" G_GUINT64_FORMAT
+                " us, p99 <%" G_GUINT64_FORMAT " us, max %" G_GUINT64_FORMAT " us\n",
+                traced->category, traced->name,
+                traced->kind == TRACE_QUEUE ? "wait" : traced->kind == TRACE_AGGREGATOR ? "aggr" : "proc",
+                traced->count, (double)traced->sum_us / traced->count,
+                histogram_percentile(traced, 50.0), histogram_percentile(traced, 99.0), traced->max_us);
+        g_print("    histogram:");
+        for (int bucket = 0; bucket < TRACE_BUCKETS; bucket++) {
+            if (traced->histogram[bucket] > 0) {
+                g_print(" <%" G_GUINT64_FORMAT "us:%" G_GUINT64_FORMAT, G_GUINT64_CONSTANT(1) << bucket,
+                        traced->histogram[bucket]);
+            }
+        }
+        g_print("\n");
+    }
+}
+
+int element_tracer_write_chrome(ElementTracer *tracer, const char *path, ThreadMonitor *threads) {
+    FILE *out;
+    guint written = MIN((guint)g_atomic_int_get(&tracer->next_event), tracer->max_events);
+    int pid = (int)getpid();
+    gboolean first = TRUE;
+
+    if (tracer->events == NULL) {
+        return 0;
+    }
+    out = fopen(path, "w");
+    if (out == NULL) {
+        g_printerr("Failed to open %s for the trace.\n", path);
+        return -1;
+    }
+    fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    // Имена потоков: роль и элемент, владеющий потоком
+    if (threads != NULL) {
+        g_mutex_lock(&threads->lock);
+        for (int i = 0; i < threads->count; i++) {
+            fprintf(out, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+                    "\"args\": {\"name\": \"%s: %s\"}}",
+                    first ? "" : ",", pid, (int)threads->threads[i].tid, threads->threads[i].role, threads->threads[i].name);
+            first = FALSE;
+        }
+        g_mutex_unlock(&threads->lock);
+    }
+    for (guint i = 0; i < written; i++) {
+        TraceEvent *event = &tracer->events[i];
+        TracedElement *traced = tracer->elements[event->element];
+
+        // Событие могло быть занято, но ещё не заполнено в момент остановки
+        if (event->tid == 0) {
+            continue;
+        }
+        fprintf(out, "%s\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %" G_GINT64_FORMAT
+                ", \"dur\": %" G_GINT64_FORMAT ", \"pid\": %d, \"tid\": %d}",
+                first ? "" : ",", traced->name, traced->category, event->start_us, event->duration_us, pid, (int)event->tid);
+        first = FALSE;
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+    g_print("Trace with %u events written to %s%s\n", written, path,
+            (guint)g_atomic_int_get(&tracer->next_event) > tracer->max_events ? " (event limit reached)" : "");
+    return 0;
+}
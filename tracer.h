@@ -0,0 +1,64 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <gst/gst.h>
+
+#include "scheduler.h"
+
+#define TRACE_BUCKETS 24 // степени двойки в микросекундах: <1, <2, <4, ... <2^23
+#define MAX_TRACED_ELEMENTS 128
+
+// Как измерять время внутри элемента
+typedef enum {
+    TRACE_SYNC,      // вход и выход в одном потоке: videoscale, videoconvert, videorate, capsfilter
+    TRACE_QUEUE,     // буфер ждёт в очереди и выходит в другом потоке
+    TRACE_AGGREGATOR // compositor: от первого входа после прошлого выхода до нового выхода
+} TraceKind;
+
+// Счётчики одного элемента. Вход и выход обновляются из потоков конвейера, отчёт - после остановки
+typedef struct {
+    char name[THREAD_NAME_LENGTH];
+    char category[THREAD_NAME_LENGTH]; // ветка или стадия, к которой относится элемент
+    TraceKind kind;
+    guint64 seen;        // буферы на входе, для выборки каждого N-го
+    gint64 enter_us;     // TRACE_SYNC: вход текущего буфера, 0 = не измеряется
+    GMutex lock;         // TRACE_QUEUE и TRACE_AGGREGATOR: входы приходят из других потоков
+    GHashTable *pending; // TRACE_QUEUE: буфер -> время входа
+    gint64 first_input_us;
+    guint64 histogram[TRACE_BUCKETS];
+    guint64 count;
+    guint64 sum_us;
+    guint64 max_us;
+    gpointer tracer;     // ElementTracer, которому принадлежит элемент
+    int index;
+} TracedElement;
+
+// Событие для Chrome trace ("ph": "X")
+typedef struct {
+    gint64 start_us;
+    gint64 duration_us;
+    pid_t tid;
+    int element; // индекс в ElementTracer.elements
+} TraceEvent;
+
+typedef struct {
+    TracedElement *elements[MAX_TRACED_ELEMENTS];
+    int count;
+    guint sample_every;  // измерять каждый N-й буфер
+    TraceEvent *events;  // NULL, если trace_output не нужен
+    guint max_events;
+    volatile gint next_event;
+    gint64 origin_us;    // ноль шкалы времени в trace
+} ElementTracer;
+
+void element_tracer_init(ElementTracer *tracer, guint sample_every, guint max_events);
+void element_tracer_clear(ElementTracer *tracer);
+// Вешает пробники на входы и выход элемента; вызывать после связывания
+void element_tracer_add(ElementTracer *tracer, GstElement *element, const char *category);
+
+// Гистограммы времени по элементам
+void element_tracer_report(ElementTracer *tracer);
+// Chrome trace JSON (открывается в chrome://tracing и Perfetto); имена потоков берутся из монитора
+int element_tracer_write_chrome(ElementTracer *tracer, const char *path, ThreadMonitor *threads);
+
+#endif